@@ -0,0 +1,578 @@
+// Copyright 2019 Bytedance Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+// Microbenchmarks of the stages of the pipeline, without a cluster, GPUs or
+// a framework. Built with BYTEPS_BUILD_BENCHMARK=1, see
+// docs/microbenchmarks.md.
+//
+//   byteps_microbench [--filter=<substring>] [--min_time=<seconds>]
+//   byteps_microbench --replay=<comm.bin|comm.json> [--queue=PUSH]
+//       [--policy=priority] [--credit=<bytes>] [--slots=<n>]
+//       [--bytes=<bytes>]
+//
+// The first form runs every benchmark whose name contains the filter, as
+// many iterations as fit in min_time. The second one replays the tasks of
+// one queue of a trace against a scheduling policy, see Replay().
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "../common/communicator.h"
+#include "../common/cpu_reducer.h"
+#include "../common/global.h"
+#include "../common/ready_table.h"
+#include "../common/scheduled_queue.h"
+#include "../common/scheduling_policy.h"
+#include "../server/server.h"
+#include "../server/queue.h"
+#include "models.h"
+#include "trace_reader.h"
+
+namespace byteps {
+namespace benchmark {
+
+using namespace byteps::common;
+
+// The google-benchmark way: the body loops on KeepRunning(), which the
+// runner calls with more and more iterations until they take min_time
+class State {
+ public:
+  explicit State(uint64_t iterations) : _iterations(iterations) {}
+
+  bool KeepRunning() {
+    if (_done == 0) _start = Clock::now();
+    if (_done++ < _iterations) return true;
+    _elapsed += Clock::now() - _start;
+    return false;
+  }
+  void PauseTiming() { _elapsed += Clock::now() - _start; }
+  void ResumeTiming() { _start = Clock::now(); }
+
+  uint64_t iterations() const { return _iterations; }
+  void SetItemsProcessed(uint64_t items) { _items = items; }
+  void SetBytesProcessed(uint64_t bytes) { _bytes = bytes; }
+
+  double seconds() const {
+    return std::chrono::duration<double>(_elapsed).count();
+  }
+  uint64_t items() const { return _items; }
+  uint64_t bytes() const { return _bytes; }
+
+ private:
+  typedef std::chrono::steady_clock Clock;
+
+  uint64_t _iterations;
+  uint64_t _done = 0;
+  Clock::time_point _start;
+  Clock::duration _elapsed = Clock::duration::zero();
+  uint64_t _items = 0;
+  uint64_t _bytes = 0;
+};
+
+struct Benchmark {
+  std::string name;
+  std::function<void(State&)> fn;
+};
+
+std::vector<Benchmark>& Registry() {
+  static std::vector<Benchmark> benchmarks;
+  return benchmarks;
+}
+
+void Register(const std::string& name, std::function<void(State&)> fn) {
+  Registry().push_back({name, fn});
+}
+
+std::string HumanBytes(size_t bytes) {
+  if (bytes >= (1 << 20) && bytes % (1 << 20) == 0) {
+    return std::to_string(bytes >> 20) + "MB";
+  }
+  if (bytes >= (1 << 10) && bytes % (1 << 10) == 0) {
+    return std::to_string(bytes >> 10) + "KB";
+  }
+  return std::to_string(bytes) + "B";
+}
+
+// ---------------------------------------------------------------------------
+// CpuReducer::sum, on the partitions of a model or on one size
+
+void BenchReducerSum(State& state, const std::vector<size_t>& sizes) {
+  CpuReducer reducer(nullptr);
+  auto max = *std::max_element(sizes.begin(), sizes.end());
+  auto dst = static_cast<float*>(aligned_alloc(64, max));
+  auto src = static_cast<float*>(aligned_alloc(64, max));
+  for (size_t i = 0; i < max / sizeof(float); ++i) {
+    dst[i] = 1;
+    src[i] = 1e-6f;
+  }
+  uint64_t total = 0;
+  for (auto size : sizes) total += size;
+  while (state.KeepRunning()) {
+    for (auto size : sizes) reducer.sum(dst, src, size, BYTEPS_FLOAT32);
+  }
+  state.SetBytesProcessed(state.iterations() * total);
+  state.SetItemsProcessed(state.iterations() * sizes.size());
+  free(dst);
+  free(src);
+}
+
+// ---------------------------------------------------------------------------
+// BytePSScheduledQueue: the partitions of a model added in backward order,
+// then taken and finished one by one
+
+void BenchScheduledQueue(State& state, const std::string& policy,
+                         const std::vector<Partition>& parts) {
+  setenv("BYTEPS_SCHEDULING_POLICY_PUSH", policy.c_str(), 1);
+  BytePSScheduledQueue queue(PUSH);
+  BPSContext context;
+  context.tensor_name = "bench";
+  std::vector<std::shared_ptr<TensorTableEntry>> tasks;
+  for (auto it = parts.rbegin(); it != parts.rend(); ++it) {
+    auto task = std::make_shared<TensorTableEntry>();
+    task->tensor_name = "bench";
+    task->key = it->key;
+    task->priority = it->priority;
+    task->len = it->bytes;
+    task->context = &context;
+    tasks.push_back(task);
+  }
+  while (state.KeepRunning()) {
+    for (auto& task : tasks) queue.addTask(task);
+    while (auto task = queue.getTask()) queue.reportFinish(task);
+  }
+  state.SetItemsProcessed(state.iterations() * tasks.size());
+}
+
+// ---------------------------------------------------------------------------
+// ReadyTable: the ready signals of 4 local GPUs for every partition, keys in
+// the dense array or past it
+
+void BenchReadyTable(State& state, const std::vector<Partition>& parts,
+                     uint64_t key_offset) {
+  ReadyTable table(3, "BENCH");
+  std::vector<uint64_t> keys;
+  for (auto& part : parts) keys.push_back(part.key + key_offset);
+  while (state.KeepRunning()) {
+    for (auto key : keys) {
+      for (int i = 0; i < 3; ++i) table.AddReadyCount(key);
+      if (table.IsKeyReady(key)) table.ClearReadyCount(key);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+
+// ---------------------------------------------------------------------------
+// Signals between two non-root local ranks of one process, as a round trip
+// of a BytePSCommMsg
+
+// What BytePSGlobal gets from BytePSComm::init(), without the environment
+class BenchComm : public BytePSCommSocket {
+ public:
+  BenchComm(int local_rank, int local_size) {
+    _rank = _local_rank = local_rank;
+    _size = _local_size = local_size;
+    _worker_id = 0;
+    _send_path = DEFAULT_BASE_SOCKET_PATH_SEND;
+    _recv_path = DEFAULT_BASE_SOCKET_PATH_RECV;
+    _send_fd = _recv_fd = -1;
+    for (int i = 0; i < local_size; ++i) _members.push_back(i);
+    _root = local_size - 1;
+  }
+};
+
+void BenchPingPong(State& state, const std::string& type) {
+  auto suffix = "bench_" + std::to_string(getpid()) + "_" + type + "_";
+  std::vector<int> members = {0, 1, 2};
+  std::shared_ptr<BytePSComm> comms[3];
+  if (type == "shm") {
+    // the root makes the segment, which the others wait for
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 3; ++i) {
+      threads.emplace_back([&, i]() {
+        comms[i] = std::make_shared<BytePSCommShm>(
+            std::make_shared<BenchComm>(i, 3), suffix, members);
+      });
+    }
+    for (auto& t : threads) t.join();
+    // still mapped, but nothing is left behind
+    shm_unlink(("/BytePS_Comm_0_" + suffix + "_2").c_str());
+  } else {
+    for (int i = 0; i < 2; ++i) {
+      comms[i] = std::make_shared<BytePSCommSocket>(
+          std::make_shared<BenchComm>(i, 3), suffix, members, false);
+    }
+  }
+
+  std::thread echo([&]() {
+    BytePSCommMsg msg;
+    int src;
+    while (true) {
+      comms[1]->recvSignal(&src, &msg, sizeof(msg));
+      if (msg.key == UINT64_MAX) break;
+      comms[1]->sendSignal(0, &msg, sizeof(msg));
+    }
+  });
+  BytePSCommMsg msg = {0, PUSH_READY, 0};
+  int src;
+  while (state.KeepRunning()) {
+    comms[0]->sendSignal(1, &msg, sizeof(msg));
+    comms[0]->recvSignal(&src, &msg, sizeof(msg));
+    msg.key++;
+  }
+  msg.key = UINT64_MAX;
+  comms[0]->sendSignal(1, &msg, sizeof(msg));
+  echo.join();
+  state.SetItemsProcessed(state.iterations());
+
+  comms[0].reset();
+  comms[1].reset();
+  // the listen thread of the root only stops at the shutdown of BytePS
+  if (comms[2]) new std::shared_ptr<BytePSComm>(comms[2]);
+  for (int i = 0; i < 3; ++i) {
+    unlink((DEFAULT_BASE_SOCKET_PATH_SEND + suffix + std::to_string(i))
+               .c_str());
+    unlink((DEFAULT_BASE_SOCKET_PATH_RECV + suffix + std::to_string(i))
+               .c_str());
+  }
+}
+
+// ---------------------------------------------------------------------------
+// The engine queue of the server: a push of every partition, then popped
+// and done one by one like an engine thread does
+
+void BenchEngineQueue(State& state, bool schedule,
+                      const std::vector<Partition>& parts) {
+  server::PriorityQueue queue(schedule);
+  uint64_t id = 0;
+  while (state.KeepRunning()) {
+    for (auto& part : parts) {
+      server::BytePSEngineMessage msg;
+      msg.id = id++;
+      msg.key = part.key;
+      msg.len = part.bytes;
+      msg.ops = server::SUM_RECV;
+      msg.chunk = 0;
+      queue.Push(std::move(msg));
+    }
+    server::BytePSEngineMessage msg;
+    while (queue.TryPop(&msg)) {
+      if (schedule) queue.ClearCounter(server::EngineQueueKey(msg));
+      queue.Done(server::EngineQueueKey(msg));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * parts.size());
+}
+
+void RegisterAll(size_t partition_bytes) {
+  for (size_t size : {4 << 10, 256 << 10, 4 << 20}) {
+    Register("reducer/sum/" + HumanBytes(size),
+             [size](State& s) { BenchReducerSum(s, {size}); });
+  }
+  for (auto& model : ModelNames()) {
+    auto parts = PartitionGradients(ModelGradients(model), partition_bytes);
+    std::vector<size_t> sizes;
+    for (auto& part : parts) sizes.push_back(part.bytes);
+    Register("reducer/sum/" + model,
+             [sizes](State& s) { BenchReducerSum(s, sizes); });
+  }
+  for (auto& model : ModelNames()) {
+    auto parts = PartitionGradients(ModelGradients(model), partition_bytes);
+    for (std::string policy : {"fifo", "priority"}) {
+      Register("scheduled_queue/" + policy + "/" + model,
+               [policy, parts](State& s) {
+                 BenchScheduledQueue(s, policy, parts);
+               });
+    }
+    Register("ready_table/dense/" + model,
+             [parts](State& s) { BenchReadyTable(s, parts, 0); });
+    // past ReadyTable::kDenseKeys
+    Register("ready_table/map/" + model, [parts](State& s) {
+      BenchReadyTable(s, parts, (1ull << 14) << 16);
+    });
+    for (bool schedule : {false, true}) {
+      Register(std::string("engine_queue/") + (schedule ? "schedule" : "fifo") +
+                   "/" + model,
+               [schedule, parts](State& s) {
+                 BenchEngineQueue(s, schedule, parts);
+               });
+    }
+  }
+  for (std::string type : {"socket", "shm"}) {
+    Register("comm/" + type + "/pingpong",
+             [type](State& s) { BenchPingPong(s, type); });
+  }
+}
+
+void RunBenchmarks(const std::string& filter, double min_time) {
+  printf("%-40s %12s %14s %14s %12s\n", "benchmark", "iterations",
+         "ns/iteration", "items/s", "GB/s");
+  for (auto& b : Registry()) {
+    if (b.name.find(filter) == std::string::npos) continue;
+    uint64_t iterations = 1;
+    while (true) {
+      State state(iterations);
+      b.fn(state);
+      auto seconds = state.seconds();
+      if (seconds >= min_time || iterations >= (1ull << 40)) {
+        printf("%-40s %12llu %14.0f %14.4g %12.3f\n", b.name.c_str(),
+               (unsigned long long)iterations, seconds * 1e9 / iterations,
+               state.items() / seconds, state.bytes() / seconds / 1e9);
+        break;
+      }
+      // aim 40% past min_time, growing at most 10x per round
+      double next = seconds > 0 ? iterations * min_time * 1.4 / seconds
+                                : iterations * 10.0;
+      iterations = std::max<uint64_t>(
+          iterations + 1, std::min<double>(next, iterations * 10.0));
+    }
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Replay: the tasks of one queue in a trace enter a scheduling policy when
+// their previous stage ended in the trace, and each one takes a slot for the
+// duration of its traced stage. Slots model the tasks a loop keeps in
+// flight, by default as many as the trace had at most. Compares when the
+// tasks would have been taken with when they were.
+
+struct ReplayOptions {
+  std::string path;
+  std::string queue = "PUSH";
+  std::string policy = "priority";
+  uint64_t credit = 0;
+  size_t slots = 0;
+  size_t bytes = 0;
+};
+
+struct ReplayTask {
+  std::shared_ptr<TensorTableEntry> entry;
+  uint64_t arrival;
+  uint64_t service;
+  uint64_t traced_start;
+  uint64_t start;
+};
+
+double Percentile(std::vector<uint64_t> v, double q) {
+  if (v.empty()) return 0;
+  std::sort(v.begin(), v.end());
+  return v[std::min<size_t>(v.size() - 1, q * v.size())];
+}
+
+void PrintReplayRow(const char* what, double traced, double replayed) {
+  printf("  %-16s %12.3f %12.3f\n", what, traced / 1e6, replayed / 1e6);
+}
+
+int Replay(const ReplayOptions& opt) {
+  std::vector<TraceSpan> spans;
+  std::string error;
+  if (!ReadTrace(opt.path, &spans, &error)) {
+    fprintf(stderr, "%s\n", error.c_str());
+    return 1;
+  }
+  int type = -1;
+  for (int i = 0; i < QueueNum; ++i) {
+    if (LogStrings[i] == opt.queue) type = i;
+  }
+  if (type < 0) {
+    fprintf(stderr, "unknown queue %s\n", opt.queue.c_str());
+    return 1;
+  }
+
+  // a task enters the queue when its previous stage ends
+  std::sort(spans.begin(), spans.end(),
+            [](const TraceSpan& a, const TraceSpan& b) {
+              return a.start_ns < b.start_ns;
+            });
+  std::unordered_map<uint64_t, uint64_t> stage_end;
+  BPSContext context;
+  context.tensor_name = "replay";
+  context.prophet = (opt.policy == "prophet");
+  std::vector<ReplayTask> tasks;
+  for (auto& span : spans) {
+    if (span.type < 0) continue;
+    if (span.type != type) {
+      stage_end[span.key] = span.start_ns + span.dur_ns;
+      continue;
+    }
+    auto it = stage_end.find(span.key);
+    auto arrival = (it != stage_end.end() && it->second <= span.start_ns)
+                       ? it->second
+                       : span.start_ns;
+    auto entry = std::make_shared<TensorTableEntry>();
+    entry->tensor_name = span.tensor;
+    entry->key = span.key;
+    entry->priority = -static_cast<int>(span.key >> 16);
+    entry->len = opt.bytes ? opt.bytes : BytePSGlobal::GetPartitionBound();
+    entry->context = &context;
+    tasks.push_back({entry, arrival, span.dur_ns, span.start_ns, 0});
+  }
+  if (tasks.empty()) {
+    fprintf(stderr, "no %s spans in %s\n", opt.queue.c_str(),
+            opt.path.c_str());
+    return 1;
+  }
+  std::sort(tasks.begin(), tasks.end(),
+            [](const ReplayTask& a, const ReplayTask& b) {
+              return a.arrival < b.arrival;
+            });
+
+  auto slots = opt.slots;
+  if (!slots) {
+    std::vector<std::pair<uint64_t, int>> edges;
+    for (auto& t : tasks) {
+      edges.push_back({t.traced_start, 1});
+      edges.push_back({t.traced_start + t.service, -1});
+    }
+    std::sort(edges.begin(), edges.end());
+    int running = 0;
+    for (auto& e : edges) {
+      running += e.second;
+      slots = std::max<size_t>(slots, running);
+    }
+  }
+
+  std::unique_ptr<SchedulingPolicy> policy;
+  if (opt.policy == "prophet") {
+    policy.reset(new ProphetPolicy(static_cast<QueueType>(type), opt.credit,
+                                   std::make_shared<ProphetPlan>()));
+  } else {
+    setenv(("BYTEPS_SCHEDULING_POLICY_" + opt.queue).c_str(),
+           opt.policy.c_str(), 1);
+    policy = CreateSchedulingPolicy(static_cast<QueueType>(type), opt.credit);
+  }
+  TaskPool pool(policy->byPriority(), nullptr);
+  std::unordered_map<TensorTableEntry*, ReplayTask*> by_entry;
+  for (auto& t : tasks) by_entry[t.entry.get()] = &t;
+
+  typedef std::pair<uint64_t, TensorTableEntry*> Finish;
+  std::priority_queue<Finish, std::vector<Finish>, std::greater<Finish>>
+      running;
+  size_t next = 0, taken = 0;
+  uint64_t now = 0, makespan_end = 0;
+  while (next < tasks.size() || !running.empty()) {
+    now = running.empty() ? tasks[next].arrival : running.top().first;
+    if (next < tasks.size()) now = std::min(now, tasks[next].arrival);
+    while (next < tasks.size() && tasks[next].arrival <= now) {
+      auto& entry = tasks[next++].entry;
+      if (!policy->onAdd(entry)) pool.push(entry);
+    }
+    while (!running.empty() && running.top().first <= now) {
+      auto entry = by_entry[running.top().second]->entry;
+      running.pop();
+      policy->onFinish(entry);
+    }
+    while (running.size() < slots) {
+      auto entry = policy->pick(pool);
+      if (!entry) break;
+      auto t = by_entry[entry.get()];
+      t->start = now;
+      makespan_end = std::max(makespan_end, now + t->service);
+      running.push({now + t->service, entry.get()});
+      ++taken;
+    }
+  }
+  if (taken < tasks.size()) {
+    fprintf(stderr, "%zu tasks were never taken by %s\n",
+            tasks.size() - taken, opt.policy.c_str());
+  }
+
+  std::vector<uint64_t> traced_wait, replayed_wait;
+  uint64_t traced_end = 0;
+  for (auto& t : tasks) {
+    traced_wait.push_back(t.traced_start - t.arrival);
+    replayed_wait.push_back(t.start - t.arrival);
+    traced_end = std::max(traced_end, t.traced_start + t.service);
+  }
+  auto mean = [](const std::vector<uint64_t>& v) {
+    double sum = 0;
+    for (auto x : v) sum += x;
+    return sum / v.size();
+  };
+  auto first = tasks.front().arrival;
+  printf("%zu %s tasks of %s, policy %s, %zu slots, credit %llu\n",
+         tasks.size(), opt.queue.c_str(), opt.path.c_str(),
+         opt.policy.c_str(), slots, (unsigned long long)opt.credit);
+  printf("  %-16s %12s %12s\n", "(ms)", "traced", "replayed");
+  PrintReplayRow("makespan", traced_end - first, makespan_end - first);
+  PrintReplayRow("mean wait", mean(traced_wait), mean(replayed_wait));
+  PrintReplayRow("p50 wait", Percentile(traced_wait, 0.5),
+                 Percentile(replayed_wait, 0.5));
+  PrintReplayRow("p99 wait", Percentile(traced_wait, 0.99),
+                 Percentile(replayed_wait, 0.99));
+  return 0;
+}
+
+bool ParseFlag(const char* arg, const char* name, std::string* value) {
+  auto len = strlen(name);
+  if (strncmp(arg, name, len) || arg[len] != '=') return false;
+  *value = arg + len + 1;
+  return true;
+}
+
+}  // namespace benchmark
+}  // namespace byteps
+
+int main(int argc, char** argv) {
+  using namespace byteps::benchmark;
+  std::string filter, value;
+  double min_time = 0.5;
+  ReplayOptions replay;
+  for (int i = 1; i < argc; ++i) {
+    if (ParseFlag(argv[i], "--filter", &filter)) {
+    } else if (ParseFlag(argv[i], "--min_time", &value)) {
+      min_time = atof(value.c_str());
+    } else if (ParseFlag(argv[i], "--replay", &replay.path)) {
+    } else if (ParseFlag(argv[i], "--queue", &replay.queue)) {
+    } else if (ParseFlag(argv[i], "--policy", &replay.policy)) {
+    } else if (ParseFlag(argv[i], "--credit", &value)) {
+      replay.credit = strtoull(value.c_str(), nullptr, 10);
+    } else if (ParseFlag(argv[i], "--slots", &value)) {
+      replay.slots = atoi(value.c_str());
+    } else if (ParseFlag(argv[i], "--bytes", &value)) {
+      replay.bytes = strtoull(value.c_str(), nullptr, 10);
+    } else {
+      fprintf(stderr,
+              "usage: %s [--filter=<substring>] [--min_time=<seconds>]\n"
+              "       %s --replay=<comm.bin|comm.json> [--queue=PUSH] "
+              "[--policy=priority]\n"
+              "           [--credit=<bytes>] [--slots=<n>] "
+              "[--bytes=<bytes>]\n",
+              argv[0], argv[0]);
+      return 1;
+    }
+  }
+  if (!replay.path.empty()) return Replay(replay);
+  // BYTEPS_PARTITION_BYTES is only read by byteps_init()
+  size_t partition_bytes =
+      getenv("BYTEPS_PARTITION_BYTES")
+          ? atoi(getenv("BYTEPS_PARTITION_BYTES"))
+          : byteps::common::BytePSGlobal::GetPartitionBound();
+  RegisterAll(partition_bytes);
+  RunBenchmarks(filter, min_time);
+  return 0;
+}
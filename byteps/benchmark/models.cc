@@ -0,0 +1,154 @@
+// Copyright 2019 Bytedance Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+#include "models.h"
+
+#include <algorithm>
+
+#include "../common/logging.h"
+
+namespace byteps {
+namespace benchmark {
+
+namespace {
+
+class ModelBuilder {
+ public:
+  void Add(const std::string& name, size_t elements) {
+    _grads.push_back({name, elements * sizeof(float)});
+  }
+  void Conv(const std::string& name, size_t in, size_t out, size_t k,
+            bool bias) {
+    Add(name + ".weight", out * in * k * k);
+    if (bias) Add(name + ".bias", out);
+  }
+  void Linear(const std::string& name, size_t in, size_t out) {
+    Add(name + ".weight", out * in);
+    Add(name + ".bias", out);
+  }
+  // batch norm and layer norm
+  void Norm(const std::string& name, size_t channels) {
+    Add(name + ".weight", channels);
+    Add(name + ".bias", channels);
+  }
+  std::vector<Gradient> Build() { return std::move(_grads); }
+
+ private:
+  std::vector<Gradient> _grads;
+};
+
+// 161 gradients, 25.6M parameters
+std::vector<Gradient> ResNet50() {
+  ModelBuilder b;
+  b.Conv("conv1", 3, 64, 7, false);
+  b.Norm("bn1", 64);
+  const size_t planes[] = {64, 128, 256, 512};
+  const int blocks[] = {3, 4, 6, 3};
+  size_t inplanes = 64;
+  for (int l = 0; l < 4; ++l) {
+    for (int i = 0; i < blocks[l]; ++i) {
+      auto name = "layer" + std::to_string(l + 1) + "." + std::to_string(i);
+      b.Conv(name + ".conv1", inplanes, planes[l], 1, false);
+      b.Norm(name + ".bn1", planes[l]);
+      b.Conv(name + ".conv2", planes[l], planes[l], 3, false);
+      b.Norm(name + ".bn2", planes[l]);
+      b.Conv(name + ".conv3", planes[l], planes[l] * 4, 1, false);
+      b.Norm(name + ".bn3", planes[l] * 4);
+      if (i == 0) {
+        b.Conv(name + ".downsample.0", inplanes, planes[l] * 4, 1, false);
+        b.Norm(name + ".downsample.1", planes[l] * 4);
+      }
+      inplanes = planes[l] * 4;
+    }
+  }
+  b.Linear("fc", 2048, 1000);
+  return b.Build();
+}
+
+// 32 gradients, 138.4M parameters, most of them in the first classifier
+std::vector<Gradient> Vgg16() {
+  ModelBuilder b;
+  const int cfg[] = {64,  64,  0,   128, 128, 0,   256, 256, 256,
+                     0,   512, 512, 512, 0,   512, 512, 512, 0};
+  size_t in = 3;
+  int index = 0;
+  for (int c : cfg) {
+    if (c) {
+      b.Conv("features." + std::to_string(index), in, c, 3, true);
+      in = c;
+      index += 2;
+    } else {
+      index += 1;
+    }
+  }
+  b.Linear("classifier.0", 512 * 7 * 7, 4096);
+  b.Linear("classifier.3", 4096, 4096);
+  b.Linear("classifier.6", 4096, 1000);
+  return b.Build();
+}
+
+// 199 gradients, 109.5M parameters, the word embeddings first
+std::vector<Gradient> BertBase() {
+  const size_t hidden = 768, ffn = 3072;
+  ModelBuilder b;
+  b.Add("embeddings.word_embeddings.weight", 30522 * hidden);
+  b.Add("embeddings.position_embeddings.weight", 512 * hidden);
+  b.Add("embeddings.token_type_embeddings.weight", 2 * hidden);
+  b.Norm("embeddings.LayerNorm", hidden);
+  for (int l = 0; l < 12; ++l) {
+    auto name = "encoder.layer." + std::to_string(l);
+    b.Linear(name + ".attention.self.query", hidden, hidden);
+    b.Linear(name + ".attention.self.key", hidden, hidden);
+    b.Linear(name + ".attention.self.value", hidden, hidden);
+    b.Linear(name + ".attention.output.dense", hidden, hidden);
+    b.Norm(name + ".attention.output.LayerNorm", hidden);
+    b.Linear(name + ".intermediate.dense", hidden, ffn);
+    b.Linear(name + ".output.dense", ffn, hidden);
+    b.Norm(name + ".output.LayerNorm", hidden);
+  }
+  b.Linear("pooler.dense", hidden, hidden);
+  return b.Build();
+}
+
+}  // namespace
+
+std::vector<std::string> ModelNames() {
+  return {"resnet50", "vgg16", "bert-base"};
+}
+
+std::vector<Gradient> ModelGradients(const std::string& model) {
+  if (model == "resnet50") return ResNet50();
+  if (model == "vgg16") return Vgg16();
+  if (model == "bert-base") return BertBase();
+  BPS_CHECK(0) << "unknown model " << model;
+  return {};
+}
+
+std::vector<Partition> PartitionGradients(const std::vector<Gradient>& grads,
+                                          size_t partition_bytes) {
+  std::vector<Partition> parts;
+  for (size_t i = 0; i < grads.size(); ++i) {
+    uint64_t part = 0;
+    for (size_t offset = 0; offset < grads[i].bytes;
+         offset += partition_bytes) {
+      parts.push_back({(i << 16) | part++, -static_cast<int>(i),
+                       std::min(partition_bytes, grads[i].bytes - offset)});
+    }
+  }
+  return parts;
+}
+
+}  // namespace benchmark
+}  // namespace byteps
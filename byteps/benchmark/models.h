@@ -0,0 +1,54 @@
+// Copyright 2019 Bytedance Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+#ifndef BYTEPS_BENCHMARK_MODELS_H
+#define BYTEPS_BENCHMARK_MODELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+namespace byteps {
+namespace benchmark {
+
+// A float32 gradient, as declared by the framework plugins
+struct Gradient {
+  std::string name;
+  size_t bytes;
+};
+
+// The gradients of a model in declaration (forward) order, so that the
+// priority of gradient i is -i. Models: resnet50, vgg16 and bert-base, with
+// the layer shapes of torchvision and of the BERT paper.
+std::vector<Gradient> ModelGradients(const std::string& model);
+std::vector<std::string> ModelNames();
+
+// A partition of a gradient, cut like EnqueueTensor does it
+struct Partition {
+  // declared_key << 16 | part, the declared key being the gradient index
+  uint64_t key;
+  int priority;
+  size_t bytes;
+};
+
+std::vector<Partition> PartitionGradients(const std::vector<Gradient>& grads,
+                                          size_t partition_bytes);
+
+}  // namespace benchmark
+}  // namespace byteps
+
+#endif  // BYTEPS_BENCHMARK_MODELS_H
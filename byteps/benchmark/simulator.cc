@@ -0,0 +1,785 @@
+// Copyright 2019 Bytedance Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+// Deterministic discrete-event simulator of a training job, to choose the
+// scheduler parameters without a cluster. Built with BYTEPS_BUILD_BENCHMARK=1,
+// see docs/simulator.md.
+//
+//   byteps_simulator (--model=<name> | --timeline=<file>)
+//       [--forward_ms=50] [--backward_ms=<ms>] [--workers=2]
+//       [--servers=<workers>] [--local_size=8] [--bandwidth=<Mbps>]
+//       [--server_bandwidth=<Mbps>] [--latency_us=20] [--pcie_gbps=12]
+//       [--nccl_gbps=60] [--nccl_launch_us=15] [--sum_gbps=8]
+//       [--iterations=15] [--warmup=5] [--cross_barrier]
+//       [--sweep=<ENV>=<v1>,<v2>,...]...
+//
+// The tasks are ordered by the real scheduling policies and Prophet plan,
+// which read their parameters from the environment as in a job (Z_*,
+// BYTEPS_SCHEDULING_*, BYTEPS_PARTITION_BYTES, BYTEPS_NCCL_GROUP_SIZE, ...),
+// on a virtual clock. The hardware is modeled: every link or engine serves
+// one transfer at a time in the order they are issued, all workers behave
+// like the simulated one, and the GPU runs the forward pass layer by layer.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../common/common.h"
+#include "../common/credit_controller.h"
+#include "../common/global.h"
+#include "../common/logging.h"
+#include "../common/prophet_plan.h"
+#include "../common/scheduling_policy.h"
+#include "models.h"
+
+namespace byteps {
+namespace benchmark {
+
+using namespace byteps::common;
+
+namespace {
+
+// the virtual clock, in nanoseconds
+int64_t now_ns = 0;
+
+long long VirtualNowMicros() { return now_ns / 1000; }
+
+const double kNsPerMs = 1e6;
+
+// 1 Mbps carries a byte in 8000ns, 1 GB/s in 1ns
+double MbpsToNsPerByte(double mbps) { return 8000 / mbps; }
+double GbpsToNsPerByte(double gbps) { return 1 / gbps; }
+
+struct Hardware {
+  int workers = 2;
+  // 0 for as many as workers
+  int servers = 0;
+  int local_size = 8;
+  // of the NIC of a worker and of a server (0 for the same), in Mbps
+  double bandwidth = 25000;
+  double server_bandwidth = 0;
+  double latency_us = 20;
+  // GB/s of the copies between GPU and host, of NCCL and of the server sums
+  double pcie_gbps = 12;
+  double nccl_gbps = 60;
+  double nccl_launch_us = 15;
+  double sum_gbps = 8;
+};
+
+// A gradient of the timeline, in declaration order
+struct Layer {
+  std::string name;
+  size_t bytes;
+  // when backward propagation produces it, from the start of the pass
+  double ready_ms;
+  double forward_ms;
+};
+
+struct Workload {
+  std::vector<Layer> layers;
+  double backward_ms;
+};
+
+// Compute of each layer in proportion to its size, in both passes
+Workload ModelWorkload(const std::string& model, double forward_ms,
+                       double backward_ms) {
+  auto grads = ModelGradients(model);
+  double total = 0;
+  for (auto& g : grads) total += g.bytes;
+  Workload w;
+  w.backward_ms = backward_ms;
+  double t = 0;
+  w.layers.resize(grads.size());
+  for (int i = grads.size() - 1; i >= 0; --i) {
+    t += backward_ms * grads[i].bytes / total;
+    w.layers[i] = {grads[i].name, grads[i].bytes, t,
+                   forward_ms * grads[i].bytes / total};
+  }
+  return w;
+}
+
+// One gradient per line: <name> <bytes> <ready_ms> [<forward_ms>], '#' starts
+// a comment. Without a forward column, |forward_ms| is split by size. The
+// backward pass lasts until the last gradient, or |backward_ms| if longer.
+bool ReadTimeline(const std::string& path, double forward_ms,
+                  double backward_ms, Workload* w, std::string* error) {
+  std::ifstream in(path);
+  if (!in) {
+    *error = "cannot open " + path;
+    return false;
+  }
+  std::string line;
+  bool has_forward = true;
+  double total = 0;
+  w->backward_ms = backward_ms;
+  for (int n = 1; std::getline(in, line); ++n) {
+    line = line.substr(0, line.find('#'));
+    std::istringstream ss(line);
+    Layer layer;
+    if (!(ss >> layer.name)) continue;
+    if (!(ss >> layer.bytes >> layer.ready_ms) || !layer.bytes) {
+      *error = path + ":" + std::to_string(n) + ": expected <name> <bytes> " +
+               "<ready_ms> [<forward_ms>]";
+      return false;
+    }
+    if (!(ss >> layer.forward_ms)) has_forward = false;
+    total += layer.bytes;
+    w->backward_ms = std::max(w->backward_ms, layer.ready_ms);
+    w->layers.push_back(layer);
+  }
+  if (w->layers.empty()) {
+    *error = "no gradients in " + path;
+    return false;
+  }
+  if (!has_forward) {
+    for (auto& layer : w->layers) {
+      layer.forward_ms = forward_ms * layer.bytes / total;
+    }
+  }
+  return true;
+}
+
+// A link or an engine that serves one transfer at a time
+class Resource {
+ public:
+  explicit Resource(double ns_per_byte = 0) : _ns_per_byte(ns_per_byte) {}
+
+  // Returns when a transfer issued at |start| completes
+  int64_t Occupy(int64_t start, int64_t duration) {
+    start = std::max(start, _free);
+    _free = start + duration;
+    _busy += duration;
+    return _free;
+  }
+  int64_t Transfer(int64_t start, double bytes) {
+    return Occupy(start, static_cast<int64_t>(bytes * _ns_per_byte));
+  }
+  int64_t busy() const { return _busy; }
+
+ private:
+  double _ns_per_byte;
+  int64_t _free = 0;
+  int64_t _busy = 0;
+};
+
+// The scheduler parameters that are not read by the policies themselves
+struct Knobs {
+  size_t partition_bytes;
+  size_t group_size;
+  size_t group_bytes;
+  uint64_t reduce_credit;
+  bool balanced;
+};
+
+size_t EnvOr(const char* name, size_t value) {
+  return getenv(name) ? atoll(getenv(name)) : value;
+}
+
+// Mirrors BytePSGlobal::Init, NcclManager and BytePSScheduledQueue
+Knobs ReadKnobs(const Hardware& hw) {
+  Knobs k;
+  size_t align = 8 * hw.local_size;
+  k.partition_bytes =
+      EnvOr("BYTEPS_PARTITION_BYTES", BytePSGlobal::GetPartitionBound());
+  k.partition_bytes = (k.partition_bytes + align - 1) / align * align;
+  k.group_bytes = EnvOr("BYTEPS_NCCL_GROUP_BYTES", 0);
+  k.group_size =
+      EnvOr("BYTEPS_NCCL_GROUP_SIZE", k.group_bytes ? MAX_GROUP_TASKS / 2 : 4);
+  BPS_CHECK_GT(k.group_size, 0);
+  auto credit_in_partition =
+      EnvOr("BYTEPS_SCHEDULING_CREDIT", k.group_size + 1);
+  k.reduce_credit = k.partition_bytes * credit_in_partition;
+  auto placement = getenv("BYTEPS_KEY_PLACEMENT");
+  k.balanced = placement && !strcmp(placement, "balanced");
+  return k;
+}
+
+// BytePSGlobal::Hash_DJB2
+uint64_t HashDJB2(uint64_t key) {
+  uint64_t hash = 5381;
+  for (char c : std::to_string(key)) hash = ((hash << 5) + hash) + c;
+  return hash;
+}
+
+struct IterationResult {
+  double iteration_ms;
+  double idle_ms;
+};
+
+struct Result {
+  std::vector<IterationResult> iterations;
+  // busy share of the NIC of the worker, each way
+  double push_busy;
+  double pull_busy;
+  // tasks left when the events ran out, 0 unless the policies deadlocked
+  size_t stalled;
+};
+
+class Simulator {
+ public:
+  Simulator(const Hardware& hw, const Workload& w, int iterations,
+            bool cross_barrier);
+  Result Run();
+
+ private:
+  struct Stage {
+    std::unique_ptr<SchedulingPolicy> policy;
+    std::unique_ptr<TaskPool> pool;
+    // tasks served at once, 0 for any number
+    size_t slots = 0;
+    size_t running = 0;
+  };
+  struct Event {
+    int64_t time;
+    uint64_t seq;
+    std::function<void()> fn;
+    bool operator>(const Event& other) const {
+      return time != other.time ? time > other.time : seq > other.seq;
+    }
+  };
+
+  void At(int64_t time, std::function<void()> fn);
+  void StartBackward();
+  void EnqueueGradient(int grad);
+  void AddTask(std::shared_ptr<TensorTableEntry> task);
+  void Kick(QueueType type);
+  void RunNccl();
+  int64_t Serve(QueueType type, std::shared_ptr<TensorTableEntry> task);
+  void Finish(QueueType type, std::shared_ptr<TensorTableEntry> task);
+  void AdvanceForward();
+  size_t Pending();
+
+  const Hardware _hw;
+  const Workload _w;
+  const int _iterations;
+  const bool _cross_barrier;
+  Knobs _knobs;
+
+  std::priority_queue<Event, std::vector<Event>, std::greater<Event>> _events;
+  uint64_t _seq = 0;
+
+  std::shared_ptr<ProphetPlan> _plan;
+  Stage _stages[QueueNum];
+  std::shared_ptr<const std::vector<QueueType>> _queue_list;
+  std::vector<std::unique_ptr<BPSContext>> _contexts;
+  std::vector<std::vector<Partition>> _parts;
+  // index of the first partition of each gradient
+  std::vector<size_t> _first_part;
+
+  Resource _uplink, _downlink, _d2h, _h2d, _nccl;
+  std::vector<Resource> _server_in, _server_out, _server_sum;
+  std::vector<int> _server;
+  std::vector<int64_t> _summed;
+  int64_t _latency;
+  double _nccl_share;
+
+  // GPU
+  int64_t _gpu_free = 0;
+  int64_t _backward_ns;
+  std::vector<int64_t> _backward_start;
+  bool _backward_done = false;
+  bool _forward_wait = false;
+  size_t _layer = 0;
+  std::vector<size_t> _parts_left;
+  std::vector<bool> _synced;
+  size_t _synced_count = 0;
+};
+
+Simulator::Simulator(const Hardware& hw, const Workload& w, int iterations,
+                     bool cross_barrier)
+    : _hw(hw), _w(w), _iterations(iterations), _cross_barrier(cross_barrier) {
+  _knobs = ReadKnobs(hw);
+  std::vector<Gradient> grads;
+  for (auto& layer : w.layers) grads.push_back({layer.name, layer.bytes});
+  auto parts = PartitionGradients(grads, _knobs.partition_bytes);
+  _parts.resize(grads.size());
+  for (auto& p : parts) _parts[p.key >> 16].push_back(p);
+  for (size_t i = 0, first = 0; i < _parts.size(); ++i) {
+    _first_part.push_back(first);
+    first += _parts[i].size();
+  }
+
+  // the queues of the root device, see GetPushQueueList()
+  auto list = std::make_shared<std::vector<QueueType>>();
+  if (hw.local_size > 1) list->push_back(REDUCE);
+  list->push_back(COPYD2H);
+  list->push_back(PUSH);
+  list->push_back(PULL);
+  list->push_back(COPYH2D);
+  if (hw.local_size > 1) list->push_back(BROADCAST);
+  _queue_list = list;
+
+  _plan = std::make_shared<ProphetPlan>();
+  for (auto type : *_queue_list) {
+    auto& stage = _stages[type];
+    stage.policy = CreateSchedulingPolicy(
+        type, type == REDUCE ? _knobs.reduce_credit : 0, _plan);
+    stage.pool.reset(new TaskPool(stage.policy->byPriority(), nullptr));
+    // the copy loops copy one task at a time, the others only post them
+    if (type == COPYD2H || type == COPYH2D) stage.slots = 1;
+  }
+  for (auto& layer : w.layers) {
+    _contexts.emplace_back(new BPSContext);
+    auto& context = *_contexts.back();
+    context.tensor_name = layer.name;
+    context.prophet = _plan->SelectTensor(layer.name, layer.bytes);
+  }
+
+  int servers = hw.servers ? hw.servers : hw.workers;
+  auto server_bw = hw.server_bandwidth ? hw.server_bandwidth : hw.bandwidth;
+  _uplink = _downlink = Resource(MbpsToNsPerByte(hw.bandwidth));
+  _d2h = _h2d = Resource(GbpsToNsPerByte(hw.pcie_gbps));
+  _nccl = Resource(GbpsToNsPerByte(hw.nccl_gbps));
+  _server_in.assign(servers, Resource(MbpsToNsPerByte(server_bw)));
+  _server_out = _server_in;
+  _server_sum.assign(servers, Resource(GbpsToNsPerByte(hw.sum_gbps)));
+  // partitions are placed in declaration order, see BytePSGlobal::PlaceKey
+  std::vector<size_t> load(servers, 0);
+  for (auto& p : parts) {
+    int s = _knobs.balanced ? std::min_element(load.begin(), load.end()) -
+                                  load.begin()
+                            : HashDJB2(p.key) % servers;
+    load[s] += p.bytes;
+    _server.push_back(s);
+  }
+  _summed.assign(parts.size(), 0);
+  _latency = hw.latency_us * 1000;
+  // a ring reduce or broadcast moves (G - 1) / G of the data over each link
+  _nccl_share = (hw.local_size - 1.0) / hw.local_size;
+
+  _backward_ns = w.backward_ms * kNsPerMs;
+  _parts_left.assign(grads.size(), 0);
+  _synced.assign(grads.size(), false);
+}
+
+void Simulator::At(int64_t time, std::function<void()> fn) {
+  _events.push({time, _seq++, std::move(fn)});
+}
+
+void Simulator::StartBackward() {
+  _backward_start.push_back(now_ns);
+  // the last start only ends the previous iteration
+  if ((int)_backward_start.size() > _iterations) return;
+  _layer = 0;
+  _synced.assign(_synced.size(), false);
+  _synced_count = 0;
+  for (size_t i = 0; i < _w.layers.size(); ++i) {
+    At(now_ns + _w.layers[i].ready_ms * kNsPerMs,
+       [this, i] { EnqueueGradient(i); });
+  }
+  _gpu_free = now_ns + _backward_ns;
+  At(_gpu_free, [this] {
+    _backward_done = true;
+    AdvanceForward();
+  });
+}
+
+void Simulator::EnqueueGradient(int grad) {
+  auto& parts = _parts[grad];
+  _parts_left[grad] = parts.size();
+  for (auto& p : parts) {
+    auto task = std::make_shared<TensorTableEntry>();
+    task->tensor_name = _w.layers[grad].name;
+    task->key = p.key;
+    task->priority = p.priority;
+    task->len = p.bytes;
+    task->context = _contexts[grad].get();
+    task->total_partnum = parts.size();
+    task->queue_list = _queue_list;
+    AddTask(task);
+  }
+}
+
+void Simulator::AddTask(std::shared_ptr<TensorTableEntry> task) {
+  auto type = (*task->queue_list)[task->stage];
+  auto& stage = _stages[type];
+  if (!stage.policy->onAdd(task)) {
+    stage.pool->push(task);
+  }
+  if (type == REDUCE || type == BROADCAST) {
+    RunNccl();
+  } else {
+    Kick(type);
+  }
+}
+
+void Simulator::Kick(QueueType type) {
+  auto& stage = _stages[type];
+  while (!stage.slots || stage.running < stage.slots) {
+    auto task = stage.policy->pick(*stage.pool);
+    if (!task) break;
+    ++stage.running;
+    At(Serve(type, task), [this, type, task] { Finish(type, task); });
+  }
+}
+
+// As RunRootNcclLoopOnce: REDUCE and BROADCAST tasks are grouped into one
+// NCCL launch, up to the group size or bytes per queue
+void Simulator::RunNccl() {
+  while (true) {
+    std::vector<std::pair<QueueType, std::shared_ptr<TensorTableEntry>>> group;
+    double total = 0;
+    for (auto type : {REDUCE, BROADCAST}) {
+      auto& stage = _stages[type];
+      if (!stage.policy) continue;
+      size_t num = 0, bytes = 0;
+      while (num < _knobs.group_size &&
+             (!_knobs.group_bytes || bytes < _knobs.group_bytes)) {
+        auto task = stage.policy->pick(*stage.pool);
+        if (!task) break;
+        ++stage.running;
+        group.push_back({type, task});
+        ++num;
+        bytes += task->len;
+      }
+      total += bytes;
+    }
+    if (group.empty()) return;
+    auto duration = static_cast<int64_t>(
+        _hw.nccl_launch_us * 1000 +
+        total * _nccl_share * GbpsToNsPerByte(_hw.nccl_gbps));
+    At(_nccl.Occupy(now_ns, duration), [this, group] {
+      for (auto& g : group) Finish(g.first, g.second);
+    });
+  }
+}
+
+int64_t Simulator::Serve(QueueType type,
+                         std::shared_ptr<TensorTableEntry> task) {
+  auto index = _first_part[task->key >> 16] + (task->key & 0xffff);
+  double all = (double)task->len * _hw.workers;
+  int s = _server[index];
+  switch (type) {
+    case COPYD2H:
+      return _d2h.Transfer(now_ns, task->len);
+    case COPYH2D:
+      return _h2d.Transfer(now_ns, task->len);
+    case PUSH: {
+      // every worker pushes the same partition to the same server, which
+      // sums them as they arrive
+      auto sent = std::max(_uplink.Transfer(now_ns, task->len),
+                           _server_in[s].Transfer(now_ns, all));
+      _summed[index] = _server_sum[s].Transfer(sent + _latency, all);
+      return sent + 2 * _latency;
+    }
+    case PULL: {
+      // the server answers once the partition is summed
+      auto start = std::max(now_ns + _latency, _summed[index]);
+      return std::max(_downlink.Transfer(start, task->len),
+                      _server_out[s].Transfer(start, all)) +
+             _latency;
+    }
+    default:
+      return now_ns;
+  }
+}
+
+void Simulator::Finish(QueueType type,
+                       std::shared_ptr<TensorTableEntry> task) {
+  auto& stage = _stages[type];
+  --stage.running;
+  stage.policy->onFinish(task);
+  if (++task->stage < task->queue_list->size()) {
+    AddTask(task);
+  } else {
+    auto grad = task->key >> 16;
+    if (--_parts_left[grad] == 0) {
+      _synced[grad] = true;
+      ++_synced_count;
+      AdvanceForward();
+    }
+  }
+  if (type == REDUCE || type == BROADCAST) {
+    RunNccl();
+  } else {
+    Kick(type);
+  }
+}
+
+// The next forward pass starts after backward propagation, and runs a layer
+// once its parameters are pulled, or once all are without --cross_barrier
+void Simulator::AdvanceForward() {
+  if (!_backward_done || _forward_wait) return;
+  while (_layer < _w.layers.size()) {
+    bool ready = _cross_barrier ? _synced[_layer]
+                                : _synced_count == _synced.size();
+    if (!ready) return;
+    if (_gpu_free > now_ns) {
+      _forward_wait = true;
+      At(_gpu_free, [this] {
+        _forward_wait = false;
+        AdvanceForward();
+      });
+      return;
+    }
+    _gpu_free = now_ns + _w.layers[_layer++].forward_ms * kNsPerMs;
+  }
+  _backward_done = false;
+  At(_gpu_free, [this] { StartBackward(); });
+}
+
+size_t Simulator::Pending() {
+  size_t pending = 0;
+  for (auto& stage : _stages) {
+    if (!stage.policy) continue;
+    pending += stage.pool->size() + stage.policy->size() + stage.running;
+  }
+  return pending;
+}
+
+Result Simulator::Run() {
+  now_ns = 0;
+  SetSchedulingClock(VirtualNowMicros);
+  // the first forward pass waits for nothing
+  for (auto& layer : _w.layers) _gpu_free += layer.forward_ms * kNsPerMs;
+  At(_gpu_free, [this] { StartBackward(); });
+  while (!_events.empty() && (int)_backward_start.size() <= _iterations) {
+    auto event = _events.top();
+    _events.pop();
+    now_ns = event.time;
+    event.fn();
+  }
+  SetSchedulingClock(nullptr);
+
+  Result r;
+  double compute = _w.backward_ms;
+  for (auto& layer : _w.layers) compute += layer.forward_ms;
+  for (size_t i = 1; i < _backward_start.size(); ++i) {
+    double ms = (_backward_start[i] - _backward_start[i - 1]) / kNsPerMs;
+    r.iterations.push_back({ms, std::max(0.0, ms - compute)});
+  }
+  double span = std::max<int64_t>(now_ns, 1);
+  r.push_busy = _uplink.busy() / span;
+  r.pull_busy = _downlink.busy() / span;
+  r.stalled = (int)_backward_start.size() > _iterations ? 0 : Pending();
+  return r;
+}
+
+struct Sweep {
+  std::string env;
+  std::vector<std::string> values;
+};
+
+struct Summary {
+  double iteration_ms;
+  double idle_ms;
+};
+
+Summary Summarize(const Result& r, int warmup) {
+  Summary s = {0, 0};
+  size_t first = std::min<size_t>(warmup, r.iterations.size() - 1);
+  for (size_t i = first; i < r.iterations.size(); ++i) {
+    s.iteration_ms += r.iterations[i].iteration_ms;
+    s.idle_ms += r.iterations[i].idle_ms;
+  }
+  s.iteration_ms /= r.iterations.size() - first;
+  s.idle_ms /= r.iterations.size() - first;
+  return s;
+}
+
+struct Options {
+  Hardware hw;
+  Workload workload;
+  int iterations = 15;
+  int warmup = 5;
+  bool cross_barrier = false;
+  std::vector<Sweep> sweeps;
+};
+
+bool RunOnce(const Options& opt, Result* r) {
+  Simulator sim(opt.hw, opt.workload, opt.iterations, opt.cross_barrier);
+  *r = sim.Run();
+  if (r->stalled || r->iterations.empty()) {
+    fprintf(stderr, "the simulation stalled with %zu tasks left\n",
+            r->stalled);
+    return false;
+  }
+  return true;
+}
+
+int RunSingle(const Options& opt) {
+  Result r;
+  if (!RunOnce(opt, &r)) return 1;
+  printf("%-10s %14s %14s\n", "iteration", "time (ms)", "GPU idle (ms)");
+  for (size_t i = 0; i < r.iterations.size(); ++i) {
+    printf("%-10zu %14.3f %14.3f%s\n", i, r.iterations[i].iteration_ms,
+           r.iterations[i].idle_ms, (int)i < opt.warmup ? "  (warmup)" : "");
+  }
+  auto s = Summarize(r, opt.warmup);
+  printf("predicted iteration time %.3f ms, GPU idle %.3f ms (%.1f%%)\n",
+         s.iteration_ms, s.idle_ms, 100 * s.idle_ms / s.iteration_ms);
+  printf("worker NIC busy: push %.1f%%, pull %.1f%%\n", 100 * r.push_busy,
+         100 * r.pull_busy);
+  return 0;
+}
+
+// Every combination of the swept values, one row each, the fastest last
+int RunSweeps(const Options& opt) {
+  for (auto& sweep : opt.sweeps) printf("%-24s ", sweep.env.c_str());
+  printf("%14s %14s\n", "time (ms)", "GPU idle (ms)");
+  std::vector<size_t> index(opt.sweeps.size(), 0);
+  std::string best;
+  double best_ms = 0;
+  while (true) {
+    std::string row;
+    for (size_t i = 0; i < opt.sweeps.size(); ++i) {
+      auto& value = opt.sweeps[i].values[index[i]];
+      setenv(opt.sweeps[i].env.c_str(), value.c_str(), 1);
+      char cell[64];
+      snprintf(cell, sizeof(cell), "%-24s ", value.c_str());
+      row += cell;
+    }
+    Result r;
+    if (RunOnce(opt, &r)) {
+      auto s = Summarize(r, opt.warmup);
+      printf("%s%14.3f %14.3f\n", row.c_str(), s.iteration_ms, s.idle_ms);
+      if (best.empty() || s.iteration_ms < best_ms) {
+        best = row;
+        best_ms = s.iteration_ms;
+      }
+    } else {
+      printf("%s%14s %14s\n", row.c_str(), "stalled", "-");
+    }
+    size_t i = 0;
+    for (; i < index.size(); ++i) {
+      if (++index[i] < opt.sweeps[i].values.size()) break;
+      index[i] = 0;
+    }
+    if (i == index.size()) break;
+  }
+  if (best.empty()) return 1;
+  printf("best: %s%.3f ms\n", best.c_str(), best_ms);
+  return 0;
+}
+
+bool ParseFlag(const char* arg, const char* name, std::string* value) {
+  auto len = strlen(name);
+  if (strncmp(arg, name, len) || arg[len] != '=') return false;
+  *value = arg + len + 1;
+  return true;
+}
+
+bool ParseSweep(const std::string& arg, Sweep* sweep) {
+  auto eq = arg.find('=');
+  if (eq == std::string::npos || eq == 0) return false;
+  sweep->env = arg.substr(0, eq);
+  std::istringstream ss(arg.substr(eq + 1));
+  std::string value;
+  while (std::getline(ss, value, ',')) {
+    if (!value.empty()) sweep->values.push_back(value);
+  }
+  return !sweep->values.empty();
+}
+
+int Usage(const char* argv0) {
+  fprintf(stderr,
+          "usage: %s (--model=<name> | --timeline=<file>) [--forward_ms=50]\n"
+          "    [--backward_ms=<ms>] [--workers=2] [--servers=<n>] "
+          "[--local_size=8]\n"
+          "    [--bandwidth=<Mbps>] [--server_bandwidth=<Mbps>] "
+          "[--latency_us=20]\n"
+          "    [--pcie_gbps=12] [--nccl_gbps=60] [--nccl_launch_us=15] "
+          "[--sum_gbps=8]\n"
+          "    [--iterations=15] [--warmup=5] [--cross_barrier]\n"
+          "    [--sweep=<ENV>=<v1>,<v2>,...]...\n",
+          argv0);
+  return 1;
+}
+
+}  // namespace
+
+int SimulatorMain(int argc, char** argv) {
+  Options opt;
+  std::string model, timeline, value;
+  double forward_ms = 50, backward_ms = 0;
+  for (int i = 1; i < argc; ++i) {
+    auto& hw = opt.hw;
+    Sweep sweep;
+    if (ParseFlag(argv[i], "--model", &model) ||
+        ParseFlag(argv[i], "--timeline", &timeline)) {
+    } else if (ParseFlag(argv[i], "--forward_ms", &value)) {
+      forward_ms = atof(value.c_str());
+    } else if (ParseFlag(argv[i], "--backward_ms", &value)) {
+      backward_ms = atof(value.c_str());
+    } else if (ParseFlag(argv[i], "--workers", &value)) {
+      hw.workers = atoi(value.c_str());
+    } else if (ParseFlag(argv[i], "--servers", &value)) {
+      hw.servers = atoi(value.c_str());
+    } else if (ParseFlag(argv[i], "--local_size", &value)) {
+      hw.local_size = atoi(value.c_str());
+    } else if (ParseFlag(argv[i], "--bandwidth", &value)) {
+      hw.bandwidth = atof(value.c_str());
+    } else if (ParseFlag(argv[i], "--server_bandwidth", &value)) {
+      hw.server_bandwidth = atof(value.c_str());
+    } else if (ParseFlag(argv[i], "--latency_us", &value)) {
+      hw.latency_us = atof(value.c_str());
+    } else if (ParseFlag(argv[i], "--pcie_gbps", &value)) {
+      hw.pcie_gbps = atof(value.c_str());
+    } else if (ParseFlag(argv[i], "--nccl_gbps", &value)) {
+      hw.nccl_gbps = atof(value.c_str());
+    } else if (ParseFlag(argv[i], "--nccl_launch_us", &value)) {
+      hw.nccl_launch_us = atof(value.c_str());
+    } else if (ParseFlag(argv[i], "--sum_gbps", &value)) {
+      hw.sum_gbps = atof(value.c_str());
+    } else if (ParseFlag(argv[i], "--iterations", &value)) {
+      opt.iterations = atoi(value.c_str());
+    } else if (ParseFlag(argv[i], "--warmup", &value)) {
+      opt.warmup = atoi(value.c_str());
+    } else if (!strcmp(argv[i], "--cross_barrier")) {
+      opt.cross_barrier = true;
+    } else if (ParseFlag(argv[i], "--sweep", &value) &&
+               ParseSweep(value, &sweep)) {
+      opt.sweeps.push_back(sweep);
+    } else {
+      return Usage(argv[0]);
+    }
+  }
+  auto& hw = opt.hw;
+  if (model.empty() == timeline.empty() || hw.workers < 1 ||
+      hw.servers < 0 || hw.local_size < 1 || hw.bandwidth <= 0 ||
+      hw.pcie_gbps <= 0 || hw.nccl_gbps <= 0 || hw.sum_gbps <= 0 ||
+      opt.iterations < 1) {
+    return Usage(argv[0]);
+  }
+  if (!model.empty()) {
+    if (!backward_ms) backward_ms = 2 * forward_ms;
+    opt.workload = ModelWorkload(model, forward_ms, backward_ms);
+  } else {
+    std::string error;
+    if (!ReadTimeline(timeline, forward_ms, backward_ms, &opt.workload,
+                      &error)) {
+      fprintf(stderr, "%s\n", error.c_str());
+      return 1;
+    }
+  }
+  // a simulated plan must not replace the one of a real job
+  unsetenv("Z_PROFILE_CACHE");
+  return opt.sweeps.empty() ? RunSingle(opt) : RunSweeps(opt);
+}
+
+}  // namespace benchmark
+}  // namespace byteps
+
+int main(int argc, char** argv) {
+  return byteps::benchmark::SimulatorMain(argc, argv);
+}
@@ -0,0 +1,242 @@
+// Copyright 2019 Bytedance Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+#include "trace_reader.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+
+#include "../common/common.h"
+#include "../common/tracer.h"
+
+namespace byteps {
+namespace benchmark {
+
+namespace {
+
+int QueueOf(const std::string& name) {
+  for (int i = 0; i < common::QueueNum; ++i) {
+    if (common::LogStrings[i] == name) return i;
+  }
+  return -2;
+}
+
+// The binary format is described in tracer.h
+class BinaryReader {
+ public:
+  explicit BinaryReader(const std::string& data) : _data(data) {}
+
+  template <typename T>
+  bool Read(T* value) {
+    if (_pos + sizeof(T) > _data.size()) return false;
+    memcpy(value, _data.data() + _pos, sizeof(T));
+    _pos += sizeof(T);
+    return true;
+  }
+  bool ReadString(std::string* s) {
+    uint32_t len;
+    if (!Read(&len) || _pos + len > _data.size()) return false;
+    s->assign(_data, _pos, len);
+    _pos += len;
+    return true;
+  }
+
+ private:
+  const std::string& _data;
+  size_t _pos = 8;
+};
+
+bool ReadBinary(const std::string& data, std::vector<TraceSpan>* spans) {
+  BinaryReader r(data);
+  int64_t offset;
+  uint32_t rank, num_queues, num_names;
+  if (!r.Read(&offset) || !r.Read(&rank) || !r.Read(&num_queues)) {
+    return false;
+  }
+  std::vector<int> queues(num_queues);
+  for (auto& q : queues) {
+    std::string name;
+    if (!r.ReadString(&name)) return false;
+    q = QueueOf(name);
+  }
+  std::unordered_map<uint64_t, std::string> names;
+  if (!r.Read(&num_names)) return false;
+  for (uint32_t i = 0; i < num_names; ++i) {
+    uint64_t declared_key;
+    if (!r.Read(&declared_key) || !r.ReadString(&names[declared_key])) {
+      return false;
+    }
+  }
+  uint64_t num_records;
+  if (!r.Read(&num_records)) return false;
+  for (uint64_t i = 0; i < num_records; ++i) {
+    common::TraceRecord record;
+    if (!r.Read(&record)) return false;
+    int type = record.type;
+    if (type != common::kTraceTotal) {
+      type = (type >= 0 && type < (int)queues.size()) ? queues[type] : -2;
+      if (type < 0) continue;
+    }
+    spans->push_back({names[record.key >> 16], record.key, type,
+                      record.start_ns, record.dur_ns});
+  }
+  return true;
+}
+
+// Just enough JSON for the trace events: the string and number members of
+// the objects in "traceEvents", anything else is skipped
+class JsonReader {
+ public:
+  explicit JsonReader(const std::string& data)
+      : _p(data.data()), _end(data.data() + data.size()) {}
+
+  bool ReadEvents(std::vector<TraceSpan>* spans) {
+    if (!Expect('{')) return false;
+    do {
+      std::string key;
+      if (!ReadString(&key) || !Expect(':')) return false;
+      if (key != "traceEvents") {
+        if (!SkipValue()) return false;
+        continue;
+      }
+      if (!Expect('[')) return false;
+      if (Peek() == ']') return true;
+      do {
+        if (!ReadEvent(spans)) return false;
+      } while (Accept(','));
+      return Expect(']');
+    } while (Accept(','));
+    return false;
+  }
+
+ private:
+  bool ReadEvent(std::vector<TraceSpan>* spans) {
+    std::unordered_map<std::string, std::string> strings;
+    std::unordered_map<std::string, double> numbers;
+    if (!Expect('{')) return false;
+    if (!Accept('}')) {
+      do {
+        std::string key;
+        if (!ReadString(&key) || !Expect(':')) return false;
+        char c = Peek();
+        if (c == '"') {
+          if (!ReadString(&strings[key])) return false;
+        } else if (c == '-' || (c >= '0' && c <= '9')) {
+          char* next;
+          numbers[key] = strtod(_p, &next);
+          _p = next;
+        } else if (!SkipValue()) {
+          return false;
+        }
+      } while (Accept(','));
+      if (!Expect('}')) return false;
+    }
+
+    // "name" is Comm.<tensor>.<QUEUE>, or Comm.<tensor> for a push_pull
+    auto& name = strings["name"];
+    auto& tid = strings["tid"];
+    if (name.compare(0, 5, "Comm.") != 0) return true;
+    TraceSpan span;
+    span.start_ns = numbers["ts"] * 1000;
+    span.dur_ns = numbers["dur"] * 1000;
+    if (tid == "total") {
+      span.tensor = name.substr(5);
+      span.key = 0;
+      span.type = -1;
+    } else {
+      auto dot = name.rfind('.');
+      span.tensor = name.substr(5, dot - 5);
+      span.key = strtoull(tid.c_str(), nullptr, 10);
+      span.type = QueueOf(name.substr(dot + 1));
+      if (span.type < 0) return true;
+    }
+    spans->push_back(span);
+    return true;
+  }
+
+  char Peek() {
+    while (_p < _end && *_p && strchr(" \t\r\n", *_p)) ++_p;
+    return _p < _end ? *_p : 0;
+  }
+  bool Accept(char c) {
+    if (Peek() != c) return false;
+    ++_p;
+    return true;
+  }
+  bool Expect(char c) { return Accept(c); }
+
+  bool ReadString(std::string* s) {
+    if (!Expect('"')) return false;
+    s->clear();
+    while (_p < _end && *_p != '"') {
+      if (*_p == '\\' && _p + 1 < _end) ++_p;
+      s->push_back(*_p++);
+    }
+    return Expect('"');
+  }
+
+  bool SkipValue() {
+    char c = Peek();
+    if (c == '"') {
+      std::string s;
+      return ReadString(&s);
+    }
+    if (c == '{' || c == '[') {
+      char close = (c == '{') ? '}' : ']';
+      ++_p;
+      if (Accept(close)) return true;
+      do {
+        if (c == '{') {
+          std::string key;
+          if (!ReadString(&key) || !Expect(':')) return false;
+        }
+        if (!SkipValue()) return false;
+      } while (Accept(','));
+      return Expect(close);
+    }
+    // a number, true, false or null
+    auto start = _p;
+    while (_p < _end && *_p && !strchr(",}] \t\r\n", *_p)) ++_p;
+    return _p > start;
+  }
+
+  const char* _p;
+  const char* _end;
+};
+
+}  // namespace
+
+bool ReadTrace(const std::string& path, std::vector<TraceSpan>* spans,
+               std::string* error) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    *error = "cannot open " + path;
+    return false;
+  }
+  std::stringstream ss;
+  ss << in.rdbuf();
+  auto data = ss.str();
+  bool ok = (data.compare(0, 8, "BPSTRC01") == 0)
+                ? ReadBinary(data, spans)
+                : JsonReader(data).ReadEvents(spans);
+  if (!ok) *error = path + " is not a valid BytePS trace";
+  return ok;
+}
+
+}  // namespace benchmark
+}  // namespace byteps
@@ -0,0 +1,48 @@
+// Copyright 2019 Bytedance Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+#ifndef BYTEPS_BENCHMARK_TRACE_READER_H
+#define BYTEPS_BENCHMARK_TRACE_READER_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+namespace byteps {
+namespace benchmark {
+
+// One span of a communication trace
+struct TraceSpan {
+  std::string tensor;
+  // the partition, declared_key << 16 | part
+  uint64_t key;
+  // the QueueType of the stage, -1 for a whole push_pull
+  int type;
+  uint64_t start_ns;
+  uint64_t dur_ns;
+};
+
+// Read a comm.bin written by the Tracer, or a comm.json in the Chrome format
+// of trace_convert.py and of the former JSON dump. Stages are matched to the
+// queues of this build by name, those it does not know are dropped. Returns
+// false and sets |error| if the file cannot be read.
+bool ReadTrace(const std::string& path, std::vector<TraceSpan>* spans,
+               std::string* error);
+
+}  // namespace benchmark
+}  // namespace byteps
+
+#endif  // BYTEPS_BENCHMARK_TRACE_READER_H
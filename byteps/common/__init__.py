@@ -16,6 +16,7 @@
 # =============================================================================
 
 import ctypes
+import json
 import os
 import sysconfig
 import atexit
@@ -111,3 +112,79 @@ class BytePSBasics(object):
             raise ValueError(
                 'BytePS has not been initialized; use bps.init().')
         return local_rank
+
+    def get_credit_window(self, queue):
+        """A function that returns the current credit window of a scheduling
+        queue, e.g. 'PUSH'.
+        Returns:
+          The window in bytes, or -1 if the queue has no credit limit.
+        """
+        fn = self.C_LIB_CTYPES.byteps_get_credit_window
+        fn.restype = ctypes.c_longlong
+        return fn(queue.encode())
+
+    def dump_traces(self):
+        """A function that writes the traces recorded so far to
+        BYTEPS_TRACE_DIR/<local_rank>/comm.bin, see docs/timeline.md.
+        Returns:
+          The number of trace records written.
+        """
+        fn = self.C_LIB_CTYPES.byteps_dump_traces
+        fn.restype = ctypes.c_longlong
+        records = fn()
+        if records == -1:
+            raise ValueError('Failed to write the traces; is BytePS '
+                             'initialized and BYTEPS_TRACE_DIR writable?')
+        return records
+
+    def resize(self, num_workers):
+        """A function that changes the number of workers whose gradients are
+        summed, without a restart. Every process of the workers that stay
+        calls it between two iterations, once their push_pulls are done;
+        it returns once all of them did. size() follows, and so does the
+        average of push_pull. Tensors keep their buffers, and the Prophet
+        plan is rescaled instead of profiled again. ps-lite keeps the nodes
+        it started with, so the job can only resize within DMLC_NUM_WORKER
+        workers, e.g. while some of them sit out.
+        """
+        if self.C_LIB_CTYPES.byteps_resize(int(num_workers)) == -1:
+            raise ValueError(
+                'BytePS has not been initialized; use bps.init().')
+
+    def get_metrics(self):
+        """A function that returns the live metrics of the pipeline: for each
+        queue the pending and in-flight tasks, the credit, and the latency
+        histograms (in nanoseconds) of the wait and of the stage; the ZPush
+        and ZPull counts, bytes and latencies; and the Prophet plan.
+        Throughputs are derived from the previous call, as 'bytes_per_sec'
+        of each queue and of push and pull.
+        Returns:
+          A dict, empty if BYTEPS_METRICS_ON=0.
+        """
+        fn = self.C_LIB_CTYPES.byteps_get_metrics
+        fn.restype = ctypes.c_longlong
+        fn.argtypes = [ctypes.c_char_p, ctypes.c_longlong]
+        size = getattr(self, '_metrics_buf_size', 1 << 16)
+        while True:
+            buf = ctypes.create_string_buffer(size)
+            length = fn(buf, size)
+            if length < size:
+                break
+            size = length + 1
+        self._metrics_buf_size = size
+        if length == -1:
+            return {}
+        metrics = json.loads(buf.value.decode())
+
+        last = getattr(self, '_last_metrics', None)
+        self._last_metrics = metrics
+        elapsed = (metrics['now_ns'] - last['now_ns']) / 1e9 if last else 0
+        counters = [(metrics['queues'].get(q), last['queues'].get(q) if last
+                     else None) for q in metrics['queues']]
+        counters += [(metrics[k], last[k] if last else None)
+                     for k in ('push', 'pull')]
+        for cur, prev in counters:
+            cur['bytes_per_sec'] = \
+                (cur['bytes'] - prev['bytes']) / elapsed \
+                if prev and elapsed > 0 else 0.0
+        return metrics
@@ -0,0 +1,71 @@
+// Copyright 2019 Bytedance Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+#include "colocated.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "logging.h"
+
+namespace byteps {
+namespace common {
+
+namespace {
+
+// The job is told apart by its scheduler, so that the servers of another job
+// on the host are not taken for its own
+std::string MarkerName(int rank) {
+  auto uri = getenv("DMLC_PS_ROOT_URI");
+  auto port = getenv("DMLC_PS_ROOT_PORT");
+  return std::string("BytePS_Server_") + (uri ? uri : "") + "_" +
+         (port ? port : "") + "_" + std::to_string(rank);
+}
+
+}  // namespace
+
+void AdvertiseColocatedServer(int rank) {
+  auto name = MarkerName(rank);
+  int fd = shm_open(name.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0666);
+  BPS_CHECK_GE(fd, 0) << "shm_open failed for " << name;
+  // the pid tells the marker of a server that crashed
+  pid_t pid = getpid();
+  BPS_CHECK_EQ(write(fd, &pid, sizeof(pid)), (ssize_t)sizeof(pid))
+      << name << ": " << strerror(errno);
+  close(fd);
+}
+
+void WithdrawColocatedServer(int rank) {
+  shm_unlink(MarkerName(rank).c_str());
+}
+
+bool IsColocatedServer(int rank) {
+  int fd = shm_open(MarkerName(rank).c_str(), O_RDONLY, 0);
+  if (fd < 0) return false;
+  pid_t pid = 0;
+  bool found = read(fd, &pid, sizeof(pid)) == sizeof(pid);
+  close(fd);
+  return found && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+}  // namespace common
+}  // namespace byteps
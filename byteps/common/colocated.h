@@ -0,0 +1,49 @@
+// Copyright 2019 Bytedance Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+#ifndef BYTEPS_COLOCATED_H
+#define BYTEPS_COLOCATED_H
+
+#include <stdint.h>
+
+namespace byteps {
+namespace common {
+
+// A kColocatedPushPull push carries this instead of the data of its
+// partition: the server runs on the host of the worker, maps the shared
+// memory of the root device and sums the partition from there. The pulls of
+// the worker are answered by copying the merge to the same place, with an
+// empty response.
+struct ColocatedBuffer {
+  // shm_open name of the segment
+  char name[64];
+  // bytes of the segment, and the partition in it
+  uint64_t size;
+  uint64_t offset;
+  uint64_t len;
+};
+
+// A server started with BYTEPS_SERVER_COLOCATED advertises its rank on its
+// host, for the workers of the same job to find once ps-lite is started
+void AdvertiseColocatedServer(int rank);
+void WithdrawColocatedServer(int rank);
+
+// Whether server |rank| advertised itself on this host and is still running
+bool IsColocatedServer(int rank);
+
+}  // namespace common
+}  // namespace byteps
+
+#endif  // BYTEPS_COLOCATED_H
@@ -96,6 +96,17 @@ int64_t TensorShape::num_elements() const {
   return result;
 }
 
+RequestType GetRequestType(const BPSContext& context) {
+  if (context.server_optimizer) {
+    return RequestType::kServerOptimizerPushPull;
+  }
+  if (context.row_len) {
+    return RequestType::kRowSparsePushPull;
+  }
+  return context.compressors.empty() ? RequestType::kDefaultPushPull
+                                     : RequestType::kCompressedPushPull;
+}
+
 int GetCommandType(RequestType requestType, int d) {
   int m = static_cast<int>(requestType);
   return (((m + d) * (m + d + 1)) / 2) + d;
@@ -117,6 +128,10 @@ ncclDataType_t getNcclDataType(DataType dtype) {
       return ncclInt8;
     case BYTEPS_INT64:
       return ncclUint64;
+#if defined(NCCL_VERSION_CODE) && NCCL_VERSION_CODE >= 21000
+    case BYTEPS_BFLOAT16:
+      return ncclBfloat16;
+#endif
     default:
       BPS_CHECK(0) << "Unsupported data type: " << dtype;
   }
@@ -129,6 +144,7 @@ int getDataTypeLength(int dtype) {
     case BYTEPS_UINT8:
       return 1;
     case BYTEPS_FLOAT16:
+    case BYTEPS_BFLOAT16:
       return 2;
     case BYTEPS_INT32:
     case BYTEPS_FLOAT32:
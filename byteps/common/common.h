@@ -30,6 +30,8 @@
 #include <unordered_map>
 #include <vector>
 
+#include "colocated.h"
+
 // Add for profiling communication events
 #include <stdio.h>
 #include <stdlib.h>
@@ -62,6 +64,7 @@ enum DataType {
   // BYTEPS_INT16 = 8,
   // BYTEPS_BOOL = 9,
   // BYTEPS_BYTE = 10,
+  BYTEPS_BFLOAT16 = 12,  // mshadow::kBfloat16
 };
 
 // List of supported frameworks.
@@ -83,9 +86,11 @@ enum QueueType {
   REDUCE,
   COPYD2H,
   PCIE_REDUCE,
+  COMPRESS,
   COORDINATE_PUSH,
   PUSH,
   PULL,
+  DECOMPRESS,
   COPYH2D,
   COORDINATE_BROADCAST,
   BROADCAST,
@@ -96,9 +101,10 @@ const int QueueNum =
     (int)QUEUE_NUM_AND_NOT_A_REAL_QUEUE_TYPE_AND_MUST_BE_THE_LAST;
 
 const std::vector<std::string> LogStrings = {
-    "COORDINATE_REDUCE",    "REDUCE",   "COPYD2H", "PCIE_REDUCE",
-    "COORDINATE_PUSH",      "PUSH",     "PULL",    "COPYH2D",
-    "COORDINATE_BROADCAST", "BROADCAST"};
+    "COORDINATE_REDUCE", "REDUCE",     "COPYD2H",
+    "PCIE_REDUCE",       "COMPRESS",   "COORDINATE_PUSH",
+    "PUSH",              "PULL",       "DECOMPRESS",
+    "COPYH2D",           "COORDINATE_BROADCAST", "BROADCAST"};
 
 class Status {
  public:
@@ -148,14 +154,25 @@ class ReadyEvent {
   virtual ~ReadyEvent() = default;
 };
 
-// add for profiling
-typedef struct CommTime {
-  long long start_t;
-  long long dur = 0;
-  bool end = false;
-  int key = -1;
-  int type = -1;
-} BPSCommTime;
+class Compressor;
+
+// A partition of a tensor, decided once by InitTensor
+struct TensorPartition {
+  std::string name;
+  unsigned int offset;
+  unsigned int len;
+};
+
+// The init push of a kServerOptimizerPushPull partition carries this instead
+// of its data. Each later push of the worker is the sum of |replicas| local
+// copies, one per GPU, so the server divides a merge by the replicas of all
+// the workers rather than by the number of pushes.
+struct ServerOptimizerHeader {
+  // bytes of the partition
+  uint64_t len;
+  uint32_t replicas;
+  uint32_t reserved;
+};
 
 typedef struct BytePSContext {
   bool initialized;
@@ -173,14 +190,33 @@ typedef struct BytePSContext {
   // CPU buffer for cross-PCIe-switch merging
   std::vector<void*> pcie_cpubuff;
   size_t buff_len;
-  // Used for profiling communication events
-  std::queue<BPSCommTime*> comm_time;
+  // one per key in key_list
+  std::vector<TensorPartition> partitions;
+  // scheduled by Prophet, decided once when the tensor is initialized
+  bool prophet = false;
+  // the server applies the optimizer: pushes gradients, pulls weights
+  bool server_optimizer = false;
+  // on the root device, per partition, what its init push carries
+  std::vector<ServerOptimizerHeader> optimizer_init;
+  // a bucket of fused small tensors, see fusion.h
+  bool fusion_bucket = false;
+  // elements of a row of a declared row-sparse tensor, and the bytes of the
+  // row once InitTensor accepts it: only the non-zero rows are pushed and
+  // pulled, from the per-partition buffers, see row_sparse.h
+  size_t row_elems = 0;
+  size_t row_len = 0;
+  std::vector<char*> row_sparse_buff;
+  // on the root device, per partition, where a co-located server finds it;
+  // the name is empty if the server of the partition is remote
+  std::vector<ColocatedBuffer> colocated;
+  // with BYTEPS_COMPRESSOR, on the root device: per partition, its
+  // compressor and the buffer PUSH sends and PULL receives, see compressor.h
+  std::vector<std::shared_ptr<Compressor>> compressors;
+  std::vector<char*> compressed_buff;
+  // Used for profiling communication events, see tracer.h
   bool profile_flag = false;
   int step_cnt = 0;
   int local_rank = 0;
-  std::unordered_map<uint64_t,
-                     std::unordered_map<int, std::queue<BPSCommTime*>>>
-      part_comm_time;
 } BPSContext;
 
 class Tensor {
@@ -195,6 +231,15 @@ class Tensor {
 // A callback to call after the PS communication completes.
 using StatusCallback = std::function<void(const Status&)>;
 
+// Shared by the partitions of one push_pull: the last partition to finish
+// calls the callback
+struct PushPullRound {
+  std::atomic_int counter;
+  StatusCallback callback;
+  // Tracer::Now() when it was enqueued, 0 if it is not traced
+  uint64_t start_ns = 0;
+};
+
 // Table storing Tensors to be reduced, keyed by unique name.
 // This table contains everything necessary to do the reduction.
 struct TensorTableEntry {
@@ -218,22 +263,35 @@ struct TensorTableEntry {
   std::shared_ptr<ReadyEvent> ready_event;
   // GPU to do reduction on, or CPU_DEVICE_ID in case of CPU.
   int device = CPU_DEVICE_ID;
-  // A callback to call with the status.
-  StatusCallback callback;
+  // Divide by the number of GPUs in the NCCL reduce, see CanFuseAverage()
+  bool average = false;
   // CPU buffer address
   void* cpubuff;
   // GPU ptr if the tensor is on CPU
   void* gpu_ptr;
   // CPU buffer for cross-PCIe-switch merging
   std::vector<void*> pcie_cpubuff;
-  // The (deep copy of) queue list of this task
-  std::vector<QueueType> queue_list;
+  // Compressor of this partition and its compressed buffer, or nullptr
+  Compressor* compressor = nullptr;
+  char* compressed = nullptr;
+  // Row-sparse encoding buffer of this partition, or nullptr
+  char* row_sparse = nullptr;
+  // Shared memory of this partition if its server is co-located, or nullptr
+  const ColocatedBuffer* colocated = nullptr;
+  // The queues of this task, shared by all tasks of the same device type,
+  // and the index of its current queue in them
+  std::shared_ptr<const std::vector<QueueType>> queue_list;
+  size_t stage = 0;
+  // Tracer::Now() when the current queue got it and when its stage took it,
+  // 0 unless traced or measured by the metrics
+  uint64_t queued_ns = 0;
+  uint64_t stage_start_ns = 0;
   // The offset of this partition
   unsigned int offset = 0;
   // The length of this partition
   unsigned int len = 0;
-  // Atomic counter
-  std::shared_ptr<std::atomic_int> counter_ptr;
+  // The push_pull of this partition, with the callback
+  std::shared_ptr<PushPullRound> round;
   // How many partitions
   unsigned int total_partnum = 0;
 };
@@ -242,11 +300,23 @@ using TensorTable = std::unordered_map<std::string, TensorTableEntry>;
 enum class RequestType {
   kDefaultPushPull,
   kRowSparsePushPull,
-  kCompressedPushPull
+  kCompressedPushPull,
+  kServerOptimizerPushPull,
+  // a dense partition pushed by a worker on the host of its server, see
+  // colocated.h
+  kColocatedPushPull
 };
 
 int GetCommandType(RequestType requestType, int d);
 
+// The key a worker pushes the new number of workers to on every server, see
+// ResizeWorkers(). Above the keys of the partitions, which are the declared
+// key << 16 plus the partition.
+const uint64_t kResizeKey = (1ULL << 48) - 1;
+
+// Request type of the pushes and pulls of a tensor
+RequestType GetRequestType(const BPSContext& context);
+
 #ifndef BYTEPS_BUILDING_SERVER
 ncclDataType_t getNcclDataType(DataType dtype);
 #endif
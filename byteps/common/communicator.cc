@@ -15,7 +15,13 @@
 
 #include "communicator.h"
 
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
 #include <cerrno>
+#include <chrono>
 #include <cstring>
 
 #include "global.h"
@@ -29,7 +35,8 @@ namespace common {
 // may be a subset of all local ranks.
 BytePSCommSocket::BytePSCommSocket(std::shared_ptr<BytePSComm> comm,
                                    const std::string& path_suffix,
-                                   const std::vector<int>& members) {
+                                   const std::vector<int>& members,
+                                   bool listen) {
   std::shared_ptr<BytePSCommSocket> sock_comm =
       std::static_pointer_cast<BytePSCommSocket>(comm);
   // TODO: use private members directly
@@ -48,8 +55,9 @@ BytePSCommSocket::BytePSCommSocket(std::shared_ptr<BytePSComm> comm,
 
   auto my_role = (_local_rank == _root) ? LOCAL_ROOT : LOCAL_WORKER;
   bool is_root = (my_role == LOCAL_ROOT) ? true : false;
+  _listen = listen;
   // init socket comm
-  if (is_root) {  // root
+  if (is_root && _listen) {  // root
     _listen_thread =
         new std::thread(&BytePSCommSocket::startListenThread, this);
   }
@@ -110,7 +118,7 @@ void BytePSCommSocket::init(int* rank, int* size, int* local_rank,
   _recv_fd = initSocket(_local_rank, _recv_path);
 
   // init socket comm
-  if (is_root) {  // root
+  if (is_root && _listen) {  // root
     _listen_thread =
         new std::thread(&BytePSCommSocket::startListenThread, this);
 
@@ -182,32 +190,35 @@ void BytePSCommSocket::startListenThread() {  // only root starts this in
     if (BytePSGlobal::ShouldShutdown()) break;
 
     auto message = *(BytePSCommMsg*)buffer;
-
-    switch (message.signal) {
-      case REDUCE_READY:
-        BytePSGlobal::GetReduceTable()->AddReadyCount(message.key);
-        break;
-      case PCIE_REDUCE_READY:
-        BytePSGlobal::GetPcieReduceTable()->AddReadyCount(message.key);
-        break;
-      case BCAST_READY:
-        BytePSGlobal::GetBroadcastTable()->AddReadyCount(message.key);
-        break;
-      case PUSH_READY:
-        BytePSGlobal::GetPushTable()->AddReadyCount(message.key);
-        break;
-      default:
-        BPS_CHECK(0) << "unsupported signal: " << message.signal;
-    }
-
-    BPS_LOG(TRACE) << "root socket recved: src=" << message.src
-                   << ", signal=" << message.signal << ", key=" << message.key
-                   << ", myrank=" << _local_rank;
+    dispatchSignal(message);
   }
   BPS_LOG(DEBUG) << "listen thread joined"
                  << " (rank=" << _local_rank << ")";
 }
 
+void BytePSCommSocket::dispatchSignal(const BytePSCommMsg& message) {
+  switch (message.signal) {
+    case REDUCE_READY:
+      BytePSGlobal::GetReduceTable()->AddReadyCount(message.key);
+      break;
+    case PCIE_REDUCE_READY:
+      BytePSGlobal::GetPcieReduceTable()->AddReadyCount(message.key);
+      break;
+    case BCAST_READY:
+      BytePSGlobal::GetBroadcastTable()->AddReadyCount(message.key);
+      break;
+    case PUSH_READY:
+      BytePSGlobal::GetPushTable()->AddReadyCount(message.key);
+      break;
+    default:
+      BPS_CHECK(0) << "unsupported signal: " << message.signal;
+  }
+
+  BPS_LOG(TRACE) << "root recved: src=" << message.src
+                 << ", signal=" << message.signal << ", key=" << message.key
+                 << ", myrank=" << _local_rank;
+}
+
 int BytePSCommSocket::sendSignal(int destination, void* data, int len) {
   std::lock_guard<std::mutex> lock(_socket_mu);
   struct sockaddr_un destaddr;
@@ -279,5 +290,256 @@ int BytePSCommSocket::broadcastSignal(void* data, int len) {
   return 0;
 }
 
+// Shared by one sender and one receiver. head and tail count the bytes
+// written and consumed so far, the records are 8-byte aligned.
+struct BytePSCommShm::Ring {
+  alignas(64) std::atomic<uint64_t> head;
+  alignas(64) std::atomic<uint64_t> tail;
+  alignas(64) char data[SHM_RING_BYTES];
+};
+
+// Followed by the rings of all local ranks sending to its rank
+struct BytePSCommShm::Inbox {
+  // bumped by every signal, the futex word of the receiver
+  alignas(64) std::atomic<uint32_t> doorbell;
+  // set while the receiver sleeps or is about to
+  std::atomic<uint32_t> sleeping;
+};
+
+namespace {
+
+// A record is its length, padding, and the data padded to 8 bytes. This
+// length skips the end of the ring instead.
+const uint32_t kShmWrap = UINT32_MAX;
+const uint64_t kShmRecordHeader = 8;
+
+uint64_t ShmRecordLen(uint32_t len) {
+  return kShmRecordHeader + ((len + 7) & ~7ULL);
+}
+
+long Futex(std::atomic<uint32_t>* addr, int op, uint32_t val,
+           const struct timespec* timeout) {
+  return syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), op, val,
+                 timeout, nullptr, 0);
+}
+
+}  // namespace
+
+BytePSCommShm::BytePSCommShm(std::shared_ptr<BytePSComm> comm,
+                             const std::string& path_suffix,
+                             const std::vector<int>& members)
+    : BytePSCommSocket(comm, path_suffix, members, false) {
+  initRings(path_suffix);
+}
+
+BytePSCommShm::~BytePSCommShm() {
+  if (_listen_thread) {
+    _listen_thread->join();
+    delete _listen_thread;
+    _listen_thread = nullptr;
+  }
+  if (_shm) munmap(_shm, _shm_size);
+  if (_local_rank == _root) shm_unlink(_shm_name.c_str());
+  BPS_LOG(DEBUG) << "Clear BytePSCommShm"
+                 << " (rank=" << _local_rank << ")";
+}
+
+void BytePSCommShm::init(int* rank, int* size, int* local_rank,
+                         int* local_size, int* worker_id,
+                         BytePSRole* my_role) {
+  BytePSCommSocket::init(rank, size, local_rank, local_size, worker_id,
+                         my_role);
+  BPS_LOG(DEBUG) << "Using Communicator=Shm";
+  initRings("");
+}
+
+void BytePSCommShm::initRings(const std::string& path_suffix) {
+  _shm_name = "/BytePS_Comm_" + std::to_string(_worker_id) + "_" +
+              path_suffix + "_" + std::to_string(_root);
+  _shm_size = _local_size * (sizeof(Inbox) + _local_size * sizeof(Ring));
+  for (int i = 0; i < _local_size; ++i) {
+    _send_mu.emplace_back(new std::mutex);
+  }
+
+  int fd;
+  if (_local_rank == _root) {
+    // a segment left by an earlier job would still hold its rings
+    shm_unlink(_shm_name.c_str());
+    fd = shm_open(_shm_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0666);
+    BPS_CHECK_GE(fd, 0) << "shm_open " << _shm_name
+                        << " failed: " << strerror(errno);
+    BPS_CHECK_EQ(ftruncate(fd, _shm_size), 0)
+        << "ftruncate " << _shm_name << " failed: " << strerror(errno);
+  } else {
+    struct BytePSCommMsg msg;
+    int src;
+    BytePSCommSocket::recvSignal(&src, &msg, sizeof(msg));
+    BPS_CHECK_EQ(msg.signal, SHM_READY) << "unexpected signal " << msg.signal;
+    BPS_CHECK_EQ(msg.key, _shm_size) << "segment size mismatch";
+    fd = shm_open(_shm_name.c_str(), O_RDWR, 0666);
+    BPS_CHECK_GE(fd, 0) << "shm_open " << _shm_name
+                        << " failed: " << strerror(errno);
+  }
+  _shm = mmap(nullptr, _shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  BPS_CHECK_NE(_shm, MAP_FAILED) << "mmap " << _shm_name
+                                 << " failed: " << strerror(errno);
+  close(fd);
+
+  if (_local_rank == _root) {
+    struct BytePSCommMsg msg = {_local_rank, SHM_READY, _shm_size};
+    for (int i : _members) {
+      if (i == _local_rank) continue;
+      BytePSCommSocket::sendSignal(i, &msg, sizeof(msg));
+    }
+    _listen_thread =
+        new std::thread(&BytePSCommShm::startShmListenThread, this);
+  }
+
+  BPS_LOG(DEBUG) << "rank=" << _local_rank << " opened " << _shm_name
+                 << ", size=" << _shm_size;
+}
+
+BytePSCommShm::Inbox* BytePSCommShm::getInbox(int rank) {
+  auto stride = sizeof(Inbox) + _local_size * sizeof(Ring);
+  return reinterpret_cast<Inbox*>(static_cast<char*>(_shm) + rank * stride);
+}
+
+BytePSCommShm::Ring* BytePSCommShm::getRing(int rank, int source) {
+  return reinterpret_cast<Ring*>(getInbox(rank) + 1) + source;
+}
+
+int BytePSCommShm::sendSignal(int destination, void* data, int len) {
+  BPS_CHECK_LE(len, MAX_LINE) << "signal too long";
+  auto inbox = getInbox(destination);
+  auto ring = getRing(destination, _local_rank);
+  auto need = ShmRecordLen(len);
+  {
+    std::lock_guard<std::mutex> lock(*_send_mu[destination]);
+    auto head = ring->head.load(std::memory_order_relaxed);
+    auto pos = head & (SHM_RING_BYTES - 1);
+    auto skip = (SHM_RING_BYTES - pos < need) ? SHM_RING_BYTES - pos : 0;
+    // only full while the receiver is behind
+    while (head + skip + need -
+               ring->tail.load(std::memory_order_acquire) >
+           SHM_RING_BYTES) {
+      if (BytePSGlobal::ShouldShutdown()) return -1;
+      std::this_thread::yield();
+    }
+    if (skip) {
+      memcpy(ring->data + pos, &kShmWrap, sizeof(kShmWrap));
+      head += skip;
+      pos = 0;
+    }
+    uint32_t record_len = len;
+    memcpy(ring->data + pos, &record_len, sizeof(record_len));
+    memcpy(ring->data + pos + kShmRecordHeader, data, len);
+    ring->head.store(head + need, std::memory_order_release);
+  }
+  // pairs with the receiver setting sleeping before its last check
+  inbox->doorbell.fetch_add(1);
+  if (inbox->sleeping.load()) {
+    Futex(&inbox->doorbell, FUTEX_WAKE, 1, nullptr);
+  }
+  return len;
+}
+
+int BytePSCommShm::popSignal(int source, void* data, int max_len) {
+  auto ring = getRing(_local_rank, source);
+  auto tail = ring->tail.load(std::memory_order_relaxed);
+  while (tail != ring->head.load(std::memory_order_acquire)) {
+    auto pos = tail & (SHM_RING_BYTES - 1);
+    uint32_t len;
+    memcpy(&len, ring->data + pos, sizeof(len));
+    if (len == kShmWrap) {
+      tail += SHM_RING_BYTES - pos;
+      ring->tail.store(tail, std::memory_order_release);
+      continue;
+    }
+    BPS_CHECK_GE(max_len, 0) << "max_len=" << max_len;
+    BPS_CHECK_LE(len, (uint32_t)max_len)
+        << "recv_len=" << len << ", but given max_len=" << max_len;
+    memcpy(data, ring->data + pos + kShmRecordHeader, len);
+    ring->tail.store(tail + ShmRecordLen(len), std::memory_order_release);
+    return len;
+  }
+  return -1;
+}
+
+void BytePSCommShm::waitSignal(uint32_t seen) {
+  auto inbox = getInbox(_local_rank);
+  auto spin_until =
+      std::chrono::steady_clock::now() +
+      std::chrono::microseconds(BytePSGlobal::GetQueueSpinMicros());
+  while (std::chrono::steady_clock::now() < spin_until) {
+    if (inbox->doorbell.load(std::memory_order_acquire) != seen) return;
+    std::this_thread::yield();
+  }
+  inbox->sleeping.store(1);
+  if (inbox->doorbell.load() == seen) {
+    // times out like the sockets, to notice shutdown
+    struct timespec timeout = {3, 0};
+    Futex(&inbox->doorbell, FUTEX_WAIT, seen, &timeout);
+  }
+  inbox->sleeping.store(0);
+}
+
+void BytePSCommShm::startShmListenThread() {
+  BPS_LOG(DEBUG) << "Listening on " << _shm_name << " " << _local_rank;
+  auto inbox = getInbox(_local_rank);
+  char buffer[MAX_LINE];
+  while (!BytePSGlobal::ShouldShutdown()) {
+    auto seen = inbox->doorbell.load();
+    int drained = 0;
+    for (int src : _members) {
+      if (src == _local_rank) continue;
+      while (popSignal(src, buffer, sizeof(buffer)) >= 0) {
+        dispatchSignal(*(BytePSCommMsg*)buffer);
+        ++drained;
+      }
+    }
+    if (!drained) waitSignal(seen);
+  }
+  BPS_LOG(DEBUG) << "listen thread joined"
+                 << " (rank=" << _local_rank << ")";
+}
+
+int BytePSCommShm::recvSignal(int* source, void* data, int max_len) {
+  auto inbox = getInbox(_local_rank);
+  int num = _members.size();
+  while (!BytePSGlobal::ShouldShutdown()) {
+    auto seen = inbox->doorbell.load();
+    for (int i = 0; i < num; ++i) {
+      int src = _members[(_next_source + i) % num];
+      if (src == _local_rank) continue;
+      int rc = popSignal(src, data, max_len);
+      if (rc < 0) continue;
+      _next_source = (_next_source + i + 1) % num;
+      *source = src;
+      BPS_LOG(TRACE) << "non-root shm recved: src=" << src << ", len=" << rc
+                     << ", myrank=" << _local_rank;
+      return rc;
+    }
+    waitSignal(seen);
+  }
+  return -1;
+}
+
+std::shared_ptr<BytePSComm> CreateComm() {
+  std::string type =
+      getenv("BYTEPS_COMM_TYPE") ? getenv("BYTEPS_COMM_TYPE") : "socket";
+  if (type == "shm") return std::make_shared<BytePSCommShm>();
+  BPS_CHECK(type == "socket") << "unknown BYTEPS_COMM_TYPE " << type;
+  return std::make_shared<BytePSCommSocket>();
+}
+
+std::shared_ptr<BytePSComm> CreateComm(std::shared_ptr<BytePSComm> comm,
+                                       const std::string& path_suffix,
+                                       const std::vector<int>& members) {
+  if (std::dynamic_pointer_cast<BytePSCommShm>(comm)) {
+    return std::make_shared<BytePSCommShm>(comm, path_suffix, members);
+  }
+  return std::make_shared<BytePSCommSocket>(comm, path_suffix, members);
+}
+
 }  // namespace common
 }  // namespace byteps
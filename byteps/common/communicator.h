@@ -26,9 +26,12 @@
 #include <sys/un.h>
 #include <unistd.h>
 
+#include <atomic>
 #include <cstdio>
 #include <cstdlib>
+#include <memory>
 #include <mutex>
+#include <string>
 #include <thread>
 #include <vector>
 
@@ -37,6 +40,10 @@
 #define DEFAULT_BASE_SOCKET_PATH_RECV "/tmp/socket_recv_"
 #define DEFAULT_BASE_SOCKET_PATH_SEND "/tmp/socket_send_"
 #define MAX_LINE 8000
+// tasks of one NCCL group signaled in a BytePSCommGroupMsg
+#define MAX_GROUP_TASKS 256
+// bytes of each ring of BytePSCommShm, must be a power of 2
+#define SHM_RING_BYTES (1 << 16)
 
 namespace byteps {
 namespace common {
@@ -50,7 +57,8 @@ enum BytePSCommSignal {
   DO_REDUCE,
   DO_BROADCAST,
   DO_GROUP,
-  DO_COPYH2D
+  DO_COPYH2D,
+  SHM_READY
 };
 
 struct BytePSCommMsg {
@@ -59,6 +67,24 @@ struct BytePSCommMsg {
   uint64_t key;
 };
 
+// DO_GROUP with the tasks of one NCCL group, in the order the root posts
+// them, instead of one DO_REDUCE or DO_BROADCAST message per task. The header
+// is a BytePSCommMsg whose key is the number of tasks.
+struct BytePSCommGroupMsg {
+  int src;
+  BytePSCommSignal signal;
+  uint64_t num;
+  struct {
+    BytePSCommSignal signal;
+    uint64_t key;
+  } tasks[MAX_GROUP_TASKS];
+
+  // bytes to send
+  int size() const {
+    return sizeof(BytePSCommMsg) + num * sizeof(tasks[0]);
+  }
+};
+
 class BytePSComm {
  public:
   BytePSComm() { _comm = nullptr; }
@@ -98,9 +124,9 @@ class BytePSCommSocket : public BytePSComm {
   BytePSCommSocket() {}
   BytePSCommSocket(std::shared_ptr<BytePSComm> comm,
                    const std::string& path_suffix,
-                   const std::vector<int>& members);
+                   const std::vector<int>& members, bool listen = true);
 
-  ~BytePSCommSocket() {
+  virtual ~BytePSCommSocket() {
     if ((_root == _local_rank) && _listen_thread) {
       _listen_thread->join();
     }
@@ -128,8 +154,12 @@ class BytePSCommSocket : public BytePSComm {
  protected:
   void startListenThread();
   int initSocket(int rank, const std::string& path);
+  // Count a ready signal of a non-root, on the root
+  void dispatchSignal(const BytePSCommMsg& message);
 
-  std::thread* _listen_thread;
+  // whether the root starts the listen thread on the socket
+  bool _listen = true;
+  std::thread* _listen_thread = nullptr;
 
   std::string _send_path;
   std::string _recv_path;
@@ -139,6 +169,63 @@ class BytePSCommSocket : public BytePSComm {
   std::mutex _socket_mu;
 };
 
+// Signals through rings in shared memory instead of datagrams, so that
+// sending and receiving a signal take no syscall unless the receiver sleeps.
+//
+// There is one single-producer single-consumer ring per pair of local ranks.
+// The threads of a process sending to the same rank take a mutex of their
+// own, and each rank has one receiver: the listen thread on the root, the
+// caller of recvSignal() otherwise. The receiver drains all available
+// signals before it sleeps on a futex, which senders only wake when the
+// receiver announced that it sleeps.
+//
+// The sockets are only used to agree on the segment: the root creates it and
+// then tells the other members to open it.
+class BytePSCommShm : public BytePSCommSocket {
+ public:
+  BytePSCommShm() { _listen = false; }
+  BytePSCommShm(std::shared_ptr<BytePSComm> comm,
+                const std::string& path_suffix,
+                const std::vector<int>& members);
+
+  ~BytePSCommShm();
+
+  void init(int* rank, int* size, int* local_rank, int* local_size,
+            int* worker_id, BytePSRole* my_role);
+  int sendSignal(int destination, void* data, int len);
+  int recvSignal(int* source, void* data, int max_len);
+
+ private:
+  struct Ring;
+  struct Inbox;
+
+  void initRings(const std::string& path_suffix);
+  void startShmListenThread();
+  Inbox* getInbox(int rank);
+  Ring* getRing(int rank, int source);
+  // Copy the next signal sent to this rank by |source| into |data|,
+  // -1 if there is none
+  int popSignal(int source, void* data, int max_len);
+  // Sleep until a signal may have been sent to this rank after the doorbell
+  // read |seen|, or a timeout
+  void waitSignal(uint32_t seen);
+
+  std::string _shm_name;
+  void* _shm = nullptr;
+  size_t _shm_size = 0;
+  std::vector<std::unique_ptr<std::mutex>> _send_mu;
+  // the ring recvSignal() starts with, for fairness
+  int _next_source = 0;
+};
+
+// The communicator set by BYTEPS_COMM_TYPE, "socket" (default) or "shm"
+std::shared_ptr<BytePSComm> CreateComm();
+// A communicator of the same type as |comm|, see the copy constructor of
+// BytePSCommSocket
+std::shared_ptr<BytePSComm> CreateComm(std::shared_ptr<BytePSComm> comm,
+                                       const std::string& path_suffix,
+                                       const std::vector<int>& members);
+
 }  // namespace common
 }  // namespace byteps
 
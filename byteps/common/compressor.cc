@@ -0,0 +1,263 @@
+// Copyright 2019 Bytedance Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+#include "compressor.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <numeric>
+
+#include "logging.h"
+
+namespace byteps {
+namespace common {
+
+namespace {
+
+// Round to nearest even, like the F16C instructions
+uint16_t FloatToHalf(float f) {
+  uint32_t x;
+  memcpy(&x, &f, sizeof(x));
+  uint32_t sign = (x >> 16) & 0x8000;
+  uint32_t abs = x & 0x7fffffff;
+  if (abs >= 0x7f800000) {  // inf or nan
+    return sign | 0x7c00 | (abs > 0x7f800000 ? 0x200 : 0);
+  }
+  if (abs >= 0x477ff000) {  // rounds to above 65504
+    return sign | 0x7c00;
+  }
+  if (abs < 0x38800000) {  // below 2^-14, subnormal in half
+    float v;
+    memcpy(&v, &abs, sizeof(v));
+    return sign | static_cast<uint16_t>(std::nearbyint(v * 16777216.0f));
+  }
+  // rebias the exponent and round the 13 dropped bits
+  abs += 0xc8000fff + ((abs >> 13) & 1);
+  return sign | (abs >> 13);
+}
+
+float HalfToFloat(uint16_t h) {
+  uint32_t sign = (h & 0x8000) << 16;
+  uint32_t exp = (h >> 10) & 0x1f;
+  uint32_t mant = h & 0x3ff;
+  uint32_t x;
+  if (exp == 0) {
+    float v = mant * (1.0f / 16777216.0f);
+    memcpy(&x, &v, sizeof(x));
+  } else if (exp == 31) {
+    x = 0x7f800000 | (mant << 13);
+  } else {
+    x = ((exp + 112) << 23) | (mant << 13);
+  }
+  x |= sign;
+  float f;
+  memcpy(&f, &x, sizeof(f));
+  return f;
+}
+
+// float16 values, 2x smaller
+class Fp16Compressor : public Compressor {
+ public:
+  Fp16Compressor(size_t len, bool error_feedback)
+      : Compressor(CompressorType::kFp16, len, error_feedback) {}
+
+ protected:
+  size_t PayloadLen() const override { return num() * sizeof(uint16_t); }
+
+  void Encode(float* x, char* payload) override {
+    auto out = reinterpret_cast<uint16_t*>(payload);
+    for (size_t i = 0; i < num(); ++i) {
+      out[i] = FloatToHalf(x[i]);
+      float err = x[i] - HalfToFloat(out[i]);
+      x[i] = std::isfinite(err) ? err : 0;
+    }
+  }
+
+  void Decode(const char* payload, float* dst, bool add) const override {
+    auto in = reinterpret_cast<const uint16_t*>(payload);
+    for (size_t i = 0; i < num(); ++i) {
+      dst[i] = (add ? dst[i] : 0) + HalfToFloat(in[i]);
+    }
+  }
+};
+
+// The k elements of the largest magnitude, as k indices then k values
+class TopKCompressor : public Compressor {
+ public:
+  TopKCompressor(size_t len, uint32_t k, bool error_feedback)
+      : Compressor(CompressorType::kTopK, len, error_feedback), _k(k) {
+    BPS_CHECK_GT(_k, 0);
+    BPS_CHECK_LE(_k, num());
+  }
+
+ protected:
+  size_t PayloadLen() const override {
+    return _k * (sizeof(uint32_t) + sizeof(float));
+  }
+  uint32_t k() const override { return _k; }
+
+  void Encode(float* x, char* payload) override {
+    _index.resize(num());
+    std::iota(_index.begin(), _index.end(), 0);
+    std::nth_element(_index.begin(), _index.begin() + _k - 1, _index.end(),
+                     [x](uint32_t a, uint32_t b) {
+                       return std::fabs(x[a]) > std::fabs(x[b]);
+                     });
+    // in order, so that decoding writes the output sequentially
+    std::sort(_index.begin(), _index.begin() + _k);
+    auto indices = reinterpret_cast<uint32_t*>(payload);
+    auto values = reinterpret_cast<float*>(indices + _k);
+    for (uint32_t i = 0; i < _k; ++i) {
+      indices[i] = _index[i];
+      values[i] = x[_index[i]];
+      x[_index[i]] = 0;
+    }
+  }
+
+  void Decode(const char* payload, float* dst, bool add) const override {
+    auto indices = reinterpret_cast<const uint32_t*>(payload);
+    auto values = reinterpret_cast<const float*>(indices + _k);
+    if (!add) memset(dst, 0, len());
+    for (uint32_t i = 0; i < _k; ++i) {
+      dst[indices[i]] += values[i];
+    }
+  }
+
+ private:
+  uint32_t _k;
+  std::vector<uint32_t> _index;
+};
+
+// The signs, scaled by the mean magnitude, 32x smaller
+class OneBitCompressor : public Compressor {
+ public:
+  OneBitCompressor(size_t len, bool error_feedback)
+      : Compressor(CompressorType::kOneBit, len, error_feedback) {}
+
+ protected:
+  size_t PayloadLen() const override {
+    return sizeof(float) + (num() + 31) / 32 * sizeof(uint32_t);
+  }
+
+  void Encode(float* x, char* payload) override {
+    double total = 0;
+    for (size_t i = 0; i < num(); ++i) total += std::fabs(x[i]);
+    float scale = num() ? total / num() : 0;
+    memcpy(payload, &scale, sizeof(scale));
+    auto bits = reinterpret_cast<uint32_t*>(payload + sizeof(float));
+    memset(bits, 0, PayloadLen() - sizeof(float));
+    for (size_t i = 0; i < num(); ++i) {
+      bool negative = x[i] < 0;
+      bits[i / 32] |= static_cast<uint32_t>(negative) << (i % 32);
+      x[i] -= negative ? -scale : scale;
+    }
+  }
+
+  void Decode(const char* payload, float* dst, bool add) const override {
+    float scale;
+    memcpy(&scale, payload, sizeof(scale));
+    auto bits = reinterpret_cast<const uint32_t*>(payload + sizeof(float));
+    for (size_t i = 0; i < num(); ++i) {
+      float v = ((bits[i / 32] >> (i % 32)) & 1) ? -scale : scale;
+      dst[i] = (add ? dst[i] : 0) + v;
+    }
+  }
+};
+
+std::unique_ptr<Compressor> MakeCompressor(CompressorType type, size_t len,
+                                           uint32_t k, bool error_feedback) {
+  BPS_CHECK_EQ(len % sizeof(float), 0) << "only float32 can be compressed";
+  switch (type) {
+    case CompressorType::kNone:
+      return nullptr;
+    case CompressorType::kFp16:
+      return std::unique_ptr<Compressor>(
+          new Fp16Compressor(len, error_feedback));
+    case CompressorType::kTopK:
+      return std::unique_ptr<Compressor>(
+          new TopKCompressor(len, k, error_feedback));
+    case CompressorType::kOneBit:
+      return std::unique_ptr<Compressor>(
+          new OneBitCompressor(len, error_feedback));
+  }
+  BPS_CHECK(0) << "unknown compressor type " << static_cast<uint32_t>(type);
+  return nullptr;
+}
+
+}  // namespace
+
+std::unique_ptr<Compressor> Compressor::Create(CompressorType type,
+                                               size_t len, double ratio,
+                                               bool error_feedback) {
+  size_t num = len / sizeof(float);
+  auto k = static_cast<uint32_t>(std::max<double>(1, ratio * num));
+  return MakeCompressor(type, len, std::min<size_t>(k, num), error_feedback);
+}
+
+std::unique_ptr<Compressor> Compressor::Create(const void* compressed,
+                                               bool error_feedback) {
+  auto header = static_cast<const CompressedHeader*>(compressed);
+  return MakeCompressor(static_cast<CompressorType>(header->type),
+                        header->len, header->k, error_feedback);
+}
+
+CompressorType Compressor::ParseType(const std::string& name) {
+  if (name == "fp16") return CompressorType::kFp16;
+  if (name == "topk") return CompressorType::kTopK;
+  if (name == "onebit") return CompressorType::kOneBit;
+  BPS_CHECK(name.empty() || name == "none") << "unknown compressor " << name;
+  return CompressorType::kNone;
+}
+
+Compressor::Compressor(CompressorType type, size_t len, bool error_feedback)
+    : _type(type),
+      _len(len),
+      _error_feedback(error_feedback),
+      _corrected(len / sizeof(float), 0.0f) {}
+
+void Compressor::Zero(void* dst) const {
+  auto header = static_cast<CompressedHeader*>(dst);
+  header->type = static_cast<uint32_t>(_type);
+  header->k = k();
+  header->len = _len;
+  memset(header + 1, 0, PayloadLen());
+}
+
+void Compressor::Compress(const void* src, void* dst) {
+  auto in = static_cast<const float*>(src);
+  auto x = _corrected.data();
+  if (_error_feedback) {
+    for (size_t i = 0; i < num(); ++i) x[i] += in[i];
+  } else {
+    memcpy(x, in, _len);
+  }
+  auto header = static_cast<CompressedHeader*>(dst);
+  header->type = static_cast<uint32_t>(_type);
+  header->k = k();
+  header->len = _len;
+  Encode(x, reinterpret_cast<char*>(header + 1));
+}
+
+void Compressor::Decompress(const void* src, void* dst, bool add) const {
+  auto header = static_cast<const CompressedHeader*>(src);
+  BPS_CHECK_EQ(header->type, static_cast<uint32_t>(_type));
+  BPS_CHECK_EQ(header->len, _len);
+  Decode(reinterpret_cast<const char*>(header + 1), static_cast<float*>(dst),
+         add);
+}
+
+}  // namespace common
+}  // namespace byteps
@@ -0,0 +1,94 @@
+// Copyright 2019 Bytedance Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+#ifndef BYTEPS_COMPRESSOR_H
+#define BYTEPS_COMPRESSOR_H
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace byteps {
+namespace common {
+
+enum class CompressorType : uint32_t { kNone, kFp16, kTopK, kOneBit };
+
+// Starts every compressed buffer, so that the server can decompress and
+// recompress a key without knowing the settings of the workers
+struct CompressedHeader {
+  uint32_t type;
+  // top-k: number of elements kept
+  uint32_t k;
+  // bytes of float32 before compression
+  uint64_t len;
+};
+
+// Compression of one float32 partition, used by the COMPRESS and DECOMPRESS
+// stages of the root device and by the server.
+//
+// The compressed size only depends on the type and len, so that the pushes
+// and pulls of a key keep their size. With error feedback, what a call of
+// Compress() loses is added to the input of the next call.
+class Compressor {
+ public:
+  // nullptr for kNone. |ratio| is the fraction of elements top-k keeps.
+  static std::unique_ptr<Compressor> Create(CompressorType type, size_t len,
+                                            double ratio, bool error_feedback);
+  // The compressor of a buffer compressed by another one
+  static std::unique_ptr<Compressor> Create(const void* compressed,
+                                            bool error_feedback);
+  // "fp16", "topk" or "onebit"
+  static CompressorType ParseType(const std::string& name);
+
+  virtual ~Compressor() = default;
+
+  size_t len() const { return _len; }
+  size_t compressed_len() const {
+    return sizeof(CompressedHeader) + PayloadLen();
+  }
+
+  // Write the compressed form of an all-zero tensor
+  void Zero(void* dst) const;
+  // Compress len() bytes of |src| into compressed_len() bytes of |dst|. Not
+  // threadsafe with error feedback.
+  void Compress(const void* src, void* dst);
+  // Decompress |src| into |dst|, or add it to |dst|. threadsafe.
+  void Decompress(const void* src, void* dst, bool add) const;
+
+ protected:
+  Compressor(CompressorType type, size_t len, bool error_feedback);
+
+  virtual size_t PayloadLen() const = 0;
+  virtual uint32_t k() const { return 0; }
+  // Compress |x| into |payload|, leaving the error of the compression in |x|
+  virtual void Encode(float* x, char* payload) = 0;
+  virtual void Decode(const char* payload, float* dst, bool add) const = 0;
+
+  size_t num() const { return _len / sizeof(float); }
+
+ private:
+  CompressorType _type;
+  size_t _len;
+  bool _error_feedback;
+  // the input plus the residual of the last call, or just the input
+  std::vector<float> _corrected;
+};
+
+}  // namespace common
+}  // namespace byteps
+
+#endif  // BYTEPS_COMPRESSOR_H
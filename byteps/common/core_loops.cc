@@ -18,21 +18,24 @@
 #include <cuda_runtime.h>
 
 #include <chrono>
+#include <deque>
 #include <memory>
+#include <vector>
 
 #include "common.h"
 #include "global.h"
 #include "logging.h"
+#include "row_sparse.h"
 
 namespace byteps {
 namespace common {
 
 void FinishOrProceed(std::shared_ptr<TensorTableEntry> task) {
-  auto &queue_list = task->queue_list;
-  BPS_CHECK_GE(queue_list.size(), 1);
-  auto this_op = queue_list[0];
+  auto &queue_list = *task->queue_list;
+  BPS_CHECK_LT(task->stage, queue_list.size());
+  auto this_op = queue_list[task->stage];
   auto q = BytePSGlobal::GetScheduledQueue(this_op);
-  q->reportFinish(task->len);
+  q->reportFinish(task);
   if (BytePSGlobal::IsTensorSampled(task->key)) {
     // We only support sampling
     BPS_CHECK(task->tensor->dtype() == common::BYTEPS_FLOAT32);
@@ -65,67 +68,46 @@ void FinishOrProceed(std::shared_ptr<TensorTableEntry> task) {
     }
   }
 
-  if (task->context->profile_flag) {
-    BPS_CHECK(task->context->part_comm_time[task->key][this_op].back()->dur ==
-              0)
-        << " tensor: " << task->tensor_name << " task->key:" << task->key
-        << " type:" << this_op << " 'dur' has already been assigned:"
-        << task->context->part_comm_time[task->key][this_op].back()->dur;
-    auto now = std::chrono::system_clock::now();
-    auto duration = now.time_since_epoch();
-    auto us = std::chrono::duration_cast<std::chrono::microseconds>(duration);
-    auto _ts =
-        task->context->part_comm_time[task->key][this_op].back()->start_t;
-    BPS_CHECK(task->context->part_comm_time.find(task->key) !=
-              task->context->part_comm_time.end())
-        << " tensor: " << task->tensor_name << " task->key:" << task->key
-        << " type:" << this_op;
-    BPS_CHECK(task->context->part_comm_time[task->key].find(this_op) !=
-              task->context->part_comm_time[task->key].end())
-        << " tensor: " << task->tensor_name << " task->key:" << task->key
-        << " type:" << this_op;
-
-    task->context->part_comm_time[task->key][this_op].back()->dur =
-        (long long)(us.count()) - _ts;
-  }
-
-  // finish current QueueType of this task, erase current QueueType.
-  queue_list.erase(queue_list.begin());
-  if (queue_list.size() > 0) {
+  // taken by getTask of this queue, also timed for the metrics
+  if (task->stage_start_ns && BytePSGlobal::ShouldTrace(task->context)) {
+    Tracer::Record(task->key, this_op, task->stage_start_ns, Tracer::Now());
+    task->stage_start_ns = 0;
+  }
+
+  // finish current QueueType of this task, move on to the next one.
+  if (++task->stage < queue_list.size()) {
     BPS_CHECK(task->tensor_name != "");
     BPS_LOG(TRACE) << "Rank=" << BytePSGlobal::GetRank() << " finishes "
                    << LogStrings[this_op] << ", tensor: " << task->tensor_name
                    << ", key=" << task->key << "; Passing to the next queue.";
-    BytePSGlobal::GetScheduledQueue(queue_list[0])->addTask(task);
+    BytePSGlobal::GetScheduledQueue(queue_list[task->stage])->addTask(task);
   } else {
     // this is the last QueueType of this current sub-task.
-    BPS_CHECK(task->counter_ptr) << task->tensor_name << " counter_ptr is null";
-    int v = task->counter_ptr.get()->fetch_add(1);
+    BPS_CHECK(task->round) << task->tensor_name << " round is null";
+    int v = task->round->counter.fetch_add(1);
     if (v == (int)(task->total_partnum - 1)) {
       // if meet this condition, that means all sub-tasks of this task have been
       // done
       BPS_CHECK(task->tensor_name != "");
       BPS_LOG(TRACE) << "Rank=" << BytePSGlobal::GetRank()
                      << " finish processing tensor: " << task->tensor_name;
-      task->callback(Status::OK());
-      //* Add for profiling communication events
-      if (task->context->profile_flag) {
-        BPS_CHECK(task->context->comm_time.back()->dur == 0)
-            << " tensor: " << task->tensor_name
-            << " 'dur' has already been assigned:"
-            << task->context->comm_time.back()->dur;
-        auto now = std::chrono::system_clock::now();
-        auto duration = now.time_since_epoch();
-        auto us =
-            std::chrono::duration_cast<std::chrono::microseconds>(duration);
-        auto _ts = task->context->comm_time.back()->start_t;
-        task->context->comm_time.back()->dur = (long long)(us.count()) - _ts;
+      StatusCallback callback;
+      callback.swap(task->round->callback);
+      callback(Status::OK());
+      if (task->round->start_ns) {
+        Tracer::Record(task->context->declared_key << 16, kTraceTotal,
+                       task->round->start_ns, Tracer::Now());
       }
       // Set the profile_flag first
       // *step_cnt* denotes the number this gradient has been synchronized.
       task->context->step_cnt += 1;
       BytePSGlobal::SetProfileFlag(task->context);
     }
+    // the entry is recycled by EnqueueTensor, do not keep the tensors alive
+    task->tensor.reset();
+    task->output.reset();
+    task->ready_event.reset();
+    task->round.reset();
   }
   return;
 }
@@ -176,7 +158,7 @@ bool RunCoordinateLoopOnce(QueueType this_op) {
                    << "Signal=" << sig << ", rank=" << rank << ", key=" << key;
 
   } else {
-    std::this_thread::sleep_for(std::chrono::nanoseconds(1000));
+    q->waitTask();
   }
   return true;
 }
@@ -229,20 +211,27 @@ inline void PostNcclCalls(
     if (task->device == CPU_DEVICE_ID && task->tensor == task->output) {
       out_p = p;
     }
+    auto red_op = (ncclRedOp_t)ncclSum;
+#ifdef BYTEPS_NCCL_PREMULSUM
+    if (task->average) {
+      red_op = nccl->GetAverageOp((ncclComm_t)nccl_comm,
+                                  (ncclDataType_t)nccl_dtype);
+    }
+#endif
 
     if (num_elem_per_gpu) {
       NCCLCHECK(ncclReduceScatter(
           (const void *)p,
           (void *)(out_p + nccl_rank * num_elem_per_gpu * unit_len),
-          (size_t)num_elem_per_gpu, (ncclDataType_t)nccl_dtype,
-          (ncclRedOp_t)ncclSum, (ncclComm_t)nccl_comm,
+          (size_t)num_elem_per_gpu, (ncclDataType_t)nccl_dtype, red_op,
+          (ncclComm_t)nccl_comm,
           (cudaStream_t)nccl_stream));
     }
     if (left_elem) {
       NCCLCHECK(ncclReduce((const void *)(p + len - left_elem * unit_len),
                            (void *)(out_p + len - left_elem * unit_len),
                            (size_t)left_elem, (ncclDataType_t)nccl_dtype,
-                           (ncclRedOp_t)ncclSum, (int)nccl_root,
+                           red_op, (int)nccl_root,
                            (ncclComm_t)nccl_comm, (cudaStream_t)nccl_stream));
     }
   } else {
@@ -268,43 +257,76 @@ bool RunRootNcclLoopOnce() {
   int rank = BytePSGlobal::GetLocalRank();
   BPS_CHECK_EQ(rank, root);
 
-  int nccl_size = BytePSGlobal::GetNccl()->GetSize();
+  auto nccl = BytePSGlobal::GetNccl();
+  int nccl_size = nccl->GetSize();
   QueueType nccl_ops[] = {REDUCE, BROADCAST};
+  size_t max_tasks = nccl->GetGroupSize();
+  size_t max_bytes = nccl->GetGroupBytes();
+  auto wait = std::chrono::microseconds(nccl->GetGroupWaitMicros());
 
   auto nccl_entry = std::make_shared<NcclGroupEntry>();
   auto &tasks = nccl_entry->tasks;
   auto &queues = nccl_entry->queues;
-
+  // the tasks of the group for the non-root devices, sent at once
+  BytePSCommGroupMsg group = {};
+  group.src = rank;
+  group.signal = DO_GROUP;
+
+  // Per queue, take tasks until the group has max_tasks of them or max_bytes
+  // in total. A group that is not full waits for more tasks until |wait|
+  // after its first one, so that small tasks are batched while a large task
+  // closes its group by itself.
+  size_t num[] = {0, 0};
+  size_t bytes[] = {0, 0};
+  auto deadline = std::chrono::steady_clock::now();
   NCCLCHECK(ncclGroupStart());
-  for (auto this_op : nccl_ops) {
-    auto q = BytePSGlobal::GetScheduledQueue(this_op);
-    for (int i = 0; i < BytePSGlobal::GetNccl()->GetGroupSize(); i++) {
-      auto task = q->getTask();
-      if (!task) {
-        break;
-      }
-      tasks.push_back(task);
-      queues.push_back(q);
-
-      if (nccl_size > 1) {
-        // notify non-root devices
-        struct BytePSCommMsg msg = {
-            rank, (this_op == REDUCE) ? DO_REDUCE : DO_BROADCAST, task->key};
-        signal_comm->broadcastSignal(&msg, sizeof(BytePSCommMsg));
-        PostNcclCalls(task, this_op);
+  while (true) {
+    bool full = true;
+    for (int i = 0; i < 2; ++i) {
+      auto this_op = nccl_ops[i];
+      auto q = BytePSGlobal::GetScheduledQueue(this_op);
+      while (num[i] < max_tasks && (!max_bytes || bytes[i] < max_bytes)) {
+        auto task = q->getTask();
+        if (!task) {
+          break;
+        }
+        if (tasks.empty()) {
+          deadline = std::chrono::steady_clock::now() + wait;
+        }
+        tasks.push_back(task);
+        queues.push_back(q);
+        ++num[i];
+        bytes[i] += task->len;
+
+        if (nccl_size > 1) {
+          group.tasks[group.num].signal =
+              (this_op == REDUCE) ? DO_REDUCE : DO_BROADCAST;
+          group.tasks[group.num].key = task->key;
+          ++group.num;
+          PostNcclCalls(task, this_op);
+        }
       }
+      full = full && (num[i] >= max_tasks ||
+                      (max_bytes && bytes[i] >= max_bytes));
+    }
+    if (tasks.empty() || full ||
+        std::chrono::steady_clock::now() >= deadline) {
+      break;
     }
+    // REDUCE and BROADCAST share a notifier
+    BytePSGlobal::GetScheduledQueue(REDUCE)->waitTask();
   }
   if (tasks.size()) {
-    struct BytePSCommMsg msg = {rank, DO_GROUP, 0};
-    signal_comm->broadcastSignal(&msg, sizeof(BytePSCommMsg));
+    // notify non-root devices
+    signal_comm->broadcastSignal(&group, group.size());
     NCCLCHECK(ncclGroupEnd());
     nccl_entry->RecordEvents();
     BPS_LOG(TRACE) << "NCCL Group size=" << tasks.size() << " rank=" << rank;
     BytePSGlobal::GetNccl()->EnqueueGroup(nccl_entry);
   } else {
     NCCLCHECK(ncclGroupEnd());
-    std::this_thread::sleep_for(std::chrono::nanoseconds(1000));
+    // REDUCE and BROADCAST share a notifier, REDUCE was polled first
+    BytePSGlobal::GetScheduledQueue(REDUCE)->waitTask();
   }
 
   return true;
@@ -319,15 +341,16 @@ bool RunNonRootNcclLoopOnce() {
   auto nccl_entry = std::make_shared<NcclGroupEntry>();
   auto &tasks = nccl_entry->tasks;
   auto &queues = nccl_entry->queues;
-  struct BytePSCommMsg msg = {};
+  BytePSCommGroupMsg group = {};
+
+  signal_comm->recvSignalFromRoot(&group, sizeof(BytePSCommGroupMsg));
+  if (BytePSGlobal::ShouldShutdown()) return true;
+  BPS_CHECK_EQ(group.signal, DO_GROUP) << group.signal;
+  BPS_CHECK_LE(group.num, MAX_GROUP_TASKS);
 
   NCCLCHECK(ncclGroupStart());
-  while (1) {
-    signal_comm->recvSignalFromRoot(&msg, sizeof(BytePSCommMsg));
-    if (BytePSGlobal::ShouldShutdown()) return true;
-    if (msg.signal == DO_GROUP) {
-      break;
-    }
+  for (size_t i = 0; i < group.num; ++i) {
+    auto &msg = group.tasks[i];
     QueueType this_op = REDUCE;
     if (msg.signal == DO_BROADCAST) {
       this_op = BROADCAST;
@@ -363,19 +386,92 @@ bool RunSyncNcclOnce() {
     nccl_entry->DestroyEvents();
     BPS_LOG(TRACE) << "Finished NCCL Group size=" << nccl_entry->tasks.size()
                    << " rank=" << BytePSGlobal::GetLocalRank();
-  } else {
-    std::this_thread::sleep_for(std::chrono::nanoseconds(1000));
   }
   return true;
 }
 
+// GPU-CPU copies in flight on one copy loop. Copies go round-robin to the
+// copy streams, and each is followed by an event. The loop polls the events
+// and lets a task proceed as soon as its copy has landed, so the copy of the
+// next partition overlaps the push (or the callback) of the previous one.
+// Only used by its loop thread.
+class CopyPipeline {
+ public:
+  explicit CopyPipeline(cudaStream_t *streams) : _streams(streams) {}
+
+  bool Full() const {
+    return _inflight.size() >= (size_t)BytePSGlobal::GetCopyPipelineDepth();
+  }
+
+  cudaStream_t NextStream() {
+    auto stream = _streams[_next];
+    _next = (_next + 1) % BytePSGlobal::GetCopyStreamNum();
+    return stream;
+  }
+
+  // |task| proceeds once the work queued so far on |stream| is done
+  void Add(std::shared_ptr<TensorTableEntry> task, cudaStream_t stream) {
+    cudaEvent_t event;
+    if (_free_events.empty()) {
+      CUDA_CALL(cudaEventCreateWithFlags(&event, cudaEventDisableTiming));
+    } else {
+      event = _free_events.back();
+      _free_events.pop_back();
+    }
+    CUDA_CALL(cudaEventRecord(event, stream));
+    _inflight.emplace_back(task, event);
+  }
+
+  // Block until the oldest copy is done, Poll() then lets its task proceed
+  void WaitOldest() {
+    if (!_inflight.empty()) {
+      CUDA_CALL(cudaEventSynchronize(_inflight.front().second));
+    }
+  }
+
+  // FinishOrProceed every task whose copy is done
+  void Poll() {
+    for (auto it = _inflight.begin(); it != _inflight.end();) {
+      auto status = cudaEventQuery(it->second);
+      if (status == cudaErrorNotReady) {
+        ++it;
+        continue;
+      }
+      CUDA_CALL(status);
+      _free_events.push_back(it->second);
+      auto task = it->first;
+      it = _inflight.erase(it);
+      FinishOrProceed(task);
+    }
+  }
+
+ private:
+  cudaStream_t *_streams;
+  int _next = 0;
+  std::deque<std::pair<std::shared_ptr<TensorTableEntry>, cudaEvent_t>>
+      _inflight;
+  std::vector<cudaEvent_t> _free_events;
+};
+
+CopyPipeline *GetDevice2HostPipeline() {
+  static CopyPipeline pipeline(BytePSGlobal::GetCopyDevice2HostStream());
+  return &pipeline;
+}
+
+CopyPipeline *GetHost2DevicePipeline() {
+  static CopyPipeline pipeline(BytePSGlobal::GetCopyHost2DeviceStream());
+  return &pipeline;
+}
+
 bool RunCopyDevice2HostLoopOnce() {
   QueueType this_op = COPYD2H;
   auto q = BytePSGlobal::GetScheduledQueue(this_op);
-  auto task = q->getTask();
+  auto pipeline = GetDevice2HostPipeline();
+  pipeline->Poll();
+  auto task = pipeline->Full() ? nullptr : q->getTask();
 
   if (task) {
-    auto copy_d2h_Stream = BytePSGlobal::GetCopyDevice2HostStream();
+    auto copy_d2h_Stream = pipeline->NextStream();
     // If we ran NCCL reduce, we should copy from task->output
     auto tensor =
         (BytePSGlobal::GetNccl()->GetSize() > 1) ? task->output : task->tensor;
@@ -425,13 +521,15 @@ bool RunCopyDevice2HostLoopOnce() {
       CUDA_CALL(cudaMemcpyAsync(
           (void *)(cpubuff + copy_offset), (const void *)(p + copy_offset),
           (size_t)copy_len, (cudaMemcpyKind)cudaMemcpyDeviceToHost,
-          (cudaStream_t)*copy_d2h_Stream));
-      CUDA_CALL(cudaStreamSynchronize(*copy_d2h_Stream));
+          (cudaStream_t)copy_d2h_Stream));
     }
 
-    FinishOrProceed(task);
+    pipeline->Add(task, copy_d2h_Stream);
+  } else if (pipeline->Full()) {
+    pipeline->WaitOldest();
   } else {
-    std::this_thread::sleep_for(std::chrono::nanoseconds(1000));
+    // copies that land in the meantime are noticed when the park times out
+    q->waitTask();
   }
   return true;
 }
@@ -474,17 +572,61 @@ bool RunPcieReduceLoopOnce() {
       if (copy_len) {
         auto total_offset = offset + nccl_rank * num_elem_per_gpu * unit_len;
 
-        // Below we assume there are only two PCIe switch
-        // and we run reducer in the context of the second switch
-        reducer->sum((void *)((char *)(task->cpubuff) + total_offset),
-                     (void *)((char *)(task->pcie_cpubuff[0]) + total_offset),
+        // We run reducer in the context of the last switch, whose copy is
+        // cpubuff, and add the copies of all other switches in one pass
+        std::vector<void *> srcs;
+        for (size_t i = 0; i + 1 < task->pcie_cpubuff.size(); ++i) {
+          srcs.push_back((char *)(task->pcie_cpubuff[i]) + total_offset);
+        }
+        reducer->sum((void *)((char *)(task->cpubuff) + total_offset), srcs,
                      copy_len, tensor->dtype());
       }
     }
 
     FinishOrProceed(task);
   } else {
-    std::this_thread::sleep_for(std::chrono::nanoseconds(1000));
+    q->waitTask();
+  }
+  return true;
+}
+
+// The buffer that PUSH sends and PULL fills: the GPU buffer of the root
+// device with GPU-direct RDMA, the framework buffer of a CPU tensor with
+// IsCpuDirect(), the host copy otherwise
+inline char *GetPushPullBuffer(std::shared_ptr<TensorTableEntry> task,
+                               bool is_push) {
+  if (BytePSGlobal::IsCpuDirect() && task->device == CPU_DEVICE_ID) {
+    auto tensor = is_push ? task->tensor : task->output;
+    BPS_CHECK(tensor);
+    return (char *)(tensor->data()) + task->offset;
+  }
+  if (BytePSGlobal::IsGpuDirect() && task->device != CPU_DEVICE_ID) {
+    // REDUCE leaves the sum in task->output, unless there is no NCCL peer
+    auto tensor = (is_push && BytePSGlobal::GetNccl()->GetSize() <= 1)
+                      ? task->tensor
+                      : task->output;
+    BPS_CHECK(tensor);
+    return (char *)(tensor->data()) + task->offset;
+  }
+  BPS_CHECK(task->cpubuff);
+  return const_cast<char *>(static_cast<const char *>(task->cpubuff) +
+                            task->offset);
+}
+
+bool RunCompressLoopOnce() {
+  QueueType this_op = COMPRESS;
+  auto q = BytePSGlobal::GetScheduledQueue(this_op);
+  auto task = q->getTask();
+  if (task) {
+    BPS_CHECK(BytePSGlobal::IsRootDevice())
+        << "only root device should enter COMPRESS loop";
+    if (task->compressor) {
+      task->compressor->Compress(GetPushPullBuffer(task, true),
+                                 task->compressed);
+    }
+    FinishOrProceed(task);
+  } else {
+    q->waitTask();
   }
   return true;
 }
@@ -498,13 +640,25 @@ bool RunPushLoopOnce() {
         << "only root device should enter PUSH loop";
 
     if (BytePSGlobal::IsDistributed()) {
-      auto offset = task->offset;
       auto len = task->len;
-
-      char *data;
-      BPS_CHECK(task->cpubuff);
-      data =
-          const_cast<char *>(static_cast<const char *>(task->cpubuff) + offset);
+      char *data = GetPushPullBuffer(task, true);
+      if (task->compressor) {
+        len = task->compressor->compressed_len();
+        data = task->compressed;
+      }
+      if (task->row_sparse) {
+        len = EncodeRows(data, task->len, task->context->row_len,
+                         task->row_sparse);
+        data = task->row_sparse;
+      }
+      auto type = GetRequestType(*task->context);
+      if (task->colocated) {
+        // the server sums the partition from the shared memory
+        data = reinterpret_cast<char *>(
+            const_cast<ColocatedBuffer *>(task->colocated));
+        len = sizeof(ColocatedBuffer);
+        type = RequestType::kColocatedPushPull;
+      }
 
       // get metadata
       const int dtype = task->tensor->dtype();
@@ -512,17 +666,24 @@ bool RunPushLoopOnce() {
       // false means not to delete data when SArray is deleted
       ps::SArray<char> vals(data, len, false);
 
-      int cmd = GetCommandType(RequestType::kDefaultPushPull, dtype);
-      auto &pskv = BytePSGlobal::EncodeDefaultKey(task->key, len);
-      BytePSGlobal::GetPS()->ZPush(pskv.keys, vals, pskv.lens, cmd,
-                                   [task, q]() { FinishOrProceed(task); });
+      int cmd = GetCommandType(type, dtype);
+      auto pskv = (task->row_sparse || task->colocated)
+                      ? BytePSGlobal::EncodeSparseKey(task->key, len)
+                      : BytePSGlobal::EncodeDefaultKey(task->key, len);
+      auto metrics = BytePSGlobal::GetMetrics();
+      auto start = metrics ? Tracer::Now() : 0;
+      BytePSGlobal::GetPS(task->key)->ZPush(
+          pskv.keys, vals, pskv.lens, cmd, [task, q, metrics, len, start]() {
+            if (metrics) metrics->Push().Record(len, start, Tracer::Now());
+            FinishOrProceed(task);
+          });
     } else {
       // This is a dummy barrier for IsCrossPcieSwitch()
       BPS_CHECK(BytePSGlobal::IsCrossPcieSwitch());
       FinishOrProceed(task);
     }
   } else {
-    std::this_thread::sleep_for(std::chrono::nanoseconds(1000));
+    q->waitTask();
   }
   return true;
 }
@@ -535,36 +696,96 @@ bool RunPullLoopOnce() {
     BPS_CHECK(BytePSGlobal::IsRootDevice())
         << "only root device should enter PULL loop";
     // TODO: allow merging
-    auto offset = task->offset;
     auto len = task->len;
-
-    char *data;
-    BPS_CHECK(task->cpubuff);
-    data =
-        const_cast<char *>(static_cast<const char *>(task->cpubuff) + offset);
+    char *data = GetPushPullBuffer(task, false);
+    if (task->compressor) {
+      len = task->compressor->compressed_len();
+      data = task->compressed;
+    }
 
     // get metadata
     const int dtype = task->output->dtype();
 
+    int cmd = GetCommandType(GetRequestType(*task->context), dtype);
+    auto &pskv = BytePSGlobal::EncodeDefaultKey(task->key, len);
+    auto metrics = BytePSGlobal::GetMetrics();
+    auto start = metrics ? Tracer::Now() : 0;
+    if (task->row_sparse) {
+      // the server answers with the rows of the sum, its size is not known:
+      // let ps-lite allocate it, then scatter the rows into the buffer
+      auto vals = new ps::SArray<char>();
+      auto lens = new ps::SArray<int>();
+      BytePSGlobal::GetPS(task->key)->ZPull(
+          pskv.keys, vals, lens, cmd,
+          [vals, lens, data, task, metrics, start]() {
+            auto header =
+                reinterpret_cast<const RowSparseHeader *>(vals->data());
+            BPS_CHECK_EQ(header->len, task->len) << task->tensor_name;
+            DecodeRows(vals->data(), data);
+            if (metrics) {
+              metrics->Pull().Record(vals->size(), start, Tracer::Now());
+            }
+            delete vals;
+            delete lens;
+            FinishOrProceed(task);
+          });
+      return true;
+    }
+    if (task->colocated) {
+      // the server copies the merge to the shared memory, then answers with
+      // no data
+      cmd = GetCommandType(RequestType::kColocatedPushPull, dtype);
+      auto vals = new ps::SArray<char>();
+      auto lens = new ps::SArray<int>();
+      BytePSGlobal::GetPS(task->key)->ZPull(
+          pskv.keys, vals, lens, cmd,
+          [vals, lens, task, metrics, len, start]() {
+            if (metrics) metrics->Pull().Record(len, start, Tracer::Now());
+            delete vals;
+            delete lens;
+            FinishOrProceed(task);
+          });
+      return true;
+    }
+
     // false means not to delete data when SArray is deleted
     auto vals = new ps::SArray<char>(data, len, false);
 
-    int cmd = GetCommandType(RequestType::kDefaultPushPull, dtype);
-    auto &pskv = BytePSGlobal::EncodeDefaultKey(task->key, len);
     // issue pull
-    BytePSGlobal::GetPS()->ZPull(pskv.keys, vals, &pskv.lens, cmd,
-                                 [vals, task, q]() {
-                                   delete vals;
-                                   FinishOrProceed(task);
-                                 });
+    BytePSGlobal::GetPS(task->key)->ZPull(
+        pskv.keys, vals, &pskv.lens, cmd,
+        [vals, task, q, metrics, len, start]() {
+          if (metrics) metrics->Pull().Record(len, start, Tracer::Now());
+          delete vals;
+          FinishOrProceed(task);
+        });
   } else {
-    std::this_thread::sleep_for(std::chrono::nanoseconds(1000));
+    q->waitTask();
   }
   return true;
 }
 
-void CopyHost2Device(std::shared_ptr<byteps::common::TensorTableEntry> task) {
-  auto copy_h2d_stream = BytePSGlobal::GetCopyHost2DeviceStream();
+bool RunDecompressLoopOnce() {
+  QueueType this_op = DECOMPRESS;
+  auto q = BytePSGlobal::GetScheduledQueue(this_op);
+  auto task = q->getTask();
+  if (task) {
+    BPS_CHECK(BytePSGlobal::IsRootDevice())
+        << "only root device should enter DECOMPRESS loop";
+    if (task->compressor) {
+      task->compressor->Decompress(task->compressed,
+                                   GetPushPullBuffer(task, false), false);
+    }
+    FinishOrProceed(task);
+  } else {
+    q->waitTask();
+  }
+  return true;
+}
+
+void CopyHost2Device(std::shared_ptr<byteps::common::TensorTableEntry> task,
+                     CopyPipeline *pipeline) {
+  auto copy_h2d_stream = pipeline->NextStream();
   auto tensor = task->output;
   BPS_CHECK(tensor);
   auto key = task->key;
@@ -602,17 +823,18 @@ void CopyHost2Device(std::shared_ptr<byteps::common::TensorTableEntry> task) {
     CUDA_CALL(cudaMemcpyAsync(
         (void *)(gpu_addr + copy_offset), (const void *)(cpubuff + copy_offset),
         (size_t)copy_len, (cudaMemcpyKind)cudaMemcpyHostToDevice,
-        (cudaStream_t)*copy_h2d_stream));
-    CUDA_CALL(cudaStreamSynchronize(*copy_h2d_stream));
+        (cudaStream_t)copy_h2d_stream));
   }
 
-  return;
+  pipeline->Add(task, copy_h2d_stream);
 }
 
 bool RunRootCopyHost2DeviceLoopOnce() {
   QueueType this_op = COPYH2D;
   auto q = BytePSGlobal::GetScheduledQueue(this_op);
-  auto task = q->getTask();
+  auto pipeline = GetHost2DevicePipeline();
+  pipeline->Poll();
+  auto task = pipeline->Full() ? nullptr : q->getTask();
 
   if (task) {
     auto key = task->key;
@@ -625,11 +847,11 @@ bool RunRootCopyHost2DeviceLoopOnce() {
       BytePSGlobal::GetBasicComm()->broadcastSignal(&msg,
                                                     sizeof(BytePSCommMsg));
     }
-    CopyHost2Device(task);
-
-    FinishOrProceed(task);
+    CopyHost2Device(task, pipeline);
+  } else if (pipeline->Full()) {
+    pipeline->WaitOldest();
   } else {
-    std::this_thread::sleep_for(std::chrono::nanoseconds(1000));
+    q->waitTask();
   }
   return true;
 }
@@ -657,17 +879,25 @@ bool RunNonRootCopyListenLoopOnce() {
 bool RunNonRootCopyHost2DeviceLoopOnce() {
   QueueType this_op = COPYH2D;
   auto q = BytePSGlobal::GetScheduledQueue(this_op);
-  auto task = q->getTask();
+  auto pipeline = GetHost2DevicePipeline();
+  pipeline->Poll();
+  auto task = pipeline->Full() ? nullptr : q->getTask();
 
   if (task) {
-    CopyHost2Device(task);
-    FinishOrProceed(task);
+    CopyHost2Device(task, pipeline);
+  } else if (pipeline->Full()) {
+    pipeline->WaitOldest();
   } else {
-    std::this_thread::sleep_for(std::chrono::nanoseconds(1000));
+    q->waitTask();
   }
   return true;
 }
 
+bool RunFusionLoopOnce() {
+  BytePSGlobal::GetFusion()->Poll();
+  return true;
+}
+
 void CoordinateReduceLoop() {
   while (RunCoordinateLoopOnce(COORDINATE_REDUCE) &&
          !BytePSGlobal::ShouldShutdown()) {
@@ -724,6 +954,12 @@ void CopyDevice2HostLoop() {
   BytePSGlobal::ReportThreadFinish();
 }
 
+void CompressLoop() {
+  while (RunCompressLoopOnce() && !BytePSGlobal::ShouldShutdown()) {
+  }
+  BytePSGlobal::ReportThreadFinish();
+}
+
 void PushLoop() {
   while (RunPushLoopOnce() && !BytePSGlobal::ShouldShutdown()) {
   }
@@ -736,6 +972,12 @@ void PullLoop() {
   BytePSGlobal::ReportThreadFinish();
 }
 
+void DecompressLoop() {
+  while (RunDecompressLoopOnce() && !BytePSGlobal::ShouldShutdown()) {
+  }
+  BytePSGlobal::ReportThreadFinish();
+}
+
 void RootCopyHost2DeviceLoop() {
   CUDA_CALL(cudaSetDevice(BytePSGlobal::GetLocalRank()));
   while (RunRootCopyHost2DeviceLoopOnce() && !BytePSGlobal::ShouldShutdown()) {
@@ -750,6 +992,13 @@ void NonRootCopyListenLoop() {
   BytePSGlobal::ReportThreadFinish();
 }
 
+void FusionLoop() {
+  CUDA_CALL(cudaSetDevice(BytePSGlobal::GetLocalRank()));
+  while (RunFusionLoopOnce() && !BytePSGlobal::ShouldShutdown()) {
+  }
+  BytePSGlobal::ReportThreadFinish();
+}
+
 void NonRootCopyHost2DeviceLoop() {
   CUDA_CALL(cudaSetDevice(BytePSGlobal::GetLocalRank()));
   while (RunNonRootCopyHost2DeviceLoopOnce() &&
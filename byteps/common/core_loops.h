@@ -35,16 +35,22 @@ void SyncNcclLoop();
 
 void CopyDevice2HostLoop();
 
+void CompressLoop();
+
 void PushLoop();
 
 void PullLoop();
 
+void DecompressLoop();
+
 void RootCopyHost2DeviceLoop();
 
 void NonRootCopyListenLoop();
 
 void NonRootCopyHost2DeviceLoop();
 
+void FusionLoop();
+
 }  // namespace common
 }  // namespace byteps
 
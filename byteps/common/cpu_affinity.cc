@@ -0,0 +1,112 @@
+// Copyright 2019 Bytedance Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+#include "cpu_affinity.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+#include "logging.h"
+
+namespace byteps {
+namespace common {
+
+namespace {
+
+// "0-3,8,10-11", the format of taskset and of sysfs
+std::vector<int> ParseCpuList(const std::string& list) {
+  std::vector<int> cpus;
+  std::stringstream ss(list);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    if (range.empty()) continue;
+    auto dash = range.find('-');
+    int first = atoi(range.substr(0, dash).c_str());
+    int last = (dash == range.npos) ? first
+                                    : atoi(range.substr(dash + 1).c_str());
+    BPS_CHECK_LE(first, last) << "invalid CPU range " << range;
+    for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+  }
+  return cpus;
+}
+
+void Pin(const std::vector<int>& cpus) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (auto cpu : cpus) CPU_SET(cpu, &set);
+  int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (ret) {
+    BPS_LOG(WARNING) << "Failed to pin a thread to CPU " << cpus[0]
+                     << (cpus.size() > 1 ? "..." : "") << ", error " << ret;
+  }
+}
+
+}  // namespace
+
+CpuAffinity::CpuAffinity(const std::string& spec, int numa_node, int index,
+                         int count) {
+  if (spec.empty()) return;
+  std::vector<int> cpus;
+  if (spec == "numa") {
+    if (numa_node < 0) {
+      BPS_LOG(WARNING) << "No NUMA node to pin the threads to";
+      return;
+    }
+    std::ifstream in("/sys/devices/system/node/node" +
+                     std::to_string(numa_node) + "/cpulist");
+    std::string list;
+    if (!(in >> list)) {
+      BPS_LOG(WARNING) << "Cannot read the CPUs of NUMA node " << numa_node;
+      return;
+    }
+    cpus = ParseCpuList(list);
+  } else {
+    cpus = ParseCpuList(spec);
+  }
+  if (cpus.empty()) return;
+
+  if (count > 1 && (int)cpus.size() >= count) {
+    size_t share = cpus.size() / count;
+    _cpus.assign(cpus.begin() + index * share,
+                 cpus.begin() + (index + 1) * share);
+  } else {
+    _cpus = cpus;
+  }
+}
+
+std::string CpuAffinity::ToString() const {
+  std::ostringstream ss;
+  for (size_t i = 0; i < _cpus.size(); ++i) {
+    ss << (i ? "," : "") << _cpus[i];
+  }
+  return ss.str();
+}
+
+void CpuAffinity::PinToCpu(int slot) const {
+  if (!Enabled()) return;
+  Pin({_cpus[slot % _cpus.size()]});
+}
+
+void CpuAffinity::PinToSet() const {
+  if (!Enabled()) return;
+  Pin(_cpus);
+}
+
+}  // namespace common
+}  // namespace byteps
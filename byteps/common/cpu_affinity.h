@@ -0,0 +1,53 @@
+// Copyright 2019 Bytedance Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+#ifndef BYTEPS_CPU_AFFINITY_H
+#define BYTEPS_CPU_AFFINITY_H
+
+#include <string>
+#include <vector>
+
+namespace byteps {
+namespace common {
+
+// The CPUs the background threads of a process are pinned to, so that they
+// neither migrate across NUMA nodes nor compete with the threads of the
+// framework, e.g. its data loaders.
+//
+// |spec| is a CPU list like "0-7,16-23", or "numa" for the CPUs of
+// |numa_node|, and empty for no pinning. The CPUs are split evenly among the
+// |count| processes sharing them, of which this one is |index|, if there are
+// enough of them.
+class CpuAffinity {
+ public:
+  CpuAffinity(const std::string& spec, int numa_node, int index, int count);
+
+  bool Enabled() const { return !_cpus.empty(); }
+  std::string ToString() const;
+
+  // Pin the calling thread to the |slot|-th CPU of the set, round-robin
+  void PinToCpu(int slot) const;
+  // Pin the calling thread to the whole set. For threads that run an OpenMP
+  // reducer, as the team they start inherits their affinity.
+  void PinToSet() const;
+
+ private:
+  std::vector<int> _cpus;
+};
+
+}  // namespace common
+}  // namespace byteps
+
+#endif  // BYTEPS_CPU_AFFINITY_H
@@ -19,19 +19,518 @@
 
 #include "cpu_reducer.h"
 
+#include <algorithm>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BYTEPS_REDUCER_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#define BPS_TARGET(isa) __attribute__((target(isa)))
+#endif
+
 namespace byteps {
 namespace common {
 
+namespace {
+
+inline float HalfBits2Float(uint16_t h) {
+  int sign = ((h >> 15) & 1);
+  int exp = ((h >> 10) & 0x1f);
+  int mantissa = (h & 0x3ff);
+  unsigned f = 0;
+
+  if (exp > 0 && exp < 31) {
+    // normal
+    exp += 112;
+    f = (sign << 31) | (exp << 23) | (mantissa << 13);
+  } else if (exp == 0) {
+    if (mantissa) {
+      // subnormal
+      exp += 113;
+      while ((mantissa & (1 << 10)) == 0) {
+        mantissa <<= 1;
+        exp--;
+      }
+      mantissa &= 0x3ff;
+      f = (sign << 31) | (exp << 23) | (mantissa << 13);
+    } else {
+      // sign-preserving zero
+      f = (sign << 31);
+    }
+  } else if (exp == 31) {
+    if (mantissa) {
+      f = 0x7fffffff;  // not a number
+    } else {
+      f = (0xff << 23) | (sign << 31);  //  inf
+    }
+  }
+
+  float res;
+  std::memcpy(&res, &f, sizeof(res));
+  return res;
+}
+
+inline uint16_t Float2HalfBits(float src) {
+  // software implementation rounds toward nearest even
+  unsigned s;
+  std::memcpy(&s, &src, sizeof(s));
+  uint16_t sign = uint16_t((s >> 16) & 0x8000);
+  int16_t exp = uint16_t(((s >> 23) & 0xff) - 127);
+  int mantissa = s & 0x7fffff;
+  uint16_t u = 0;
+
+  if ((s & 0x7fffffff) == 0) {
+    // sign-preserving zero
+    return sign;
+  }
+
+  if (exp > 15) {
+    if (exp == 128 && mantissa) {
+      // not a number
+      u = 0x7fff;
+    } else {
+      // overflow to infinity
+      u = sign | 0x7c00;
+    }
+    return u;
+  }
+
+  int sticky_bit = 0;
+
+  if (exp >= -14) {
+    // normal fp32 to normal fp16
+    exp = uint16_t(exp + uint16_t(15));
+    u = uint16_t(((exp & 0x1f) << 10));
+    u = uint16_t(u | (mantissa >> 13));
+  } else {
+    // normal single-precision to subnormal half_t-precision representation
+    int rshift = (-14 - exp);
+    if (rshift < 32) {
+      mantissa |= (1 << 23);
+
+      sticky_bit = ((mantissa & ((1 << rshift) - 1)) != 0);
+
+      mantissa = (mantissa >> rshift);
+      u = (uint16_t(mantissa >> 13) & 0x3ff);
+    } else {
+      mantissa = 0;
+      u = 0;
+    }
+  }
+
+  // round to nearest even
+  int round_bit = ((mantissa >> 12) & 1);
+  sticky_bit |= ((mantissa & ((1 << 12) - 1)) != 0);
+
+  if ((round_bit && sticky_bit) || (round_bit && (u & 1))) {
+    u = uint16_t(u + 1);
+  }
+
+  return u | sign;
+}
+
+// bfloat16 is the upper half of a float32
+inline float BFloat16Bits2Float(uint16_t h) {
+  uint32_t f = static_cast<uint32_t>(h) << 16;
+  float res;
+  std::memcpy(&res, &f, sizeof(res));
+  return res;
+}
+
+inline uint16_t Float2BFloat16Bits(float src) {
+  uint32_t f;
+  std::memcpy(&f, &src, sizeof(f));
+  if ((f & 0x7fffffff) > 0x7f800000) {
+    return 0x7fc0;  // not a number
+  }
+  // round to nearest even
+  return (f + 0x7fff + ((f >> 16) & 1)) >> 16;
+}
+
+// Portable kernels, the only ones outside x86. The compiler vectorizes the
+// float32 loops with the baseline instruction set (SSE2 on x86-64).
+
+void SumFloat32(void* dst, const void* src, size_t n) {
+  auto d = static_cast<float*>(dst);
+  auto s = static_cast<const float*>(src);
+#pragma omp simd
+  for (size_t i = 0; i < n; ++i) {
+    d[i] = d[i] + s[i];
+  }
+}
+
+void Sum3Float32(void* dst, const void* src1, const void* src2, size_t n,
+                 bool nt) {
+  auto d = static_cast<float*>(dst);
+  auto s1 = static_cast<const float*>(src1);
+  auto s2 = static_cast<const float*>(src2);
+#pragma omp simd
+  for (size_t i = 0; i < n; ++i) {
+    d[i] = s1[i] + s2[i];
+  }
+}
+
+void SumFloat16(void* dst, const void* src, size_t n) {
+  auto d = static_cast<uint16_t*>(dst);
+  auto s = static_cast<const uint16_t*>(src);
+  for (size_t i = 0; i < n; ++i) {
+    d[i] = Float2HalfBits(HalfBits2Float(d[i]) + HalfBits2Float(s[i]));
+  }
+}
+
+void Sum3Float16(void* dst, const void* src1, const void* src2, size_t n,
+                 bool nt) {
+  auto d = static_cast<uint16_t*>(dst);
+  auto s1 = static_cast<const uint16_t*>(src1);
+  auto s2 = static_cast<const uint16_t*>(src2);
+  for (size_t i = 0; i < n; ++i) {
+    d[i] = Float2HalfBits(HalfBits2Float(s1[i]) + HalfBits2Float(s2[i]));
+  }
+}
+
+void SumBFloat16(void* dst, const void* src, size_t n) {
+  auto d = static_cast<uint16_t*>(dst);
+  auto s = static_cast<const uint16_t*>(src);
+  for (size_t i = 0; i < n; ++i) {
+    d[i] = Float2BFloat16Bits(BFloat16Bits2Float(d[i]) +
+                              BFloat16Bits2Float(s[i]));
+  }
+}
+
+void Sum3BFloat16(void* dst, const void* src1, const void* src2, size_t n,
+                  bool nt) {
+  auto d = static_cast<uint16_t*>(dst);
+  auto s1 = static_cast<const uint16_t*>(src1);
+  auto s2 = static_cast<const uint16_t*>(src2);
+  for (size_t i = 0; i < n; ++i) {
+    d[i] = Float2BFloat16Bits(BFloat16Bits2Float(s1[i]) +
+                              BFloat16Bits2Float(s2[i]));
+  }
+}
+
+template <typename T>
+void SumLoop(void* dst, const void* src, size_t n) {
+  auto d = static_cast<T*>(dst);
+  auto s = static_cast<const T*>(src);
+#pragma omp simd
+  for (size_t i = 0; i < n; ++i) {
+    d[i] = d[i] + s[i];
+  }
+}
+
+const ReduceKernels kSseKernels = {
+    "sse",       SumFloat32,  Sum3Float32, SumFloat16,
+    Sum3Float16, SumBFloat16, Sum3BFloat16};
+
+#ifdef BYTEPS_REDUCER_X86
+
+inline bool IsAligned(const void* p, size_t alignment) {
+  return reinterpret_cast<uintptr_t>(p) % alignment == 0;
+}
+
+// AVX and F16C, e.g. Ivy Bridge
+
+BPS_TARGET("avx") void SumFloat32Avx(void* dst, const void* src, size_t n) {
+  auto d = static_cast<float*>(dst);
+  auto s = static_cast<const float*>(src);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 v = _mm256_add_ps(_mm256_loadu_ps(d + i), _mm256_loadu_ps(s + i));
+    _mm256_storeu_ps(d + i, v);
+  }
+  for (; i < n; ++i) d[i] = d[i] + s[i];
+}
+
+BPS_TARGET("avx")
+void Sum3Float32Avx(void* dst, const void* src1, const void* src2, size_t n,
+                    bool nt) {
+  auto d = static_cast<float*>(dst);
+  auto s1 = static_cast<const float*>(src1);
+  auto s2 = static_cast<const float*>(src2);
+  size_t i = 0;
+  if (nt && IsAligned(d, 32)) {
+    for (; i + 8 <= n; i += 8) {
+      _mm256_stream_ps(d + i, _mm256_add_ps(_mm256_loadu_ps(s1 + i),
+                                            _mm256_loadu_ps(s2 + i)));
+    }
+    _mm_sfence();
+  }
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(d + i, _mm256_add_ps(_mm256_loadu_ps(s1 + i),
+                                          _mm256_loadu_ps(s2 + i)));
+  }
+  for (; i < n; ++i) d[i] = s1[i] + s2[i];
+}
+
+BPS_TARGET("avx,f16c") inline __m256 LoadHalf8(const uint16_t* p) {
+  return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)p));
+}
+
+BPS_TARGET("avx,f16c")
+void SumFloat16Avx(void* dst, const void* src, size_t n) {
+  auto d = static_cast<uint16_t*>(dst);
+  auto s = static_cast<const uint16_t*>(src);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 v = _mm256_add_ps(LoadHalf8(d + i), LoadHalf8(s + i));
+    _mm_storeu_si128((__m128i*)(d + i), _mm256_cvtps_ph(v, 0));
+  }
+  SumFloat16(d + i, s + i, n - i);
+}
+
+BPS_TARGET("avx,f16c")
+void Sum3Float16Avx(void* dst, const void* src1, const void* src2, size_t n,
+                    bool nt) {
+  auto d = static_cast<uint16_t*>(dst);
+  auto s1 = static_cast<const uint16_t*>(src1);
+  auto s2 = static_cast<const uint16_t*>(src2);
+  size_t i = 0;
+  if (nt && IsAligned(d, 16)) {
+    for (; i + 8 <= n; i += 8) {
+      __m256 v = _mm256_add_ps(LoadHalf8(s1 + i), LoadHalf8(s2 + i));
+      _mm_stream_si128((__m128i*)(d + i), _mm256_cvtps_ph(v, 0));
+    }
+    _mm_sfence();
+  }
+  for (; i + 8 <= n; i += 8) {
+    __m256 v = _mm256_add_ps(LoadHalf8(s1 + i), LoadHalf8(s2 + i));
+    _mm_storeu_si128((__m128i*)(d + i), _mm256_cvtps_ph(v, 0));
+  }
+  Sum3Float16(d + i, s1 + i, s2 + i, n - i, false);
+}
+
+const ReduceKernels kAvxKernels = {
+    "avx",          SumFloat32Avx, Sum3Float32Avx, SumFloat16Avx,
+    Sum3Float16Avx, SumBFloat16,   Sum3BFloat16};
+
+// AVX2 adds the 256-bit integer operations of the bfloat16 conversions
+
+BPS_TARGET("avx2") inline __m256 LoadBFloat16x8(const uint16_t* p) {
+  __m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)p));
+  return _mm256_castsi256_ps(_mm256_slli_epi32(v, 16));
+}
+
+BPS_TARGET("avx2") inline __m128i ToBFloat16x8(__m256 v) {
+  __m256i f = _mm256_castps_si256(v);
+  __m256i lsb = _mm256_and_si256(_mm256_srli_epi32(f, 16),
+                                 _mm256_set1_epi32(1));
+  __m256i r = _mm256_add_epi32(f, _mm256_add_epi32(lsb,
+                                                   _mm256_set1_epi32(0x7fff)));
+  r = _mm256_srli_epi32(r, 16);
+  __m256i nan = _mm256_castps_si256(_mm256_cmp_ps(v, v, _CMP_UNORD_Q));
+  r = _mm256_blendv_epi8(r, _mm256_set1_epi32(0x7fc0), nan);
+  // pack the 8 values, within each 128-bit lane, then gather the lanes
+  r = _mm256_permute4x64_epi64(_mm256_packus_epi32(r, r), 0xd8);
+  return _mm256_castsi256_si128(r);
+}
+
+BPS_TARGET("avx2") void SumBFloat16Avx2(void* dst, const void* src, size_t n) {
+  auto d = static_cast<uint16_t*>(dst);
+  auto s = static_cast<const uint16_t*>(src);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 v = _mm256_add_ps(LoadBFloat16x8(d + i), LoadBFloat16x8(s + i));
+    _mm_storeu_si128((__m128i*)(d + i), ToBFloat16x8(v));
+  }
+  SumBFloat16(d + i, s + i, n - i);
+}
+
+BPS_TARGET("avx2")
+void Sum3BFloat16Avx2(void* dst, const void* src1, const void* src2, size_t n,
+                      bool nt) {
+  auto d = static_cast<uint16_t*>(dst);
+  auto s1 = static_cast<const uint16_t*>(src1);
+  auto s2 = static_cast<const uint16_t*>(src2);
+  size_t i = 0;
+  if (nt && IsAligned(d, 16)) {
+    for (; i + 8 <= n; i += 8) {
+      __m256 v = _mm256_add_ps(LoadBFloat16x8(s1 + i), LoadBFloat16x8(s2 + i));
+      _mm_stream_si128((__m128i*)(d + i), ToBFloat16x8(v));
+    }
+    _mm_sfence();
+  }
+  for (; i + 8 <= n; i += 8) {
+    __m256 v = _mm256_add_ps(LoadBFloat16x8(s1 + i), LoadBFloat16x8(s2 + i));
+    _mm_storeu_si128((__m128i*)(d + i), ToBFloat16x8(v));
+  }
+  Sum3BFloat16(d + i, s1 + i, s2 + i, n - i, false);
+}
+
+const ReduceKernels kAvx2Kernels = {
+    "avx2",         SumFloat32Avx,   Sum3Float32Avx, SumFloat16Avx,
+    Sum3Float16Avx, SumBFloat16Avx2, Sum3BFloat16Avx2};
+
+// AVX-512F, masked loads and stores handle the tails of float32
+
+BPS_TARGET("avx512f")
+void SumFloat32Avx512(void* dst, const void* src, size_t n) {
+  auto d = static_cast<float*>(dst);
+  auto s = static_cast<const float*>(src);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512 v = _mm512_add_ps(_mm512_loadu_ps(d + i), _mm512_loadu_ps(s + i));
+    _mm512_storeu_ps(d + i, v);
+  }
+  if (i < n) {
+    __mmask16 m = (__mmask16)((1u << (n - i)) - 1);
+    __m512 v = _mm512_add_ps(_mm512_maskz_loadu_ps(m, d + i),
+                             _mm512_maskz_loadu_ps(m, s + i));
+    _mm512_mask_storeu_ps(d + i, m, v);
+  }
+}
+
+BPS_TARGET("avx512f")
+void Sum3Float32Avx512(void* dst, const void* src1, const void* src2,
+                       size_t n, bool nt) {
+  auto d = static_cast<float*>(dst);
+  auto s1 = static_cast<const float*>(src1);
+  auto s2 = static_cast<const float*>(src2);
+  size_t i = 0;
+  if (nt && IsAligned(d, 64)) {
+    for (; i + 16 <= n; i += 16) {
+      _mm512_stream_ps(d + i, _mm512_add_ps(_mm512_loadu_ps(s1 + i),
+                                            _mm512_loadu_ps(s2 + i)));
+    }
+    _mm_sfence();
+  }
+  for (; i + 16 <= n; i += 16) {
+    _mm512_storeu_ps(d + i, _mm512_add_ps(_mm512_loadu_ps(s1 + i),
+                                          _mm512_loadu_ps(s2 + i)));
+  }
+  if (i < n) {
+    __mmask16 m = (__mmask16)((1u << (n - i)) - 1);
+    __m512 v = _mm512_add_ps(_mm512_maskz_loadu_ps(m, s1 + i),
+                             _mm512_maskz_loadu_ps(m, s2 + i));
+    _mm512_mask_storeu_ps(d + i, m, v);
+  }
+}
+
+BPS_TARGET("avx512f") inline __m512 LoadHalf16(const uint16_t* p) {
+  return _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)p));
+}
+
+BPS_TARGET("avx512f")
+void SumFloat16Avx512(void* dst, const void* src, size_t n) {
+  auto d = static_cast<uint16_t*>(dst);
+  auto s = static_cast<const uint16_t*>(src);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512 v = _mm512_add_ps(LoadHalf16(d + i), LoadHalf16(s + i));
+    _mm256_storeu_si256((__m256i*)(d + i), _mm512_cvtps_ph(v, 0));
+  }
+  SumFloat16Avx(d + i, s + i, n - i);
+}
+
+BPS_TARGET("avx512f")
+void Sum3Float16Avx512(void* dst, const void* src1, const void* src2,
+                       size_t n, bool nt) {
+  auto d = static_cast<uint16_t*>(dst);
+  auto s1 = static_cast<const uint16_t*>(src1);
+  auto s2 = static_cast<const uint16_t*>(src2);
+  size_t i = 0;
+  if (nt && IsAligned(d, 32)) {
+    for (; i + 16 <= n; i += 16) {
+      __m512 v = _mm512_add_ps(LoadHalf16(s1 + i), LoadHalf16(s2 + i));
+      _mm256_stream_si256((__m256i*)(d + i), _mm512_cvtps_ph(v, 0));
+    }
+    _mm_sfence();
+  }
+  for (; i + 16 <= n; i += 16) {
+    __m512 v = _mm512_add_ps(LoadHalf16(s1 + i), LoadHalf16(s2 + i));
+    _mm256_storeu_si256((__m256i*)(d + i), _mm512_cvtps_ph(v, 0));
+  }
+  Sum3Float16Avx(d + i, s1 + i, s2 + i, n - i, false);
+}
+
+BPS_TARGET("avx512f") inline __m512 LoadBFloat16x16(const uint16_t* p) {
+  __m512i v = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)p));
+  return _mm512_castsi512_ps(_mm512_slli_epi32(v, 16));
+}
+
+BPS_TARGET("avx512f") inline __m256i ToBFloat16x16(__m512 v) {
+  __m512i f = _mm512_castps_si512(v);
+  __m512i lsb = _mm512_and_si512(_mm512_srli_epi32(f, 16),
+                                 _mm512_set1_epi32(1));
+  __m512i r = _mm512_add_epi32(f, _mm512_add_epi32(lsb,
+                                                   _mm512_set1_epi32(0x7fff)));
+  r = _mm512_srli_epi32(r, 16);
+  __mmask16 nan = _mm512_cmp_ps_mask(v, v, _CMP_UNORD_Q);
+  r = _mm512_mask_mov_epi32(r, nan, _mm512_set1_epi32(0x7fc0));
+  return _mm512_cvtepi32_epi16(r);
+}
+
+BPS_TARGET("avx512f")
+void SumBFloat16Avx512(void* dst, const void* src, size_t n) {
+  auto d = static_cast<uint16_t*>(dst);
+  auto s = static_cast<const uint16_t*>(src);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512 v = _mm512_add_ps(LoadBFloat16x16(d + i), LoadBFloat16x16(s + i));
+    _mm256_storeu_si256((__m256i*)(d + i), ToBFloat16x16(v));
+  }
+  SumBFloat16Avx2(d + i, s + i, n - i);
+}
+
+BPS_TARGET("avx512f")
+void Sum3BFloat16Avx512(void* dst, const void* src1, const void* src2,
+                        size_t n, bool nt) {
+  auto d = static_cast<uint16_t*>(dst);
+  auto s1 = static_cast<const uint16_t*>(src1);
+  auto s2 = static_cast<const uint16_t*>(src2);
+  size_t i = 0;
+  if (nt && IsAligned(d, 32)) {
+    for (; i + 16 <= n; i += 16) {
+      __m512 v = _mm512_add_ps(LoadBFloat16x16(s1 + i),
+                               LoadBFloat16x16(s2 + i));
+      _mm256_stream_si256((__m256i*)(d + i), ToBFloat16x16(v));
+    }
+    _mm_sfence();
+  }
+  for (; i + 16 <= n; i += 16) {
+    __m512 v = _mm512_add_ps(LoadBFloat16x16(s1 + i),
+                             LoadBFloat16x16(s2 + i));
+    _mm256_storeu_si256((__m256i*)(d + i), ToBFloat16x16(v));
+  }
+  Sum3BFloat16Avx2(d + i, s1 + i, s2 + i, n - i, false);
+}
+
+const ReduceKernels kAvx512Kernels = {
+    "avx512",          SumFloat32Avx512,  Sum3Float32Avx512, SumFloat16Avx512,
+    Sum3Float16Avx512, SumBFloat16Avx512, Sum3BFloat16Avx512};
+
+#endif  // BYTEPS_REDUCER_X86
+
+// The best kernels of this CPU, with |isa| ("avx512", "avx2", "avx" or
+// "sse") as an upper bound
+const ReduceKernels* SelectKernels(const std::string& isa) {
+#ifdef BYTEPS_REDUCER_X86
+  __builtin_cpu_init();
+  bool avx = __builtin_cpu_supports("avx");
+  // older compilers have no __builtin_cpu_supports("f16c")
+  unsigned int eax, ebx, ecx, edx;
+  bool f16c = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_F16C);
+  bool avx2 = avx && f16c && __builtin_cpu_supports("avx2");
+  bool avx512 = avx2 && __builtin_cpu_supports("avx512f");
+  if (avx512 && isa == "avx512") return &kAvx512Kernels;
+  if (avx2 && (isa == "avx512" || isa == "avx2")) return &kAvx2Kernels;
+  if (avx && f16c && isa != "sse") return &kAvxKernels;
+#endif
+  return &kSseKernels;
+}
+
+}  // namespace
+
 CpuReducer::CpuReducer(std::shared_ptr<BytePSComm> comm) {
 #ifndef BYTEPS_BUILDING_SERVER
-  std::vector<int> peers;
-  auto pcie_size = BytePSGlobal::GetPcieSwitchSize();
-  for (int i = BytePSGlobal::GetLocalRank() % pcie_size;
-       i < BytePSGlobal::GetLocalSize(); i += pcie_size) {
-    peers.push_back(i);
-  }
   if (comm) {
-    _comm = std::make_shared<BytePSCommSocket>(comm, std::string("cpu"), peers);
+    std::vector<int> peers;
+    auto pcie_size = BytePSGlobal::GetPcieSwitchSize();
+    for (int i = BytePSGlobal::GetLocalRank() % pcie_size;
+         i < BytePSGlobal::GetLocalSize(); i += pcie_size) {
+      peers.push_back(i);
+    }
+    _comm = CreateComm(comm, std::string("cpu"), peers);
   } else {
     _comm = nullptr;
   }
@@ -42,6 +541,17 @@ CpuReducer::CpuReducer(std::shared_ptr<BytePSComm> comm) {
   } else {
     _num_threads = 4;
   }
+
+  std::string isa = getenv("BYTEPS_REDUCER_ISA") ? getenv("BYTEPS_REDUCER_ISA")
+                                                 : "avx512";
+  BPS_CHECK(isa == "avx512" || isa == "avx2" || isa == "avx" || isa == "sse")
+      << "unknown BYTEPS_REDUCER_ISA " << isa
+      << ", must be one of [avx512, avx2, avx, sse]";
+  _kernels = SelectKernels(isa);
+  _nt_bytes = getenv("BYTEPS_REDUCER_NT_BYTES")
+                  ? strtoull(getenv("BYTEPS_REDUCER_NT_BYTES"), nullptr, 10)
+                  : (8 << 20);
+  BPS_LOG(DEBUG) << "CpuReducer uses " << _kernels->isa << " kernels";
   return;
 }
 
@@ -57,13 +567,14 @@ bool CpuReducer::isRoot() {
 int CpuReducer::sum(void* dst, void* src, size_t len, DataType dtype) {
   switch (dtype) {
     case BYTEPS_FLOAT32:
-      return _sum(reinterpret_cast<float*>(dst), reinterpret_cast<float*>(src),
-                  len);
+      return _sum(_kernels->sum_float32, dst, src, len, 4);
     case BYTEPS_FLOAT64:
       return _sum(reinterpret_cast<double*>(dst),
                   reinterpret_cast<double*>(src), len);
     case BYTEPS_FLOAT16:
-      return _sum_float16(dst, src, len);
+      return _sum(_kernels->sum_float16, dst, src, len, 2);
+    case BYTEPS_BFLOAT16:
+      return _sum(_kernels->sum_bfloat16, dst, src, len, 2);
     case BYTEPS_UINT8:
       return _sum(reinterpret_cast<uint8_t*>(dst),
                   reinterpret_cast<uint8_t*>(src), len);
@@ -91,39 +602,19 @@ int CpuReducer::_sum(T* dst, T* src, size_t len) {
   return 0;
 }
 
-int CpuReducer::_sum_float16(void* dst, void* src, size_t len) {
-  // cast src and dst to your float16 type
-  auto in = (unsigned short*)src;
-  auto inout = (unsigned short*)dst;
-  len = len / (size_t)2;
-
-#if __AVX__ && __F16C__
-  if (is_avx_and_f16c()) {
-#pragma omp parallel for simd num_threads(_num_threads)
-    for (size_t i = 0; i < (size_t)(len / 8) * 8; i += 8) {
-      // convert in & inout to m256
-      __m256 in_m256 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(in + i)));
-      __m256 inout_m256 =
-          _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(inout + i)));
-
-      // add them together to new_inout_m256
-      __m256 new_inout_m256 = _mm256_add_ps(in_m256, inout_m256);
-
-      // convert back and store in inout
-      __m128i new_inout_m128i = _mm256_cvtps_ph(new_inout_m256, 0);
-      _mm_storeu_si128((__m128i*)(inout + i), new_inout_m128i);
-    }
+int CpuReducer::_sum(SumKernel kernel, void* dst, const void* src,
+                     size_t len, size_t elem_size) {
+  auto d = static_cast<char*>(dst);
+  auto s = static_cast<const char*>(src);
+  size_t n = len / elem_size;
+  // one block per thread, of whole cache lines
+  size_t block = (n + _num_threads - 1) / _num_threads;
+  block = (block + 63) / 64 * 64;
+#pragma omp parallel for num_threads(_num_threads)
+  for (size_t i = 0; i < n; i += block) {
+    auto offset = i * elem_size;
+    kernel(d + offset, s + offset, std::min(block, n - i));
   }
-#endif
-  for (size_t i = (len / 8) * 8; i < (size_t)len; ++i) {
-    float in_float;
-    float inout_float;
-    HalfBits2Float(in + i, &in_float);
-    HalfBits2Float(inout + i, &inout_float);
-    inout_float += in_float;
-    Float2HalfBits(&inout_float, inout + i);
-  }
-
   return 0;
 }
 
@@ -131,14 +622,15 @@ int CpuReducer::sum(void* dst, void* src1, void* src2, size_t len,
                     DataType dtype) {
   switch (dtype) {
     case BYTEPS_FLOAT32:
-      return _sum(reinterpret_cast<float*>(dst), reinterpret_cast<float*>(src1),
-                  reinterpret_cast<float*>(src2), len);
+      return _sum(_kernels->sum3_float32, dst, src1, src2, len, 4);
     case BYTEPS_FLOAT64:
       return _sum(reinterpret_cast<double*>(dst),
                   reinterpret_cast<double*>(src1),
                   reinterpret_cast<double*>(src2), len);
     case BYTEPS_FLOAT16:
-      return _sum_float16(dst, src1, src2, len);
+      return _sum(_kernels->sum3_float16, dst, src1, src2, len, 2);
+    case BYTEPS_BFLOAT16:
+      return _sum(_kernels->sum3_bfloat16, dst, src1, src2, len, 2);
     case BYTEPS_UINT8:
       return _sum(reinterpret_cast<uint8_t*>(dst),
                   reinterpret_cast<uint8_t*>(src1),
@@ -170,39 +662,77 @@ int CpuReducer::_sum(T* dst, T* src1, T* src2, size_t len) {
   return 0;
 }
 
-int CpuReducer::_sum_float16(void* dst, void* src1, void* src2, size_t len) {
-  // cast src and dst to your float16 type
-  auto in1 = (unsigned short*)src1;
-  auto in2 = (unsigned short*)src2;
-  auto out = (unsigned short*)dst;
-  len = len / (size_t)2;
-
-#if __AVX__ && __F16C__
-  if (is_avx_and_f16c()) {
-#pragma omp parallel for simd num_threads(_num_threads)
-    for (size_t i = 0; i < (size_t)(len / 8) * 8; i += 8) {
-      // convert in1 & in2 to m256
-      __m256 in_m256 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(in1 + i)));
-      __m256 inout_m256 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i*)(in2 + i)));
+int CpuReducer::_sum(Sum3Kernel kernel, void* dst, const void* src1,
+                     const void* src2, size_t len, size_t elem_size) {
+  auto d = static_cast<char*>(dst);
+  auto s1 = static_cast<const char*>(src1);
+  auto s2 = static_cast<const char*>(src2);
+  size_t n = len / elem_size;
+  bool nt = len >= _nt_bytes;
+  size_t block = (n + _num_threads - 1) / _num_threads;
+  block = (block + 63) / 64 * 64;
+#pragma omp parallel for num_threads(_num_threads)
+  for (size_t i = 0; i < n; i += block) {
+    auto offset = i * elem_size;
+    kernel(d + offset, s1 + offset, s2 + offset, std::min(block, n - i), nt);
+  }
+  return 0;
+}
 
-      // add them together to new_inout_m256
-      __m256 new_inout_m256 = _mm256_add_ps(in_m256, inout_m256);
+SumKernel CpuReducer::_sum_kernel(DataType dtype, size_t* elem_size) {
+  switch (dtype) {
+    case BYTEPS_FLOAT32:
+      *elem_size = 4;
+      return _kernels->sum_float32;
+    case BYTEPS_FLOAT64:
+      *elem_size = 8;
+      return SumLoop<double>;
+    case BYTEPS_FLOAT16:
+      *elem_size = 2;
+      return _kernels->sum_float16;
+    case BYTEPS_BFLOAT16:
+      *elem_size = 2;
+      return _kernels->sum_bfloat16;
+    case BYTEPS_UINT8:
+      *elem_size = 1;
+      return SumLoop<uint8_t>;
+    case BYTEPS_INT32:
+      *elem_size = 4;
+      return SumLoop<int32_t>;
+    case BYTEPS_INT8:
+      *elem_size = 1;
+      return SumLoop<int8_t>;
+    case BYTEPS_INT64:
+      *elem_size = 8;
+      return SumLoop<int64_t>;
+    default:
+      BPS_CHECK(0) << "Unsupported data type: " << dtype;
+  }
+  return nullptr;
+}
 
-      // convert back and store in out
-      __m128i new_inout_m128i = _mm256_cvtps_ph(new_inout_m256, 0);
-      _mm_storeu_si128((__m128i*)(out + i), new_inout_m128i);
+int CpuReducer::sum(void* dst, const std::vector<void*>& srcs, size_t len,
+                    DataType dtype) {
+  size_t elem_size;
+  auto kernel = _sum_kernel(dtype, &elem_size);
+  auto d = static_cast<char*>(dst);
+  size_t n = len / elem_size;
+  size_t block = (n + _num_threads - 1) / _num_threads;
+  block = (block + 63) / 64 * 64;
+  // Add the sources one L1-sized stripe at a time: the stripe of dst stays
+  // in cache, so it is read and written back once for all sources
+  const size_t stripe = (16 << 10) / elem_size;
+#pragma omp parallel for num_threads(_num_threads)
+  for (size_t i = 0; i < n; i += block) {
+    size_t end = std::min(i + block, n);
+    for (size_t j = i; j < end; j += stripe) {
+      size_t m = std::min(stripe, end - j);
+      for (auto src : srcs) {
+        kernel(d + j * elem_size,
+               static_cast<const char*>(src) + j * elem_size, m);
+      }
     }
   }
-#endif
-  for (size_t i = (size_t)(len / 8) * 8; i < (size_t)len; ++i) {
-    float in1_float;
-    float in2_float;
-    float out_float;
-    HalfBits2Float(in1 + i, &in1_float);
-    HalfBits2Float(in2 + i, &in2_float);
-    out_float = in1_float + in2_float;
-    Float2HalfBits(&out_float, out + i);
-  }
   return 0;
 }
 
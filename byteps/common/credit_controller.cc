@@ -0,0 +1,115 @@
+// Copyright 2019 Bytedance Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+#include "credit_controller.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+
+#include "global.h"
+#include "logging.h"
+
+namespace byteps {
+namespace common {
+
+// the baseline delay is re-learned after this many completions, so that it
+// follows a changing path
+static const int kDelayEpoch = 1024;
+
+static long long SteadyNowMicros() {
+  auto now = std::chrono::steady_clock::now().time_since_epoch();
+  return std::chrono::duration_cast<std::chrono::microseconds>(now).count();
+}
+
+static SchedulingClock scheduling_clock = SteadyNowMicros;
+
+void SetSchedulingClock(SchedulingClock clock) {
+  scheduling_clock = clock ? clock : SteadyNowMicros;
+}
+
+long long SchedulingNowMicros() { return scheduling_clock(); }
+
+CreditController::CreditController(uint64_t window) {
+  _window = window;
+  _min_window = std::min<uint64_t>(window, BytePSGlobal::GetPartitionBound());
+  _max_window = 4 * window;
+  _adaptive = getenv("BYTEPS_ADAPTIVE_CREDIT")
+                  ? atoi(getenv("BYTEPS_ADAPTIVE_CREDIT"))
+                  : false;
+  _delay_tolerance = getenv("BYTEPS_ADAPTIVE_CREDIT_DELAY")
+                         ? atof(getenv("BYTEPS_ADAPTIVE_CREDIT_DELAY"))
+                         : 0.5;
+  BPS_CHECK_GT(_delay_tolerance, 0);
+}
+
+bool CreditController::admit(uint64_t len) {
+  if (_inflight == 0 || _inflight + len <= _window) {
+    return true;
+  }
+  _limited = true;
+  return false;
+}
+
+void CreditController::onTake(uint64_t key, uint64_t len) {
+  auto& task = _tasks[key];
+  _inflight -= task.len;
+  task.len = len;
+  task.start = SchedulingNowMicros();
+  _inflight += len;
+}
+
+void CreditController::onFinish(uint64_t key) {
+  auto it = _tasks.find(key);
+  if (it == _tasks.end()) return;
+  auto len = it->second.len;
+  auto start = it->second.start;
+  _inflight -= len;
+  _tasks.erase(it);
+  if (_adaptive) {
+    auto now = SchedulingNowMicros();
+    adjust(now - start, len, now);
+  }
+}
+
+void CreditController::adjust(long long delay, uint64_t len, long long now) {
+  if (_delay_samples++ % kDelayEpoch == 0 || delay < _min_delay) {
+    _min_delay = delay;
+  }
+
+  auto old_window = _window;
+  if (delay > _min_delay * (1 + _delay_tolerance)) {
+    // at most one decrease per delay, as the tasks already in flight were
+    // sent under the old window
+    if (now - _last_decrease > delay) {
+      _window = std::max(_min_window, _window / 2);
+      _last_decrease = now;
+    }
+  } else if (_limited) {
+    _window = std::min(_max_window,
+                       _window + std::max<uint64_t>(
+                                     1, _min_window * len / _window));
+  }
+  _limited = false;
+
+  if (_window != old_window) {
+    BPS_LOG(TRACE) << "Credit window " << old_window << " -> " << _window
+                   << " bytes, delay=" << delay << "us"
+                   << ", min_delay=" << _min_delay << "us";
+  }
+}
+
+}  // namespace common
+}  // namespace byteps
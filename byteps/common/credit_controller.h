@@ -0,0 +1,79 @@
+// Copyright 2019 Bytedance Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+#ifndef BYTEPS_CREDIT_CONTROLLER_H
+#define BYTEPS_CREDIT_CONTROLLER_H
+
+#include <cstdint>
+#include <unordered_map>
+
+namespace byteps {
+namespace common {
+
+// Microseconds of the monotonic clock that times the credit windows and the
+// Prophet profiling. The scheduler simulator replaces it with its virtual
+// clock; nullptr restores the steady clock.
+typedef long long (*SchedulingClock)();
+void SetSchedulingClock(SchedulingClock clock);
+long long SchedulingNowMicros();
+
+// Byte window bounding the tasks a queue keeps in flight.
+//
+// With BYTEPS_ADAPTIVE_CREDIT=1 the window is sized AIMD-style from the
+// completion delay of the tasks: when the delay grows past the lowest delay
+// seen by more than BYTEPS_ADAPTIVE_CREDIT_DELAY (a fraction), the link is
+// queueing and the window shrinks by half; while tasks are held back by the
+// window and the delay stays low, it grows by about one partition per window.
+// It stays within [one partition, 4 x the initial window].
+// Not thread-safe, the owning queue serializes the calls.
+class CreditController {
+ public:
+  explicit CreditController(uint64_t window);
+
+  // True if a task of |len| bytes fits; never blocks an empty window
+  bool admit(uint64_t len);
+  void onTake(uint64_t key, uint64_t len);
+  void onFinish(uint64_t key);
+
+  uint64_t getWindow() const { return _window; }
+  uint64_t getInflight() const { return _inflight; }
+
+ private:
+  struct Inflight {
+    uint64_t len = 0;
+    long long start = 0;
+  };
+
+  void adjust(long long delay, uint64_t len, long long now);
+
+  uint64_t _window;
+  uint64_t _min_window;
+  uint64_t _max_window;
+  uint64_t _inflight = 0;
+  std::unordered_map<uint64_t, Inflight> _tasks;
+
+  bool _adaptive;
+  double _delay_tolerance;
+  // the window held back a task since the last completion
+  bool _limited = false;
+  long long _min_delay = 0;
+  int _delay_samples = 0;
+  long long _last_decrease = 0;
+};
+
+}  // namespace common
+}  // namespace byteps
+
+#endif  // BYTEPS_CREDIT_CONTROLLER_H
@@ -0,0 +1,307 @@
+// Copyright 2019 Bytedance Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+#include "fusion.h"
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+
+#include "global.h"
+#include "logging.h"
+#include "operations.h"
+
+namespace byteps {
+namespace common {
+
+namespace {
+
+// The GPU buffer of a bucket
+class FusionTensor : public Tensor {
+ public:
+  FusionTensor(void* data, int64_t size, DataType dtype)
+      : _data(data), _size(size), _dtype(dtype) {}
+  const DataType dtype() const override { return _dtype; }
+  const TensorShape shape() const override {
+    TensorShape shape;
+    shape.AddDim(_size / getDataTypeLength(_dtype));
+    return shape;
+  }
+  const void* data() const override { return _data; }
+  int64_t size() const override { return _size; }
+
+ private:
+  void* _data;
+  int64_t _size;
+  DataType _dtype;
+};
+
+// All members of the bucket have been copied in
+class FusionReadyEvent : public ReadyEvent {
+ public:
+  explicit FusionReadyEvent(cudaEvent_t event) : _event(event) {}
+  bool Ready() const override {
+    auto status = cudaEventQuery(_event);
+    if (status == cudaErrorNotReady) return false;
+    CUDA_CALL(status);
+    return true;
+  }
+
+ private:
+  cudaEvent_t _event;
+};
+
+}  // namespace
+
+FusionManager::FusionManager(size_t threshold) : _threshold(threshold) {
+  CUDA_CALL(
+      cudaStreamCreateWithFlags(&_copy_in_stream, cudaStreamNonBlocking));
+  CUDA_CALL(
+      cudaStreamCreateWithFlags(&_copy_out_stream, cudaStreamNonBlocking));
+  BPS_LOG(DEBUG) << "Fusing tensors smaller than " << threshold << " bytes";
+}
+
+FusionManager::~FusionManager() {
+  for (auto& b : _buckets) {
+    if (b->buff) {
+      cudaFree(b->buff);
+      cudaEventDestroy(b->event);
+    }
+  }
+  cudaStreamDestroy(_copy_in_stream);
+  cudaStreamDestroy(_copy_out_stream);
+}
+
+void FusionManager::Plan(const std::vector<BPSContext*>& contexts,
+                         const std::vector<size_t>& sizes,
+                         const std::vector<int>& dtypes) {
+  std::vector<size_t> order;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (size_t i = 0; i < contexts.size(); ++i) {
+      auto& context = *contexts[i];
+      BPS_CHECK(context.initialized) << context.tensor_name;
+      if (context.fusion_bucket || context.prophet ||
+          context.server_optimizer || context.row_len ||
+          sizes[i] >= _threshold || _members.count(&context)) {
+        continue;
+      }
+      order.push_back(i);
+    }
+  }
+  std::sort(order.begin(), order.end(), [&contexts](size_t a, size_t b) {
+    return contexts[a]->declared_key < contexts[b]->declared_key;
+  });
+  order.erase(std::unique(order.begin(), order.end(),
+                          [&contexts](size_t a, size_t b) {
+                            return contexts[a] == contexts[b];
+                          }),
+              order.end());
+
+  // buckets of at least two members, neighbors in declared order
+  std::vector<std::unique_ptr<Bucket>> planned;
+  std::vector<std::unique_ptr<Member>> members;
+  Bucket* open = nullptr;
+  size_t first_member = 0;
+  auto seal = [&] {
+    if (open && open->members.size() < 2) {
+      members.resize(first_member);
+      planned.pop_back();
+    }
+    open = nullptr;
+  };
+  for (auto i : order) {
+    if (open &&
+        (open->dtype != dtypes[i] || open->size + sizes[i] > _threshold)) {
+      seal();
+    }
+    if (!open) {
+      planned.emplace_back(new Bucket);
+      open = planned.back().get();
+      open->dtype = dtypes[i];
+      first_member = members.size();
+    }
+    auto m = new Member;
+    m->context = contexts[i];
+    m->bucket = open;
+    m->offset = open->size;
+    m->size = sizes[i];
+    open->size += sizes[i];
+    open->members.push_back(m);
+    members.emplace_back(m);
+  }
+  seal();
+
+  // declared as the same fusion tensors on every rank, in order
+  for (auto& b : planned) {
+    auto bucket = b.get();
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      bucket->id = _buckets.size();
+      _buckets.emplace_back(std::move(b));
+    }
+    InitBucket(bucket);
+  }
+  std::lock_guard<std::mutex> lock(_mutex);
+  for (auto& m : members) {
+    _members[m->context] = std::move(m);
+  }
+}
+
+void FusionManager::InitBucket(Bucket* b) {
+  auto name = std::string("BytePSFusion_") + std::to_string(b->id);
+  BytePSGlobal::IsTensorDeclared(name);
+  BytePSGlobal::GetProphetPlan()->RegisterTensor(name, false);
+  auto& context = BytePSGlobal::GetContextFromName(name);
+  context.fusion_bucket = true;
+
+  CUDA_CALL(cudaSetDevice(BytePSGlobal::GetLocalRank()));
+  void* buff;
+  CUDA_CALL(cudaMalloc(&buff, b->size));
+  CUDA_CALL(cudaMemset(buff, 0, b->size));
+  CUDA_CALL(cudaEventCreateWithFlags(&b->event, cudaEventDisableTiming));
+  InitTensor(context, b->size, b->dtype, nullptr);
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  b->context = &context;
+  b->buff = static_cast<char*>(buff);
+  b->tensor = std::make_shared<FusionTensor>(
+      buff, b->size, static_cast<DataType>(b->dtype));
+  BPS_LOG(DEBUG) << name << " fuses " << b->members.size()
+                 << " tensors, size=" << b->size;
+}
+
+bool FusionManager::IsMember(BPSContext& context) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _members.count(&context) > 0;
+}
+
+bool FusionManager::Enqueue(
+    BPSContext& context, std::shared_ptr<Tensor> input,
+    std::shared_ptr<Tensor> output, std::shared_ptr<ReadyEvent> ready_event,
+    int device, int priority, int version, StatusCallback callback,
+    std::shared_ptr<const std::vector<QueueType>> queue_list) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  auto it = _members.find(&context);
+  if (it == _members.end()) return false;
+  // nothing to send at all, the same on every rank
+  if (queue_list->empty()) return false;
+  BPS_CHECK_NE(device, CPU_DEVICE_ID)
+      << context.tensor_name << " is fused, it must be pushed from the GPU";
+  auto m = it->second.get();
+  Request req;
+  req.input = input ? input : output;
+  req.output = output;
+  req.ready_event = ready_event;
+  req.callback = callback;
+  req.device = device;
+  req.priority = priority;
+  req.version = version;
+  req.queue_list = queue_list;
+  m->requests.push_back(std::move(req));
+  // pushed again before the round is over: joins the next one
+  if (m->requests.size() == 1) JoinRound(m);
+  return true;
+}
+
+void FusionManager::JoinRound(Member* m) {
+  auto b = m->bucket;
+  auto& req = m->requests.front();
+  if (b->received++ == 0) {
+    b->priority = req.priority;
+    b->device = req.device;
+    b->queue_list = req.queue_list;
+  }
+  b->priority = std::max(b->priority, req.priority);
+  b->version = req.version;
+  _waiting.push_back(m);
+  _cv.notify_one();
+}
+
+void FusionManager::Poll() {
+  std::vector<Bucket*> full;
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    auto not_ready = [](Member* m) {
+      auto& event = m->requests.front().ready_event;
+      return event && !event->Ready();
+    };
+    if (_waiting.empty() ||
+        std::all_of(_waiting.begin(), _waiting.end(), not_ready)) {
+      // members' ready events are noticed when the park times out
+      _cv.wait_for(lock, std::chrono::microseconds(
+                             BytePSGlobal::GetQueueParkMicros()));
+    }
+    for (auto it = _waiting.begin(); it != _waiting.end();) {
+      auto m = *it;
+      if (not_ready(m)) {
+        ++it;
+        continue;
+      }
+      auto b = m->bucket;
+      CUDA_CALL(cudaMemcpyAsync(b->buff + m->offset,
+                                m->requests.front().input->data(), m->size,
+                                cudaMemcpyDeviceToDevice, _copy_in_stream));
+      it = _waiting.erase(it);
+      if (++b->copied == (int)b->members.size()) {
+        CUDA_CALL(cudaEventRecord(b->event, _copy_in_stream));
+        full.push_back(b);
+      }
+    }
+  }
+
+  for (auto b : full) {
+    BPS_LOG(TRACE) << b->context->tensor_name << " is full, enqueue it";
+    EnqueueTensor(*b->context, b->tensor, b->tensor,
+                  std::make_shared<FusionReadyEvent>(b->event), b->device,
+                  b->priority, b->version,
+                  [this, b](const Status& status) { FinishRound(b, status); },
+                  b->queue_list);
+  }
+}
+
+void FusionManager::FinishRound(Bucket* b, const Status& status) {
+  std::vector<StatusCallback> callbacks;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (auto m : b->members) {
+      CUDA_CALL(cudaMemcpyAsync(
+          const_cast<void*>(m->requests.front().output->data()),
+          b->buff + m->offset, m->size, cudaMemcpyDeviceToDevice,
+          _copy_out_stream));
+    }
+  }
+  CUDA_CALL(cudaStreamSynchronize(_copy_out_stream));
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    b->received = 0;
+    b->copied = 0;
+    b->queue_list.reset();
+    for (auto m : b->members) {
+      callbacks.push_back(m->requests.front().callback);
+      m->requests.pop_front();
+    }
+    // push_pulls that came in during the round start the next one
+    for (auto m : b->members) {
+      if (!m->requests.empty()) JoinRound(m);
+    }
+  }
+  for (auto& callback : callbacks) {
+    callback(status);
+  }
+}
+
+}  // namespace common
+}  // namespace byteps
@@ -0,0 +1,136 @@
+// Copyright 2019 Bytedance Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+#ifndef BYTEPS_FUSION_H
+#define BYTEPS_FUSION_H
+
+#include <cuda_runtime.h>
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+
+namespace byteps {
+namespace common {
+
+// Fusion of small GPU tensors into buckets, which go through the pipeline as
+// one tensor with their own keys.
+//
+// Buckets are planned by a bulk init (InitTensors), from its tensors sorted
+// by declared key: tensors smaller than BYTEPS_FUSION_THRESHOLD bytes fill a
+// bucket while the dtype is the same and the bucket stays under the
+// threshold. This does not depend on the order or the timing of the inits,
+// so every worker and local rank forms the same buckets as long as their
+// bulk inits list the same tensors. Tensors initialized on their own are
+// never fused.
+//
+// A push_pull of a member is copied into the GPU buffer of the bucket once
+// the tensor is ready, the bucket is enqueued with the highest priority of
+// its members once all of them are in, and its result is copied back to
+// their outputs before their callbacks run. A member pushed again before the
+// round is over waits for the next round instead of going on its own, so
+// all ranks fuse the same push_pulls. Prophet and server-optimizer tensors
+// are not fused, so Prophet blocks are planned on the same gradients with
+// and without fusion.
+class FusionManager {
+ public:
+  explicit FusionManager(size_t threshold);
+  ~FusionManager();
+
+  // Plan the buckets of the tensors of a bulk init, once they are
+  // initialized. Tensors already in a bucket are skipped.
+  void Plan(const std::vector<BPSContext*>& contexts,
+            const std::vector<size_t>& sizes, const std::vector<int>& dtypes);
+  // Whether |context| was planned in a bucket
+  bool IsMember(BPSContext& context);
+
+  // Add a push_pull to its bucket. Returns false if it is not fused and
+  // should be enqueued on its own.
+  bool Enqueue(BPSContext& context, std::shared_ptr<Tensor> input,
+               std::shared_ptr<Tensor> output,
+               std::shared_ptr<ReadyEvent> ready_event, int device,
+               int priority, int version, StatusCallback callback,
+               std::shared_ptr<const std::vector<QueueType>> queue_list);
+
+  // Copy the ready members into their buckets and enqueue the full buckets.
+  // Called by the fusion loop, waits for at most the queue park timeout.
+  void Poll();
+
+ private:
+  struct Bucket;
+
+  struct Request {
+    std::shared_ptr<Tensor> input;
+    std::shared_ptr<Tensor> output;
+    std::shared_ptr<ReadyEvent> ready_event;
+    StatusCallback callback;
+    int device;
+    int priority;
+    int version;
+    std::shared_ptr<const std::vector<QueueType>> queue_list;
+  };
+
+  struct Member {
+    BPSContext* context;
+    Bucket* bucket;
+    size_t offset;
+    size_t size;
+    // push_pulls in order, the first one is in the current round
+    std::deque<Request> requests;
+  };
+
+  struct Bucket {
+    int id;
+    int dtype;
+    size_t size = 0;
+    std::vector<Member*> members;
+    BPSContext* context = nullptr;
+    char* buff = nullptr;
+    std::shared_ptr<Tensor> tensor;
+    cudaEvent_t event;
+    // current round
+    int received = 0;
+    int copied = 0;
+    int device;
+    int priority;
+    int version;
+    std::shared_ptr<const std::vector<QueueType>> queue_list;
+  };
+
+  void InitBucket(Bucket* bucket);
+  // Add the first request of |m| to the round of its bucket
+  void JoinRound(Member* m);
+  void FinishRound(Bucket* bucket, const Status& status);
+
+  size_t _threshold;
+  std::mutex _mutex;
+  std::condition_variable _cv;
+  std::unordered_map<BPSContext*, std::unique_ptr<Member>> _members;
+  std::vector<std::unique_ptr<Bucket>> _buckets;
+  // members whose push_pull waits for its tensor to be copied in
+  std::vector<Member*> _waiting;
+  cudaStream_t _copy_in_stream;
+  cudaStream_t _copy_out_stream;
+};
+
+}  // namespace common
+}  // namespace byteps
+
+#endif  // BYTEPS_FUSION_H
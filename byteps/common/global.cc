@@ -21,6 +21,8 @@
 
 #include <sstream>
 
+#include "core_loops.h"
+
 namespace byteps {
 namespace common {
 
@@ -40,9 +42,9 @@ bool BytePSGlobal::_is_root_device;
 bool BytePSGlobal::_is_distributed_job;
 bool BytePSGlobal::_is_cross_pcie_switch;
 uint32_t BytePSGlobal::_partition_bytes = 4096000;
-
-// added by jxtxzzw and chris
-int BytePSGlobal::pushsize[20] = {0};
+uint32_t BytePSGlobal::_partition_min_bytes = 0;
+uint32_t BytePSGlobal::_queue_spin_us = 0;
+uint32_t BytePSGlobal::_queue_park_us = 100;
 
 int BytePSGlobal::_is_trace = 0;
 int BytePSGlobal::_start_step = 10;
@@ -56,6 +58,9 @@ std::shared_ptr<BytePSSharedMemory> BytePSGlobal::_shm_obj;
 std::unordered_map<uint64_t, PSKV> BytePSGlobal::ps_kv_;
 std::vector<unsigned long> BytePSGlobal::_server_accumulated_len;
 std::string BytePSGlobal::_hash_knob;
+std::string BytePSGlobal::_key_placement;
+std::unordered_map<uint64_t, int> BytePSGlobal::_planned_server;
+std::vector<unsigned long> BytePSGlobal::_planned_len;
 
 volatile BytePSScheduledQueue* BytePSGlobal::_queues[QueueNum] = {NULL};
 std::mutex BytePSGlobal::_queues_mutex[QueueNum];
@@ -63,6 +68,9 @@ std::vector<std::thread*> BytePSGlobal::_threads;
 
 std::mutex BytePSGlobal::_context_mutex;
 ps::KVWorker<char>* BytePSGlobal::_ps = NULL;
+int BytePSGlobal::_ps_lane_num = 1;
+std::vector<ps::KVWorker<char>*> BytePSGlobal::_ps_lanes;
+std::vector<bool> BytePSGlobal::_colocated_servers;
 std::mutex BytePSGlobal::_encode_mutex;
 ReadyTable* BytePSGlobal::_reduce_table;
 ReadyTable* BytePSGlobal::_pcie_reduce_table;
@@ -71,14 +79,26 @@ ReadyTable* BytePSGlobal::_push_table;
 ReadyTable* BytePSGlobal::_pull_table;
 ReadyTable* BytePSGlobal::_copy_table;
 bool BytePSGlobal::_is_using_reduce = false;
+bool BytePSGlobal::_is_gpu_direct = false;
+bool BytePSGlobal::_is_cpu_direct = false;
+CompressorType BytePSGlobal::_compressor_type = CompressorType::kNone;
+double BytePSGlobal::_compressor_ratio = 0.01;
+bool BytePSGlobal::_compressor_error_feedback = true;
+size_t BytePSGlobal::_compressor_min_bytes = 65536;
 std::vector<int> BytePSGlobal::_reduce_roots;
 
 std::unordered_map<std::string, BPSContext> BytePSGlobal::_name_to_cxt;
 unsigned int next_key_ = 0;
 cudaStream_t* BytePSGlobal::_copy_device2host_stream;
 cudaStream_t* BytePSGlobal::_copy_host2device_stream;
+int BytePSGlobal::_copy_stream_num = 2;
+int BytePSGlobal::_copy_pipeline_depth = 4;
 std::shared_ptr<NcclManager> BytePSGlobal::_nccl_manager;
+std::shared_ptr<CpuAffinity> BytePSGlobal::_cpu_affinity;
 std::shared_ptr<CpuReducer> BytePSGlobal::_cpu_reducer;
+std::shared_ptr<ProphetPlan> BytePSGlobal::_prophet_plan;
+std::shared_ptr<Metrics> BytePSGlobal::_metrics;
+std::shared_ptr<FusionManager> BytePSGlobal::_fusion;
 
 std::hash<std::string> BytePSGlobal::_built_in_hash_fn;
 unsigned int BytePSGlobal::_built_in_hash_coefficient;
@@ -118,8 +138,11 @@ void BytePSGlobal::Init() {
   _trace_dir = getenv("BYTEPS_TRACE_DIR")
                    ? std::string(getenv("BYTEPS_TRACE_DIR"))
                    : "./trace";
+  if (getenv("BYTEPS_TRACE_RING_RECORDS")) {
+    Tracer::SetCapacity(atoi(getenv("BYTEPS_TRACE_RING_RECORDS")));
+  }
 
-  _basic_comm = std::make_shared<BytePSCommSocket>();
+  _basic_comm = CreateComm();
 
   _basic_comm->init(&_rank, &_size, &_local_rank, &_local_size, &_worker_id,
                     &_my_role);
@@ -133,6 +156,25 @@ void BytePSGlobal::Init() {
                  << AlignTo(_partition_bytes, (8 * _local_size)) << " bytes";
   // alignment for Reduce-Scatter/All-Gather
   _partition_bytes = AlignTo(_partition_bytes, (8 * _local_size));
+  // the bandwidth-delay product of the link, below which a partition does
+  // not fill it during one round trip
+  if (getenv("BYTEPS_PARTITION_MIN_BYTES")) {
+    _partition_min_bytes = atoi(getenv("BYTEPS_PARTITION_MIN_BYTES"));
+    _partition_min_bytes = std::min(_partition_min_bytes, _partition_bytes);
+    BPS_LOG(DEBUG) << "Per-tensor partition size, at least "
+                   << _partition_min_bytes << " bytes";
+  }
+
+  // Idle loop threads spin for _queue_spin_us, then park on the queue for at
+  // most _queue_park_us. The park timeout bounds how late we notice readiness
+  // that nobody signals, e.g. a CUDA event.
+  if (getenv("BYTEPS_QUEUE_SPIN_US")) {
+    _queue_spin_us = atoi(getenv("BYTEPS_QUEUE_SPIN_US"));
+  }
+  if (getenv("BYTEPS_QUEUE_PARK_US")) {
+    _queue_park_us = atoi(getenv("BYTEPS_QUEUE_PARK_US"));
+  }
+  BPS_CHECK_GT(_queue_park_us, 0) << "BYTEPS_QUEUE_PARK_US must be positive";
 
   BPS_CHECK(getenv("DMLC_NUM_WORKER")) << "error: env DMLC_NUM_WORKER not set";
 
@@ -147,6 +189,20 @@ void BytePSGlobal::Init() {
     BPS_CHECK(getenv("DMLC_NUM_SERVER"))
         << "error: launch distributed job, but env DMLC_NUM_SERVER not set";
 
+    if (getenv("BYTEPS_PS_LANES")) {
+      _ps_lane_num = atoi(getenv("BYTEPS_PS_LANES"));
+    }
+    BPS_CHECK_GT(_ps_lane_num, 0) << "BYTEPS_PS_LANES must be positive";
+
+    // set key placement
+    _key_placement = std::string(getenv("BYTEPS_KEY_PLACEMENT")
+                                     ? getenv("BYTEPS_KEY_PLACEMENT")
+                                     : "hash");
+    BPS_CHECK(_key_placement == "hash" || _key_placement == "balanced")
+        << "Unsupported BYTEPS_KEY_PLACEMENT " << _key_placement
+        << ", must be one of [hash, balanced]";
+    BPS_LOG(DEBUG) << "Using key placement: " << _key_placement;
+
     // set hash function
     _hash_knob = std::string(
         getenv("BYTEPS_KEY_HASH_FN") ? getenv("BYTEPS_KEY_HASH_FN") : "djb2");
@@ -185,6 +241,42 @@ void BytePSGlobal::Init() {
     numa_bind(numa_parse_nodestring(std::to_string(numa_index).c_str()));
   }
 
+  // Pin the background threads, to the CPUs of the NUMA node of the GPU or
+  // to a list shared by the local ranks
+  if (getenv("BYTEPS_THREAD_AFFINITY")) {
+    std::string spec(getenv("BYTEPS_THREAD_AFFINITY"));
+    int node = -1;
+    GetGpuNumaNode(_local_rank, &node);
+    int index = _local_rank, count = _local_size;
+    if (spec == "numa") {
+      // shared by the local ranks whose GPUs are on the same node
+      index = count = 0;
+      for (int i = 0; i < _local_size; ++i) {
+        int other = -1;
+        GetGpuNumaNode(i, &other);
+        if (other != node) continue;
+        if (i < _local_rank) ++index;
+        ++count;
+      }
+    }
+    auto affinity = std::make_shared<CpuAffinity>(spec, node, index, count);
+    if (affinity->Enabled()) {
+      _cpu_affinity = affinity;
+      BPS_LOG(DEBUG) << "Background threads pinned to CPUs "
+                     << affinity->ToString() << " rank=" << _local_rank;
+    }
+  }
+
+  // Shared memory arenas instead of one segment per tensor
+  if (getenv("BYTEPS_SHM_ARENA_BYTES") &&
+      atoll(getenv("BYTEPS_SHM_ARENA_BYTES")) > 0) {
+    bool hugepage = getenv("BYTEPS_SHM_HUGEPAGE")
+                        ? atoi(getenv("BYTEPS_SHM_HUGEPAGE"))
+                        : true;
+    _shm_obj->initArena(atoll(getenv("BYTEPS_SHM_ARENA_BYTES")), hugepage,
+                        _basic_comm);
+  }
+
   // Init CPU Reducer
   if (_is_cross_pcie_switch) {
     _cpu_reducer = std::make_shared<CpuReducer>(_basic_comm);
@@ -213,6 +305,59 @@ void BytePSGlobal::Init() {
         new ReadyTable(GetPcieSwitchSize() - 1, "NCCL_BROADCAST");
   }
 
+  // GPU-direct RDMA: the whole partition is reduced to the root device, whose
+  // GPU buffer is then pushed and pulled by the RDMA van without staging it
+  // in host memory. This needs a NIC that can access GPU memory (e.g. with
+  // nvidia-peermem), all GPUs under one PCIe switch, and the RDMA van.
+  if (getenv("BYTEPS_GPU_DIRECT") && atoi(getenv("BYTEPS_GPU_DIRECT")) &&
+      _is_distributed_job) {
+    BPS_CHECK(!_is_cross_pcie_switch)
+        << "BYTEPS_GPU_DIRECT cannot be used with BYTEPS_PCIE_SWITCH_SIZE.";
+    BPS_CHECK(!getenv("BYTEPS_REDUCE_ROOTS"))
+        << "BYTEPS_GPU_DIRECT cannot be used with BYTEPS_REDUCE_ROOTS.";
+    BPS_CHECK(getenv("DMLC_ENABLE_RDMA") && atoi(getenv("DMLC_ENABLE_RDMA")))
+        << "BYTEPS_GPU_DIRECT needs DMLC_ENABLE_RDMA=1.";
+    _is_gpu_direct = true;
+    _is_using_reduce = true;
+    // the root of the local communicator is the last local rank
+    _reduce_roots.push_back(_local_size - 1);
+    BPS_LOG(DEBUG) << "Using GPU-direct RDMA for push and pull";
+  }
+
+  // CPU training: a worker alone on its machine has nothing to reduce
+  // locally, so its CPU tensors skip NCCL, the copies and shared memory, and
+  // are pushed from and pulled into the framework buffers
+  _is_cpu_direct = _is_distributed_job && _local_size == 1 &&
+                   (getenv("BYTEPS_CPU_DIRECT")
+                        ? atoi(getenv("BYTEPS_CPU_DIRECT"))
+                        : true);
+  if (_is_cpu_direct) {
+    BPS_LOG(DEBUG) << "Pushing and pulling CPU tensors in place";
+  }
+
+  // Compression of pushes and pulls, done by the root device on the host
+  // buffers, and by the servers on the sums
+  if (getenv("BYTEPS_COMPRESSOR") && _is_distributed_job) {
+    _compressor_type = Compressor::ParseType(getenv("BYTEPS_COMPRESSOR"));
+    BPS_CHECK(!IsCompressing() || !_is_gpu_direct)
+        << "BYTEPS_COMPRESSOR cannot be used with BYTEPS_GPU_DIRECT.";
+    if (getenv("BYTEPS_COMPRESSOR_TOPK_RATIO")) {
+      _compressor_ratio = atof(getenv("BYTEPS_COMPRESSOR_TOPK_RATIO"));
+    }
+    BPS_CHECK(_compressor_ratio > 0 && _compressor_ratio <= 1)
+        << "BYTEPS_COMPRESSOR_TOPK_RATIO must be in (0, 1]";
+    if (getenv("BYTEPS_COMPRESSOR_ERROR_FEEDBACK")) {
+      _compressor_error_feedback =
+          atoi(getenv("BYTEPS_COMPRESSOR_ERROR_FEEDBACK"));
+    }
+    if (getenv("BYTEPS_COMPRESSOR_MIN_BYTES")) {
+      _compressor_min_bytes = atoi(getenv("BYTEPS_COMPRESSOR_MIN_BYTES"));
+    }
+    BPS_LOG(DEBUG) << "Compressing tensors of at least "
+                   << _compressor_min_bytes << " bytes with "
+                   << getenv("BYTEPS_COMPRESSOR");
+  }
+
   // Configure the reduce strategy
   if (getenv("BYTEPS_REDUCE_ROOTS")) {
     BPS_CHECK(!_is_cross_pcie_switch)
@@ -230,14 +375,42 @@ void BytePSGlobal::Init() {
   }
 
   // Create CUDA streams for GPU-CPU copies
-  _copy_host2device_stream = (cudaStream_t*)malloc(sizeof(cudaStream_t) * 1);
-  _copy_device2host_stream = (cudaStream_t*)malloc(sizeof(cudaStream_t) * 1);
-  CUDA_CALL(cudaStreamCreateWithFlags(_copy_host2device_stream,
-                                      cudaStreamNonBlocking));
-  CUDA_CALL(cudaStreamCreateWithFlags(_copy_device2host_stream,
-                                      cudaStreamNonBlocking));
-  CUDA_CALL(cudaStreamSynchronize(*_copy_host2device_stream));
-  CUDA_CALL(cudaStreamSynchronize(*_copy_device2host_stream));
+  if (getenv("BYTEPS_COPY_STREAMS")) {
+    _copy_stream_num = atoi(getenv("BYTEPS_COPY_STREAMS"));
+  }
+  if (getenv("BYTEPS_COPY_PIPELINE_DEPTH")) {
+    _copy_pipeline_depth = atoi(getenv("BYTEPS_COPY_PIPELINE_DEPTH"));
+  }
+  BPS_CHECK_GT(_copy_stream_num, 0) << "BYTEPS_COPY_STREAMS must be positive";
+  BPS_CHECK_GT(_copy_pipeline_depth, 0)
+      << "BYTEPS_COPY_PIPELINE_DEPTH must be positive";
+  _copy_host2device_stream =
+      (cudaStream_t*)malloc(sizeof(cudaStream_t) * _copy_stream_num);
+  _copy_device2host_stream =
+      (cudaStream_t*)malloc(sizeof(cudaStream_t) * _copy_stream_num);
+  for (int i = 0; i < _copy_stream_num; ++i) {
+    CUDA_CALL(cudaStreamCreateWithFlags(_copy_host2device_stream + i,
+                                        cudaStreamNonBlocking));
+    CUDA_CALL(cudaStreamCreateWithFlags(_copy_device2host_stream + i,
+                                        cudaStreamNonBlocking));
+    CUDA_CALL(cudaStreamSynchronize(_copy_host2device_stream[i]));
+    CUDA_CALL(cudaStreamSynchronize(_copy_device2host_stream[i]));
+  }
+
+  // Prophet block plan, filled by the PUSH queue during the first iteration
+  _prophet_plan = std::make_shared<ProphetPlan>();
+
+  // Live pipeline metrics, polled by byteps_get_metrics()
+  if (!getenv("BYTEPS_METRICS_ON") || atoi(getenv("BYTEPS_METRICS_ON"))) {
+    _metrics = std::make_shared<Metrics>();
+  }
+
+  // Fusion of small tensors
+  if (getenv("BYTEPS_FUSION_THRESHOLD") &&
+      atoi(getenv("BYTEPS_FUSION_THRESHOLD")) > 0) {
+    _fusion = std::make_shared<FusionManager>(
+        atoi(getenv("BYTEPS_FUSION_THRESHOLD")));
+  }
 
   // Create queues
   for (int i = 0; i < QueueNum; i++) {
@@ -245,6 +418,9 @@ void BytePSGlobal::Init() {
     auto type = static_cast<QueueType>(i);
     BytePSGlobal::CreateScheduledQueue(type);
   }
+  // The root NCCL loop serves REDUCE and BROADCAST from one thread
+  GetScheduledQueue(BROADCAST)->setNotifier(
+      GetScheduledQueue(REDUCE)->getNotifier());
 
   joined_thread_cnt = 0;
 
@@ -265,12 +441,27 @@ ps::KVWorker<char>* BytePSGlobal::GetOrInitPS() {
   if (!_ps && IsDistributed() &&
       _my_role == BytePSRole::LOCAL_ROOT) {  // only the root needs networking
     // init low-level ps implementation
-    _ps = new ps::KVWorker<char>(0, 0);
+    // the lanes are customers of app 0, the servers answer each of them
+    for (int i = 0; i < _ps_lane_num; ++i) {
+      _ps_lanes.push_back(new ps::KVWorker<char>(0, i));
+    }
+    _ps = _ps_lanes[0];
     ps::StartAsync(0, "byteps\0");
     if (!ps::Postoffice::Get()->is_recovery()) {
       ps::Postoffice::Get()->Barrier(
           0, ps::kWorkerGroup + ps::kServerGroup + ps::kScheduler);
     }
+    // the servers advertised themselves before the barrier
+    int colocated = 0;
+    for (int i = 0; i < ps::NumServers(); ++i) {
+      _colocated_servers.push_back(IsColocatedServer(i));
+      colocated += _colocated_servers.back();
+    }
+    if (colocated) {
+      BPS_LOG(INFO) << colocated << " of " << ps::NumServers()
+                    << " servers are co-located, their partitions are pushed "
+                    << "and pulled through shared memory";
+    }
   }
   return _ps;
 }
@@ -278,12 +469,24 @@ ps::KVWorker<char>* BytePSGlobal::GetOrInitPS() {
 void BytePSGlobal::Start(const std::vector<LoopFunction>& func) {
   // Start background threads
   for (size_t i = 0; i < func.size(); i++) {
-    _threads.push_back(new std::thread(func[i]));
+    _threads.push_back(new std::thread(&BytePSGlobal::RunLoop, func[i], i));
   }
   BPS_LOG(DEBUG) << "Started " << func.size()
                  << " background threads. rank=" << _local_rank;
 }
 
+void BytePSGlobal::RunLoop(LoopFunction func, int slot) {
+  if (_cpu_affinity) {
+    // the OpenMP team of the CPU reducer would share a single CPU
+    if (func == PcieReduceLoop) {
+      _cpu_affinity->PinToSet();
+    } else {
+      _cpu_affinity->PinToCpu(slot);
+    }
+  }
+  func();
+}
+
 const Status NOT_INITIALIZED_ERROR = Status::PreconditionError(
     "BytePS has not been initialized; use bps.init().");
 
@@ -300,6 +503,7 @@ void BytePSGlobal::Shutdown() {
                  << " (rank=" << _local_rank << ")";
   _should_shutdown = true;
   int total_thread_num = _threads.size();
+  if (_is_trace == 2) DumpTraces();
 
   for (size_t i = 0; i < _threads.size(); i++) {
     if (_threads[i]->joinable()) {
@@ -321,11 +525,16 @@ void BytePSGlobal::Shutdown() {
 
   if (_ps) {
     ps::Finalize(0, false);
-    delete _ps;
+    for (auto lane : _ps_lanes) delete lane;
+    _ps_lanes.clear();
+    _colocated_servers.clear();
+    _ps = NULL;
   }
 
-  CUDA_CALL(cudaStreamDestroy(*_copy_device2host_stream));
-  CUDA_CALL(cudaStreamDestroy(*_copy_host2device_stream));
+  for (int i = 0; i < _copy_stream_num; ++i) {
+    CUDA_CALL(cudaStreamDestroy(_copy_device2host_stream[i]));
+    CUDA_CALL(cudaStreamDestroy(_copy_host2device_stream[i]));
+  }
 
   if (_reduce_table) {
     delete _reduce_table;
@@ -350,6 +559,10 @@ void BytePSGlobal::Shutdown() {
   _shm_obj.reset();
   _cpu_reducer.reset();
   _nccl_manager.reset();
+  _cpu_affinity.reset();
+  _prophet_plan.reset();
+  _fusion.reset();
+  _metrics.reset();
 
   BPS_LOG(DEBUG) << "Shutdown BytePS: all BytePS resources has been cleaned"
                  << " (rank=" << _local_rank << ")";
@@ -391,7 +604,7 @@ void BytePSGlobal::SetProfileFlag(BytePSContext* ctxt) {
     } else if (ctxt->step_cnt == _end_step) {
       ctxt->profile_flag = false;
       if (BytePSGlobal::IsAllTensorOutput(ctxt->tensor_name)) {
-        std::thread _t(BytePSGlobal::OutputTraces);
+        std::thread _t(BytePSGlobal::DumpTraces);
         _t.detach();
       }
     }
@@ -400,26 +613,6 @@ void BytePSGlobal::SetProfileFlag(BytePSContext* ctxt) {
   }
 }
 
-void BytePSGlobal::EmitTrace(std::ostream* os, const BPSCommTime* ret,
-                             BytePSContext* ctxt) {
-  std::string tid = (ret->key == -1) ? "total" : std::to_string(ret->key);
-  std::string para_name = "Comm." + ctxt->tensor_name;
-  std::string para_name_type =
-      (ret->key == -1) ? para_name : para_name + "." + LogStrings[ret->type];
-  (*os) << "        {\n"
-        << "            \"ph\": \"X\",\n"
-        << "            \"args\": {\n"
-        << "                \"name\": \"" << para_name << "\"\n"
-        << "            },\n"
-        << "            \"pid\": \"" << para_name << "\",\n"
-        << "            \"name\": \"" << para_name_type << "\",\n"
-        << "            \"ts\": " << ret->start_t << ",\n"
-        << "            \"dur\": " << ret->dur << ",\n"
-        << "            \"tid\": \"" << tid << "\",\n"
-        << "            \"cat\": \"Comm\"\n"
-        << "        }";
-}
-
 void BytePSGlobal::Who2beOutput(const std::string& name) {
   std::lock_guard<std::mutex> lock(_context_mutex);
   if (_name2end.find(name) == _name2end.end()) {
@@ -440,61 +633,24 @@ bool BytePSGlobal::IsAllTensorOutput(const std::string& name) {
     return false;
 }
 
-void BytePSGlobal::OutputTraces() {
-  // Asynchronously output communication traces
+int64_t BytePSGlobal::DumpTraces() {
   auto trace_path =
-      _trace_dir + "/" + std::to_string(_local_rank) + "/comm.json";
-  // Output these traces
-  std::ofstream file;
-  file.open(trace_path);
-  file << "{" << std::endl;
-  file << "    \"traceEvents\": [" << std::endl;
-  auto first = true;
-  for (std::unordered_map<std::string, int>::iterator iter = _name2end.begin();
-       iter != _name2end.end(); iter++) {
-    BPSContext* ctxt = &_name_to_cxt[iter->first];
-    while (ctxt->comm_time.size() > 0) {
-      BPSCommTime* ret = ctxt->comm_time.front();
-      if (!first)
-        file << ",\n";
-      else
-        first = false;
-      BytePSGlobal::EmitTrace(&file, ret, ctxt);
-      ctxt->comm_time.pop();
-    }
-    while (!ctxt->part_comm_time.empty()) {
-      auto part_id = ctxt->part_comm_time.begin()->first;
-      auto& type2part_comm_time = ctxt->part_comm_time.begin()->second;
-      BPS_CHECK(!type2part_comm_time.empty())
-          << "type2part_comm_time should not be empty";
-      while (!type2part_comm_time.empty()) {
-        auto type = type2part_comm_time.begin()->first;
-        auto& _part_comm_time_queue = type2part_comm_time.begin()->second;
-        BPS_CHECK(_part_comm_time_queue.size() > 0)
-            << "_part_comm_time_queue should not be empty";
-        while (_part_comm_time_queue.size() > 0) {
-          BPSCommTime* ret = _part_comm_time_queue.front();
-          if (!first)
-            file << ",\n";
-          else
-            first = false;
-          BytePSGlobal::EmitTrace(&file, ret, ctxt);
-          _part_comm_time_queue.pop();
-        }
-        type2part_comm_time.erase(type);
-      }
-      // if the unordered_map becomes empty, all the traces of this part_id has
-      // been read, delete this part_id
-      ctxt->part_comm_time.erase(part_id);
+      _trace_dir + "/" + std::to_string(_local_rank) + "/comm.bin";
+  std::unordered_map<uint64_t, std::string> names;
+  {
+    std::lock_guard<std::mutex> lock(_context_mutex);
+    for (auto& it : _name_to_cxt) {
+      names[it.second.declared_key] = it.first;
     }
   }
-  file << "\n" << std::endl;
-  file << "    ]," << std::endl;
-  file << "    \"displayTimeUnit\": \"ms\"" << std::endl;
-  file << "}" << std::endl;
-  // BPS_LOG(TRACE) << "Communication traces output done!";
-  std::cout << "Local rank " << _local_rank
-            << ": communication traces output done!" << std::endl;
+  if (_is_trace == 1 && Tracer::Wrapped()) {
+    BPS_LOG(WARNING) << "Traces of the early steps were overwritten, "
+                     << "raise BYTEPS_TRACE_RING_RECORDS to keep them";
+  }
+  auto records = Tracer::Dump(trace_path, _local_rank, LogStrings, names);
+  BPS_LOG(INFO) << "Local rank " << _local_rank << ": " << records
+                << " trace records written to " << trace_path;
+  return records;
 }
 
 uint64_t BytePSGlobal::Hash_Naive(uint64_t key) {
@@ -527,6 +683,69 @@ uint64_t BytePSGlobal::Hash_SDBM(uint64_t key) {
   return hash;
 }
 
+// With "balanced", the placement must not depend on the order in which the
+// tensors are initialized, which differs between workers as they are
+// initialized on several threads. The partitions planned by
+// PlanKeyPlacement() go where it put them. Any other tensor has its
+// partitions on consecutive servers, from the one its first key hashes to,
+// so that a huge tensor is spread over all of them. Called with
+// _encode_mutex held.
+int BytePSGlobal::PlaceKey(uint64_t key, int num_servers) {
+  if (_key_placement == "balanced") {
+    auto it = _planned_server.find(key);
+    if (it != _planned_server.end()) {
+      return it->second;
+    }
+    uint64_t part = key & 0xffff;
+    return (HashKey(key - part, num_servers) + part) % num_servers;
+  }
+  return HashKey(key, num_servers);
+}
+
+int BytePSGlobal::HashKey(uint64_t key, int num_servers) {
+  // send it to a single random picked server
+  if (!_hash_knob.compare(std::string("naive"))) {
+    return Hash_Naive(key) % num_servers;
+  } else if (!_hash_knob.compare(std::string("built_in"))) {
+    return Hash_BuiltIn(key) % num_servers;
+  } else if (!_hash_knob.compare(std::string("djb2"))) {
+    return Hash_DJB2(key) % num_servers;
+  } else if (!_hash_knob.compare(std::string("sdbm"))) {
+    return Hash_SDBM(key) % num_servers;
+  }
+  BPS_CHECK(0) << "Unsupported BYTEPS_KEY_HASH_FN, "
+               << "must be one of [naive, built_in, djb2, sdbm]";
+  return 0;
+}
+
+void BytePSGlobal::PlanKeyPlacement(
+    const std::vector<std::pair<uint64_t, size_t>>& parts) {
+  if (_key_placement != "balanced") {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(_encode_mutex);
+  if (_planned_len.empty()) {
+    _planned_len.assign(_server_accumulated_len.size(), 0);
+  }
+  BPS_CHECK(!_planned_len.empty());
+  // every partition to the server with the fewest planned bytes so far, the
+  // lowest rank on ties; keys already placed keep their server
+  for (auto& part : parts) {
+    if (ps_kv_.count(part.first) || _planned_server.count(part.first)) {
+      continue;
+    }
+    int server = std::min_element(_planned_len.begin(), _planned_len.end()) -
+                 _planned_len.begin();
+    _planned_len[server] += part.second;
+    _planned_server[part.first] = server;
+  }
+}
+
+std::unique_ptr<Compressor> BytePSGlobal::CreateCompressor(size_t len) {
+  return Compressor::Create(_compressor_type, len, _compressor_ratio,
+                            _compressor_error_feedback);
+}
+
 PSKV& BytePSGlobal::EncodeDefaultKey(uint64_t key, size_t len) {
   std::lock_guard<std::mutex> lock(_encode_mutex);
   PSKV& pskv = ps_kv_[key];
@@ -537,21 +756,7 @@ PSKV& BytePSGlobal::EncodeDefaultKey(uint64_t key, size_t len) {
     auto krs = ps::Postoffice::Get()->GetServerKeyRanges();
     const int num_servers = krs.size();
     BPS_CHECK_GT(num_servers, 0);
-    // send it to a single random picked server
-    int server;
-    if (!_hash_knob.compare(std::string("naive"))) {
-      server = Hash_Naive(key) % num_servers;
-    } else if (!_hash_knob.compare(std::string("built_in"))) {
-      server = Hash_BuiltIn(key) % num_servers;
-    } else if (!_hash_knob.compare(std::string("djb2"))) {
-      server = Hash_DJB2(key) % num_servers;
-    } else if (!_hash_knob.compare(std::string("sdbm"))) {
-      server = Hash_SDBM(key) % num_servers;
-    } else {
-      BPS_CHECK(0) << "Unsupported BYTEPS_KEY_HASH_FN, "
-                   << "must be one of [naive, built_in, djb2, sdbm]";
-    }
-
+    int server = PlaceKey(key, num_servers);
     _server_accumulated_len[server] += len;
     BPS_LOG(DEBUG) << "key " << key << " assigned to server " << server
                    << ", accumulated workload for this server is "
@@ -561,16 +766,63 @@ PSKV& BytePSGlobal::EncodeDefaultKey(uint64_t key, size_t len) {
     pskv.keys.push_back(ps_key);
     pskv.lens.push_back(len);
     pskv.size = len;
+    pskv.server = server;
   }
   BPS_LOG(TRACE) << "key " << key << " is encoded to " << pskv.keys[0];
   return pskv;
 }
 
+uint32_t BytePSGlobal::GetPartitionBound(size_t size) {
+  if (!_partition_min_bytes) {
+    return _partition_bytes;
+  }
+  // as few partitions as the bound allows, or one per server if they are
+  // still large enough, so that a tensor is pipelined over all servers, also
+  // one that fits in a single partition
+  size_t parts = (size + _partition_bytes - 1) / _partition_bytes;
+  size_t servers = _server_accumulated_len.size();
+  parts = std::max(parts, std::min(servers, size / _partition_min_bytes));
+  // even partitions, the last one is not a small remainder
+  size_t align = 8 * _local_size;
+  size_t bound = (size + parts - 1) / parts;
+  bound = (bound + align - 1) / align * align;
+  return std::min<size_t>(bound, _partition_bytes);
+}
+
+PSKV BytePSGlobal::EncodeSparseKey(uint64_t key, size_t len) {
+  std::lock_guard<std::mutex> lock(_encode_mutex);
+  auto it = ps_kv_.find(key);
+  BPS_CHECK(it != ps_kv_.end()) << "key " << key << " is not initialized";
+  PSKV pskv;
+  pskv.keys = it->second.keys;
+  pskv.lens.push_back(len);
+  pskv.size = len;
+  pskv.server = it->second.server;
+  return pskv;
+}
+
+bool BytePSGlobal::IsColocatedKey(uint64_t key) {
+  std::lock_guard<std::mutex> lock(_encode_mutex);
+  auto it = ps_kv_.find(key);
+  BPS_CHECK(it != ps_kv_.end()) << "key " << key << " is not initialized";
+  auto server = it->second.server;
+  return server < (int)_colocated_servers.size() && _colocated_servers[server];
+}
+
 uint32_t BytePSGlobal::GetTensorCount() {
   std::lock_guard<std::mutex> lock(_context_mutex);
   return BytePSGlobal::_name_to_cxt.size();
 }
 
+std::vector<std::string> BytePSGlobal::GetDeclaredTensorNames() {
+  std::lock_guard<std::mutex> lock(_context_mutex);
+  std::vector<std::string> names;
+  for (auto& it : _name_to_cxt) {
+    names.push_back(it.first);
+  }
+  return names;
+}
+
 cudaStream_t* BytePSGlobal::GetCopyDevice2HostStream() {
   return BytePSGlobal::_copy_device2host_stream;
 }
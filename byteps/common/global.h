@@ -27,13 +27,19 @@
 
 #include "common.h"
 #include "communicator.h"
+#include "compressor.h"
+#include "cpu_affinity.h"
 #include "cpu_reducer.h"
+#include "fusion.h"
 #include "logging.h"
+#include "metrics.h"
 #include "nccl_manager.h"
+#include "prophet_plan.h"
 #include "ps/ps.h"
 #include "ready_table.h"
 #include "scheduled_queue.h"
 #include "shared_memory.h"
+#include "tracer.h"
 
 namespace byteps {
 namespace common {
@@ -42,6 +48,7 @@ struct PSKV {
   ps::SArray<ps::Key> keys;  // n keys
   ps::SArray<int> lens;      // the length of the i-th value
   int size;
+  int server;  // the rank of the server the keys are placed on
 };
 
 typedef void (*LoopFunction)();
@@ -60,6 +67,11 @@ class BytePSGlobal {
   static int GetLocalSize() { return _local_size; }
   static int GetWorkerID() { return _worker_id; }
   static int GetNumWorker() { return _num_worker; }
+  // After a resize, with |num_worker| workers of GetLocalSize() ranks each
+  static void SetNumWorker(int num_worker) {
+    _num_worker = num_worker;
+    _size = num_worker * _local_size;
+  }
   static int GetPcieSwitchSize() { return _nccl_manager->GetSize(); }
   static int GetPcieSwitchIndex() {
     return _local_rank / _nccl_manager->GetSize();
@@ -80,20 +92,51 @@ class BytePSGlobal {
   static void CreateScheduledQueue(QueueType queueType);
   static ps::KVWorker<char>* GetPS() { return _ps; }
   static ps::KVWorker<char>* GetOrInitPS();
+  // The partitions are striped by key over BYTEPS_PS_LANES ps-lite workers,
+  // each with its own response thread, and as many push and pull threads
+  // take the tasks in the order of their queues. The first lane is GetPS().
+  static int GetPSLaneNum() { return _ps_lane_num; }
+  static ps::KVWorker<char>* GetPS(uint64_t key) {
+    return _ps_lanes[(key + (key >> 16)) % _ps_lanes.size()];
+  }
 
   static bool IsTensorDeclared(const std::string& name);
   static ps::Key GetKeyFromName(const std::string& name);
   static BPSContext& GetContextFromName(const std::string& name);
   static uint32_t GetTensorCount();
+  static std::vector<std::string> GetDeclaredTensorNames();
 
   static std::vector<unsigned long> _server_accumulated_len;
   static std::unordered_map<uint64_t, PSKV> ps_kv_;
   static PSKV& EncodeDefaultKey(uint64_t key, size_t len);
+  // With BYTEPS_KEY_PLACEMENT=balanced, bin-pack the partitions (key, bytes)
+  // over the servers in the order given, which must be the same on all
+  // workers. Keys already placed are left alone.
+  static void PlanKeyPlacement(
+      const std::vector<std::pair<uint64_t, size_t>>& parts);
+  // The keys of EncodeDefaultKey(), which placed the dense partition, with
+  // the length of one row-sparse or co-located push
+  static PSKV EncodeSparseKey(uint64_t key, size_t len);
+  // Whether the server EncodeDefaultKey() placed |key| on runs on this host
+  // with BYTEPS_SERVER_COLOCATED, see colocated.h
+  static bool IsColocatedKey(uint64_t key);
 
   static uint32_t GetPartitionBound() { return _partition_bytes; }
-
+  // Partition size of a tensor of |size| bytes. With
+  // BYTEPS_PARTITION_MIN_BYTES set, a tensor is cut into even partitions, at
+  // least one per server as long as they keep that size; otherwise it is
+  // GetPartitionBound(). The same on every worker and local rank.
+  static uint32_t GetPartitionBound(size_t size);
+  static uint32_t GetPartitionMinBytes() { return _partition_min_bytes; }
+  static uint32_t GetQueueSpinMicros() { return _queue_spin_us; }
+  static uint32_t GetQueueParkMicros() { return _queue_park_us; }
+
+  // GetCopyStreamNum() streams each, shared round-robin by the copies in
+  // flight, at most GetCopyPipelineDepth() per direction
   static cudaStream_t* GetCopyDevice2HostStream();
   static cudaStream_t* GetCopyHost2DeviceStream();
+  static int GetCopyStreamNum() { return _copy_stream_num; }
+  static int GetCopyPipelineDepth() { return _copy_pipeline_depth; }
 
   // methods to access or modify the _ready_table
   static ReadyTable* GetReduceTable() { return _reduce_table; }
@@ -104,6 +147,17 @@ class BytePSGlobal {
 
   // reduce strategies
   static bool IsUsingReduce() { return _is_using_reduce; }
+  // Push and pull GPU tensors straight from the GPU buffer of the root device
+  static bool IsGpuDirect() { return _is_gpu_direct; }
+  // Push and pull CPU tensors straight from the framework buffers
+  static bool IsCpuDirect() { return _is_cpu_direct; }
+  // Compress the pushes and pulls of float32 tensors of at least
+  // GetCompressorMinBytes(), with the BYTEPS_COMPRESSOR_* settings
+  static bool IsCompressing() {
+    return _compressor_type != CompressorType::kNone;
+  }
+  static size_t GetCompressorMinBytes() { return _compressor_min_bytes; }
+  static std::unique_ptr<Compressor> CreateCompressor(size_t len);
   static int GetReduceRootByKey(ps::Key k) {
     return _reduce_roots[Hash_DJB2(k) % _reduce_roots.size()];
   }
@@ -111,16 +165,24 @@ class BytePSGlobal {
   // for non-root
   static ReadyTable* GetCopyTable() { return _copy_table; }
 
-  static int pushsize[20];
   static std::shared_ptr<NcclManager> GetNccl() { return _nccl_manager; }
   static std::shared_ptr<CpuReducer> GetCpuReducer() { return _cpu_reducer; }
+  static std::shared_ptr<ProphetPlan> GetProphetPlan() { return _prophet_plan; }
+  // nullptr unless BYTEPS_FUSION_THRESHOLD is set
+  static std::shared_ptr<FusionManager> GetFusion() { return _fusion; }
+  // nullptr if BYTEPS_METRICS_ON=0
+  static std::shared_ptr<Metrics> GetMetrics() { return _metrics; }
 
   static bool IsTensorSampled(uint64_t key) { return (key == _sample_key); }
 
   static void SetProfileFlag(BPSContext* ctxt);
-  static void EmitTrace(std::ostream* os, const BPSCommTime* ret,
-                        BPSContext* ctxt);
-  static void OutputTraces();
+  // With BYTEPS_TRACE_ON=2 every push_pull is traced, otherwise those of
+  // the steps between BYTEPS_TRACE_START_STEP and BYTEPS_TRACE_END_STEP
+  static bool ShouldTrace(const BPSContext* ctxt) {
+    return _is_trace == 2 || ctxt->profile_flag;
+  }
+  // Write the traces to BYTEPS_TRACE_DIR/<local_rank>/comm.bin
+  static int64_t DumpTraces();
   static bool IsAllTensorOutput(const std::string& name);
   static void Who2beOutput(const std::string& name);
 
@@ -153,6 +215,10 @@ class BytePSGlobal {
   static std::mutex _context_mutex;
 
   static ps::KVWorker<char>* _ps;
+  static int _ps_lane_num;
+  static std::vector<ps::KVWorker<char>*> _ps_lanes;
+  // by server rank, whether it is co-located with this worker
+  static std::vector<bool> _colocated_servers;
   static std::mutex _encode_mutex;
   static std::unordered_map<std::string, BPSContext> _name_to_cxt;
 
@@ -165,8 +231,13 @@ class BytePSGlobal {
 
   static cudaStream_t* _copy_device2host_stream;
   static cudaStream_t* _copy_host2device_stream;
+  static int _copy_stream_num;
+  static int _copy_pipeline_depth;
 
   static uint32_t _partition_bytes;
+  static uint32_t _partition_min_bytes;
+  static uint32_t _queue_spin_us;
+  static uint32_t _queue_park_us;
 
   // (key, ready_signal_count) pair, only valid for root device
   static ReadyTable* _reduce_table;
@@ -180,10 +251,24 @@ class BytePSGlobal {
 
   // for reduce strategies
   static bool _is_using_reduce;
+  static bool _is_gpu_direct;
+  static bool _is_cpu_direct;
   static std::vector<int> _reduce_roots;
 
+  // compression of pushes and pulls
+  static CompressorType _compressor_type;
+  static double _compressor_ratio;
+  static bool _compressor_error_feedback;
+  static size_t _compressor_min_bytes;
+
   static std::shared_ptr<NcclManager> _nccl_manager;
+  // BYTEPS_THREAD_AFFINITY, nullptr when the threads are not pinned
+  static std::shared_ptr<CpuAffinity> _cpu_affinity;
+  static void RunLoop(LoopFunction func, int slot);
   static std::shared_ptr<CpuReducer> _cpu_reducer;
+  static std::shared_ptr<ProphetPlan> _prophet_plan;
+  static std::shared_ptr<Metrics> _metrics;
+  static std::shared_ptr<FusionManager> _fusion;
 
   // for debug sampling
   static uint64_t _sample_key;
@@ -192,6 +277,15 @@ class BytePSGlobal {
     return input / alignment * alignment;
   }
 
+  // key placement, "hash" or "balanced"
+  static std::string _key_placement;
+  static int PlaceKey(uint64_t key, int num_servers);
+  static int HashKey(uint64_t key, int num_servers);
+  // "balanced": the servers of the keys of PlanKeyPlacement(), and the bytes
+  // it put on each server
+  static std::unordered_map<uint64_t, int> _planned_server;
+  static std::vector<unsigned long> _planned_len;
+
   // hash functions
   static std::string _hash_knob;
   static std::hash<std::string> _built_in_hash_fn;
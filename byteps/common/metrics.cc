@@ -0,0 +1,143 @@
+// Copyright 2019 Bytedance Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+#include "metrics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+#include "global.h"
+
+namespace byteps {
+namespace common {
+
+int LatencyHistogram::BucketOf(uint64_t ns) {
+  if (ns < (1u << kSubBits)) return ns;
+  int shift = 63 - __builtin_clzll(ns) - kSubBits;
+  return ((shift + 1) << kSubBits) |
+         ((ns >> shift) & ((1u << kSubBits) - 1));
+}
+
+uint64_t LatencyHistogram::BucketEnd(int bucket) {
+  if (bucket < (1 << kSubBits)) return bucket;
+  int shift = (bucket >> kSubBits) - 1;
+  uint64_t sub = (1u << kSubBits) | (bucket & ((1u << kSubBits) - 1));
+  return (sub << shift) + ((1ull << shift) - 1);
+}
+
+void LatencyHistogram::Record(uint64_t ns) {
+  _buckets[BucketOf(ns)].fetch_add(1, std::memory_order_relaxed);
+  _count.fetch_add(1, std::memory_order_relaxed);
+  _sum.fetch_add(ns, std::memory_order_relaxed);
+  auto max = _max.load(std::memory_order_relaxed);
+  while (ns > max && !_max.compare_exchange_weak(max, ns,
+                                                 std::memory_order_relaxed)) {
+  }
+}
+
+uint64_t LatencyHistogram::Percentile(double q) const {
+  auto count = Count();
+  if (!count) return 0;
+  auto target = std::max<uint64_t>(1, std::ceil(q * count));
+  uint64_t seen = 0;
+  for (int i = 0; i < kNumBuckets; ++i) {
+    seen += _buckets[i].load(std::memory_order_relaxed);
+    if (seen >= target) {
+      return std::min(BucketEnd(i), _max.load(std::memory_order_relaxed));
+    }
+  }
+  return _max.load(std::memory_order_relaxed);
+}
+
+std::string LatencyHistogram::ToJson() const {
+  auto count = Count();
+  std::ostringstream ss;
+  ss << "{\"count\":" << count << ",\"mean\":"
+     << (count ? _sum.load(std::memory_order_relaxed) / count : 0)
+     << ",\"p50\":" << Percentile(0.5) << ",\"p90\":" << Percentile(0.9)
+     << ",\"p99\":" << Percentile(0.99)
+     << ",\"max\":" << _max.load(std::memory_order_relaxed) << "}";
+  return ss.str();
+}
+
+void TransferMetrics::Record(uint64_t len, uint64_t start_ns,
+                             uint64_t end_ns) {
+  count.fetch_add(1, std::memory_order_relaxed);
+  bytes.fetch_add(len, std::memory_order_relaxed);
+  latency.Record(end_ns - start_ns);
+}
+
+namespace {
+
+std::string TransferJson(const TransferMetrics& m) {
+  std::ostringstream ss;
+  ss << "{\"count\":" << m.count.load(std::memory_order_relaxed)
+     << ",\"bytes\":" << m.bytes.load(std::memory_order_relaxed)
+     << ",\"latency_ns\":" << m.latency.ToJson() << "}";
+  return ss.str();
+}
+
+}  // namespace
+
+std::string Metrics::Collect() {
+  std::ostringstream ss;
+  ss << std::boolalpha << "{\"now_ns\":" << Tracer::Now()
+     << ",\"queues\":{";
+  bool first = true;
+  for (int i = 0; i < QueueNum; ++i) {
+    auto type = static_cast<QueueType>(i);
+    auto q = BytePSGlobal::GetScheduledQueue(type);
+    if (!q) continue;
+    auto& m = _queues[i];
+    auto taken = m.taken.load(std::memory_order_relaxed);
+    auto finished = m.finished.load(std::memory_order_relaxed);
+    ss << (first ? "" : ",") << "\"" << LogStrings[i] << "\":{"
+       << "\"pending\":" << q->pendingSize()
+       << ",\"in_flight\":" << (taken > finished ? taken - finished : 0)
+       << ",\"credit_window\":" << q->getCreditWindow()
+       << ",\"credit_in_flight\":" << q->getCreditInflight()
+       << ",\"added\":" << m.added.load(std::memory_order_relaxed)
+       << ",\"finished\":" << finished
+       << ",\"bytes\":" << m.bytes.load(std::memory_order_relaxed)
+       << ",\"wait_ns\":" << m.wait.ToJson()
+       << ",\"service_ns\":" << m.service.ToJson() << "}";
+    first = false;
+  }
+  ss << "},\"push\":" << TransferJson(_push)
+     << ",\"pull\":" << TransferJson(_pull);
+
+  auto plan = BytePSGlobal::GetProphetPlan();
+  if (plan) {
+    auto stats = plan->GetStats();
+    ss << ",\"prophet\":{\"enabled\":" << stats.enabled
+       << ",\"profiling\":" << stats.profiling
+       << ",\"blocking\":" << stats.blocking
+       << ",\"stages\":" << stats.stages
+       << ",\"bandwidth\":" << stats.bandwidth
+       << ",\"bandwidth_estimate\":" << stats.bandwidth_estimate
+       << ",\"iterations\":" << stats.iterations
+       << ",\"blocks\":" << stats.blocks << ",\"block_end\":[";
+    for (size_t i = 0; i < stats.block_end.size(); ++i) {
+      ss << (i ? "," : "") << stats.block_end[i];
+    }
+    ss << "]}";
+  }
+  ss << "}";
+  return ss.str();
+}
+
+}  // namespace common
+}  // namespace byteps
@@ -0,0 +1,96 @@
+// Copyright 2019 Bytedance Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+#ifndef BYTEPS_METRICS_H
+#define BYTEPS_METRICS_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+#include "common.h"
+
+namespace byteps {
+namespace common {
+
+// Latency histogram in the style of HdrHistogram: a bucket per power of 2 of
+// nanoseconds, split in 8 linear sub-buckets, so that a percentile is within
+// 12.5% of the real value. Record() is one relaxed atomic add per counter.
+class LatencyHistogram {
+ public:
+  void Record(uint64_t ns);
+  uint64_t Count() const { return _count.load(std::memory_order_relaxed); }
+  // upper bound of the bucket holding the |q| quantile, 0 if empty
+  uint64_t Percentile(double q) const;
+  // {"count":..,"mean":..,"p50":..,"p90":..,"p99":..,"max":..}
+  std::string ToJson() const;
+
+ private:
+  static const int kSubBits = 3;
+  static const int kNumBuckets = (64 - kSubBits + 1) << kSubBits;
+
+  static int BucketOf(uint64_t ns);
+  static uint64_t BucketEnd(int bucket);
+
+  std::atomic<uint64_t> _buckets[kNumBuckets] = {};
+  std::atomic<uint64_t> _count{0};
+  std::atomic<uint64_t> _sum{0};
+  std::atomic<uint64_t> _max{0};
+};
+
+// Counters of one scheduled queue. The wait is from addTask() to getTask(),
+// the service from getTask() to reportFinish().
+struct QueueMetrics {
+  std::atomic<uint64_t> added{0};
+  std::atomic<uint64_t> taken{0};
+  std::atomic<uint64_t> finished{0};
+  std::atomic<uint64_t> bytes{0};
+  LatencyHistogram wait;
+  LatencyHistogram service;
+};
+
+// ZPush or ZPull requests, from their issue to their callback
+struct TransferMetrics {
+  std::atomic<uint64_t> count{0};
+  std::atomic<uint64_t> bytes{0};
+  LatencyHistogram latency;
+
+  void Record(uint64_t len, uint64_t start_ns, uint64_t end_ns);
+};
+
+// Live metrics of the pipeline, kept by BytePSGlobal when BYTEPS_METRICS_ON
+// is not 0. Collect() reads them without stopping the loops, so counters of
+// different stages may be a few tasks apart.
+class Metrics {
+ public:
+  QueueMetrics& Queue(QueueType type) { return _queues[type]; }
+  TransferMetrics& Push() { return _push; }
+  TransferMetrics& Pull() { return _pull; }
+
+  // A JSON object with the counters, the pending tasks and credit of every
+  // queue, and the state of the Prophet plan
+  std::string Collect();
+
+ private:
+  QueueMetrics _queues[QueueNum];
+  TransferMetrics _push;
+  TransferMetrics _pull;
+};
+
+}  // namespace common
+}  // namespace byteps
+
+#endif  // BYTEPS_METRICS_H
@@ -14,6 +14,11 @@
 // =============================================================================
 
 #include "nccl_manager.h"
+
+#include <cctype>
+#include <fstream>
+#include <numeric>
+
 #include "global.h"
 #include "logging.h"
 
@@ -51,6 +56,71 @@ NcclManager::NcclManager(std::shared_ptr<BytePSComm> comm) {
   return;
 }
 
+bool GetGpuNumaNode(int device, int* node) {
+  char bus_id[32];
+  if (cudaDeviceGetPCIBusId(bus_id, sizeof(bus_id), device) != cudaSuccess) {
+    return false;
+  }
+  std::string id(bus_id);
+  // CUDA may print a domain of 8 digits, sysfs has 4 in lower case
+  if (id.find(':') == 8) id = id.substr(4);
+  for (auto& c : id) c = tolower(c);
+  std::ifstream in("/sys/bus/pci/devices/" + id + "/numa_node");
+  return (bool)(in >> *node);
+}
+
+namespace {
+
+int FindIsland(std::vector<int>& parent, int i) {
+  while (parent[i] != i) i = parent[i] = parent[parent[i]];
+  return i;
+}
+
+}  // namespace
+
+// Two GPUs reduce at full speed if they are connected by NVLink (which is
+// the only peer link with native atomics), or if they are on the same NUMA
+// node: otherwise their traffic crosses the CPU interconnect, like two PCIe
+// switches. Returns the size of the islands of connected GPUs if they are
+// blocks of consecutive local ranks of the same size, and 0 otherwise.
+int NcclManager::DetectPcieSwitchSize(int local_size) {
+  std::vector<int> numa(local_size);
+  for (int i = 0; i < local_size; ++i) {
+    if (!GetGpuNumaNode(i, &numa[i])) return 0;
+  }
+  std::vector<int> parent(local_size);
+  std::iota(parent.begin(), parent.end(), 0);
+  for (int i = 0; i < local_size; ++i) {
+    for (int j = i + 1; j < local_size; ++j) {
+      int nvlink = 0;
+      if (cudaDeviceGetP2PAttribute(&nvlink,
+                                    cudaDevP2PAttrNativeAtomicSupported, i,
+                                    j) != cudaSuccess) {
+        nvlink = 0;
+      }
+      if (nvlink || numa[i] == numa[j]) {
+        parent[FindIsland(parent, j)] = FindIsland(parent, i);
+      }
+    }
+  }
+
+  std::vector<int> count(local_size, 0);
+  for (int i = 0; i < local_size; ++i) ++count[FindIsland(parent, i)];
+  int size = count[FindIsland(parent, 0)];
+  std::string log;
+  for (int i = 0; i < local_size; ++i) {
+    int island = FindIsland(parent, i);
+    log += " " + std::to_string(island);
+    // every block of |size| consecutive ranks must be exactly one island
+    if (count[island] != size ||
+        island != FindIsland(parent, i / size * size)) {
+      size = 0;
+    }
+  }
+  BPS_LOG(DEBUG) << "GPU islands by local rank:" << log;
+  return size;
+}
+
 ncclComm_t NcclManager::GetComm(uint64_t key, QueueType op) {
   return _nccl_comm[key % _nccl_num_rings];
 }
@@ -71,6 +141,32 @@ bool NcclManager::IsSignalRoot() {
   return _signal_comm->getRoot() == BytePSGlobal::GetLocalRank();
 }
 
+#ifdef BYTEPS_NCCL_PREMULSUM
+ncclRedOp_t NcclManager::GetAverageOp(ncclComm_t comm, ncclDataType_t dtype) {
+  std::lock_guard<std::mutex> lock(_average_ops_mutex);
+  auto it = _average_ops.find({comm, dtype});
+  if (it != _average_ops.end()) return it->second;
+  // the scalar is copied by NCCL, it must have the type of the data
+  ncclRedOp_t op;
+  double scale = 1.0 / BytePSGlobal::GetSize();
+  float scale_float = scale;
+  BPS_CHECK(dtype == ncclFloat32 || dtype == ncclFloat64) << dtype;
+  void* scalar = (dtype == ncclFloat32) ? (void*)&scale_float : (void*)&scale;
+  NCCLCHECK(ncclRedOpCreatePreMulSum(&op, scalar, dtype,
+                                     ncclScalarHostImmediate, comm));
+  _average_ops[{comm, dtype}] = op;
+  return op;
+}
+
+void NcclManager::ResetAverageOps() {
+  std::lock_guard<std::mutex> lock(_average_ops_mutex);
+  for (auto& it : _average_ops) {
+    NCCLCHECK(ncclRedOpDestroy(it.second, it.first.first));
+  }
+  _average_ops.clear();
+}
+#endif
+
 void NcclManager::ConstructRings() {
   std::string log_string("Constructing NCCL communicators.");
   auto local_rank = BytePSGlobal::GetLocalRank();
@@ -80,8 +176,7 @@ void NcclManager::ConstructRings() {
     peers.push_back(i);
     log_string = log_string + " " + std::to_string(i);
   }
-  _signal_comm = std::make_shared<BytePSCommSocket>(_global_comm,
-                                                    std::string("nccl"), peers);
+  _signal_comm = CreateComm(_global_comm, std::string("nccl"), peers);
   BPS_LOG(DEBUG) << log_string;
 
   // init and sycn NCCL-reduce-id using out-of-band socket
@@ -127,16 +222,43 @@ void NcclManager::ConstructRings() {
 }
 
 void NcclManager::InitGlobalEnv() {  // init all global env/param here
-  _nccl_group_size =
-      (getenv("BYTEPS_NCCL_GROUP_SIZE") ? atoi(getenv("BYTEPS_NCCL_GROUP_SIZE"))
-                                        : 4);
+  _nccl_group_bytes = (getenv("BYTEPS_NCCL_GROUP_BYTES")
+                           ? atoll(getenv("BYTEPS_NCCL_GROUP_BYTES"))
+                           : 0);
+  // with a byte budget, the number of tasks is only bounded by the signal
+  _nccl_group_size = _nccl_group_bytes ? MAX_GROUP_TASKS / 2 : 4;
+  if (getenv("BYTEPS_NCCL_GROUP_SIZE")) {
+    _nccl_group_size = atoi(getenv("BYTEPS_NCCL_GROUP_SIZE"));
+  }
+  BPS_CHECK_GT(_nccl_group_size, 0);
+  // REDUCE and BROADCAST tasks share the signal of a group
+  BPS_CHECK_LE(_nccl_group_size, MAX_GROUP_TASKS / 2)
+      << "BYTEPS_NCCL_GROUP_SIZE is at most " << MAX_GROUP_TASKS / 2;
+  _nccl_group_wait_us = (getenv("BYTEPS_NCCL_GROUP_WAIT_US")
+                             ? atoi(getenv("BYTEPS_NCCL_GROUP_WAIT_US"))
+                             : 0);
   BPS_LOG(DEBUG) << "nccl_group_size"
-                 << " set to " << _nccl_group_size;
+                 << " set to " << _nccl_group_size
+                 << ", nccl_group_bytes set to " << _nccl_group_bytes
+                 << ", nccl_group_wait_us set to " << _nccl_group_wait_us;
 
-  _nccl_pcie_size = (getenv("BYTEPS_PCIE_SWITCH_SIZE")
-                         ? atoi(getenv("BYTEPS_PCIE_SWITCH_SIZE"))
-                         : 8);
   auto local_size = BytePSGlobal::GetLocalSize();
+  if (getenv("BYTEPS_PCIE_SWITCH_SIZE")) {
+    _nccl_pcie_size = atoi(getenv("BYTEPS_PCIE_SWITCH_SIZE"));
+  } else {
+    // every local rank sees all the GPUs, so they all detect the same size
+    int detected = DetectPcieSwitchSize(local_size);
+    if (detected == 1 && local_size > 1) {
+      // e.g. one GPU per NUMA node: NCCL groups of one GPU would leave all
+      // the reduction to the CPU, which is unlikely to be wanted
+      BPS_LOG(WARNING) << "Detected one GPU per PCIe switch, ignored; set "
+                       << "BYTEPS_PCIE_SWITCH_SIZE=1 if that is right";
+      detected = 0;
+    }
+    _nccl_pcie_size = detected > 1 ? detected : 8;
+    BPS_LOG(DEBUG) << "detected pcie switch size " << detected
+                   << " (0 for unknown)";
+  }
   _nccl_pcie_num = local_size / _nccl_pcie_size;
   if (!_nccl_pcie_num) {
     _nccl_pcie_size = local_size;
@@ -165,13 +287,20 @@ void NcclManager::InitGlobalEnv() {  // init all global env/param here
 }
 
 void NcclManager::EnqueueGroup(std::shared_ptr<NcclGroupEntry> e) {
-  std::lock_guard<std::mutex> lock(_nccl_mutex);
-  _nccl_pipeline.push(e);
+  {
+    std::lock_guard<std::mutex> lock(_nccl_mutex);
+    _nccl_pipeline.push(e);
+  }
+  _nccl_cond.notify_one();
   return;
 }
 
+// Waits at most one park interval, so that the caller can check for shutdown
 std::shared_ptr<NcclGroupEntry> NcclManager::DequeueGroup() {
-  std::lock_guard<std::mutex> lock(_nccl_mutex);
+  std::unique_lock<std::mutex> lock(_nccl_mutex);
+  _nccl_cond.wait_for(
+      lock, std::chrono::microseconds(BytePSGlobal::GetQueueParkMicros()),
+      [this] { return _nccl_pipeline.size() > 0; });
   if (!_nccl_pipeline.size()) {
     return nullptr;
   }
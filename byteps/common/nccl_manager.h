@@ -16,6 +16,8 @@
 #ifndef BYTEPS_NCCL_MANAGER_H
 #define BYTEPS_NCCL_MANAGER_H
 
+#include <condition_variable>
+#include <map>
 #include <memory>
 #include <queue>
 #include <vector>
@@ -23,9 +25,18 @@
 #include "communicator.h"
 #include "scheduled_queue.h"
 
+// ncclRedOpCreatePreMulSum is available since NCCL 2.11
+#if defined(NCCL_VERSION_CODE) && NCCL_VERSION_CODE >= 21100
+#define BYTEPS_NCCL_PREMULSUM 1
+#endif
+
 namespace byteps {
 namespace common {
 
+// The NUMA node of a GPU from sysfs, which is -1 without NUMA. Returns false
+// if sysfs does not list the GPU, e.g. in some containers.
+bool GetGpuNumaNode(int device, int* node);
+
 class NcclGroupEntry {
  public:
   void RecordEvents();
@@ -63,7 +74,12 @@ class NcclManager {
     BPS_LOG(DEBUG) << "Clear NcclManager";
   }
 
+  // A group takes at most GetGroupSize() tasks and GetGroupBytes() bytes
+  // (0 for no limit) per queue, and waits up to GetGroupWaitMicros() after
+  // its first task for more
   int GetGroupSize() { return _nccl_group_size; }
+  size_t GetGroupBytes() { return _nccl_group_bytes; }
+  int GetGroupWaitMicros() { return _nccl_group_wait_us; }
   void EnqueueGroup(std::shared_ptr<NcclGroupEntry> e);
   std::shared_ptr<NcclGroupEntry> DequeueGroup();
 
@@ -76,8 +92,18 @@ class NcclManager {
   std::shared_ptr<BytePSComm> GetSignalComm() { return _signal_comm; }
   bool IsSignalRoot();
 
+#ifdef BYTEPS_NCCL_PREMULSUM
+  // The sum of the inputs multiplied by 1 / BytePSGlobal::GetSize(), created
+  // once per communicator and data type
+  ncclRedOp_t GetAverageOp(ncclComm_t comm, ncclDataType_t dtype);
+  // Destroy them after a resize, no NCCL call may be using them
+  void ResetAverageOps();
+#endif
+
  protected:
   void InitGlobalEnv();
+  // BYTEPS_PCIE_SWITCH_SIZE from the topology of the GPUs, 0 if unknown
+  int DetectPcieSwitchSize(int local_size);
   virtual void ConstructRings();
 
   cudaStream_t* _nccl_stream;
@@ -86,6 +112,8 @@ class NcclManager {
 
   // global user-defined env
   size_t _nccl_group_size;
+  size_t _nccl_group_bytes;
+  int _nccl_group_wait_us;
   size_t _nccl_pcie_size;
   size_t _nccl_pcie_num;
   size_t _nccl_num_rings;
@@ -94,10 +122,16 @@ class NcclManager {
 
   // for pipelining nccl
   std::mutex _nccl_mutex;
+  std::condition_variable _nccl_cond;
   std::queue<std::shared_ptr<NcclGroupEntry>> _nccl_pipeline;
 
   std::shared_ptr<BytePSComm> _signal_comm;
   std::shared_ptr<BytePSComm> _global_comm;
+
+#ifdef BYTEPS_NCCL_PREMULSUM
+  std::mutex _average_ops_mutex;
+  std::map<std::pair<ncclComm_t, ncclDataType_t>, ncclRedOp_t> _average_ops;
+#endif
 };
 
 class NcclManagerExpr : public NcclManager {
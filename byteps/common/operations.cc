@@ -18,13 +18,18 @@
 #include <cuda_runtime.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
 #include <memory>
+#include <mutex>
 #include <thread>
 
 #include "core_loops.h"
 #include "global.h"
 #include "logging.h"
+#include "row_sparse.h"
 
 namespace byteps {
 namespace common {
@@ -37,10 +42,12 @@ void byteps_init() {
   // The order of func does not matter
   std::vector<LoopFunction> func;
 
-  // Push & Pull in distributed mode
+  // Push & Pull in distributed mode, one pull thread per lane
   if (BytePSGlobal::IsDistributed()) {
     if (BytePSGlobal::IsRootDevice()) {
-      func.push_back(PullLoop);
+      for (int i = 0; i < BytePSGlobal::GetPSLaneNum(); ++i) {
+        func.push_back(PullLoop);
+      }
     }
   }
 
@@ -55,8 +62,14 @@ void byteps_init() {
     if (BytePSGlobal::IsRootDevice()) {
       // PUSH can be a real push in distributed mode
       // Or a dummy barrier in cross-pcie-switch mode
-      func.push_back(PushLoop);
+      for (int i = 0; i < BytePSGlobal::GetPSLaneNum(); ++i) {
+        func.push_back(PushLoop);
+      }
       func.push_back(RootCopyHost2DeviceLoop);
+      if (BytePSGlobal::IsCompressing()) {
+        func.push_back(CompressLoop);
+        func.push_back(DecompressLoop);
+      }
     } else {
       func.push_back(CoordinatePushLoop);
       func.push_back(NonRootCopyHost2DeviceLoop);
@@ -64,6 +77,11 @@ void byteps_init() {
     }
   }
 
+  // Fusion of small tensors
+  if (BytePSGlobal::GetFusion()) {
+    func.push_back(FusionLoop);
+  }
+
   // Per-PCIe-switch NCCL calls
   func.push_back(SyncNcclLoop);
   if (BytePSGlobal::GetNccl()->IsSignalRoot()) {
@@ -92,121 +110,182 @@ int byteps_size() { return BytePSGlobal::GetSize(); }
 
 int byteps_local_size() { return BytePSGlobal::GetLocalSize(); }
 
+long long byteps_get_credit_window(const char* queue) {
+  if (!BytePSGlobal::CheckInit().ok()) return -1;
+  for (int i = 0; i < QueueNum; i++) {
+    if (LogStrings[i] == queue) {
+      auto q = BytePSGlobal::GetScheduledQueue(static_cast<QueueType>(i));
+      return q ? q->getCreditWindow() : -1;
+    }
+  }
+  return -1;
+}
+
+long long byteps_dump_traces() {
+  if (!BytePSGlobal::CheckInit().ok()) return -1;
+  return BytePSGlobal::DumpTraces();
+}
+
+long long byteps_get_metrics(char* buf, long long size) {
+  if (!BytePSGlobal::CheckInit().ok()) return -1;
+  auto metrics = BytePSGlobal::GetMetrics();
+  if (!metrics) return -1;
+  auto json = metrics->Collect();
+  if (buf && size > 0) {
+    auto n = std::min<long long>(json.size(), size - 1);
+    memcpy(buf, json.data(), n);
+    buf[n] = 0;
+  }
+  return json.size();
+}
+
+int byteps_resize(int num_workers) {
+  if (!BytePSGlobal::CheckInit().ok()) return -1;
+  ResizeWorkers(num_workers);
+  return 0;
+}
+
 }  // extern "C"
 
 Status CheckInitialized() { return BytePSGlobal::CheckInit(); }
 
-void PartitionTensor(
-    std::shared_ptr<TensorTableEntry> entry,
-    std::vector<std::shared_ptr<TensorTableEntry>> &partitions) {
-  BPS_CHECK(entry->counter_ptr)
-      << entry->tensor_name << " counter pointer is null";
-  auto size = entry->tensor ? entry->tensor->size() : entry->output->size();
-  auto bound = BytePSGlobal::GetPartitionBound();
-  auto accumulated = 0;
-  int i = 0;
+namespace {
+
+// Recycles the entries (and rounds) of the push_pulls enqueued by a thread.
+// An object is reused once the pool holds its only reference, i.e. its
+// partition went through all queues, with the capacity of its strings and
+// vectors, so that a steady-state push_pull does not allocate.
+template <typename T>
+class RecyclePool {
+ public:
+  std::shared_ptr<T> Get() {
+    auto scan = std::min(_objects.size(), kMaxScan);
+    for (size_t n = 0; n < scan; ++n) {
+      auto &obj = _objects[_next];
+      _next = (_next + 1) % _objects.size();
+      if (obj.use_count() == 1) {
+        // pairs with the release of the last other reference
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return obj;
+      }
+    }
+    auto obj = std::make_shared<T>();
+    if (_objects.size() < kMaxObjects) _objects.push_back(obj);
+    return obj;
+  }
 
-  while (accumulated < size) {
-    std::shared_ptr<TensorTableEntry> e(new TensorTableEntry);
-    // will assign the key later, so don't do it now
-    // e->key = entry->key;
-    e->tensor_name = entry->tensor_name + std::string("_") + std::to_string(i);
-    e->context = entry->context;
-    e->ready_event = entry->ready_event;
-    e->device = entry->device;
-    e->priority = entry->priority;
-    e->version = entry->version;
-    e->callback = entry->callback;
-    e->cpubuff = entry->cpubuff;
-    e->gpu_ptr = entry->gpu_ptr;
-    e->pcie_cpubuff = entry->pcie_cpubuff;
-    e->queue_list = entry->queue_list;
-    e->tensor = entry->tensor;
-    e->output = entry->output;
-    e->offset = accumulated;
-    e->len = ((size - accumulated) > bound) ? bound : (size - accumulated);
-    e->counter_ptr = entry->counter_ptr;
-    e->total_partnum = entry->total_partnum;
-
-    accumulated += e->len;
-    ++i;
+ private:
+  // objects are mostly released in the order they were taken
+  static const size_t kMaxScan = 16;
+  static const size_t kMaxObjects = 1 << 16;
+  std::vector<std::shared_ptr<T>> _objects;
+  size_t _next = 0;
+};
 
-    partitions.push_back(e);
-  }
-}
+// bound to the const& of std::min, so they need a definition
+template <typename T>
+const size_t RecyclePool<T>::kMaxScan;
+template <typename T>
+const size_t RecyclePool<T>::kMaxObjects;
+
+thread_local RecyclePool<TensorTableEntry> entry_pool;
+thread_local RecyclePool<PushPullRound> round_pool;
+
+}  // namespace
 
 Status EnqueueTensor(BPSContext &context, std::shared_ptr<Tensor> input,
                      std::shared_ptr<Tensor> output,
                      std::shared_ptr<ReadyEvent> ready_event, const int device,
                      const int priority, const int version,
                      StatusCallback callback,
-                     std::shared_ptr<std::vector<QueueType>> queue_list) {
+                     std::shared_ptr<const std::vector<QueueType>> queue_list,
+                     bool average) {
   if (BytePSGlobal::ShouldShutdown()) {
     return Status::OK();
   }
 
+  // the buckets are reduced without scaling
+  auto fusion = BytePSGlobal::GetFusion();
+  if (fusion && !average &&
+      fusion->Enqueue(context, input, output, ready_event, device, priority,
+                      version, callback, queue_list)) {
+    return Status::OK();
+  }
+
   auto &name = context.tensor_name;
   if (input && output) {
     BPS_CHECK_EQ(input->size(), output->size())
         << name << " output tensor size does not match";
   }
 
-  std::shared_ptr<TensorTableEntry> e(new TensorTableEntry);
-  e->tensor_name = name;
-  e->context = &context;
-  e->tensor = input;
-  e->output = output;
-  e->ready_event = ready_event;
-  e->device = device;
-  e->priority = priority;
-  e->version = version;
-  e->callback = callback;
-  e->cpubuff = context.cpubuff;
-  e->gpu_ptr = context.gpu_ptr;
-  e->pcie_cpubuff = context.pcie_cpubuff;
-  e->queue_list = *queue_list;
-  e->counter_ptr = std::make_shared<std::atomic_int>(0);
-  e->total_partnum = context.key_list.size();
-
-  std::vector<std::shared_ptr<TensorTableEntry>> partitions;
-  PartitionTensor(e, partitions);
+  auto &partitions = context.partitions;
   BPS_CHECK_EQ(context.key_list.size(), partitions.size())
       << name << ": " << context.key_list.size() << ", " << partitions.size();
 
-  if (e->queue_list.size() == 0) {
-    BPS_CHECK(e->tensor_name != "");
-    BPS_LOG(TRACE) << e->tensor_name << ", device=" << e->device
+  if (queue_list->size() == 0) {
+    BPS_CHECK(name != "");
+    BPS_LOG(TRACE) << name << ", device=" << device
                    << " has no queue_list assigned, skipped";
-    e->callback(Status::OK());
+    callback(Status::OK());
     return Status::OK();
   }
 
-  // add for profiling
-  if (context.profile_flag) {
-    auto now = std::chrono::system_clock::now();
-    auto duration = now.time_since_epoch();
-    auto us = std::chrono::duration_cast<std::chrono::microseconds>(duration);
-
-    BPSCommTime *ret = new BPSCommTime;
-    ret->start_t = (long long)(us.count());
-    context.comm_time.push(ret);
-  }
+  auto round = round_pool.Get();
+  round->counter = 0;
+  round->callback = std::move(callback);
+  round->start_ns = BytePSGlobal::ShouldTrace(&context) ? Tracer::Now() : 0;
 
   unsigned int accumulated = 0;
   for (size_t i = 0; i < partitions.size(); ++i) {
-    auto task = partitions[i];
-    task->key = context.key_list[i];  // assign the key now
+    // assign every field, the entry may be recycled
+    auto task = entry_pool.Get();
+    task->tensor_name = partitions[i].name;
+    task->key = context.key_list[i];
+    task->context = &context;
+    task->tensor = input;
+    task->output = output;
+    task->priority = priority;
+    task->version = version;
+    task->root_rank = 0;
+    task->ready_event = ready_event;
+    task->device = device;
+    task->average = average;
+    task->cpubuff = context.cpubuff;
+    task->gpu_ptr = context.gpu_ptr;
+    task->pcie_cpubuff = context.pcie_cpubuff;
+    if (!context.compressors.empty()) {
+      task->compressor = context.compressors[i].get();
+      task->compressed = context.compressed_buff[i];
+    } else {
+      task->compressor = nullptr;
+      task->compressed = nullptr;
+    }
+    task->row_sparse =
+        context.row_len ? context.row_sparse_buff[i] : nullptr;
+    task->colocated =
+        (!context.colocated.empty() && context.colocated[i].name[0])
+            ? &context.colocated[i]
+            : nullptr;
+    task->queue_list = queue_list;
+    task->stage = 0;
+    task->queued_ns = 0;
+    task->stage_start_ns = 0;
+    task->offset = partitions[i].offset;
+    task->len = partitions[i].len;
+    task->round = round;
+    task->total_partnum = partitions.size();
+
     BPS_CHECK(task->tensor_name != "");
     BPS_LOG(TRACE) << "EnqueueTensor: " << (task->tensor_name)
                    << ", key=" << (task->key) << ", offset=" << (task->offset)
                    << ", len=" << (task->len) << ", device=" << (task->device)
                    << " rank=" << BytePSGlobal::GetLocalRank();
 
-    BytePSGlobal::GetScheduledQueue(e->queue_list[0])->addTask(task);
+    BytePSGlobal::GetScheduledQueue((*queue_list)[0])->addTask(task);
     accumulated += task->len;
   }
 
-  auto tensor = (e->tensor ? e->tensor : e->output);
+  auto tensor = (input ? input : output);
   BPS_CHECK(tensor);
   BPS_CHECK_EQ(accumulated, tensor->size())
       << "accumulated partition size not equal to original tensor size";
@@ -216,23 +295,38 @@ Status EnqueueTensor(BPSContext &context, std::shared_ptr<Tensor> input,
   return Status::OK();
 }
 
-void InitTensor(BPSContext &context, size_t size, int dtype, void *cpubuff) {
-  std::lock_guard<std::mutex> lock(context.init_mutex);
-  if (context.initialized) {
-    return;
+namespace {
+
+// An init push in flight
+struct InitPush {
+  ps::KVWorker<char> *ps;
+  int ts;
+};
+
+// Cut |context| into its partitions and keys, unless done already, and
+// return the partition bound: the size of all partitions but the last. Called
+// with context.init_mutex held.
+size_t PartitionTensor(BPSContext &context, size_t size, int dtype,
+                       bool gpu_direct) {
+  if (!context.partitions.empty()) {
+    return context.partitions[0].len;
   }
-  CUDA_CALL(cudaSetDevice(BytePSGlobal::GetLocalRank()));
-
-  BPS_CHECK_GT(size, 0) << "init tensor size not larger than 0";
-  // Get metadata
-  auto bound = BytePSGlobal::GetPartitionBound();
+  size_t bound = BytePSGlobal::GetPartitionBound(size);
   auto &name = context.tensor_name;
-  context.buff_len = size;
   size_t accumulated = 0;
 
-  // Add for timeline
-  BytePSGlobal::SetProfileFlag(&context);
-  context.local_rank = BytePSGlobal::GetLocalRank();
+  // Row-sparse tensors are encoded on the host, and partitions keep whole rows
+  if (context.row_elems) {
+    size_t row_len = context.row_elems * getDataTypeLength(dtype);
+    if ((dtype == BYTEPS_FLOAT32 || dtype == BYTEPS_FLOAT64) && !gpu_direct &&
+        !context.server_optimizer && size % row_len == 0) {
+      context.row_len = row_len;
+      bound = std::max<size_t>(bound / row_len, 1) * row_len;
+    } else {
+      BPS_LOG(WARNING) << name << " is pushed dense, row-sparse needs float "
+                       << "data on the host in rows of " << row_len << " bytes";
+    }
+  }
 
   // Total key space is 0 to 2^64 - 1
   // It will be divided to N PS servers, for now we assume N <= 2^16
@@ -241,9 +335,14 @@ void InitTensor(BPSContext &context, size_t size, int dtype, void *cpubuff) {
   // Below we support up to 2^16 tensors, and up to 2^16 partitions per tensor
   ps::Key start_key = context.declared_key << 16;
   while (accumulated < size) {
+    TensorPartition part;
+    part.name = name + std::string("_") +
+                std::to_string(context.key_list.size());
+    part.offset = accumulated;
+    part.len = ((size - accumulated) > bound) ? bound : (size - accumulated);
+    context.partitions.push_back(part);
     context.key_list.push_back(start_key++);
-    accumulated +=
-        ((size - accumulated) > bound) ? bound : (size - accumulated);
+    accumulated += part.len;
   }
   BPS_LOG(DEBUG) << name << " partitioned to " << context.key_list.size()
                  << " part(s)"
@@ -251,6 +350,32 @@ void InitTensor(BPSContext &context, size_t size, int dtype, void *cpubuff) {
                  << context.key_list.front() << ", " << context.key_list.back()
                  << "]"
                  << " rank=" << BytePSGlobal::GetLocalRank();
+  return bound;
+}
+
+// All of InitTensor but waiting for the init pushes, which are appended to
+// |pushes|. Called with context.init_mutex held.
+void StartInitTensor(BPSContext &context, size_t size, int dtype,
+                     void *cpubuff, std::vector<InitPush> *pushes) {
+  // pushed from and pulled into the framework buffers, with no GPU work
+  bool cpu_direct = cpubuff && BytePSGlobal::IsCpuDirect();
+  // pushed from and pulled into the GPU buffers
+  bool gpu_direct = !cpubuff && BytePSGlobal::IsGpuDirect();
+  if (!cpu_direct) {
+    CUDA_CALL(cudaSetDevice(BytePSGlobal::GetLocalRank()));
+  }
+
+  BPS_CHECK_GT(size, 0) << "init tensor size not larger than 0";
+  // Get metadata
+  size_t bound = PartitionTensor(context, size, dtype, gpu_direct);
+  auto &name = context.tensor_name;
+  context.buff_len = size;
+  size_t accumulated = 0;
+
+  // Add for timeline
+  BytePSGlobal::SetProfileFlag(&context);
+  context.local_rank = BytePSGlobal::GetLocalRank();
+  context.prophet = BytePSGlobal::GetProphetPlan()->SelectTensor(name, size);
 
   auto key_list = context.key_list;
 
@@ -264,26 +389,78 @@ void InitTensor(BPSContext &context, size_t size, int dtype, void *cpubuff) {
 
   // If cpubuff is not nullptr, the tensor itself is on CPU
   // We need to register with CUDA so that NCCL can work on it
-  if (cpubuff) {
+  if (cpubuff && !cpu_direct) {
     BPS_LOG(DEBUG) << name << " is already on cpu, len=" << size;
     CUDA_CALL(cudaHostRegister(cpubuff, size, cudaHostRegisterMapped));
     CUDA_CALL(cudaHostGetDevicePointer(&(context.gpu_ptr), cpubuff, 0));
   }
 
-  // We always allocate our own cpu buffer
-  // use the first key in key_list as the index
+  // We always allocate our own cpu buffer, unless the tensor is pushed in
+  // place; use the first key in key_list as the index
   auto shm_obj = BytePSGlobal::GetSharedMemoryObj();
-  if (BytePSGlobal::IsCrossPcieSwitch()) {
+  if (cpu_direct) {
+    BPS_LOG(DEBUG) << name << " is pushed and pulled in place, len=" << size;
+  } else if (BytePSGlobal::IsCrossPcieSwitch()) {
     context.pcie_cpubuff = shm_obj->openPcieSharedMemory(key_list[0], size);
     context.cpubuff = context.pcie_cpubuff.back();
   } else {
     context.cpubuff = shm_obj->openSharedMemory(std::string("BytePS_ShM_"),
                                                 key_list[0], size);
   }
-  BPS_LOG(TRACE) << name << ": open shared memory size " << size;
+  if (context.cpubuff) {
+    BPS_LOG(TRACE) << name << ": open shared memory size " << size;
+  }
+
+  // Large float32 tensors are compressed by the root device. Server-optimizer
+  // tensors pull weights, which are not compressed.
+  if (BytePSGlobal::IsCompressing() && BytePSGlobal::IsRootDevice() &&
+      dtype == BYTEPS_FLOAT32 && !context.server_optimizer &&
+      !context.row_len && size >= BytePSGlobal::GetCompressorMinBytes()) {
+    for (accumulated = 0; accumulated < size; accumulated += bound) {
+      std::shared_ptr<Compressor> compressor = BytePSGlobal::CreateCompressor(
+          std::min<size_t>(bound, size - accumulated));
+      auto buff = static_cast<char *>(malloc(compressor->compressed_len()));
+      BPS_CHECK(buff) << name << ": failed to allocate compressed buffer";
+      // the init push carries no values, the server only learns the format
+      compressor->Zero(buff);
+      context.compressors.push_back(compressor);
+      context.compressed_buff.push_back(buff);
+    }
+    BPS_LOG(DEBUG) << name << " is compressed, "
+                   << context.compressors[0]->compressed_len()
+                   << " bytes for the first partition";
+  }
+
+  if (context.row_len && BytePSGlobal::IsRootDevice()) {
+    for (auto &part : context.partitions) {
+      auto buff = static_cast<char *>(
+          malloc(RowSparseCapacity(part.len, context.row_len)));
+      BPS_CHECK(buff) << name << ": failed to allocate row-sparse buffer";
+      context.row_sparse_buff.push_back(buff);
+    }
+    BPS_LOG(DEBUG) << name << " is row-sparse, " << context.row_len
+                   << " bytes per row";
+  }
+
+  if (context.server_optimizer && BytePSGlobal::IsRootDevice()) {
+    // the pushes are summed over the local GPUs
+    uint32_t replicas = BytePSGlobal::GetLocalSize();
+    context.optimizer_init.clear();
+    for (auto &part : context.partitions) {
+      context.optimizer_init.push_back({part.len, replicas, 0});
+    }
+  }
+
+  // Dense partitions pushed from the shared memory can skip the network if
+  // their server is co-located
+  bool shm_pushed = BytePSGlobal::IsDistributed() &&
+                    BytePSGlobal::IsRootDevice() && !cpu_direct &&
+                    !gpu_direct &&
+                    GetRequestType(context) == RequestType::kDefaultPushPull;
+  if (shm_pushed) context.colocated.resize(context.partitions.size());
 
   // Init tensors with BytePS server
-  char *data = const_cast<char *>(static_cast<const char *>(context.cpubuff));
+  char *data = static_cast<char *>(cpu_direct ? cpubuff : context.cpubuff);
   accumulated = 0;
   size_t i = 0;
   while (accumulated < size) {
@@ -292,14 +469,53 @@ void InitTensor(BPSContext &context, size_t size, int dtype, void *cpubuff) {
 
     if (BytePSGlobal::IsDistributed() && BytePSGlobal::IsRootDevice()) {
       auto ps = BytePSGlobal::GetOrInitPS();
-      // encode the key for pskv scattering
-      auto &pskv = BytePSGlobal::EncodeDefaultKey(key, len);
+      char *vals_data = data + accumulated;
+      int vals_len = len;
+      if (!context.compressors.empty()) {
+        vals_data = context.compressed_buff[i];
+        vals_len = context.compressors[i]->compressed_len();
+      }
+      // encode the key for pskv scattering, row-sparse keys are placed by
+      // their dense size
+      auto pskv = BytePSGlobal::EncodeDefaultKey(
+          key, context.row_len ? len : vals_len);
+      if (context.row_len) {
+        // no rows, the server only learns the format
+        vals_data = context.row_sparse_buff[i];
+        vals_len = EncodeRows(data + accumulated, len, context.row_len, {},
+                              vals_data);
+        pskv = BytePSGlobal::EncodeSparseKey(key, vals_len);
+      }
+      if (context.server_optimizer) {
+        // no values either, the first merge sets the weights
+        vals_data = reinterpret_cast<char *>(&context.optimizer_init[i]);
+        vals_len = sizeof(ServerOptimizerHeader);
+        pskv = BytePSGlobal::EncodeSparseKey(key, vals_len);
+      }
       // false means not to delete data when SArray is deleted
-      ps::SArray<char> vals(data + accumulated, len, false);
+      ps::SArray<char> vals(vals_data, vals_len, false);
       // cmd type
-      int cmd = GetCommandType(RequestType::kDefaultPushPull, dtype);
-      // blocking push, also as a global barrirer
-      ps->Wait(ps->ZPush(pskv.keys, vals, pskv.lens, cmd));
+      int cmd = GetCommandType(GetRequestType(context), dtype);
+      if (shm_pushed && BytePSGlobal::IsColocatedKey(key)) {
+        // this and every later push only tell the server where the data is
+        auto &buf = context.colocated[i];
+        std::string shm_name;
+        size_t shm_size, shm_offset;
+        BPS_CHECK(shm_obj->findSegment(data + accumulated, len, &shm_name,
+                                       &shm_size, &shm_offset))
+            << name << " is not in shared memory";
+        BPS_CHECK_LT(shm_name.size(), sizeof(buf.name)) << shm_name;
+        strncpy(buf.name, shm_name.c_str(), sizeof(buf.name));
+        buf.size = shm_size;
+        buf.offset = shm_offset;
+        buf.len = len;
+        vals_data = reinterpret_cast<char *>(&buf);
+        vals_len = sizeof(buf);
+        pskv = BytePSGlobal::EncodeSparseKey(key, vals_len);
+        cmd = GetCommandType(RequestType::kColocatedPushPull, dtype);
+      }
+      // answered once every worker pushed it, also as a global barrier
+      pushes->push_back({ps, ps->ZPush(pskv.keys, vals, pskv.lens, cmd)});
     }
 
     accumulated += len;
@@ -308,11 +524,133 @@ void InitTensor(BPSContext &context, size_t size, int dtype, void *cpubuff) {
 
   BPS_CHECK_EQ(accumulated, size);
   BPS_CHECK_EQ(i, key_list.size());
+}
 
+void FinishInitTensor(BPSContext &context, size_t size) {
   context.initialized = true;
 
-  BPS_LOG(TRACE) << "Finish Init " << name << ", size=" << size
-                 << ", parts=" << key_list.size();
+  BPS_LOG(TRACE) << "Finish Init " << context.tensor_name << ", size=" << size
+                 << ", parts=" << context.key_list.size();
+}
+
+}  // namespace
+
+void InitTensor(BPSContext &context, size_t size, int dtype, void *cpubuff) {
+  std::lock_guard<std::mutex> lock(context.init_mutex);
+  if (context.initialized) {
+    return;
+  }
+  // the partitions are pushed together, and waited for at once
+  std::vector<InitPush> pushes;
+  StartInitTensor(context, size, dtype, cpubuff, &pushes);
+  for (auto &push : pushes) {
+    push.ps->Wait(push.ts);
+  }
+  FinishInitTensor(context, size);
+}
+
+void InitTensors(const std::vector<BPSContext *> &contexts,
+                 const std::vector<size_t> &sizes,
+                 const std::vector<int> &dtypes) {
+  BPS_CHECK_EQ(contexts.size(), sizes.size());
+  BPS_CHECK_EQ(contexts.size(), dtypes.size());
+  // lock in key order, so that two bulk inits cannot deadlock
+  std::vector<size_t> order(contexts.size());
+  for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+  std::sort(order.begin(), order.end(), [&contexts](size_t a, size_t b) {
+    return contexts[a]->declared_key < contexts[b]->declared_key;
+  });
+  std::vector<std::unique_lock<std::mutex>> locks;
+  std::vector<size_t> started;
+  for (auto i : order) {
+    auto &context = *contexts[i];
+    if (!locks.empty() && locks.back().mutex() == &context.init_mutex) {
+      continue;  // listed twice
+    }
+    locks.emplace_back(context.init_mutex);
+    if (context.initialized) continue;
+    started.push_back(i);
+  }
+  // the same tensors in the same order on every worker, so the balanced
+  // placement can bin-pack them
+  std::vector<std::pair<uint64_t, size_t>> parts;
+  for (auto i : started) {
+    auto &context = *contexts[i];
+    PartitionTensor(context, sizes[i], dtypes[i], BytePSGlobal::IsGpuDirect());
+    for (size_t j = 0; j < context.key_list.size(); ++j) {
+      parts.emplace_back(context.key_list[j], context.partitions[j].len);
+    }
+  }
+  BytePSGlobal::PlanKeyPlacement(parts);
+  std::vector<InitPush> pushes;
+  for (auto i : started) {
+    StartInitTensor(*contexts[i], sizes[i], dtypes[i], nullptr, &pushes);
+  }
+  BPS_LOG(DEBUG) << "Bulk init of " << started.size() << " tensors, "
+                 << pushes.size() << " init pushes";
+  for (auto &push : pushes) {
+    push.ps->Wait(push.ts);
+  }
+  for (auto i : started) {
+    FinishInitTensor(*contexts[i], sizes[i]);
+  }
+  // all the tensors listed, also those initialized before, so that the
+  // buckets do not depend on which inits got in first
+  if (auto fusion = BytePSGlobal::GetFusion()) {
+    fusion->Plan(contexts, sizes, dtypes);
+  }
+}
+
+namespace {
+
+class InitWorkerPool {
+ public:
+  explicit InitWorkerPool(int threads) {
+    for (int i = 0; i < threads; ++i) {
+      _threads.emplace_back(&InitWorkerPool::Loop, this);
+    }
+  }
+
+  void Run(std::function<void()> task) {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _tasks.push_back(std::move(task));
+    }
+    _cv.notify_one();
+  }
+
+ private:
+  void Loop() {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv.wait(lock, [this] { return !_tasks.empty(); });
+        task = std::move(_tasks.front());
+        _tasks.pop_front();
+      }
+      task();
+    }
+  }
+
+  std::mutex _mutex;
+  std::condition_variable _cv;
+  std::deque<std::function<void()>> _tasks;
+  std::vector<std::thread> _threads;
+};
+
+}  // namespace
+
+void RunInitTask(std::function<void()> task) {
+  // never destroyed, its threads may be blocked in an init push at exit
+  static InitWorkerPool *pool = [] {
+    int threads = getenv("BYTEPS_INIT_THREADS")
+                      ? atoi(getenv("BYTEPS_INIT_THREADS"))
+                      : 4;
+    BPS_CHECK_GT(threads, 0);
+    return new InitWorkerPool(threads);
+  }();
+  pool->Run(std::move(task));
 }
 
 BPSContext &GetContextFromName(const std::string &name) {
@@ -323,9 +661,92 @@ bool IsTensorDeclared(const std::string &name) {
   return BytePSGlobal::IsTensorDeclared(name);
 }
 
+void DeclareProphetTensor(const std::string &name, bool enabled) {
+  BytePSGlobal::IsTensorDeclared(name);
+  BytePSGlobal::GetProphetPlan()->RegisterTensor(name, enabled);
+}
+
+void SetBackwardPassesPerStep(int passes) {
+  BPS_CHECK_GT(passes, 0) << "backward_passes_per_step must be positive";
+  BytePSGlobal::GetProphetPlan()->SetBackwardPasses(passes);
+}
+
+void ResizeWorkers(int num_workers) {
+  BPS_CHECK(BytePSGlobal::IsDistributed()) << "resize needs a distributed job";
+  BPS_CHECK_GT(num_workers, 0) << "the number of workers must be positive";
+  int old_workers = BytePSGlobal::GetNumWorker();
+  if (num_workers == old_workers) return;
+  if (BytePSGlobal::IsRootDevice()) {
+    // every server answers once all the workers that stay asked, at most
+    // ps::NumWorkers(), which ps-lite started with
+    auto krs = ps::Postoffice::Get()->GetServerKeyRanges();
+    int32_t workers = num_workers;
+    int cmd = GetCommandType(RequestType::kDefaultPushPull, BYTEPS_INT32);
+    std::vector<InitPush> pushes;
+    for (auto &kr : krs) {
+      ps::SArray<ps::Key> keys(1, kr.begin() + kResizeKey);
+      ps::SArray<char> vals(reinterpret_cast<char *>(&workers),
+                            sizeof(workers), false);
+      ps::SArray<int> lens(1, sizeof(workers));
+      auto ps = BytePSGlobal::GetOrInitPS();
+      pushes.push_back({ps, ps->ZPush(keys, vals, lens, cmd)});
+    }
+    for (auto &push : pushes) push.ps->Wait(push.ts);
+  }
+  BytePSGlobal::SetNumWorker(num_workers);
+#ifdef BYTEPS_NCCL_PREMULSUM
+  // the fused average divides by the old size
+  BytePSGlobal::GetNccl()->ResetAverageOps();
+#endif
+  BytePSGlobal::GetProphetPlan()->Rescale(old_workers, num_workers);
+  BPS_LOG(INFO) << "Resized from " << old_workers << " to " << num_workers
+                << " workers, rank=" << BytePSGlobal::GetRank();
+}
+
+bool CanFuseAverage(BPSContext &context, int device, int dtype) {
+#ifdef BYTEPS_NCCL_PREMULSUM
+  if (context.server_optimizer) return false;
+  // the scale is applied by the NCCL reduce, which a group of one GPU skips
+  auto nccl = BytePSGlobal::GetNccl();
+  if (!nccl || nccl->GetSize() <= 1) return false;
+  if (BytePSGlobal::IsCpuDirect() && device == CPU_DEVICE_ID) return false;
+  auto fusion = BytePSGlobal::GetFusion();
+  if (fusion && fusion->IsMember(context)) return false;
+  return dtype == BYTEPS_FLOAT32 || dtype == BYTEPS_FLOAT64;
+#else
+  return false;
+#endif
+}
+
+void DeclareServerOptimizerTensor(const std::string &name) {
+  BytePSGlobal::IsTensorDeclared(name);
+  auto &context = BytePSGlobal::GetContextFromName(name);
+  BPS_CHECK(!context.initialized)
+      << name << " is initialized, declare it for the server optimizer first";
+  context.server_optimizer = true;
+}
+
+void DeclareRowSparseTensor(const std::string &name, size_t row_elems) {
+  BytePSGlobal::IsTensorDeclared(name);
+  auto &context = BytePSGlobal::GetContextFromName(name);
+  BPS_CHECK(!context.initialized)
+      << name << " is initialized, declare it row-sparse first";
+  BPS_CHECK_GT(row_elems, 0) << name;
+  context.row_elems = row_elems;
+}
+
 std::shared_ptr<std::vector<QueueType>> GetPushQueueList(int device) {
   auto queue_list = std::make_shared<std::vector<QueueType>>();
 
+  // CPU tensors of a worker alone on its machine go straight to the servers
+  if (BytePSGlobal::IsCpuDirect() && device == CPU_DEVICE_ID) {
+    if (BytePSGlobal::IsCompressing()) {
+      queue_list->push_back(COMPRESS);
+    }
+    queue_list->push_back(PUSH);
+    return queue_list;
+  }
+
   // Per-PCIe-switch NCCL reduce
   if (BytePSGlobal::GetNccl()->IsSignalRoot()) {
     queue_list->push_back(REDUCE);
@@ -334,8 +755,10 @@ std::shared_ptr<std::vector<QueueType>> GetPushQueueList(int device) {
     queue_list->push_back(REDUCE);
   }
 
-  // Copy from GPU to CPU
-  if (BytePSGlobal::IsDistributed() || BytePSGlobal::IsCrossPcieSwitch()) {
+  // Copy from GPU to CPU, unless the root device pushes its GPU buffer
+  bool gpu_direct = BytePSGlobal::IsGpuDirect() && device != CPU_DEVICE_ID;
+  if ((BytePSGlobal::IsDistributed() || BytePSGlobal::IsCrossPcieSwitch()) &&
+      !gpu_direct) {
     queue_list->push_back(COPYD2H);
   }
 
@@ -348,6 +771,10 @@ std::shared_ptr<std::vector<QueueType>> GetPushQueueList(int device) {
   // In case IsCrossPcieSwitch(), PUSH runs as a dummy barrier
   if (BytePSGlobal::IsDistributed() || BytePSGlobal::IsCrossPcieSwitch()) {
     if (BytePSGlobal::IsRootDevice()) {
+      // tensors that are not compressed pass through
+      if (BytePSGlobal::IsCompressing()) {
+        queue_list->push_back(COMPRESS);
+      }
       queue_list->push_back(PUSH);
     } else {
       queue_list->push_back(COORDINATE_PUSH);
@@ -359,15 +786,28 @@ std::shared_ptr<std::vector<QueueType>> GetPushQueueList(int device) {
 std::shared_ptr<std::vector<QueueType>> GetPullQueueList(int device) {
   auto queue_list = std::make_shared<std::vector<QueueType>>();
 
+  if (BytePSGlobal::IsCpuDirect() && device == CPU_DEVICE_ID) {
+    queue_list->push_back(PULL);
+    if (BytePSGlobal::IsCompressing()) {
+      queue_list->push_back(DECOMPRESS);
+    }
+    return queue_list;
+  }
+
   // Pull in distributed mode
   if (BytePSGlobal::IsDistributed()) {
     if (BytePSGlobal::IsRootDevice()) {
       queue_list->push_back(PULL);
+      if (BytePSGlobal::IsCompressing()) {
+        queue_list->push_back(DECOMPRESS);
+      }
     }
   }
 
-  // Copy from CPU to GPU
-  if (BytePSGlobal::IsDistributed() || BytePSGlobal::IsCrossPcieSwitch()) {
+  // Copy from CPU to GPU, unless the root device pulls into its GPU buffer
+  bool gpu_direct = BytePSGlobal::IsGpuDirect() && device != CPU_DEVICE_ID;
+  if ((BytePSGlobal::IsDistributed() || BytePSGlobal::IsCrossPcieSwitch()) &&
+      !gpu_direct) {
     queue_list->push_back(COPYH2D);
   }
 
@@ -381,5 +821,21 @@ std::shared_ptr<std::vector<QueueType>> GetPullQueueList(int device) {
   return queue_list;
 }
 
+std::shared_ptr<const std::vector<QueueType>> GetPushPullQueueList(
+    int device) {
+  // the lists only depend on whether the tensor is on CPU
+  static std::once_flag once[2];
+  static std::shared_ptr<const std::vector<QueueType>> lists[2];
+  int i = (device == CPU_DEVICE_ID) ? 0 : 1;
+  std::call_once(once[i], [device, i]() {
+    auto queue_list = GetPushQueueList(device);
+    auto queue_list_pull = GetPullQueueList(device);
+    queue_list->insert(queue_list->end(), queue_list_pull->begin(),
+                       queue_list_pull->end());
+    lists[i] = queue_list;
+  });
+  return lists[i];
+}
+
 }  // namespace common
 }  // namespace byteps
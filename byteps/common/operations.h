@@ -49,6 +49,23 @@ int byteps_size();
 // C interface to return number of byteps processes in the node it is on.
 // Returns -1 if byteps is not initialized.
 int byteps_local_size();
+
+// C interface to return the credit window (bytes) of a scheduling queue,
+// e.g. "PUSH". Returns -1 if it is unlimited or BytePS is not initialized.
+long long byteps_get_credit_window(const char* queue);
+
+// C interface to write the traces recorded so far to
+// BYTEPS_TRACE_DIR/<local_rank>/comm.bin. Returns the number of records
+// written, or -1 on error or if BytePS is not initialized.
+long long byteps_dump_traces();
+
+// C interface to write the pipeline metrics as JSON into |buf| of |size|
+// bytes, NUL-terminated and truncated if needed. Returns the length of the
+// whole JSON, or -1 if the metrics are off or BytePS is not initialized.
+long long byteps_get_metrics(char* buf, long long size);
+
+// C interface to ResizeWorkers(). Returns -1 if BytePS is not initialized.
+int byteps_resize(int num_workers);
 }
 
 // Below are all for Framework plugins
@@ -57,19 +74,72 @@ Status EnqueueTensor(BPSContext &context, std::shared_ptr<Tensor> input,
                      std::shared_ptr<ReadyEvent> ready_event, const int device,
                      const int priority, const int version,
                      StatusCallback callback,
-                     std::shared_ptr<std::vector<QueueType>> queue_list);
+                     std::shared_ptr<const std::vector<QueueType>> queue_list,
+                     bool average = false);
+
+// Whether EnqueueTensor can average the push_pull of |context| in its NCCL
+// reduce, by scaling the inputs by 1 / byteps_size(), so that the framework
+// does not divide the output. Needs NCCL 2.11, float32 or float64 and an NCCL
+// group of more than one GPU, as a single GPU skips the reduce; fused,
+// server-optimizer and CPU-direct tensors are left to the framework. Call it
+// after InitTensor.
+bool CanFuseAverage(BPSContext &context, int device, int dtype);
 
 void InitTensor(BPSContext &context, size_t size, int dtype, void *cpubuff);
 
+// InitTensor of several GPU tensors at once, e.g. all the gradients of a
+// model before the first step: the init pushes of all their partitions are
+// issued before waiting for any. Tensors already initialized are not pushed
+// again. With fusion, the buckets are planned from all of them, see fusion.h.
+void InitTensors(const std::vector<BPSContext *> &contexts,
+                 const std::vector<size_t> &sizes,
+                 const std::vector<int> &dtypes);
+
+// Run |task| on the init worker pool: the first push_pull of a tensor blocks
+// in InitTensor on the init push, off the framework thread. The tasks start
+// in order on BYTEPS_INIT_THREADS threads (default 4).
+void RunInitTask(std::function<void()> task);
+
 // Only call these in Framework plugins for the best performance
 bool IsTensorDeclared(const std::string &name);
 
 BPSContext &GetContextFromName(const std::string &name);
 
+// Force Prophet scheduling on or off for a tensor, overriding Z_keyword,
+// Z_REGEX and Z_MIN_BYTES. Call it before the tensor is initialized.
+void DeclareProphetTensor(const std::string &name, bool enabled);
+
+// Let the servers run the optimizer for a float32 tensor: its first push_pull
+// sets the weights, every later one pushes gradients and returns the updated
+// weights. Call it before the tensor is initialized.
+void DeclareServerOptimizerTensor(const std::string &name);
+
+// Push and pull only the rows of a float tensor that are not all zero, e.g.
+// of an embedding gradient, with |row_elems| elements per row. Call it before
+// the tensor is initialized.
+void DeclareRowSparseTensor(const std::string &name, size_t row_elems);
+
+// Tell Prophet how many backward passes the framework accumulates locally
+// between two push_pulls of the same gradients.
+void SetBackwardPassesPerStep(int passes);
+
+// Change the number of workers whose gradients are summed to |num_workers|,
+// at most DMLC_NUM_WORKER, without a restart: every rank of the workers that
+// stay calls it between two iterations, once its push_pulls are done. The
+// tensors keep their keys and buffers, the servers merge |num_workers| pushes
+// from the next one on, and the Prophet plan is rescaled instead of
+// profiled again. Blocks until all the workers that stay called it.
+void ResizeWorkers(int num_workers);
+
 std::shared_ptr<std::vector<QueueType>> GetPushQueueList(int device);
 
 std::shared_ptr<std::vector<QueueType>> GetPullQueueList(int device);
 
+// GetPushQueueList followed by GetPullQueueList, built once and shared by
+// all push_pulls of the same device type
+std::shared_ptr<const std::vector<QueueType>> GetPushPullQueueList(
+    int device);
+
 }  // namespace common
 }  // namespace byteps
 
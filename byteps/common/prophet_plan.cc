@@ -0,0 +1,546 @@
+// Copyright 2019 Bytedance Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+#include "prophet_plan.h"
+
+#include <cuda_runtime.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+#include "credit_controller.h"
+#include "global.h"
+#include "logging.h"
+
+namespace byteps {
+namespace common {
+
+ProphetPlan::ProphetPlan() {
+  // Tensors whose name contains Z_keyword or matches Z_REGEX, and that are at
+  // least Z_MIN_BYTES large, are scheduled by Prophet
+  _keyword = getenv("Z_keyword") ? std::string(getenv("Z_keyword")) : "";
+  if (getenv("Z_REGEX")) {
+    _use_regex = true;
+    _regex = std::regex(getenv("Z_REGEX"));
+  }
+  _min_bytes = getenv("Z_MIN_BYTES") ? atoll(getenv("Z_MIN_BYTES")) : 0;
+  _enabled = _keyword.size() || _use_regex;
+
+  // Z_NET_B is given in Mbps, 1 Mbps = 125 bytes/ms
+  if (getenv("Z_NET_B")) {
+    _fixed_bandwidth = true;
+    _bandwidth = atoll(getenv("Z_NET_B")) * 125;
+  }
+  _credit = getenv("Z_CREDIT")
+                ? atoll(getenv("Z_CREDIT"))
+                : 4 * (long long)BytePSGlobal::GetPartitionBound();
+  _doors = getenv("Z_DOORS") ? atoi(getenv("Z_DOORS")) : 1;
+  _cache_path = getenv("Z_PROFILE_CACHE") ? getenv("Z_PROFILE_CACHE") : "";
+
+  // Stage detection: profile Z_PROFILE_ITERS iterations, and keep a boundary
+  // only if at least Z_STAGE_CONFIDENCE of them show it
+  _profile_iters =
+      getenv("Z_PROFILE_ITERS") ? atoi(getenv("Z_PROFILE_ITERS")) : 3;
+  BPS_CHECK_GE(_profile_iters, 1);
+  _stage_k = getenv("Z_STAGE_K") ? atof(getenv("Z_STAGE_K")) : 3.0;
+  _min_confidence =
+      getenv("Z_STAGE_CONFIDENCE") ? atof(getenv("Z_STAGE_CONFIDENCE")) : 0.6;
+  _pull_credit =
+      getenv("Z_PULL_CREDIT") ? atoll(getenv("Z_PULL_CREDIT")) : _credit;
+
+  // Keep re-estimating the bandwidth after profiling, unless it was given
+  _bw_adaptive = getenv("Z_BW_ADAPTIVE") ? atoi(getenv("Z_BW_ADAPTIVE"))
+                                         : !_fixed_bandwidth;
+  _bw_alpha = getenv("Z_BW_ALPHA") ? atof(getenv("Z_BW_ALPHA")) : 0.1;
+  BPS_CHECK(_bw_alpha > 0 && _bw_alpha <= 1) << "Z_BW_ALPHA must be in (0, 1]";
+  _replan_interval =
+      getenv("Z_REPLAN_INTERVAL") ? atoi(getenv("Z_REPLAN_INTERVAL")) : 1;
+  BPS_CHECK_GE(_replan_interval, 1);
+
+  BPS_LOG(DEBUG) << "Prophet scheduling "
+                 << (_enabled ? "enabled for keyword " + _keyword
+                              : "disabled unless tensors are registered")
+                 << ", bandwidth="
+                 << (_fixed_bandwidth ? std::to_string(_bandwidth)
+                                      : std::string("profiled"))
+                 << " bytes/ms, credit=" << _credit;
+}
+
+long long ProphetPlan::NowMicros() { return SchedulingNowMicros(); }
+
+bool ProphetPlan::IsEnabled() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _enabled;
+}
+
+void ProphetPlan::RegisterTensor(const std::string& name, bool enabled) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _registered[name] = enabled;
+  _enabled = _enabled || enabled;
+  BPS_LOG(DEBUG) << "Prophet scheduling " << (enabled ? "on" : "off")
+                 << " for tensor " << name;
+}
+
+void ProphetPlan::SetBackwardPasses(int passes) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (passes == _backward_passes) return;
+  if (_cache_checked) {
+    BPS_LOG(WARNING) << "Prophet plan already in use, " << passes
+                     << " backward passes per step not in its signature";
+  }
+  _backward_passes = passes;
+  BPS_LOG(DEBUG) << "Prophet: " << passes << " backward passes per step";
+}
+
+void ProphetPlan::Rescale(int old_workers, int new_workers) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  double scale = (double)old_workers / new_workers;
+  if (!_fixed_bandwidth && _bandwidth > 0) {
+    _bandwidth = std::max(1LL, (long long)(_bandwidth * scale));
+  }
+  _bw_estimate *= scale;
+  if (_cache_checked) {
+    _signature = ComputeSignature();
+    if (!_profiling) WriteCache();
+  }
+  BPS_LOG(INFO) << "Prophet plan rescaled from " << old_workers << " to "
+                << new_workers << " workers, bandwidth " << _bandwidth
+                << " bytes/ms";
+}
+
+bool ProphetPlan::SelectTensor(const std::string& name, size_t size) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  auto it = _registered.find(name);
+  if (it != _registered.end()) {
+    return it->second;
+  }
+  bool match = (_keyword.size() && name.find(_keyword) != name.npos) ||
+               (_use_regex && std::regex_search(name, _regex));
+  return match && size >= _min_bytes;
+}
+
+bool ProphetPlan::IsProfiling() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _profiling;
+}
+
+bool ProphetPlan::IsReady() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return !_profiling;
+}
+
+// Bump when the cache format or the meaning of its tables changes
+static const char* kCacheVersion = "prophet-plan-v2";
+
+static uint64_t Fnv1a(const std::string& s,
+                      uint64_t h = 14695981039346656037ULL) {
+  for (unsigned char c : s) {
+    h ^= c;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+std::string ProphetPlan::ComputeSignature() {
+  auto names = BytePSGlobal::GetDeclaredTensorNames();
+  std::sort(names.begin(), names.end());
+  uint64_t h = Fnv1a(kCacheVersion);
+  for (auto& name : names) {
+    auto it = _registered.find(name);
+    bool selected = (_keyword.size() && name.find(_keyword) != name.npos) ||
+                    (_use_regex && std::regex_search(name, _regex));
+    if (it != _registered.end()) {
+      selected = it->second;
+    }
+    if (selected) {
+      h = Fnv1a(name + ";", h);
+    }
+  }
+
+  cudaDeviceProp prop;
+  std::string gpu = "unknown";
+  if (cudaGetDeviceProperties(&prop, BytePSGlobal::GetLocalRank()) ==
+      cudaSuccess) {
+    gpu = prop.name;
+  }
+  std::ostringstream ss;
+  ss << gpu << ";" << BytePSGlobal::GetNumWorker() << ";"
+     << BytePSGlobal::GetPartitionBound() << ";"
+     << (getenv("Z_CACHE_TAG") ? getenv("Z_CACHE_TAG") : "");
+  // Left out by default, so that plans cached before they were added match
+  if (_backward_passes != 1) ss << ";passes=" << _backward_passes;
+  if (BytePSGlobal::GetPartitionMinBytes()) {
+    ss << ";min_partition=" << BytePSGlobal::GetPartitionMinBytes();
+  }
+  h = Fnv1a(ss.str(), h);
+
+  std::ostringstream hex;
+  hex << std::hex << h;
+  return hex.str();
+}
+
+bool ProphetPlan::ReadCache(const std::string& signature) {
+  std::ifstream in(_cache_path);
+  if (!in) return false;
+  std::string version, sig;
+  in >> version >> sig;
+  if (version != kCacheVersion || sig != signature) return false;
+
+  long long bandwidth;
+  int total, count;
+  in >> bandwidth >> total >> count;
+  if (!in || total <= 0 || count <= 0 || count > total) return false;
+  std::vector<bool> known(total, false);
+  for (int i = 0; i < count; i++) {
+    int id;
+    in >> id;
+    if (!in || id < 0 || id >= total) return false;
+    known[id] = true;
+  }
+  int stages;
+  in >> stages;
+  if (!in || stages < 2) return false;
+  std::vector<int> checkpoint(stages);
+  for (auto& c : checkpoint) in >> c;
+  std::vector<double> confidence(stages);
+  for (auto& c : confidence) in >> c;
+  int execs;
+  in >> execs;
+  if (!in || execs < 0) return false;
+  std::vector<double> exec(execs);
+  for (auto& e : exec) in >> e;
+  if (!in) return false;
+
+  _total_grad = total;
+  _known = known;
+  _grad_tic.assign(total, 0);
+  _pushed.assign(total, false);
+  _grad_checkpoint = checkpoint;
+  _checkpoint_confidence = confidence;
+  _blocking = _grad_checkpoint.size() > 2;
+  _backward_exec = exec;
+  _block_end.assign(_grad_checkpoint.size(), -1);
+  if (!_fixed_bandwidth) {
+    _bandwidth = bandwidth;
+  }
+  _bw_estimate = _bandwidth;
+  return true;
+}
+
+void ProphetPlan::WriteCache() {
+  if (_cache_path.empty() || _signature.empty()) return;
+  std::ofstream out(_cache_path, std::ios::trunc);
+  if (!out) {
+    BPS_LOG(INFO) << "Cannot write Prophet profile cache " << _cache_path;
+    return;
+  }
+  out.precision(17);
+  out << kCacheVersion << "\n" << _signature << "\n" << _bandwidth << "\n";
+  std::vector<int> ids;
+  for (int i = 0; i < _total_grad; i++) {
+    if (_known[i]) ids.push_back(i);
+  }
+  out << _total_grad << " " << ids.size() << "\n";
+  for (auto id : ids) out << id << " ";
+  out << "\n" << _grad_checkpoint.size() << "\n";
+  for (auto c : _grad_checkpoint) out << c << " ";
+  out << "\n";
+  for (auto c : _checkpoint_confidence) out << c << " ";
+  out << "\n" << _backward_exec.size() << "\n";
+  for (auto e : _backward_exec) out << e << " ";
+  out << "\n";
+  BPS_LOG(DEBUG) << "Prophet plan saved to " << _cache_path;
+}
+
+void ProphetPlan::LoadCache() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_cache_checked) return;
+  _cache_checked = true;
+  if (_cache_path.empty() || !_profiling) return;
+  // All Prophet tensors are declared by the time the first gradient arrives
+  _signature = ComputeSignature();
+  if (ReadCache(_signature)) {
+    _profiling = false;
+    BPS_LOG(INFO) << "Prophet plan loaded from " << _cache_path << ": "
+                  << _grad_checkpoint.size() - 1 << " stages, bandwidth "
+                  << _bandwidth << " bytes/ms";
+  } else {
+    BPS_LOG(INFO) << "No matching Prophet plan in " << _cache_path
+                  << ", profiling the first iteration";
+  }
+}
+
+void ProphetPlan::RecordGradientReady(int grad_id) {
+  BPS_CHECK_GE(grad_id, 0) << "Prophet expects priority <= 0";
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (!_profiling) return;
+  if (grad_id >= _total_grad) {
+    _total_grad = grad_id + 1;
+    _grad_tic.resize(_total_grad, 0);
+    _pushed.resize(_total_grad, false);
+    _known.resize(_total_grad, false);
+  }
+  // Only the first partition marks the gradient ready
+  if (_grad_tic[grad_id] == 0) {
+    _grad_tic[grad_id] = NowMicros();
+    _ready_count++;
+  }
+}
+
+void ProphetPlan::RecordPushStart(int grad_id, uint64_t key) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (!_profiling && !_bw_adaptive) return;
+  _push_start_tic[key] = NowMicros();
+}
+
+void ProphetPlan::UpdateBandwidth(double sample) {
+  if (_profiling) {
+    if (!_fixed_bandwidth && sample > _bandwidth) {
+      _bandwidth = (long long)sample;
+    }
+  } else if (_bw_estimate <= 0) {
+    _bw_estimate = sample;
+  } else {
+    _bw_estimate = _bw_alpha * sample + (1 - _bw_alpha) * _bw_estimate;
+  }
+}
+
+void ProphetPlan::RecordPushFinish(int grad_id, uint64_t key, size_t len) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  auto it = _push_start_tic.find(key);
+  if (it == _push_start_tic.end()) return;
+  auto start = it->second;
+  _push_start_tic.erase(it);
+
+  // Pushes are pipelined, so a push only owns the link from the moment the
+  // previous one completed
+  auto now = NowMicros();
+  auto t = now - std::max(start, _last_finish);
+  _last_finish = now;
+  if (t > 0) {
+    UpdateBandwidth((double)len * 1000.0 / t);
+  }
+
+  if (!_profiling || grad_id < 0 || grad_id >= _total_grad) return;
+  if (_pushed[grad_id]) return;
+  _pushed[grad_id] = true;
+  _finish_count++;
+
+  // Gradient 0 is the last one produced by backward propagation, so once it
+  // has arrived and everything seen so far is pushed, this run is over
+  if (_grad_tic[0] != 0 && _finish_count == _ready_count) {
+    EndProfileRun();
+  }
+}
+
+void ProphetPlan::Replan() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _total_iterations++;
+  if (_profiling || !_bw_adaptive || _bw_estimate <= 0) return;
+  if (++_iteration % _replan_interval) return;
+  auto old_bandwidth = _bandwidth;
+  _bandwidth = (long long)_bw_estimate;
+  if (std::abs(_bandwidth - old_bandwidth) * 10 > old_bandwidth) {
+    BPS_LOG(DEBUG) << "Prophet re-planned stage budgets, bandwidth "
+                   << old_bandwidth << " -> " << _bandwidth << " bytes/ms";
+  }
+}
+
+static double Median(std::vector<double> v) {
+  if (v.empty()) return 0;
+  auto mid = v.begin() + v.size() / 2;
+  std::nth_element(v.begin(), mid, v.end());
+  if (v.size() % 2) return *mid;
+  return (*mid + *std::max_element(v.begin(), mid)) / 2;
+}
+
+void ProphetPlan::EndProfileRun() {
+  _runs.push_back(_grad_tic);
+  for (int i = 0; i < _total_grad; i++) {
+    if (_grad_tic[i] != 0) _known[i] = true;
+  }
+  _grad_tic.assign(_total_grad, 0);
+  _pushed.assign(_total_grad, false);
+  _ready_count = 0;
+  _finish_count = 0;
+  BPS_LOG(DEBUG) << "Prophet profiling run " << _runs.size() << "/"
+                 << _profile_iters << " done";
+  if ((int)_runs.size() < _profile_iters) return;
+
+  BuildPlan();
+  _runs.clear();
+  _bw_estimate = _bandwidth;
+  _profiling = false;
+}
+
+void ProphetPlan::BuildPlan() {
+  std::vector<int> ids;
+  for (int i = 0; i < _total_grad; i++) {
+    if (_known[i]) ids.push_back(i);
+  }
+
+  // Ready time of each gradient relative to the first one of its run, median
+  // over the runs
+  std::vector<std::vector<double>> rel(_runs.size());
+  for (size_t r = 0; r < _runs.size(); r++) {
+    long long base = 0;
+    for (auto t : _runs[r]) {
+      if (t != 0 && (base == 0 || t < base)) base = t;
+    }
+    rel[r].assign(_total_grad, -1);
+    for (size_t i = 0; i < _runs[r].size(); i++) {
+      if (_runs[r][i] != 0) rel[r][i] = _runs[r][i] - base;
+    }
+  }
+  std::vector<double> tic(_total_grad, 0);
+  for (auto id : ids) {
+    std::vector<double> samples;
+    for (auto& run : rel) {
+      if (run[id] >= 0) samples.push_back(run[id]);
+    }
+    tic[id] = Median(samples);
+  }
+
+  // A gap that is an outlier (robust z-score above Z_STAGE_K, from the median
+  // and MAD of all gaps) is a candidate stage boundary
+  std::vector<double> gaps;
+  for (size_t i = 1; i < ids.size(); i++) {
+    gaps.push_back(std::fabs(tic[ids[i]] - tic[ids[i - 1]]));
+  }
+  double median = Median(gaps);
+  std::vector<double> dev;
+  for (auto g : gaps) dev.push_back(std::fabs(g - median));
+  double scale = std::max(std::max(1.4826 * Median(dev), 0.05 * median), 1.0);
+  double threshold = median + _stage_k * scale;
+
+  _grad_checkpoint.clear();
+  _backward_exec.clear();
+  _checkpoint_confidence.clear();
+  _grad_checkpoint.push_back(-1);
+  _checkpoint_confidence.push_back(1);
+  int rejected = 0;
+  for (size_t i = 1; i < ids.size(); i++) {
+    double diff = gaps[i - 1];
+    if (diff <= threshold) continue;
+
+    // The confidence of a boundary is the share of runs that show it too
+    int seen = 0, agree = 0;
+    for (auto& run : rel) {
+      if (run[ids[i]] < 0 || run[ids[i - 1]] < 0) continue;
+      seen++;
+      if (std::fabs(run[ids[i]] - run[ids[i - 1]]) > threshold) agree++;
+    }
+    double confidence = seen ? (double)agree / seen : 0;
+    if (confidence < _min_confidence) {
+      rejected++;
+      continue;
+    }
+
+    diff /= 1000;
+    if (_backward_exec.size() == 0) {
+      double _diff = std::fabs(tic[ids[i - 1]] - tic[ids[0]]);
+      _diff /= 1000;
+      _backward_exec.push_back(_diff);
+    }
+    _grad_checkpoint.push_back(ids[i - 1]);
+    _checkpoint_confidence.push_back(confidence);
+    _backward_exec.insert(_backward_exec.begin(), diff);
+  }
+  _grad_checkpoint.push_back(_total_grad - 1);
+  _checkpoint_confidence.push_back(1);
+  _block_end.assign(_grad_checkpoint.size(), -1);
+
+  // Without a stable stepwise pattern, blocking only delays gradients
+  _blocking = _grad_checkpoint.size() > 2;
+
+  BPS_LOG(INFO) << "Prophet plan built from " << _runs.size() << " run(s): "
+                << ids.size() << " gradients, " << _grad_checkpoint.size() - 1
+                << " stages (" << rejected << " unstable boundaries dropped)"
+                << ", bandwidth " << _bandwidth << " bytes/ms"
+                << (_blocking ? "" : ", blocking disabled");
+  WriteCache();
+}
+
+int ProphetPlan::GetNumGradients() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _total_grad;
+}
+
+bool ProphetPlan::HasGradient(int grad_id) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return grad_id >= 0 && grad_id < _total_grad && _known[grad_id];
+}
+
+bool ProphetPlan::IsBlocking() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return !_profiling && _blocking;
+}
+
+double ProphetPlan::GetCheckpointConfidence(int index) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (index < 0 || index >= (int)_checkpoint_confidence.size()) return 0;
+  return _checkpoint_confidence[index];
+}
+
+int ProphetPlan::GetNumCheckpoints() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _grad_checkpoint.size();
+}
+
+int ProphetPlan::GetCheckpoint(int index) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (index < 0 || index >= (int)_grad_checkpoint.size()) return -1;
+  return _grad_checkpoint[index];
+}
+
+long long ProphetPlan::GetStageBudget(int stage) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (stage < 0 || stage >= (int)_backward_exec.size()) return 0;
+  return (long long)(_backward_exec[stage] * _bandwidth);
+}
+
+void ProphetPlan::RecordBlockEnd(int stage, int grad_id) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (stage >= 0 && stage < (int)_block_end.size()) {
+    _block_end[stage] = grad_id;
+  }
+  _blocks++;
+}
+
+long long ProphetPlan::GetBandwidth() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _bandwidth;
+}
+
+ProphetStats ProphetPlan::GetStats() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  ProphetStats stats;
+  stats.enabled = _enabled;
+  stats.profiling = _profiling;
+  stats.blocking = !_profiling && _blocking;
+  stats.stages = _profiling ? 0 : (int)_grad_checkpoint.size() - 1;
+  stats.bandwidth = _bandwidth;
+  stats.bandwidth_estimate = (long long)_bw_estimate;
+  stats.iterations = _total_iterations;
+  stats.blocks = _blocks;
+  stats.block_end = _block_end;
+  return stats;
+}
+
+}  // namespace common
+}  // namespace byteps
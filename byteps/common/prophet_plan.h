@@ -0,0 +1,189 @@
+// Copyright 2019 Bytedance Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+#ifndef BYTEPS_PROPHET_PLAN_H
+#define BYTEPS_PROPHET_PLAN_H
+
+#include <cstdint>
+#include <mutex>
+#include <regex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace byteps {
+namespace common {
+
+struct ProphetStats {
+  bool enabled;
+  bool profiling;
+  bool blocking;
+  int stages;
+  // bytes per millisecond, the one of the plan and the running estimate
+  long long bandwidth;
+  long long bandwidth_estimate;
+  // iterations and blocks pushed since the start
+  uint64_t iterations;
+  uint64_t blocks;
+  // last gradient of the latest block of each stage, -1 if none
+  std::vector<int> block_end;
+};
+
+// Block plan used by Prophet to schedule gradient PUSH.
+//
+// Tensors are selected once, when they are initialized: either explicitly by
+// RegisterTensor() from a framework declare call, or by name (Z_keyword
+// substring, Z_REGEX) and size (Z_MIN_BYTES). The result is cached in
+// BPSContext::prophet.
+//
+// With Z_PROFILE_CACHE set, a built plan is saved to that file together with a
+// signature of the model and cluster: the Prophet tensor names, GPU type,
+// number of workers, partition size, backward passes per synchronization and
+// Z_CACHE_TAG (e.g. the batch size).
+// The next run installs it when its first Prophet gradient arrives, if the
+// signature is the same, and skips the profiling run.
+//
+// A gradient is identified by its index, i.e. -priority. During the first
+// Z_PROFILE_ITERS iterations (the profiling runs) we record when each gradient
+// becomes ready for PUSH and how long pushes take. From the median ready times
+// we derive the stage boundaries (checkpoints) of the stepwise gradient-ready
+// pattern, as robust outliers among the gaps between gradients, and a byte
+// budget for each stage: how many bytes the link can carry before the next
+// stage arrives. Each boundary gets a confidence, the share of runs showing
+// it; unstable ones are dropped, and without any stage boundary left blocking
+// is disabled.
+//
+// After profiling, every completed Prophet push keeps feeding a bandwidth
+// estimate (EWMA of the per-push link throughput), and Replan() applies it to
+// the stage budgets at iteration boundaries, so block sizes follow the link.
+//
+// The same stages order PULL: forward propagation starts from gradient 0, so
+// pulls of the first stage (ids up to checkpoint 1) go out unthrottled, while
+// the later stages share the pull credit and cannot flood the link first.
+class ProphetPlan {
+ public:
+  ProphetPlan();
+
+  bool IsEnabled();
+  void RegisterTensor(const std::string& name, bool enabled);
+  bool SelectTensor(const std::string& name, size_t size);
+
+  // Number of backward passes the framework accumulates locally before it
+  // push_pulls the gradients. Only the last one reaches the PUSH queue, so an
+  // iteration of the plan is one synchronization. Part of the cache signature.
+  void SetBackwardPasses(int passes);
+
+  // After the job went from |old_workers| to |new_workers| workers. The
+  // stages come from the backward pass of this worker and are kept. The
+  // servers sum the push of every worker, so the measured bandwidth is
+  // scaled by old_workers / new_workers, unless Z_NET_B fixes it, and the
+  // running estimate corrects it from the next pushes. A built plan is
+  // cached again under the new signature.
+  void Rescale(int old_workers, int new_workers);
+
+  // True until every gradient seen in the profiling run has been pushed once
+  bool IsProfiling();
+  bool IsReady();
+
+  // Install the cached plan if it was built for the same signature. Called
+  // for every Prophet gradient, only the first call does anything.
+  void LoadCache();
+
+  // Profiling hooks, called by the PUSH queue
+  void RecordGradientReady(int grad_id);
+  void RecordPushStart(int grad_id, uint64_t key);
+  void RecordPushFinish(int grad_id, uint64_t key, size_t len);
+
+  // Called by the PUSH queue at the start of every iteration
+  void Replan();
+
+  // Plan tables, only valid once IsReady()
+  bool IsBlocking();
+  double GetCheckpointConfidence(int index);
+  int GetNumGradients();
+  bool HasGradient(int grad_id);
+  int GetNumCheckpoints();
+  int GetCheckpoint(int index);
+  long long GetStageBudget(int stage);
+  void RecordBlockEnd(int stage, int grad_id);
+
+  long long GetBandwidth();
+  ProphetStats GetStats();
+  long long GetCredit() const { return _credit; }
+  long long GetPullCredit() const { return _pull_credit; }
+  int GetDoors() const { return _doors; }
+
+ private:
+  void EndProfileRun();
+  void BuildPlan();
+  std::string ComputeSignature();
+  bool ReadCache(const std::string& signature);
+  void WriteCache();
+  static long long NowMicros();
+  void UpdateBandwidth(double sample);
+
+  std::mutex _mutex;
+  bool _enabled;
+  std::string _keyword;
+  bool _use_regex = false;
+  std::regex _regex;
+  size_t _min_bytes = 0;
+  std::unordered_map<std::string, bool> _registered;
+  int _backward_passes = 1;
+  std::string _cache_path;
+  std::string _signature;
+  bool _cache_checked = false;
+  bool _profiling = true;
+
+  // bytes per millisecond, _bandwidth is the value the budgets are built on
+  long long _bandwidth = 0;
+  bool _fixed_bandwidth = false;
+  double _bw_estimate = 0;
+  double _bw_alpha;
+  bool _bw_adaptive;
+  int _replan_interval;
+  int _iteration = 0;
+  uint64_t _total_iterations = 0;
+  uint64_t _blocks = 0;
+  long long _last_finish = 0;
+  std::unordered_map<uint64_t, long long> _push_start_tic;
+  long long _credit;
+  long long _pull_credit;
+  int _doors;
+
+  // per-gradient tables of the current profiling run, indexed by gradient id
+  std::vector<long long> _grad_tic;
+  std::vector<bool> _pushed;
+  std::vector<bool> _known;
+  std::vector<std::vector<long long>> _runs;
+  int _profile_iters;
+  double _stage_k;
+  double _min_confidence;
+  int _total_grad = 0;
+  int _ready_count = 0;
+  int _finish_count = 0;
+
+  // per-stage tables
+  std::vector<int> _grad_checkpoint;
+  std::vector<double> _checkpoint_confidence;
+  bool _blocking = false;
+  std::vector<double> _backward_exec;  // in milliseconds
+  std::vector<int> _block_end;
+};
+
+}  // namespace common
+}  // namespace byteps
+
+#endif  // BYTEPS_PROPHET_PLAN_H
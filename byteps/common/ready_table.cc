@@ -19,20 +19,71 @@
 namespace byteps {
 namespace common {
 
+ReadyTable::ReadyTable(int ready_count, const char* name)
+    : _dense(new std::atomic<std::atomic<int>*>[kDenseKeys]) {
+  _ready_count = ready_count;
+  _table_name = std::string(name);
+  for (uint64_t i = 0; i < kDenseKeys; ++i) {
+    _dense[i].store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+ReadyTable::~ReadyTable() {
+  for (uint64_t i = 0; i < kDenseKeys; ++i) {
+    delete[] _dense[i].load();
+  }
+}
+
+std::atomic<int>* ReadyTable::GetRow(uint64_t declared_key) {
+  auto row = _dense[declared_key].load(std::memory_order_acquire);
+  if (row) return row;
+  auto fresh = new std::atomic<int>[kDenseParts];
+  for (uint64_t i = 0; i < kDenseParts; ++i) {
+    fresh[i].store(0, std::memory_order_relaxed);
+  }
+  if (_dense[declared_key].compare_exchange_strong(row, fresh)) {
+    return fresh;
+  }
+  // another thread added it first
+  delete[] fresh;
+  return row;
+}
+
 // below are methods for accessing/modifying the _ready_table
 bool ReadyTable::IsKeyReady(uint64_t key) {
+  if (IsDense(key)) {
+    auto row = _dense[key >> 16].load(std::memory_order_acquire);
+    int count = row ? row[key & 0xffff].load(std::memory_order_relaxed) : 0;
+    return count == _ready_count;
+  }
   std::lock_guard<std::mutex> lock(_table_mutex);
   return _ready_table[key] == (_ready_count);
 }
 
 int ReadyTable::AddReadyCount(uint64_t key) {
-  std::lock_guard<std::mutex> lock(_table_mutex);
-  BPS_CHECK_LT(_ready_table[key], _ready_count)
-      << _table_name << ": " << _ready_table[key] << ", " << (_ready_count);
-  return ++_ready_table[key];
+  int count;
+  if (IsDense(key)) {
+    count = GetRow(key >> 16)[key & 0xffff].fetch_add(1) + 1;
+    BPS_CHECK_LE(count, _ready_count)
+        << _table_name << ": " << count - 1 << ", " << (_ready_count);
+  } else {
+    std::lock_guard<std::mutex> lock(_table_mutex);
+    BPS_CHECK_LT(_ready_table[key], _ready_count)
+        << _table_name << ": " << _ready_table[key] << ", " << (_ready_count);
+    count = ++_ready_table[key];
+  }
+  if (count == _ready_count && _ready_callback) {
+    _ready_callback(key);
+  }
+  return count;
 }
 
 void ReadyTable::ClearReadyCount(uint64_t key) {
+  if (IsDense(key)) {
+    auto row = _dense[key >> 16].load(std::memory_order_acquire);
+    if (row) row[key & 0xffff].store(0, std::memory_order_relaxed);
+    return;
+  }
   std::lock_guard<std::mutex> lock(_table_mutex);
   _ready_table[key] = 0;
 }
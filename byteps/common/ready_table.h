@@ -16,31 +16,54 @@
 #ifndef BYTEPS_READY_TABLE_H
 #define BYTEPS_READY_TABLE_H
 
+#include <atomic>
+#include <functional>
+#include <memory>
 #include <mutex>
+#include <string>
 #include <thread>
 #include <unordered_map>
 
 namespace byteps {
 namespace common {
 
+// Counts the ready signals of each key (declared_key << 16 | partition).
+// Keys of the first kDenseKeys tensors with at most kDenseParts partitions
+// are counted by atomics in a dense array, so that checking them takes no
+// lock. The rows of the array are allocated when a tensor is first signaled.
+// Other keys fall back to a map under a mutex.
 class ReadyTable {
  public:
-  ReadyTable(int ready_count, const char* name) {
-    _ready_count = ready_count;
-    _table_name = std::string(name);
-  }
+  ReadyTable(int ready_count, const char* name);
+  ~ReadyTable();
   // methods to access or modify the _ready_table
   bool IsKeyReady(uint64_t key);
   int AddReadyCount(uint64_t key);
   void ClearReadyCount(uint64_t key);
+  // called with the key whenever a key becomes ready
+  void SetReadyCallback(std::function<void(uint64_t)> cb) {
+    _ready_callback = cb;
+  }
 
  private:
-  // (key, ready_signal_count) pair, only valid for root device
+  static const uint64_t kDenseKeys = 1 << 14;
+  static const uint64_t kDenseParts = 256;
+
+  static bool IsDense(uint64_t key) {
+    return (key >> 16) < kDenseKeys && (key & 0xffff) < kDenseParts;
+  }
+  // the counts of the partitions of a declared key
+  std::atomic<int>* GetRow(uint64_t declared_key);
+
+  std::unique_ptr<std::atomic<std::atomic<int>*>[]> _dense;
+  // (key, ready_signal_count) pair of the other keys, only valid for root
+  // device
   std::unordered_map<uint64_t, int> _ready_table;
   // use this mutex to access/modify the _ready_table
   std::mutex _table_mutex;
   int _ready_count;
   std::string _table_name;
+  std::function<void(uint64_t)> _ready_callback;
 };
 
 }  // namespace common
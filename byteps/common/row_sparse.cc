@@ -0,0 +1,142 @@
+// Copyright 2019 Bytedance Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+#include "row_sparse.h"
+
+#include <cstring>
+
+#include "common.h"
+#include "logging.h"
+
+namespace byteps {
+namespace common {
+
+namespace {
+
+bool IsZero(const char* p, size_t n) {
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= n; i += sizeof(uint64_t)) {
+    uint64_t x;
+    memcpy(&x, p + i, sizeof(x));
+    if (x) return false;
+  }
+  for (; i < n; ++i) {
+    if (p[i]) return false;
+  }
+  return true;
+}
+
+template <typename T>
+void AddRow(const char* src, char* dst, size_t row_len) {
+  auto s = reinterpret_cast<const T*>(src);
+  auto d = reinterpret_cast<T*>(dst);
+  for (size_t i = 0; i < row_len / sizeof(T); ++i) {
+    d[i] += s[i];
+  }
+}
+
+const uint32_t* Indices(const RowSparseHeader* header) {
+  return reinterpret_cast<const uint32_t*>(header + 1);
+}
+
+const char* Rows(const RowSparseHeader* header) {
+  return reinterpret_cast<const char*>(Indices(header) + header->num_rows);
+}
+
+}  // namespace
+
+size_t RowSparseCapacity(size_t len, size_t row_len) {
+  return sizeof(RowSparseHeader) + len / row_len * sizeof(uint32_t) + len;
+}
+
+size_t EncodeRows(const void* src, size_t len, size_t row_len, void* dst) {
+  BPS_CHECK_EQ(len % row_len, 0) << len << " bytes, rows of " << row_len;
+  auto in = static_cast<const char*>(src);
+  auto header = static_cast<RowSparseHeader*>(dst);
+  auto indices = reinterpret_cast<uint32_t*>(header + 1);
+  uint32_t num_rows = 0;
+  for (uint32_t r = 0; r < len / row_len; ++r) {
+    if (!IsZero(in + r * row_len, row_len)) indices[num_rows++] = r;
+  }
+  // the rows go after the indices, which are only known now
+  auto out = reinterpret_cast<char*>(indices + num_rows);
+  for (uint32_t i = 0; i < num_rows; ++i) {
+    memcpy(out + i * row_len, in + indices[i] * row_len, row_len);
+  }
+  header->len = len;
+  header->row_len = row_len;
+  header->num_rows = num_rows;
+  return out + num_rows * row_len - static_cast<char*>(dst);
+}
+
+size_t EncodeRows(const void* src, size_t len, size_t row_len,
+                  const std::vector<uint32_t>& rows, void* dst) {
+  auto in = static_cast<const char*>(src);
+  auto header = static_cast<RowSparseHeader*>(dst);
+  header->len = len;
+  header->row_len = row_len;
+  header->num_rows = rows.size();
+  auto indices = reinterpret_cast<uint32_t*>(header + 1);
+  auto out = reinterpret_cast<char*>(indices + rows.size());
+  for (size_t i = 0; i < rows.size(); ++i) {
+    indices[i] = rows[i];
+    memcpy(out + i * row_len, in + rows[i] * row_len, row_len);
+  }
+  return out + rows.size() * row_len - static_cast<char*>(dst);
+}
+
+void DecodeRows(const void* src, void* dst) {
+  auto header = static_cast<const RowSparseHeader*>(src);
+  auto indices = Indices(header);
+  auto rows = Rows(header);
+  auto out = static_cast<char*>(dst);
+  size_t row_len = header->row_len;
+  // zero the gaps between the rows instead of the whole partition
+  size_t next = 0;
+  for (uint32_t i = 0; i < header->num_rows; ++i) {
+    size_t offset = indices[i] * row_len;
+    BPS_CHECK_LE(offset + row_len, header->len) << "row " << indices[i];
+    memset(out + next, 0, offset - next);
+    memcpy(out + offset, rows + i * row_len, row_len);
+    next = offset + row_len;
+  }
+  memset(out + next, 0, header->len - next);
+}
+
+void AddRows(const void* src, void* dst, int dtype, std::vector<bool>* seen,
+             std::vector<uint32_t>* rows) {
+  auto header = static_cast<const RowSparseHeader*>(src);
+  auto indices = Indices(header);
+  auto in = Rows(header);
+  auto out = static_cast<char*>(dst);
+  size_t row_len = header->row_len;
+  for (uint32_t i = 0; i < header->num_rows; ++i) {
+    auto r = indices[i];
+    BPS_CHECK_LT(r, seen->size()) << "row " << r;
+    if (!(*seen)[r]) {
+      (*seen)[r] = true;
+      rows->push_back(r);
+    }
+    if (dtype == BYTEPS_FLOAT32) {
+      AddRow<float>(in + i * row_len, out + r * row_len, row_len);
+    } else {
+      BPS_CHECK_EQ(dtype, BYTEPS_FLOAT64) << "row-sparse needs float data";
+      AddRow<double>(in + i * row_len, out + r * row_len, row_len);
+    }
+  }
+}
+
+}  // namespace common
+}  // namespace byteps
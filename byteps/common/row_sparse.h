@@ -0,0 +1,63 @@
+// Copyright 2019 Bytedance Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+#ifndef BYTEPS_ROW_SPARSE_H
+#define BYTEPS_ROW_SPARSE_H
+
+#include <stdint.h>
+
+#include <cstddef>
+#include <vector>
+
+namespace byteps {
+namespace common {
+
+// The pushes and pulls of a kRowSparsePushPull partition only carry its rows
+// that are not all zero, e.g. the rows of an embedding gradient looked up in
+// the step. The buffer starts with this header, followed by num_rows uint32
+// row indices in increasing order, then the rows in the same order.
+struct RowSparseHeader {
+  // bytes of the dense partition
+  uint64_t len;
+  // bytes of a row, len is a multiple of it
+  uint32_t row_len;
+  uint32_t num_rows;
+};
+
+// Size of the encoding of a partition whose rows are all non-zero
+size_t RowSparseCapacity(size_t len, size_t row_len);
+
+// Encode the non-zero rows of |len| bytes of |src| into |dst|, which holds
+// RowSparseCapacity() bytes. Returns the size of the encoding.
+size_t EncodeRows(const void* src, size_t len, size_t row_len, void* dst);
+
+// Encode the given |rows| of |src|, sorted, whether they are zero or not
+size_t EncodeRows(const void* src, size_t len, size_t row_len,
+                  const std::vector<uint32_t>& rows, void* dst);
+
+// Write the dense partition of |src| to |dst|: the rows it does not carry are
+// zero. |dst| holds the len of the header.
+void DecodeRows(const void* src, void* dst);
+
+// Add the rows of |src| to the dense partition |dst| of BYTEPS_FLOAT32 or
+// BYTEPS_FLOAT64 |dtype|. The rows not marked in |seen| yet are marked and
+// appended to |rows|.
+void AddRows(const void* src, void* dst, int dtype, std::vector<bool>* seen,
+             std::vector<uint32_t>* rows);
+
+}  // namespace common
+}  // namespace byteps
+
+#endif  // BYTEPS_ROW_SPARSE_H
@@ -20,17 +20,35 @@
 #include <stdlib.h>
 
 #include <atomic>
+#include <condition_variable>
 #include <memory>
-#include <set>
-#include <stack>
-#include <unordered_map>
-#include <vector>
+#include <mutex>
 
 #include "common.h"
+#include "metrics.h"
 #include "ready_table.h"
+#include "scheduling_policy.h"
 
 namespace byteps {
 namespace common {
+
+// Wakes up loop threads waiting for a queue. Every event that may make a task
+// schedulable bumps the epoch; a waiter returns once the epoch moved past the
+// value it saw before its last attempt, or after the park timeout.
+class QueueNotifier {
+ public:
+  uint64_t getEpoch() { return _epoch.load(); }
+  void notify();
+  void wait(uint64_t seen_epoch);
+
+ private:
+  std::mutex _mutex;
+  std::condition_variable _cond;
+  std::atomic<uint64_t> _epoch{0};
+};
+
+// Tasks waiting for one stage of the pipeline. Which task goes next is up to
+// the SchedulingPolicy selected for the queue type.
 class BytePSScheduledQueue {
  public:
   BytePSScheduledQueue(QueueType type);
@@ -38,7 +56,6 @@ class BytePSScheduledQueue {
   QueueType getQueueType() { return _qt; }
 
   void addTask(std::shared_ptr<TensorTableEntry>);
-  void addTask_helper(std::shared_ptr<TensorTableEntry>);
 
   void recorderTs(std::shared_ptr<TensorTableEntry>);
 
@@ -46,55 +63,33 @@ class BytePSScheduledQueue {
 
   std::shared_ptr<TensorTableEntry> getTask(uint64_t key);
 
-  std::multiset<std::shared_ptr<TensorTableEntry>>::iterator findTask(
-      int priority);
-
   uint32_t pendingSize();
 
-  void reportFinish(int size);
-  void reportFinish(int size, int priority);
+  // Current credit window of the scheduling policy, -1 if unlimited
+  long long getCreditWindow();
+  // Bytes taken within the credit window, -1 if unlimited
+  long long getCreditInflight();
+
+  void reportFinish(std::shared_ptr<TensorTableEntry> task);
+
+  // Block until the queue may have changed since the last getTask()
+  void waitTask();
+  std::shared_ptr<QueueNotifier> getNotifier() { return _notifier; }
+  void setNotifier(std::shared_ptr<QueueNotifier> notifier) {
+    _notifier = notifier;
+  }
 
  private:
-  struct comparator {
-    bool operator()(std::shared_ptr<TensorTableEntry> a,
-                    std::shared_ptr<TensorTableEntry> b) {
-      return (a->priority > b->priority);
-    }
-  };
-  std::vector<std::shared_ptr<TensorTableEntry>> _sq;
-  std::multiset<std::shared_ptr<TensorTableEntry>, comparator> _ms;
-  std::vector<std::shared_ptr<TensorTableEntry>> _mysq;
-  std::stack<int> _mystack;
-  std::stack<int> _mystackpull;
+  std::unique_ptr<SchedulingPolicy> _policy;
+  std::unique_ptr<TaskPool> _pool;
   std::mutex _mutex;
-  uint64_t _credits;
+  std::shared_ptr<QueueNotifier> _notifier;
+  uint64_t _seen_epoch = 0;
   bool _is_scheduled;
-  int _tensor_part[160] = {0};
-  int _visited[160] = {0};
-  int _meetzero = 0;
-  int _dooropen = 11;
-  int _pulldoor = 0;
-  int batchsize = atoi(getenv("Z_BATCH_SIZE"));
-  int _grad_checkpoint[13] = {-1, 9,   22,  35,  50,  62, 77,
-                              90, 103, 117, 130, 143, 156};
-  int B = atoi(getenv("Z_NET_B"));
-  int _door = atoi(getenv("Z_DOORS"));
-  long long _bps_credit = atoi(getenv("Z_CREDIT"));
-  long long _backward_exec[13] = {16, 15, 9,  10, 12, 18, 15,
-                                  21, 30, 25, 20, 5,  0};
-  int _exec_stage = 0;
-  int _noleftsize = 0;
-  int _sizepointer = 0;
-  int _stagepullnum = 0;
-  int _dequeue = 0;
-  int _pointer = 12;
-  int _stagestart = 1;
-  long long dynamic_size = 0;
-  int _pushsize = 0;
-  int _pullsize = 0;
-  int expected_priority = _grad_checkpoint[_pointer];
   QueueType _qt;
   ReadyTable *_rt;
+  // nullptr if BYTEPS_METRICS_ON=0
+  QueueMetrics *_metrics = nullptr;
 };
 }  // namespace common
 }  // namespace byteps
@@ -0,0 +1,424 @@
+// Copyright 2019 Bytedance Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+#include "scheduling_policy.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+
+#include "global.h"
+#include "logging.h"
+
+namespace byteps {
+namespace common {
+
+static inline bool IsProphetTask(std::shared_ptr<TensorTableEntry> task) {
+  return task->context && task->context->prophet;
+}
+
+void TaskPool::push(std::shared_ptr<TensorTableEntry> task) {
+  TaskOrder order(_by_priority ? task->priority * -1 : 0, _seq++);
+  _key_index.emplace(task->key, order);
+  if (isReady(task)) {
+    _ready.emplace(order, task);
+    return;
+  }
+  _pending.emplace(order, task);
+  if (task->ready_event && !task->ready_event->Ready()) {
+    _event_waiting.insert(order);
+  }
+}
+
+bool TaskPool::isReady(std::shared_ptr<TensorTableEntry> task) {
+  if (task->ready_event && !task->ready_event->Ready()) {
+    return false;
+  }
+  if (_rt && !_rt->IsKeyReady(task->key)) {
+    return false;
+  }
+  return true;
+}
+
+void TaskPool::markReady(uint64_t key) {
+  std::lock_guard<std::mutex> lock(_ready_keys_mutex);
+  _ready_keys.push_back(key);
+}
+
+void TaskPool::check(TaskOrder order) {
+  auto it = _pending.find(order);
+  if (it == _pending.end() || !isReady(it->second)) {
+    return;
+  }
+  _event_waiting.erase(order);
+  _ready.insert(*it);
+  _pending.erase(it);
+}
+
+void TaskPool::promote() {
+  std::vector<uint64_t> keys;
+  {
+    std::lock_guard<std::mutex> lock(_ready_keys_mutex);
+    keys.swap(_ready_keys);
+  }
+  for (auto key : keys) {
+    auto range = _key_index.equal_range(key);
+    std::vector<TaskOrder> orders;
+    for (auto kit = range.first; kit != range.second; ++kit) {
+      orders.push_back(kit->second);
+    }
+    for (auto& order : orders) {
+      check(order);
+    }
+  }
+  for (auto it = _event_waiting.begin(); it != _event_waiting.end();) {
+    auto order = *it;
+    if (!_pending.at(order)->ready_event->Ready()) {
+      ++it;
+      continue;
+    }
+    // still pending if its key is not ready, the table reports it later
+    it = _event_waiting.erase(it);
+    check(order);
+  }
+}
+
+std::shared_ptr<TensorTableEntry> TaskPool::remove(TaskMap& map,
+                                                   TaskMap::iterator it) {
+  auto task = it->second;
+  auto range = _key_index.equal_range(task->key);
+  for (auto kit = range.first; kit != range.second; ++kit) {
+    if (kit->second == it->first) {
+      _key_index.erase(kit);
+      break;
+    }
+  }
+  _event_waiting.erase(it->first);
+  map.erase(it);
+  return task;
+}
+
+std::shared_ptr<TensorTableEntry> TaskPool::take(TaskMap::iterator it) {
+  auto task = remove(_ready, it);
+  if (_rt) {
+    _rt->ClearReadyCount(task->key);
+  }
+  return task;
+}
+
+std::shared_ptr<TensorTableEntry> TaskPool::takeByKey(uint64_t key) {
+  auto range = _key_index.equal_range(key);
+  if (range.first == range.second) {
+    return nullptr;
+  }
+  auto order = range.first->second;
+  for (auto kit = range.first; kit != range.second; ++kit) {
+    order = std::min(order, kit->second);
+  }
+  auto it = _ready.find(order);
+  if (it != _ready.end()) {
+    return remove(_ready, it);
+  }
+  it = _pending.find(order);
+  BPS_CHECK(it != _pending.end());
+  return remove(_pending, it);
+}
+
+std::shared_ptr<TensorTableEntry> FifoPolicy::pick(TaskPool& pool) {
+  pool.promote();
+  auto& ready = pool.ready();
+  if (ready.empty()) {
+    return nullptr;
+  }
+  return pool.take(ready.begin());
+}
+
+bool PriorityCreditPolicy::admit(std::shared_ptr<TensorTableEntry> task) {
+  return !_credit || _credit->admit(task->len);
+}
+
+void PriorityCreditPolicy::onTake(std::shared_ptr<TensorTableEntry> task) {
+  if (_credit) {
+    _credit->onTake(task->key, task->len);
+  }
+}
+
+std::shared_ptr<TensorTableEntry> PriorityCreditPolicy::pick(TaskPool& pool) {
+  pool.promote();
+  auto& ready = pool.ready();
+  for (auto it = ready.begin(); it != ready.end(); ++it) {
+    if (!admit(it->second)) continue;
+    auto task = pool.take(it);
+    onTake(task);
+    return task;
+  }
+  return nullptr;
+}
+
+void PriorityCreditPolicy::onFinish(std::shared_ptr<TensorTableEntry> task) {
+  if (_credit) {
+    _credit->onFinish(task->key);
+  }
+}
+
+ProphetPolicy::ProphetPolicy(QueueType type, uint64_t credits,
+                             std::shared_ptr<ProphetPlan> plan)
+    : PriorityCreditPolicy(credits), _qt(type), _plan(plan) {
+  _bps_credit.reset(new CreditController(_plan->GetCredit()));
+  _pull_credit.reset(new CreditController(_plan->GetPullCredit()));
+}
+
+long long ProphetPolicy::getCreditWindow() const {
+  if (_qt == PUSH) {
+    return _bps_credit->getWindow();
+  } else if (_qt == PULL) {
+    return _pull_credit->getWindow();
+  }
+  return PriorityCreditPolicy::getCreditWindow();
+}
+
+long long ProphetPolicy::getCreditInflight() const {
+  if (_qt == PUSH) {
+    return _bps_credit->getInflight();
+  } else if (_qt == PULL) {
+    return _pull_credit->getInflight();
+  }
+  return PriorityCreditPolicy::getCreditInflight();
+}
+
+bool ProphetPolicy::onAdd(std::shared_ptr<TensorTableEntry> task) {
+  if (_qt != PUSH || !IsProphetTask(task)) {
+    return false;
+  }
+  int grad_id = task->priority * -1;
+  _plan->LoadCache();
+  if (_plan->IsProfiling()) {
+    // profiling run: push without blocks and record the gradient-ready time
+    _plan->RecordGradientReady(grad_id);
+    return false;
+  }
+  if (!_plan->IsBlocking() || !_plan->HasGradient(grad_id)) {
+    // no stable stages, or not seen during profiling, so it has no place in
+    // the block plan
+    return false;
+  }
+  _ms.insert(task);
+  return true;
+}
+
+std::multiset<std::shared_ptr<TensorTableEntry>>::iterator
+ProphetPolicy::findTask(int priority) {
+  if (_ms.size() == 0) {
+    return _ms.end();
+  }
+  std::shared_ptr<TensorTableEntry> e(new TensorTableEntry);
+  e->priority = priority;
+  std::multiset<std::shared_ptr<TensorTableEntry>>::iterator it =
+      _ms.lower_bound(e);
+  if (it == _ms.end()) {
+    return it;
+  } else if ((*it)->priority != priority) {
+    return _ms.end();
+  } else {
+    BPS_CHECK_EQ((*it)->priority, priority);
+    return it;
+  }
+}
+
+void ProphetPolicy::endProphetBlock() {
+  _dequeue = 0;
+  if (_pointer > 0) {
+    _pointer--;
+  }
+  _plan->RecordBlockEnd(_sizepointer,
+                        _mystack.empty() ? -1 : _mystack.top() * -1);
+}
+
+void ProphetPolicy::resetProphetIteration() {
+  _plan->Replan();
+  _dequeue = 0;
+  _meetzero = 0;
+  _sizepointer = 0;
+  _visited.assign(_plan->GetNumGradients(), 0);
+  _pointer = _plan->GetNumCheckpoints() - 1;
+  expected_priority = _plan->GetCheckpoint(_pointer);
+  _iteration_start = false;
+}
+
+std::shared_ptr<TensorTableEntry> ProphetPolicy::pickBlockTask(
+    ReadyTable* rt, bool* block_end) {
+  if (_iteration_start) {
+    resetProphetIteration();
+  }
+
+  // Collect the gradients of the current stage, from the last layer to the
+  // first, until we reach the stage checkpoint
+  while (!_dequeue) {
+    if (expected_priority < 0) {
+      _dequeue = 1;
+      break;
+    }
+    if (_plan->HasGradient(expected_priority)) {
+      auto msit = findTask(expected_priority * -1);
+      if (msit == _ms.end()) {
+        return nullptr;
+      }
+      if (!_visited[expected_priority]) {
+        for (unsigned int x = 0; x < (*msit)->total_partnum; x++) {
+          _mystack.push(expected_priority * -1);
+        }
+        if (expected_priority == 0) {
+          _meetzero = 1;
+        }
+        _visited[expected_priority] = 1;
+      }
+    }
+    expected_priority--;
+    if (expected_priority == _plan->GetCheckpoint(_pointer - 1)) {
+      _dequeue = 1;
+      dynamic_size = _plan->GetStageBudget(_sizepointer++);
+    }
+  }
+
+  // Send the block: highest priority first, bounded by the stage budget, or
+  // by the credit once the whole model has been collected
+  if (_mystack.empty()) {
+    endProphetBlock();
+    *block_end = true;
+    return nullptr;
+  }
+  auto msit = findTask(_mystack.top());
+  if (msit == _ms.end()) {
+    return nullptr;
+  }
+  auto task = *msit;
+  if (rt && !rt->IsKeyReady(task->key)) {
+    return nullptr;
+  }
+  if (!_meetzero) {
+    if (dynamic_size > task->len) {
+      dynamic_size -= task->len;
+    } else {
+      endProphetBlock();
+      *block_end = true;
+      return nullptr;
+    }
+  } else if (!_bps_credit->admit(task->len)) {
+    return nullptr;
+  } else {
+    _bps_credit->onTake(task->key, task->len);
+  }
+  _ms.erase(msit);
+  _mystack.pop();
+  if (rt) {
+    rt->ClearReadyCount(task->key);
+  }
+  _plan->RecordPushStart(task->priority * -1, task->key);
+
+  if (_mystack.empty() && _meetzero) {
+    _iteration_start = true;
+  }
+  return task;
+}
+
+std::shared_ptr<TensorTableEntry> ProphetPolicy::pick(TaskPool& pool) {
+  if (_qt == PUSH && _ms.size() > 0) {
+    // When a block ends, the next stage may be collectable right away. There
+    // are at most as many blocks as checkpoints.
+    int blocks = _plan->GetNumCheckpoints();
+    for (int i = 0; i <= blocks; i++) {
+      bool block_end = false;
+      auto task = pickBlockTask(pool.readyTable(), &block_end);
+      if (task) {
+        return task;
+      }
+      if (!block_end) break;
+    }
+  }
+  return PriorityCreditPolicy::pick(pool);
+}
+
+bool ProphetPolicy::isThrottledPull(std::shared_ptr<TensorTableEntry> task) {
+  if (_qt != PULL || !IsProphetTask(task) || !_plan->IsReady()) {
+    return false;
+  }
+  // the first stage is needed first by the next forward propagation
+  return task->priority * -1 > _plan->GetCheckpoint(1);
+}
+
+bool ProphetPolicy::admit(std::shared_ptr<TensorTableEntry> task) {
+  if (!PriorityCreditPolicy::admit(task)) {
+    return false;
+  }
+  if (isThrottledPull(task) && !_pull_credit->admit(task->len)) {
+    return false;
+  }
+  return true;
+}
+
+void ProphetPolicy::onTake(std::shared_ptr<TensorTableEntry> task) {
+  PriorityCreditPolicy::onTake(task);
+  if (isThrottledPull(task)) {
+    _pull_credit->onTake(task->key, task->len);
+  }
+  if (_qt == PUSH && IsProphetTask(task)) {
+    _plan->RecordPushStart(task->priority * -1, task->key);
+  }
+}
+
+void ProphetPolicy::onFinish(std::shared_ptr<TensorTableEntry> task) {
+  PriorityCreditPolicy::onFinish(task);
+  if (_qt == PUSH) {
+    _plan->RecordPushFinish(task->priority * -1, task->key, task->len);
+    _bps_credit->onFinish(task->key);
+  } else if (_qt == PULL) {
+    _pull_credit->onFinish(task->key);
+  }
+}
+
+std::unique_ptr<SchedulingPolicy> CreateSchedulingPolicy(QueueType type,
+                                                         uint64_t credits) {
+  return CreateSchedulingPolicy(type, credits, BytePSGlobal::GetProphetPlan());
+}
+
+std::unique_ptr<SchedulingPolicy> CreateSchedulingPolicy(
+    QueueType type, uint64_t credits, std::shared_ptr<ProphetPlan> plan) {
+  // Prophet only changes PUSH and PULL, the rest go by priority
+  std::string name = (type == PUSH || type == PULL) ? "prophet" : "priority";
+  std::string env = "BYTEPS_SCHEDULING_POLICY_" + LogStrings[type];
+  if (getenv(env.c_str())) {
+    name = getenv(env.c_str());
+  } else if (getenv("BYTEPS_SCHEDULING_POLICY")) {
+    name = getenv("BYTEPS_SCHEDULING_POLICY");
+  }
+
+  std::unique_ptr<SchedulingPolicy> policy;
+  if (name == "fifo") {
+    policy.reset(new FifoPolicy());
+  } else if (name == "priority") {
+    policy.reset(new PriorityCreditPolicy(credits));
+  } else if (name == "prophet") {
+    policy.reset(new ProphetPolicy(type, credits, plan));
+  } else {
+    BPS_CHECK(0) << "unknown scheduling policy " << name << " for queue "
+                 << LogStrings[type];
+  }
+  BPS_LOG(DEBUG) << "Queue " << LogStrings[type] << " uses scheduling policy "
+                 << policy->name();
+  return policy;
+}
+
+}  // namespace common
+}  // namespace byteps
@@ -0,0 +1,207 @@
+// Copyright 2019 Bytedance Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+#ifndef BYTEPS_SCHEDULING_POLICY_H
+#define BYTEPS_SCHEDULING_POLICY_H
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stack>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+#include "credit_controller.h"
+#include "prophet_plan.h"
+#include "ready_table.h"
+
+namespace byteps {
+namespace common {
+
+// Pending tasks of one queue, ordered by (-priority, arrival) or by arrival
+// only, and indexed by key. A task moves from the pending set to the ready
+// set the first time it is observed ready; readiness never goes back until
+// the task is taken. A task is checked when it is pushed, when the ready
+// table reports its key, and, while it waits for a ready event, on every
+// promote(), since events are only known by polling. Each check is a lookup,
+// so no call scans all the pending tasks.
+class TaskPool {
+ public:
+  typedef std::pair<int, uint64_t> TaskOrder;
+  typedef std::map<TaskOrder, std::shared_ptr<TensorTableEntry>> TaskMap;
+
+  TaskPool(bool by_priority, ReadyTable* rt)
+      : _by_priority(by_priority), _rt(rt) {}
+
+  void push(std::shared_ptr<TensorTableEntry> task);
+  // Move the pending tasks reported by markReady() and those whose ready
+  // event fired to the ready set, so a policy can reach all ready tasks
+  void promote();
+  // |key| reached its ready count in the ready table; thread-safe, as the
+  // table calls it from the loop that signaled the key
+  void markReady(uint64_t key);
+  TaskMap& ready() { return _ready; }
+  // Take a ready task and clear its ready count
+  std::shared_ptr<TensorTableEntry> take(TaskMap::iterator it);
+  // Take the earliest task of |key|, ready or not
+  std::shared_ptr<TensorTableEntry> takeByKey(uint64_t key);
+  size_t size() const { return _pending.size() + _ready.size(); }
+  ReadyTable* readyTable() { return _rt; }
+
+ private:
+  bool isReady(std::shared_ptr<TensorTableEntry> task);
+  // Move the pending task at |order| to the ready set if it is ready
+  void check(TaskOrder order);
+  std::shared_ptr<TensorTableEntry> remove(TaskMap& map, TaskMap::iterator it);
+
+  bool _by_priority;
+  ReadyTable* _rt;
+  TaskMap _pending;
+  TaskMap _ready;
+  std::unordered_multimap<uint64_t, TaskOrder> _key_index;
+  // pending tasks whose ready event has not fired yet
+  std::set<TaskOrder> _event_waiting;
+  uint64_t _seq = 0;
+  // keys reported ready since the last promote()
+  std::mutex _ready_keys_mutex;
+  std::vector<uint64_t> _ready_keys;
+};
+
+// Decides which task a BytePSScheduledQueue hands out next. The queue calls
+// the hooks with its mutex held, so a policy needs no locking of its own.
+class SchedulingPolicy {
+ public:
+  virtual ~SchedulingPolicy() {}
+  virtual const char* name() const = 0;
+  // Whether the queue's pool orders tasks by priority rather than by arrival
+  virtual bool byPriority() const { return true; }
+  // Return true to keep |task| in the policy instead of the queue's pool
+  virtual bool onAdd(std::shared_ptr<TensorTableEntry> task) { return false; }
+  virtual std::shared_ptr<TensorTableEntry> pick(TaskPool& pool) = 0;
+  virtual void onFinish(std::shared_ptr<TensorTableEntry> task) {}
+  // Number of tasks kept by the policy
+  virtual size_t size() const { return 0; }
+  // Current credit window in bytes, -1 if unlimited
+  virtual long long getCreditWindow() const { return -1; }
+  // Bytes of the tasks taken within the window, -1 if unlimited
+  virtual long long getCreditInflight() const { return -1; }
+};
+
+// First ready task in arrival order
+class FifoPolicy : public SchedulingPolicy {
+ public:
+  const char* name() const override { return "fifo"; }
+  bool byPriority() const override { return false; }
+  std::shared_ptr<TensorTableEntry> pick(TaskPool& pool) override;
+};
+
+// Highest-priority ready task whose size fits in the byte credit, as in
+// ByteScheduler. A credit of 0 disables credit control.
+class PriorityCreditPolicy : public SchedulingPolicy {
+ public:
+  explicit PriorityCreditPolicy(uint64_t credits) {
+    if (credits) {
+      _credit.reset(new CreditController(credits));
+    }
+  }
+  const char* name() const override { return "priority"; }
+  std::shared_ptr<TensorTableEntry> pick(TaskPool& pool) override;
+  void onFinish(std::shared_ptr<TensorTableEntry> task) override;
+  long long getCreditWindow() const override {
+    return _credit ? (long long)_credit->getWindow() : -1;
+  }
+  long long getCreditInflight() const override {
+    return _credit ? (long long)_credit->getInflight() : -1;
+  }
+
+ protected:
+  virtual bool admit(std::shared_ptr<TensorTableEntry> task);
+  virtual void onTake(std::shared_ptr<TensorTableEntry> task);
+
+ private:
+  std::unique_ptr<CreditController> _credit;
+};
+
+// Prophet block scheduling for PUSH, and forward-order pull credit for PULL,
+// driven by the tables in ProphetPlan. Tasks that are not Prophet-scheduled
+// fall back to PriorityCreditPolicy.
+class ProphetPolicy : public PriorityCreditPolicy {
+ public:
+  ProphetPolicy(QueueType type, uint64_t credits,
+                std::shared_ptr<ProphetPlan> plan);
+  const char* name() const override { return "prophet"; }
+  bool onAdd(std::shared_ptr<TensorTableEntry> task) override;
+  std::shared_ptr<TensorTableEntry> pick(TaskPool& pool) override;
+  void onFinish(std::shared_ptr<TensorTableEntry> task) override;
+  size_t size() const override { return _ms.size(); }
+  long long getCreditWindow() const override;
+  long long getCreditInflight() const override;
+
+ protected:
+  bool admit(std::shared_ptr<TensorTableEntry> task) override;
+  void onTake(std::shared_ptr<TensorTableEntry> task) override;
+
+ private:
+  struct comparator {
+    bool operator()(std::shared_ptr<TensorTableEntry> a,
+                    std::shared_ptr<TensorTableEntry> b) {
+      return (a->priority > b->priority);
+    }
+  };
+
+  std::multiset<std::shared_ptr<TensorTableEntry>>::iterator findTask(
+      int priority);
+  std::shared_ptr<TensorTableEntry> pickBlockTask(ReadyTable* rt,
+                                                  bool* block_end);
+  void endProphetBlock();
+  void resetProphetIteration();
+  bool isThrottledPull(std::shared_ptr<TensorTableEntry> task);
+
+  QueueType _qt;
+  std::shared_ptr<ProphetPlan> _plan;
+  std::multiset<std::shared_ptr<TensorTableEntry>, comparator> _ms;
+  std::stack<int> _mystack;
+
+  // Prophet iteration cursor
+  std::vector<int> _visited;
+  bool _iteration_start = true;
+  int _meetzero = 0;
+  // bounds the rest of the iteration once gradient 0 has been collected
+  std::unique_ptr<CreditController> _bps_credit;
+  int _sizepointer = 0;
+  int _dequeue = 0;
+  int _pointer = 0;
+  long long dynamic_size = 0;
+  int expected_priority = 0;
+
+  // bounds the pulls of all stages but the first
+  std::unique_ptr<CreditController> _pull_credit;
+};
+
+// Policy for |type|, from BYTEPS_SCHEDULING_POLICY_<QUEUE> or
+// BYTEPS_SCHEDULING_POLICY: fifo, priority or prophet. |credits| is the byte
+// credit of the priority fallback, 0 for unlimited. Prophet uses |plan|, or
+// the one of BytePSGlobal.
+std::unique_ptr<SchedulingPolicy> CreateSchedulingPolicy(QueueType type,
+                                                         uint64_t credits);
+std::unique_ptr<SchedulingPolicy> CreateSchedulingPolicy(
+    QueueType type, uint64_t credits, std::shared_ptr<ProphetPlan> plan);
+
+}  // namespace common
+}  // namespace byteps
+
+#endif  // BYTEPS_SCHEDULING_POLICY_H
@@ -20,13 +20,233 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <algorithm>
 #include "global.h"
 
 namespace byteps {
 namespace common {
 
+namespace {
+
+// tensors (declared keys) an arena can hold
+const uint64_t kArenaSlots = 1 << 14;
+const uint64_t kArenaAlign = 4096;
+// the data starts on a huge page
+const uint64_t kArenaDataOffset = 2 << 20;
+const uint64_t kArenaClaiming = UINT64_MAX - 1;
+const uint64_t kArenaFull = UINT64_MAX;
+
+std::string PcieSharedMemoryPrefix(int i) {
+  return std::string("BytePS_Pcie") + std::to_string(i) + "_Shm_";
+}
+
+// The shared memory of PCIe switch i is on its NUMA node, or interleaved if
+// the job is not distributed
+void SetPcieNumaPolicy(int i) {
+  if (BytePSGlobal::IsDistributed()) {
+    numa_set_preferred(std::min(i, numa_max_node()));
+  } else {
+    numa_set_interleave_mask(numa_all_nodes_ptr);
+  }
+}
+
+void ResetPcieNumaPolicy() {
+  if (BytePSGlobal::IsDistributed()) {
+    numa_set_preferred(-1);
+  } else {
+    numa_set_interleave_mask(numa_no_nodes_ptr);
+  }
+}
+
+}  // namespace
+
+// Shared by the local ranks at the start of an arena segment
+struct BytePSSharedMemory::ArenaHeader {
+  // bytes carved from the data so far
+  std::atomic<uint64_t> carved;
+  // by declared key, claimed by the first rank that opens the tensor
+  struct {
+    // 0 if unclaimed, kArenaClaiming, kArenaFull or the data offset + 1
+    std::atomic<uint64_t> offset;
+    uint64_t size;
+  } slots[kArenaSlots];
+};
+
+BytePSSharedMemory::~BytePSSharedMemory() {
+  if (_arenas.size()) {
+    size_t reserved, carved, requested;
+    getArenaStats(&reserved, &carved, &requested);
+    BPS_LOG(INFO) << "Shared memory arena: reserved " << reserved
+                  << " bytes, carved " << carved << " bytes for tensors of "
+                  << requested << " bytes (fragmentation "
+                  << (carved ? 100.0 * (carved - requested) / carved : 0)
+                  << "%)";
+  }
+  for (auto& it : _arenas) {
+    CUDA_CALL(cudaHostUnregister(it.second.data));
+    munmap(it.second.header, _arena_map_size);
+    if (_arena_owner) shm_unlink(it.second.name.c_str());
+  }
+  for (auto& it : _key_shm_addr) {
+    CUDA_CALL(cudaHostUnregister(it.second));
+    munmap(it.second, _key_shm_size[it.first]);
+    shm_unlink(it.first.c_str());
+  }
+
+  BPS_LOG(DEBUG) << "Clear shared memory: all BytePS shared memory "
+                    "released/unregistered.";
+}
+
+void BytePSSharedMemory::initArena(size_t size, bool hugepage,
+                                   std::shared_ptr<BytePSComm> comm) {
+  static_assert(sizeof(ArenaHeader) <= kArenaDataOffset,
+                "arena header does not fit before the data");
+  _arena_owner = (comm->getLocalRank() == comm->getRoot());
+  _arena_map_size = kArenaDataOffset + size;
+  if (!_arena_owner) {
+    struct BytePSCommMsg msg;
+    comm->recvSignalFromRoot(&msg, sizeof(msg));
+    BPS_CHECK_EQ(msg.signal, SHM_READY) << "unexpected signal " << msg.signal;
+    BPS_CHECK_EQ(msg.key, size) << "BYTEPS_SHM_ARENA_BYTES differs from root";
+  }
+
+  std::vector<std::string> prefixes;
+  if (BytePSGlobal::IsCrossPcieSwitch()) {
+    for (int i = 0; i < BytePSGlobal::GetPcieSwitchNum(); i++) {
+      prefixes.push_back(PcieSharedMemoryPrefix(i));
+    }
+  } else {
+    prefixes.push_back(std::string("BytePS_ShM_"));
+  }
+  for (size_t i = 0; i < prefixes.size(); i++) {
+    auto name = prefixes[i] + "Arena";
+    int shm_fd;
+    if (_arena_owner) {
+      // the header of an earlier job would still claim its tensors
+      shm_unlink(name.c_str());
+      shm_fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0666);
+      BPS_CHECK_GE(shm_fd, 0) << "shm_open failed for " << name;
+      BPS_CHECK_GE(ftruncate(shm_fd, _arena_map_size), 0) << strerror(errno);
+    } else {
+      shm_fd = shm_open(name.c_str(), O_RDWR, 0666);
+      BPS_CHECK_GE(shm_fd, 0) << "shm_open failed for " << name;
+    }
+    void* ptr = mmap(0, _arena_map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     shm_fd, 0);
+    BPS_CHECK_NE(ptr, (void*)-1) << strerror(errno);
+    close(shm_fd);
+    if (hugepage && madvise(ptr, _arena_map_size, MADV_HUGEPAGE)) {
+      BPS_LOG(DEBUG) << name << ": no huge pages, " << strerror(errno);
+    }
+
+    Arena arena;
+    arena.name = name;
+    arena.header = static_cast<ArenaHeader*>(ptr);
+    arena.data = static_cast<char*>(ptr) + kArenaDataOffset;
+    arena.size = size;
+    // registering faults the pages in, on the node of the PCIe switch
+    if (BytePSGlobal::IsCrossPcieSwitch()) SetPcieNumaPolicy(i);
+    CUDA_CALL(cudaHostRegister(arena.data, size, cudaHostRegisterDefault));
+    if (BytePSGlobal::IsCrossPcieSwitch()) ResetPcieNumaPolicy();
+    _arenas[prefixes[i]] = arena;
+  }
+
+  if (_arena_owner) {
+    struct BytePSCommMsg msg = {comm->getLocalRank(), SHM_READY, size};
+    comm->broadcastSignal(&msg, sizeof(msg));
+  }
+  BPS_LOG(DEBUG) << "Initialized " << prefixes.size()
+                 << " shared memory arenas of " << size << " bytes";
+}
+
+void* BytePSSharedMemory::openArenaMemory(Arena& arena, uint64_t key,
+                                          size_t size) {
+  auto declared_key = key >> 16;
+  if (declared_key >= kArenaSlots) return nullptr;
+  auto& slot = arena.header->slots[declared_key];
+  uint64_t offset = 0;
+  if (slot.offset.compare_exchange_strong(offset, kArenaClaiming)) {
+    auto len = (size + kArenaAlign - 1) / kArenaAlign * kArenaAlign;
+    auto start = arena.header->carved.load();
+    while (start + len <= arena.size &&
+           !arena.header->carved.compare_exchange_weak(start, start + len)) {
+    }
+    slot.size = size;
+    if (start + len <= arena.size) {
+      slot.offset.store(start + 1);
+    } else {
+      BPS_LOG(WARNING) << arena.name << " is full, key " << key << " of "
+                       << size << " bytes gets its own shared memory";
+      slot.offset.store(kArenaFull);
+    }
+  }
+  // another rank may be claiming it
+  while ((offset = slot.offset.load()) == kArenaClaiming) {
+    std::this_thread::yield();
+  }
+  if (offset == kArenaFull) return nullptr;
+  BPS_CHECK_EQ(slot.size, size)
+      << arena.name << ": key " << key << " was opened with another size";
+  BPS_LOG(TRACE) << arena.name << ": key " << key << " at offset "
+                 << offset - 1 << ", size " << size;
+  return arena.data + offset - 1;
+}
+
+void BytePSSharedMemory::getArenaStats(size_t* reserved, size_t* carved,
+                                       size_t* requested) {
+  *reserved = *carved = *requested = 0;
+  for (auto& it : _arenas) {
+    auto& arena = it.second;
+    *reserved += arena.size;
+    *carved += std::min<size_t>(arena.header->carved.load(), arena.size);
+    for (uint64_t i = 0; i < kArenaSlots; i++) {
+      auto offset = arena.header->slots[i].offset.load();
+      if (offset && offset != kArenaClaiming && offset != kArenaFull) {
+        *requested += arena.header->slots[i].size;
+      }
+    }
+  }
+}
+
+bool BytePSSharedMemory::findSegment(const void* ptr, size_t len,
+                                     std::string* name, size_t* size,
+                                     size_t* offset) {
+  auto p = static_cast<const char*>(ptr);
+  auto holds = [p, len](const void* start, size_t bytes) {
+    auto s = static_cast<const char*>(start);
+    return p >= s && p + len <= s + bytes;
+  };
+  // an arena is mapped from its header
+  for (auto& it : _arenas) {
+    if (holds(it.second.header, _arena_map_size)) {
+      *name = it.second.name;
+      *size = _arena_map_size;
+      *offset = p - reinterpret_cast<const char*>(it.second.header);
+      return true;
+    }
+  }
+  std::lock_guard<std::mutex> lock(_shm_mu);
+  for (auto& it : _key_shm_addr) {
+    auto bytes = _key_shm_size[it.first];
+    if (holds(it.second, bytes)) {
+      *name = it.first;
+      *size = bytes;
+      *offset = p - static_cast<const char*>(it.second);
+      return true;
+    }
+  }
+  return false;
+}
+
 void* BytePSSharedMemory::openSharedMemory(const std::string& prefix,
                                            uint64_t key, size_t size) {
+  // the arenas are only added before the first tensor
+  auto it = _arenas.find(prefix);
+  if (it != _arenas.end()) {
+    auto ptr = openArenaMemory(it->second, key, size);
+    if (ptr) return ptr;
+  }
+
   std::string shm_name(prefix);
   shm_name += std::to_string(key);
   int shm_fd = shm_open(shm_name.c_str(), O_CREAT | O_RDWR, 0666);
@@ -52,29 +272,13 @@ std::vector<void*> BytePSSharedMemory::openPcieSharedMemory(uint64_t key,
                                                             size_t size) {
   std::vector<void*> r;
   for (int i = 0; i < BytePSGlobal::GetPcieSwitchNum(); i++) {
-    auto prefix = std::string("BytePS_Pcie") + std::to_string(i) + "_Shm_";
-    if (BytePSGlobal::IsDistributed()) {
-      if (BytePSGlobal::IsCrossPcieSwitch()) {
-        if (i <= numa_max_node()) {
-          numa_set_preferred(i);
-          r.push_back(openSharedMemory(prefix, key, size));
-          numa_set_preferred(-1);
-        } else {
-          numa_set_preferred(numa_max_node());
-          r.push_back(openSharedMemory(prefix, key, size));
-          numa_set_preferred(-1);
-        }
-      } else {
-        r.push_back(openSharedMemory(prefix, key, size));
-      }
+    auto prefix = PcieSharedMemoryPrefix(i);
+    if (BytePSGlobal::IsCrossPcieSwitch()) {
+      SetPcieNumaPolicy(i);
+      r.push_back(openSharedMemory(prefix, key, size));
+      ResetPcieNumaPolicy();
     } else {
-      if (BytePSGlobal::IsCrossPcieSwitch()) {
-        numa_set_interleave_mask(numa_all_nodes_ptr);
-        r.push_back(openSharedMemory(prefix, key, size));
-        numa_set_interleave_mask(numa_no_nodes_ptr);
-      } else {
-        r.push_back(openSharedMemory(prefix, key, size));
-      }
+      r.push_back(openSharedMemory(prefix, key, size));
     }
   }
   return r;
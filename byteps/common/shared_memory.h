@@ -18,10 +18,12 @@
 
 #include <cuda_runtime.h>
 #include <sys/mman.h>
+#include <atomic>
 #include <cerrno>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <memory>
 #include <mutex>
 #include <thread>
 #include <unordered_map>
@@ -31,27 +33,51 @@
 namespace byteps {
 namespace common {
 
+class BytePSComm;
+
 class BytePSSharedMemory {
  public:
   BytePSSharedMemory() {}
 
-  ~BytePSSharedMemory() {
-    for (auto &it : _key_shm_addr) {
-      CUDA_CALL(cudaHostUnregister(it.second));
-      munmap(it.second, _key_shm_size[it.first]);
-      shm_unlink(it.first.c_str());
-    }
-
-    BPS_LOG(DEBUG) << "Clear shared memory: all BytePS shared memory "
-                      "released/unregistered.";
-  }
+  ~BytePSSharedMemory();
 
   void *openSharedMemory(const std::string &prefix, uint64_t key, size_t size);
   std::vector<void *> openPcieSharedMemory(uint64_t key, size_t size);
 
+  // Carve the tensors of each prefix from one segment of |size| bytes, which
+  // is mapped and registered with CUDA once per process, instead of opening
+  // one segment per tensor. The root creates the segments and signals the
+  // other local ranks over |comm|, so every rank must call it. Tensors that
+  // do not fit once it is full get their own segment as before.
+  void initArena(size_t size, bool hugepage,
+                 std::shared_ptr<BytePSComm> comm);
+  // Summed over the arenas: bytes reserved, carved (with alignment), and
+  // requested by the tensors
+  void getArenaStats(size_t *reserved, size_t *carved, size_t *requested);
+  // The segment that holds the |len| bytes at |ptr|, for a co-located server
+  // to map it: its name, size and the offset of |ptr| in it. False if they
+  // are not in shared memory of this process.
+  bool findSegment(const void *ptr, size_t len, std::string *name,
+                   size_t *size, size_t *offset);
+
  private:
+  struct ArenaHeader;
+  struct Arena {
+    std::string name;
+    ArenaHeader *header;
+    char *data;
+    size_t size;
+  };
+
+  // nullptr if the tensor does not fit
+  void *openArenaMemory(Arena &arena, uint64_t key, size_t size);
+
   std::unordered_map<std::string, void *> _key_shm_addr;
   std::unordered_map<std::string, size_t> _key_shm_size;
+  // by prefix
+  std::unordered_map<std::string, Arena> _arenas;
+  size_t _arena_map_size = 0;
+  bool _arena_owner = false;
 
   std::mutex _shm_mu;
 };
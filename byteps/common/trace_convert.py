@@ -0,0 +1,105 @@
+# Copyright 2019 Bytedance Inc. or its affiliates. All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+# =============================================================================
+"""Convert the binary traces of BytePS (comm.bin) to Chrome traces.
+
+    python trace_convert.py traces/0/comm.bin [traces/0/comm.json]
+
+The format is described in byteps/common/tracer.h.
+"""
+
+import json
+import struct
+import sys
+
+_TOTAL = -1
+# start_ns, dur_ns, key, type, thread
+_RECORD = struct.Struct('<QQQiI')
+
+
+class _Reader(object):
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def unpack(self, fmt):
+        values = struct.unpack_from(fmt, self.data, self.pos)
+        self.pos += struct.calcsize(fmt)
+        return values
+
+    def string(self):
+        length, = self.unpack('<I')
+        s = self.data[self.pos:self.pos + length].decode('utf-8', 'replace')
+        self.pos += length
+        return s
+
+
+def load(path):
+    """Returns (local_rank, events) of a comm.bin, in Chrome trace events."""
+    with open(path, 'rb') as f:
+        r = _Reader(f.read())
+    magic = r.data[:8]
+    r.pos = 8
+    if magic != b'BPSTRC01':
+        raise ValueError('%s is not a BytePS trace' % path)
+    offset_ns, local_rank = r.unpack('<qI')
+    queues = [r.string() for _ in range(r.unpack('<I')[0])]
+    names = {}
+    for _ in range(r.unpack('<I')[0]):
+        declared_key, = r.unpack('<Q')
+        names[declared_key] = r.string()
+    num_records, = r.unpack('<Q')
+
+    events = []
+    for i in range(num_records):
+        start_ns, dur_ns, key, qtype, _ = _RECORD.unpack_from(
+            r.data, r.pos + i * _RECORD.size)
+        tensor = 'Comm.' + names.get(key >> 16, str(key >> 16))
+        if qtype == _TOTAL:
+            name, tid = tensor, 'total'
+        else:
+            qname = queues[qtype] if qtype < len(queues) else str(qtype)
+            name, tid = tensor + '.' + qname, str(key)
+        events.append({
+            'ph': 'X',
+            'args': {'name': tensor},
+            'pid': tensor,
+            'name': name,
+            # microseconds of the system clock, as the Chrome format expects
+            'ts': (start_ns + offset_ns) // 1000,
+            'dur': dur_ns // 1000,
+            'tid': tid,
+            'cat': 'Comm',
+        })
+    events.sort(key=lambda e: e['ts'])
+    return local_rank, events
+
+
+def main(argv):
+    if len(argv) not in (2, 3):
+        sys.stderr.write(__doc__)
+        return 1
+    src = argv[1]
+    dst = argv[2] if len(argv) == 3 else src.rsplit('.', 1)[0] + '.json'
+    local_rank, events = load(src)
+    with open(dst, 'w') as f:
+        json.dump({'traceEvents': events, 'displayTimeUnit': 'ms'}, f,
+                  indent=4)
+    print('Local rank %d: %d events written to %s' %
+          (local_rank, len(events), dst))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
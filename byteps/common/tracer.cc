@@ -0,0 +1,162 @@
+// Copyright 2019 Bytedance Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+#include "tracer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+
+#include "logging.h"
+
+namespace byteps {
+namespace common {
+
+namespace {
+
+struct TraceRing {
+  std::unique_ptr<TraceRecord[]> records;
+  uint64_t mask;
+  // records written so far, only by the owning thread
+  std::atomic<uint64_t> head{0};
+  // head at the end of the last dump
+  uint64_t dumped = 0;
+};
+
+std::mutex rings_mu;
+// never freed, the records of exited threads are still dumped
+std::vector<TraceRing*> rings;
+size_t ring_capacity = 1 << 14;
+
+TraceRing* NewRing() {
+  std::lock_guard<std::mutex> lock(rings_mu);
+  auto ring = new TraceRing;
+  // a power of 2
+  size_t capacity = 1;
+  while (capacity < ring_capacity) capacity <<= 1;
+  ring->records.reset(new TraceRecord[capacity]);
+  ring->mask = capacity - 1;
+  rings.push_back(ring);
+  return ring;
+}
+
+thread_local TraceRing* my_ring = nullptr;
+
+void WriteString(FILE* f, const std::string& s) {
+  uint32_t len = s.size();
+  fwrite(&len, sizeof(len), 1, f);
+  fwrite(s.data(), 1, len, f);
+}
+
+}  // namespace
+
+uint64_t Tracer::Now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void Tracer::SetCapacity(size_t records) {
+  std::lock_guard<std::mutex> lock(rings_mu);
+  ring_capacity = std::max<size_t>(records, 1);
+}
+
+void Tracer::Record(uint64_t key, int32_t type, uint64_t start_ns,
+                    uint64_t end_ns) {
+  if (!my_ring) my_ring = NewRing();
+  auto head = my_ring->head.load(std::memory_order_relaxed);
+  auto& r = my_ring->records[head & my_ring->mask];
+  r.start_ns = start_ns;
+  r.dur_ns = end_ns - start_ns;
+  r.key = key;
+  r.type = type;
+  my_ring->head.store(head + 1, std::memory_order_release);
+}
+
+int64_t Tracer::Dump(const std::string& path, int local_rank,
+                     const std::vector<std::string>& queue_names,
+                     const std::unordered_map<uint64_t, std::string>& names) {
+  std::vector<TraceRecord> out;
+  {
+    std::lock_guard<std::mutex> lock(rings_mu);
+    for (uint32_t i = 0; i < rings.size(); ++i) {
+      auto ring = rings[i];
+      auto capacity = ring->mask + 1;
+      auto end = ring->head.load(std::memory_order_acquire);
+      auto begin = (end > capacity) ? end - capacity : 0;
+      auto first = out.size();
+      for (auto j = begin; j < end; ++j) {
+        out.push_back(ring->records[j & ring->mask]);
+        out.back().thread = i;
+      }
+      // drop what the thread overwrote while copying
+      auto now = ring->head.load(std::memory_order_acquire);
+      auto overwritten = (now > capacity) ? now - capacity : 0;
+      if (overwritten > begin) {
+        auto drop = std::min(overwritten - begin, end - begin);
+        out.erase(out.begin() + first, out.begin() + first + drop);
+      }
+      ring->dumped = end;
+    }
+  }
+
+  FILE* f = fopen(path.c_str(), "wb");
+  if (!f) {
+    BPS_LOG(WARNING) << "Cannot write traces to " << path;
+    return -1;
+  }
+  auto offset = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::system_clock::now().time_since_epoch())
+                    .count() -
+                static_cast<int64_t>(Now());
+  fwrite("BPSTRC01", 1, 8, f);
+  fwrite(&offset, sizeof(offset), 1, f);
+  uint32_t rank = local_rank;
+  fwrite(&rank, sizeof(rank), 1, f);
+  uint32_t num = queue_names.size();
+  fwrite(&num, sizeof(num), 1, f);
+  for (auto& name : queue_names) WriteString(f, name);
+  num = names.size();
+  fwrite(&num, sizeof(num), 1, f);
+  for (auto& it : names) {
+    fwrite(&it.first, sizeof(it.first), 1, f);
+    WriteString(f, it.second);
+  }
+  uint64_t num_records = out.size();
+  fwrite(&num_records, sizeof(num_records), 1, f);
+  fwrite(out.data(), sizeof(TraceRecord), out.size(), f);
+  bool ok = !ferror(f);
+  fclose(f);
+  if (!ok) {
+    BPS_LOG(WARNING) << "Failed to write traces to " << path;
+    return -1;
+  }
+  return num_records;
+}
+
+bool Tracer::Wrapped() {
+  std::lock_guard<std::mutex> lock(rings_mu);
+  for (auto ring : rings) {
+    auto head = ring->head.load(std::memory_order_acquire);
+    if (head - ring->dumped > ring->mask + 1) return true;
+  }
+  return false;
+}
+
+}  // namespace common
+}  // namespace byteps
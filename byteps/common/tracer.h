@@ -0,0 +1,75 @@
+// Copyright 2019 Bytedance Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+#ifndef BYTEPS_TRACER_H
+#define BYTEPS_TRACER_H
+
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace byteps {
+namespace common {
+
+// A span of one stage of a partition, or of a whole push_pull
+struct TraceRecord {
+  // steady clock, in nanoseconds
+  uint64_t start_ns;
+  uint64_t dur_ns;
+  // the partition, or declared_key << 16 for a whole push_pull
+  uint64_t key;
+  // QueueType, or kTraceTotal
+  int32_t type;
+  // the ring it was recorded on, set when dumping
+  uint32_t thread;
+};
+
+const int32_t kTraceTotal = -1;
+
+// Records spans into a ring of fixed-size records per thread, without locks
+// or allocation after the first record of a thread. A full ring overwrites
+// its oldest records, so the rings always hold the latest spans.
+//
+// Dump() writes them in a compact binary form, which trace_convert.py turns
+// into Chrome traces:
+//   char magic[8] "BPSTRC01"
+//   int64 offset of the system clock from the steady clock, in nanoseconds
+//   uint32 local rank
+//   uint32 number of queue names, then each as uint32 length and bytes
+//   uint32 number of tensors, then each as uint64 declared key, uint32
+//     length and the bytes of its name
+//   uint64 number of records, then the TraceRecords
+class Tracer {
+ public:
+  static uint64_t Now();
+  // Records per thread, before the first record
+  static void SetCapacity(size_t records);
+  static void Record(uint64_t key, int32_t type, uint64_t start_ns,
+                     uint64_t end_ns);
+  // Returns the number of records written, -1 on error. It does not stop
+  // the recording threads, records they overwrite meanwhile are skipped.
+  static int64_t Dump(const std::string& path, int local_rank,
+                      const std::vector<std::string>& queue_names,
+                      const std::unordered_map<uint64_t, std::string>& names);
+  // Whether a ring overwrote records since the last Dump()
+  static bool Wrapped();
+};
+
+}  // namespace common
+}  // namespace byteps
+
+#endif  // BYTEPS_TRACER_H
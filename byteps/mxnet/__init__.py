@@ -25,6 +25,9 @@ import os
 from byteps.mxnet.ops import byteps_push_pull, byteps_declare_tensor
 from byteps.mxnet.ops import init, shutdown
 from byteps.mxnet.ops import size, local_size, rank, local_rank
+from byteps.mxnet.ops import dump_traces
+from byteps.mxnet.ops import resize
+from byteps.mxnet.ops import get_metrics
 
 parameter_index = 0
 
@@ -37,9 +37,16 @@ struct PushPullParam {
   NDArray* input;
   int version;
   int priority;
-
-  PushPullParam(BPSContext* context, NDArray* input, int version, int priority)
-      : context(context), input(input), version(version), priority(priority) {}
+  // averaged by the NCCL reduce
+  bool average;
+
+  PushPullParam(BPSContext* context, NDArray* input, int version, int priority,
+                bool average)
+      : context(context),
+        input(input),
+        version(version),
+        priority(priority),
+        average(average) {}
 };
 
 // callback function to release parameters used for pushpull with MXNet Engine
@@ -78,17 +85,14 @@ void DoPushPull(void*, void* on_complete_ptr, void* param) {
 
   auto device = TensorUtil::GetDevice(input);
   auto byteps_input = std::make_shared<MXTensor<NDArray>>(input);
-  auto queue_list = common::GetPushQueueList(device);
-  auto queue_list_pull = common::GetPullQueueList(device);
-  queue_list->insert(queue_list->end(), queue_list_pull->begin(),
-                     queue_list_pull->end());
+  auto queue_list = common::GetPushPullQueueList(device);
 
   auto enqueue_result = common::EnqueueTensor(
       context, byteps_input, byteps_input, nullptr, device, priority, version,
       [on_complete](const Status& status) {
         InvokeCompleteCallback(on_complete, status);
       },
-      queue_list);
+      queue_list, push_pull_param->average);
   ThrowIfError(enqueue_result);
 }
 
@@ -108,8 +112,15 @@ extern "C" int byteps_mxnet_push_pull_async(NDArray* tensor, char* name,
                             std::make_shared<MXTensor<NDArray>>(tensor)->data())
                       : nullptr;
   common::InitTensor(context, size, dtype, cpubuff);
-
-  auto push_pull_param = new PushPullParam(&context, tensor, version, priority);
+  // the server already averages what it applies, the output is the weights
+  if (context.server_optimizer) is_average = false;
+
+  // the averaging is folded into the NCCL reduce if possible, otherwise
+  // the sum is divided by another engine op
+  bool fused_average =
+      is_average && common::CanFuseAverage(context, device, dtype);
+  auto push_pull_param =
+      new PushPullParam(&context, tensor, version, priority, fused_average);
   auto var = tensor->var();
   // Use MXEnginePushAsync instead of Engine::Get()->PushAsync to avoid ABI
   // compatibility issues
@@ -117,7 +128,7 @@ extern "C" int byteps_mxnet_push_pull_async(NDArray* tensor, char* name,
                     &MX_EXEC_CTX, nullptr, 0, &var, 1,
                     &MX_FUNC_PROP, 0, "BytePSPushPull");
 
-  if (is_average) {
+  if (is_average && !fused_average) {
     // average the aggregated gradient
     auto num_worker = byteps_size();
     *tensor /= num_worker;
@@ -132,5 +143,24 @@ extern "C" void byteps_mxnet_declare_tensor(char* name) {
   return;
 }
 
+extern "C" void byteps_mxnet_declare_server_optimizer_tensor(char* name) {
+  std::string tensor_name = GetOpName("byteps", name);
+  common::DeclareServerOptimizerTensor(tensor_name);
+  return;
+}
+
+extern "C" void byteps_mxnet_declare_row_sparse_tensor(char* name,
+                                                       int row_elems) {
+  std::string tensor_name = GetOpName("byteps", name);
+  common::DeclareRowSparseTensor(tensor_name, row_elems);
+  return;
+}
+
+extern "C" void byteps_mxnet_declare_prophet_tensor(char* name, int enabled) {
+  std::string tensor_name = GetOpName("byteps", name);
+  common::DeclareProphetTensor(tensor_name, enabled != 0);
+  return;
+}
+
 }  // namespace mxnet
 }  // namespace byteps
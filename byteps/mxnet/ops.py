@@ -36,6 +36,9 @@ size = _basics.size
 local_size = _basics.local_size
 rank = _basics.rank
 local_rank = _basics.local_rank
+dump_traces = _basics.dump_traces
+resize = _basics.resize
+get_metrics = _basics.get_metrics
 
 dll_path = os.path.join(os.path.dirname(__file__),
                         'c_lib' + get_ext_suffix())
@@ -76,5 +79,15 @@ def byteps_push_pull(tensor, version=0, priority=0, name=None, is_average=True):
     return
 
 
-def byteps_declare_tensor(name):
+def byteps_declare_tensor(name, prophet=None, server_optimizer=False,
+                          row_sparse=0):
     check_call(MXNET_LIB_CTYPES.byteps_mxnet_declare_tensor(c_str(name)))
+    if prophet is not None:
+        check_call(MXNET_LIB_CTYPES.byteps_mxnet_declare_prophet_tensor(
+            c_str(name), ctypes.c_int(int(prophet))))
+    if server_optimizer:
+        check_call(MXNET_LIB_CTYPES.byteps_mxnet_declare_server_optimizer_tensor(
+            c_str(name)))
+    if row_sparse:
+        check_call(MXNET_LIB_CTYPES.byteps_mxnet_declare_row_sparse_tensor(
+            c_str(name), ctypes.c_int(int(row_sparse))))
@@ -36,6 +36,10 @@ const DataType TensorUtil::GetDType(NDArray* tensor) {
       return DataType::BYTEPS_INT8;
     case mshadow::kInt64:
       return DataType::BYTEPS_INT64;
+#if MXNET_VERSION >= 10700
+    case mshadow::kBfloat16:
+      return DataType::BYTEPS_BFLOAT16;
+#endif
     default:
       throw std::logic_error("GetDType: Type " +
                              std::to_string(tensor->dtype()) +
@@ -0,0 +1,113 @@
+// Copyright 2019 Bytedance Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+#ifndef BYTEPS_SERVER_BUFFER_POOL_H
+#define BYTEPS_SERVER_BUFFER_POOL_H
+
+#include <numa.h>
+#include <sys/mman.h>
+#include <mutex>
+#include <vector>
+
+namespace byteps {
+namespace server {
+
+/**
+ * \brief arena for the store buffers of the server, which live as long as the
+ * server does.
+ *
+ * Buffers are carved from a few large regions instead of one malloc per key:
+ * they are backed by huge pages when possible (fewer TLB misses while
+ * summing), optionally bound to one NUMA node, and the total can be capped.
+ * A few large, stable regions also keep the number of distinct memory
+ * regions the RDMA van has to register small.
+ */
+class BufferPool {
+ public:
+  /**
+   * \param region_size bytes mapped at a time
+   * \param limit maximum total bytes, 0 for unlimited
+   * \param numa_node node to bind the regions to, -1 for the default policy
+   */
+  BufferPool(size_t region_size, size_t limit, int numa_node)
+      : region_size_(RoundUp(region_size, kHugePageSize)),
+        limit_(limit), numa_node_(numa_node) {}
+
+  ~BufferPool() {
+    for (auto& r : regions_) munmap(r.first, r.second);
+  }
+
+  /**
+   * \brief a buffer of |len| bytes, aligned to a cache line. threadsafe.
+   */
+  char* Alloc(size_t len) {
+    std::lock_guard<std::mutex> lk(mu_);
+    len = RoundUp(len, kAlignment);
+    if (offset_ + len > size_) {
+      NewRegion(std::max(region_size_, RoundUp(len, kHugePageSize)));
+    }
+    auto p = base_ + offset_;
+    offset_ += len;
+    return p;
+  }
+
+  size_t mapped() const { return mapped_; }
+
+ private:
+  static const size_t kAlignment = 64;
+  static const size_t kHugePageSize = 2 * 1024 * 1024;
+
+  static size_t RoundUp(size_t n, size_t align) {
+    return (n + align - 1) / align * align;
+  }
+
+  void NewRegion(size_t size) {
+    CHECK(!limit_ || mapped_ + size <= limit_)
+        << "BytePS server store needs more than BYTEPS_SERVER_MEMORY_LIMIT="
+        << limit_ << " bytes";
+    auto flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   flags | MAP_HUGETLB, -1, 0);
+    if (p == MAP_FAILED) {
+      // no reserved huge pages, ask for transparent ones instead
+      p = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+      CHECK_NE(p, MAP_FAILED) << "failed to map " << size << " bytes";
+      madvise(p, size, MADV_HUGEPAGE);
+    }
+    if (numa_node_ >= 0 && numa_available() >= 0) {
+      numa_tonode_memory(p, size, numa_node_);
+    }
+    regions_.emplace_back(p, size);
+    base_ = static_cast<char*>(p);
+    offset_ = 0;
+    size_ = size;
+    mapped_ += size;
+  }
+
+  std::mutex mu_;
+  size_t region_size_;
+  size_t limit_;
+  int numa_node_;
+  std::vector<std::pair<void*, size_t> > regions_;
+  char* base_ = nullptr;
+  size_t offset_ = 0;
+  size_t size_ = 0;
+  size_t mapped_ = 0;
+};
+
+}  // namespace server
+}  // namespace byteps
+
+#endif  // BYTEPS_SERVER_BUFFER_POOL_H
@@ -0,0 +1,128 @@
+// Copyright 2019 Bytedance Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+#ifndef BYTEPS_SERVER_OPTIMIZER_H
+#define BYTEPS_SERVER_OPTIMIZER_H
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+namespace byteps {
+namespace server {
+
+/**
+ * \brief optimizer applied by the server to the keys pushed with
+ * kServerOptimizerPushPull, so that workers pull updated weights instead of
+ * each running the same update.
+ *
+ * The first merge of such a key carries the initial weights, which are
+ * stored as they are (averaged over the copies summed: every worker pushes
+ * the sum of its local GPUs). Every later merge is a sum of gradients: its
+ * mean updates the weights in place, with the optimizer state kept next to
+ * them in server memory. Only float32 is supported.
+ */
+class ServerOptimizer {
+ public:
+  enum Type { SGD, MOMENTUM, ADAM };
+
+  ServerOptimizer() {
+    std::string type = getenv("BYTEPS_SERVER_OPTIMIZER")
+                       ? getenv("BYTEPS_SERVER_OPTIMIZER") : "sgd";
+    if (type == "sgd") {
+      type_ = SGD;
+    } else if (type == "momentum") {
+      type_ = MOMENTUM;
+    } else if (type == "adam") {
+      type_ = ADAM;
+    } else {
+      CHECK(0) << "unknown BYTEPS_SERVER_OPTIMIZER " << type;
+    }
+    lr_ = GetFloat("BYTEPS_SERVER_LR", 0.01);
+    weight_decay_ = GetFloat("BYTEPS_SERVER_WEIGHT_DECAY", 0);
+    momentum_ = GetFloat("BYTEPS_SERVER_MOMENTUM", 0.9);
+    beta1_ = GetFloat("BYTEPS_SERVER_ADAM_BETA1", 0.9);
+    beta2_ = GetFloat("BYTEPS_SERVER_ADAM_BETA2", 0.999);
+    eps_ = GetFloat("BYTEPS_SERVER_ADAM_EPS", 1e-8);
+  }
+
+  // Number of state buffers, of the size of the weights, per key
+  int NumStates() const {
+    return type_ == SGD ? 0 : (type_ == MOMENTUM ? 1 : 2);
+  }
+
+  /**
+   * \brief apply the mean of the |replicas| copies summed in |merged| to
+   * |weights|
+   * \param step 0 for the initial weights, then 1, 2, ...
+   * \param state NumStates() buffers, zero-initialized
+   */
+  void Apply(float* weights, const float* merged, float* state0,
+             float* state1, size_t n, size_t replicas, uint64_t step) {
+    float scale = 1.0f / replicas;
+    if (step == 0) {
+      for (size_t i = 0; i < n; ++i) weights[i] = merged[i] * scale;
+      return;
+    }
+    switch (type_) {
+      case SGD: {
+        for (size_t i = 0; i < n; ++i) {
+          float g = merged[i] * scale + weight_decay_ * weights[i];
+          weights[i] -= lr_ * g;
+        }
+        break;
+      }
+      case MOMENTUM: {
+        for (size_t i = 0; i < n; ++i) {
+          float g = merged[i] * scale + weight_decay_ * weights[i];
+          state0[i] = momentum_ * state0[i] + g;
+          weights[i] -= lr_ * state0[i];
+        }
+        break;
+      }
+      case ADAM: {
+        float c1 = 1.0f - std::pow(beta1_, (float) step);
+        float c2 = 1.0f - std::pow(beta2_, (float) step);
+        for (size_t i = 0; i < n; ++i) {
+          float g = merged[i] * scale + weight_decay_ * weights[i];
+          state0[i] = beta1_ * state0[i] + (1 - beta1_) * g;
+          state1[i] = beta2_ * state1[i] + (1 - beta2_) * g * g;
+          weights[i] -= lr_ * (state0[i] / c1) /
+                        (std::sqrt(state1[i] / c2) + eps_);
+        }
+        break;
+      }
+    }
+  }
+
+ private:
+  static float GetFloat(const char* name, float default_val) {
+    return getenv(name) ? atof(getenv(name)) : default_val;
+  }
+
+  Type type_;
+  float lr_;
+  float weight_decay_;
+  float momentum_;
+  float beta1_;
+  float beta2_;
+  float eps_;
+};
+
+}  // namespace server
+}  // namespace byteps
+
+#endif  // BYTEPS_SERVER_OPTIMIZER_H
@@ -16,91 +16,193 @@
 #ifndef BYTEPS_SERVER_QUEUE_H
 #define BYTEPS_SERVER_QUEUE_H
 
+#include <chrono>
+#include <deque>
 #include <vector>
 #include <mutex>
 #include <condition_variable>
 #include <memory>
+#include <unordered_map>
 #include <algorithm>
 
 namespace byteps {
 namespace server {
 
 /**
- * \brief thread-safe queue allowing push and waited pop
+ * \brief thread-safe queue allowing push and waited pop. It is drained by its
+ * engine thread, and by other engine threads stealing work from it.
+ *
+ * Messages are kept per EngineQueueKey() in arrival order, and an indexed heap orders the
+ * keys by their oldest message id, so the queue is FIFO. With scheduling, the
+ * key pushed most often since its last ClearCounter() comes first instead.
+ *
+ * A popped key is busy until Done() is called for it: it leaves the heap, so
+ * that the messages of one key are processed one at a time and in order, by
+ * whichever thread pops them.
  */
 class PriorityQueue {
  public:
   PriorityQueue(bool is_schedule) { 
     enable_schedule_ = is_schedule;
-    if (enable_schedule_) {
-      std::make_heap(queue_.begin(), queue_.end(),
-        [this](const BytePSEngineMessage& a, const BytePSEngineMessage& b) {
-          return ComparePriority(a, b);
-        }
-      );
-    }
   }
   ~PriorityQueue() { }
 
   /**
-   * \brief push an value and sort using heap. threadsafe.
+   * \brief push an value, and move its key up in the heap. threadsafe.
    * \param new_value the value
    */
   void Push(BytePSEngineMessage new_value) {
-    mu_.lock();
-    queue_.push_back(std::move(new_value));
-    if (enable_schedule_) {
-      ++push_cnt_[new_value.key]; 
-      std::push_heap(queue_.begin(), queue_.end(), 
-        [this](const BytePSEngineMessage& a, const BytePSEngineMessage& b) {
-          return ComparePriority(a, b);
-        }
-      );
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      auto& entry = keys_[EngineQueueKey(new_value)];
+      ++entry.push_cnt;
+      ++size_;
+      entry.msgs.push_back(std::move(new_value));
+      if (entry.busy) {
+        // goes back to the heap on Done()
+      } else if (entry.pos < 0) {
+        entry.pos = heap_.size();
+        heap_.push_back(&entry);
+        SiftUp(entry.pos);
+      } else if (enable_schedule_) {
+        SiftUp(entry.pos);
+      }
     }
-    mu_.unlock();
-    cond_.notify_all();
+    cond_.notify_one();
   }
 
   /**
    * \brief wait until pop an element from the beginning, threadsafe
    * \param value the poped value
+   * \param timeout_us give up after that long, wait forever if negative
+   * \return whether an element was popped
    */
-  void WaitAndPop(BytePSEngineMessage* value) {
+  bool WaitAndPop(BytePSEngineMessage* value, int timeout_us = -1) {
     std::unique_lock<std::mutex> lk(mu_);
-    cond_.wait(lk, [this]{return !queue_.empty();});
-    if (enable_schedule_) {
-      std::pop_heap(queue_.begin(), queue_.end(), 
-        [this](const BytePSEngineMessage& a, const BytePSEngineMessage& b) {
-          return ComparePriority(a, b);
-        }
-      );
-      *value = queue_.back();
-      queue_.pop_back();
-    } else {
-      *value = std::move(queue_.front());	
-      queue_.erase(queue_.begin());
+    auto pred = [this]{return !heap_.empty();};
+    if (timeout_us < 0) {
+      cond_.wait(lk, pred);
+    } else if (!cond_.wait_for(lk, std::chrono::microseconds(timeout_us),
+                               pred)) {
+      return false;
+    }
+    PopLocked(value);
+    return true;
+  }
+
+  /**
+   * \brief pop the first element without waiting, threadsafe
+   * \param steal only pop while another thread is busy with this queue, and
+   *   never a TERMINATE
+   * \return whether an element was popped
+   */
+  bool TryPop(BytePSEngineMessage* value, bool steal = false) {
+    std::lock_guard<std::mutex> lk(mu_);
+    if (heap_.empty()) return false;
+    if (steal && (busy_cnt_ == 0 ||
+                  heap_[0]->msgs.front().ops == TERMINATE)) {
+      return false;
     }
+    PopLocked(value);
+    return true;
+  }
+
+  /**
+   * \brief the popped message of EngineQueueKey() |key| is processed,
+   * release the key
+   */
+  void Done(uint64_t key) {
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      auto& entry = keys_[key];
+      entry.busy = false;
+      --busy_cnt_;
+      if (entry.msgs.empty()) return;
+      entry.pos = heap_.size();
+      heap_.push_back(&entry);
+      SiftUp(entry.pos);
+    }
+    cond_.notify_one();
+  }
+
+  // number of queued messages, busy keys included
+  size_t Size() const {
+    std::lock_guard<std::mutex> lk(mu_);
+    return size_;
   }
 
   void ClearCounter(uint64_t key) {
     if (!enable_schedule_) return;
     std::unique_lock<std::mutex> lk(mu_);
-    push_cnt_[key] = 0;
+    auto& entry = keys_[key];
+    entry.push_cnt = 0;
+    if (entry.pos >= 0) SiftDown(entry.pos);
   }
 
-  bool ComparePriority(const BytePSEngineMessage& a, const BytePSEngineMessage& b) {
-    if (push_cnt_[a.key] == push_cnt_[b.key]) {
-      return (a.id > b.id);
+ private:
+  struct KeyEntry {
+    uint64_t push_cnt = 0;
+    std::deque<BytePSEngineMessage> msgs;
+    bool busy = false;
+    int pos = -1;  // index in heap_, -1 if busy or no message is queued
+  };
+
+  void PopLocked(BytePSEngineMessage* value) {
+    --size_;
+    auto entry = heap_[0];
+    *value = std::move(entry->msgs.front());
+    entry->msgs.pop_front();
+    Swap(0, heap_.size() - 1);
+    heap_.pop_back();
+    entry->pos = -1;
+    if (!heap_.empty()) SiftDown(0);
+    entry->busy = true;
+    ++busy_cnt_;
+  }
+
+  bool ComparePriority(const KeyEntry* a, const KeyEntry* b) const {
+    if (!enable_schedule_ || a->push_cnt == b->push_cnt) {
+      return (a->msgs.front().id < b->msgs.front().id);
     } else {
-      return (push_cnt_[a.key] > push_cnt_[b.key]);
+      return (a->push_cnt > b->push_cnt);
+    }
+  }
+
+  void Swap(int i, int j) {
+    std::swap(heap_[i], heap_[j]);
+    heap_[i]->pos = i;
+    heap_[j]->pos = j;
+  }
+
+  void SiftUp(int i) {
+    while (i > 0) {
+      int parent = (i - 1) / 2;
+      if (!ComparePriority(heap_[i], heap_[parent])) break;
+      Swap(i, parent);
+      i = parent;
+    }
+  }
+
+  void SiftDown(int i) {
+    int n = heap_.size();
+    while (true) {
+      int best = i;
+      int l = 2 * i + 1, r = 2 * i + 2;
+      if (l < n && ComparePriority(heap_[l], heap_[best])) best = l;
+      if (r < n && ComparePriority(heap_[r], heap_[best])) best = r;
+      if (best == i) break;
+      Swap(i, best);
+      i = best;
     }
   }
 
- private:
   mutable std::mutex mu_;
-  std::vector<BytePSEngineMessage> queue_;
   std::condition_variable cond_;
-  std::unordered_map<uint64_t, uint64_t> push_cnt_;
+  // entries are never erased, so the pointers in heap_ stay valid
+  std::unordered_map<uint64_t, KeyEntry> keys_;
+  std::vector<KeyEntry*> heap_;
+  size_t busy_cnt_ = 0;
+  size_t size_ = 0;
   volatile bool enable_schedule_ = false;
 };
 
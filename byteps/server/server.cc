@@ -13,7 +13,18 @@
 // limitations under the License.
 // =============================================================================
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
 #include "server.h"
+#include "buffer_pool.h"
+#include "../common/cpu_affinity.h"
+#include "optimizer.h"
 #include "queue.h"
 
 namespace byteps {
@@ -25,12 +36,47 @@ using namespace ps;
 std::vector<PriorityQueue*> engine_queues_;
 std::vector<std::thread *> engine_threads_;
 
+// store buffers
+BufferPool* buffer_pool_;
+
+// applies the updates of kServerOptimizerPushPull keys
+ServerOptimizer* server_optimizer_;
+
+// BYTEPS_SERVER_THREAD_AFFINITY, the CPUs of the engine threads
+byteps::common::CpuAffinity* engine_affinity_;
+
+// the shared memory segments of the co-located workers, by name, mapped by
+// their first push until the server shuts down
+std::unordered_map<std::string, std::pair<char*, size_t> > colocated_segments_;
+std::mutex colocated_mu_;
+
+// The data of a kColocatedPushPull push
+char* MapColocated(const byteps::common::ColocatedBuffer& buf) {
+  std::string name(buf.name, strnlen(buf.name, sizeof(buf.name)));
+  CHECK_LE(buf.offset + buf.len, buf.size) << name;
+  std::lock_guard<std::mutex> lock(colocated_mu_);
+  auto& segment = colocated_segments_[name];
+  if (!segment.first) {
+    int fd = shm_open(name.c_str(), O_RDWR, 0666);
+    CHECK_GE(fd, 0) << "shm_open failed for " << name
+                    << ", is the worker on another host?";
+    void* ptr = mmap(0, buf.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    CHECK_NE(ptr, (void*)-1) << name << ": " << strerror(errno);
+    segment = std::make_pair(static_cast<char*>(ptr), (size_t) buf.size);
+  }
+  CHECK_EQ(segment.second, buf.size) << name << " was mapped with another size";
+  return segment.first + buf.offset;
+}
+
+// Called with the handle_mu_ of the key's shard held
 void SendPushResponse(uint64_t key, const ps::KVMeta& req, ps::KVServer<char>* server){
-  auto iterator = push_response_map_.find(key);
-  if (iterator == push_response_map_.end()) { // new key
+  auto& response_map = push_response_map_[GetShardID(key)];
+  auto iterator = response_map.find(key);
+  if (iterator == response_map.end()) { // new key
     ps::KVPairs<char> response;
     response.keys.push_back(key);
-    push_response_map_[key] = response; // add to the map
+    response_map[key] = response; // add to the map
     server->Response(req, response);
   } else { // not new key, then reuse the memory address to avoid ibv_reg_mr on RDMA data path
     ps::KVPairs<char> *response = &iterator->second;
@@ -43,19 +89,37 @@ void SendPullResponse(const DataHandleType type,
                       const uint64_t key,
                       const ps::KVMeta& req_meta,
                       ps::KVServer<char>* server) {
-  std::lock_guard<std::mutex> lock(pullresp_mu_);
-  auto& stored = store_[key];
+  auto shard = GetShardID(key);
+  std::lock_guard<std::mutex> lock(store_mu_[shard]);
+  auto store_it = store_[shard].find(key);
+  CHECK(store_it != store_[shard].end()) << "init " << key << " first";
+  auto& stored = store_it->second;
   CHECK(stored.tensor) << "init " << key << " first";
+  auto& response_map = pull_response_map_[shard];
   // as server returns when store_realt is ready in this case
   auto len = stored.len;
+  if (log_key_info_) {
+    LOG(INFO) << "pull response key=" << key << "\t version=" << stored.version
+              << "\t receiver=" << req_meta.sender;
+  }
+  auto colocated = stored.colocated.find(req_meta.sender);
+  if (colocated != stored.colocated.end()) {
+    // into the shared memory of the worker, which only needs to be told
+    bps_reducer_->copy(colocated->second, stored.tensor, len);
+    ps::KVPairs<char> response;
+    response.keys = {EncodeKey(key)};
+    response.lens = {0};
+    server->Response(req_meta, response);
+    return;
+  }
   // send pull response
-  auto iterator = pull_response_map_.find(key);
-  if (iterator == pull_response_map_.end()) { // new key
+  auto iterator = response_map.find(key);
+  if (iterator == response_map.end()) { // new key
     ps::KVPairs<char> response;
     response.keys = {EncodeKey(key)};
     response.lens = {len};
     response.vals = ps::SArray<char>(stored.tensor, len, false); // zero copy
-    pull_response_map_[key] = response; // add to the map
+    response_map[key] = response; // add to the map
     server->Response(req_meta, response);
   } else { // not new key, then reuse the memory address to avoid ibv_reg_mr on RDMA data path
     ps::KVPairs<char> *response = &iterator->second;
@@ -63,19 +127,164 @@ void SendPullResponse(const DataHandleType type,
     auto p = static_cast<char*>(stored.tensor);
     CHECK(p);
     response->vals = ps::SArray<char>(p, len, false); 
+    // except for row-sparse keys, whose merges vary in size
+    if (stored.row_len) response->lens = ps::SArray<int>(1, len);
     server->Response(req_meta, *response);
   }
 }
 
+// Push |msg| to the engine. A message larger than engine_chunk_size_ is split
+// into chunks, spread over the engine queues from |tid|, so that the engine
+// threads reduce it in parallel. The chunks of a COPY_MERGED or FLIP_MERGED
+// count down pending_chunks, and the last one done releases the pulls.
+void PushEngineMessage(size_t tid, const BytePSEngineMessage& msg) {
+  if (!engine_chunk_size_ || msg.len <= engine_chunk_size_) {
+    engine_queues_[tid]->Push(msg);
+    return;
+  }
+  int chunks = (msg.len + engine_chunk_size_ - 1) / engine_chunk_size_;
+  CHECK_LT(chunks, 1 << 16) << "BYTEPS_SERVER_ENGINE_CHUNK_SIZE is too small";
+  std::shared_ptr<std::atomic<int> > pending;
+  if (msg.ops == COPY_MERGED || msg.ops == FLIP_MERGED ||
+      msg.ops == APPLY_OPTIMIZER) pending.reset(new std::atomic<int>(chunks));
+  for (int c = 0; c < chunks; ++c) {
+    auto offset = c * engine_chunk_size_;
+    BytePSEngineMessage chunk = msg;
+    chunk.dst = (char*) msg.dst + offset;
+    chunk.src = (char*) msg.src + offset;
+    if (msg.src2) chunk.src2 = (char*) msg.src2 + offset;
+    for (int s = 0; s < 2; ++s) {
+      if (msg.state[s]) chunk.state[s] = (char*) msg.state[s] + offset;
+    }
+    chunk.len = std::min(engine_chunk_size_, msg.len - offset);
+    chunk.chunk = c;
+    chunk.pending_chunks = pending;
+    engine_queues_[(tid + c) % engine_thread_num_]->Push(chunk);
+  }
+}
+
+void ClearEngineCounter(size_t tid, uint64_t key, size_t len) {
+  int chunks = 1;
+  if (engine_chunk_size_ && len > engine_chunk_size_) {
+    chunks = (len + engine_chunk_size_ - 1) / engine_chunk_size_;
+  }
+  for (int c = 0; c < chunks; ++c) {
+    engine_queues_[(tid + c) % engine_thread_num_]->ClearCounter(
+        key ^ ((uint64_t) c << 48));
+  }
+}
+
+// Called when a COPY_MERGED, FLIP_MERGED or APPLY_OPTIMIZER chunk is done. Once all chunks are,
+// the merged result is in the store: answer the pulls waiting for it.
+void FinishMerge(const BytePSEngineMessage& msg) {
+  if (msg.pending_chunks && --(*msg.pending_chunks) > 0) {
+    return;  // other chunks are still running
+  }
+  {
+    auto shard = GetShardID(msg.key);
+    std::lock_guard<std::mutex> lock(store_mu_[shard]);
+    auto& stored = store_[shard][msg.key];
+    if (msg.ops == FLIP_MERGED) {
+      // the merged slot becomes the one pulls are served from
+      std::swap(stored.tensor, stored.next);
+    }
+    ++stored.version;
+  }
+  // the pull state lives with the engine thread of the key, whoever runs the
+  // message
+  auto tid = GetThreadID(msg.key, 0);
+  std::lock_guard<std::mutex> lock(flag_mu_[tid]);
+  if (is_push_finished_[tid].find(msg.key) == is_push_finished_[tid].end()) {
+    is_push_finished_[tid][msg.key] = false;
+    pull_cnt_[tid][msg.key] = 0;
+    pull_quota_[tid][msg.key] = 0;
+  }
+  // with partial aggregation, a merge may be published before all the pulls
+  // of the previous one came in, so the quotas add up
+  is_push_finished_[tid][msg.key] = true;
+  pull_quota_[tid][msg.key] += msg.pushes ? msg.pushes : ActiveWorkers();
+  auto& pulls = q_pull_reqmeta_[tid][msg.key];
+  size_t served = 0;
+  auto now = enable_stats_ ? StatsNowMicros() : 0;
+  for (auto& req_meta : pulls) {
+    SendPullResponse(msg.type, msg.key, req_meta, byteps_server_); 
+    if (enable_stats_) {
+      auto ks = GetKeyStats(msg.key);
+      ks->pulls++;
+      ks->pull_waits++;
+      ks->pull_wait_us += now - q_pull_time_[tid][msg.key][served];
+    }
+    ++served;
+    pull_cnt_[tid][msg.key] += 1;
+    if (pull_cnt_[tid][msg.key] == pull_quota_[tid][msg.key]) {
+      is_push_finished_[tid][msg.key] = false;
+      pull_cnt_[tid][msg.key] = 0;
+      pull_quota_[tid][msg.key] = 0;
+      break;
+    }
+  }
+  pulls.erase(pulls.begin(), pulls.begin() + served);
+  if (enable_stats_) {
+    auto& times = q_pull_time_[tid][msg.key];
+    times.erase(times.begin(), times.begin() + served);
+  }
+}
+
+// Encode the rows the pushes of a row-sparse key touched from its sum into the
+// store, and zero them for the next merge
+void MergeRows(uint64_t key, BytePSArray& stored) {
+  std::sort(stored.rows.begin(), stored.rows.end());
+  auto len = byteps::common::EncodeRows(stored.decompressed, stored.dense_len,
+                                        stored.row_len, stored.rows,
+                                        stored.tensor);
+  for (auto r : stored.rows) {
+    memset(stored.decompressed + r * stored.row_len, 0, stored.row_len);
+    stored.row_seen[r] = false;
+  }
+  stored.rows.clear();
+  std::lock_guard<std::mutex> lock(store_mu_[GetShardID(key)]);
+  stored.len = len;
+}
+
+// Take a message from the queue of another engine thread that is busy,
+// starting after |self|. |home| is set to the queue it came from.
+bool StealEngineMessage(size_t self, BytePSEngineMessage* msg, size_t* home) {
+  for (size_t n = 1; n < engine_thread_num_; ++n) {
+    auto victim = (self + n) % engine_thread_num_;
+    if (engine_queues_[victim]->TryPop(msg, true)) {
+      *home = victim;
+      return true;
+    }
+  }
+  return false;
+}
+
 void BytePSServerEngineThread(int i) {
+  if (engine_affinity_) {
+    // a reducer with an OpenMP team needs more than one CPU
+    if (bps_reducer_->getNumThreads() > 1) {
+      engine_affinity_->PinToSet();
+    } else {
+      engine_affinity_->PinToCpu(i);
+    }
+  }
   auto& q = engine_queues_[i];
   while (true) {
     BytePSEngineMessage msg;
-    q->WaitAndPop(&msg);
+    size_t home = i;
+    if (enable_engine_steal_) {
+      if (!q->TryPop(&msg) && !StealEngineMessage(i, &msg, &home) &&
+          !q->WaitAndPop(&msg, engine_steal_interval_us_)) {
+        continue;
+      }
+    } else {
+      q->WaitAndPop(&msg);
+    }
     if (msg.ops == TERMINATE) break;
     // do some check
     CHECK(msg.dst);
     CHECK(msg.src);
+    auto start = enable_stats_ ? StatsNowMicros() : 0;
 
     bool is_debug = (debug_mode_ && (debug_key_ == msg.key));
     switch (msg.ops) {
@@ -97,21 +306,46 @@ void BytePSServerEngineThread(int i) {
                     << "dst_addr: " << DEBUG_PRINT_TENSOR_ADDRESS(msg.dst) << "\t"
                     << "src_addr: " << DEBUG_PRINT_TENSOR_ADDRESS(msg.src) << "\t";
         }
-        std::lock_guard<std::mutex> lock(flag_mu_[i]);
-        if (is_push_finished_[i].find(msg.key) == is_push_finished_[i].end()) {
-          is_push_finished_[i][msg.key] = false;
-          pull_cnt_[i][msg.key] = 0;
-        }
-        is_push_finished_[i][msg.key] = true;
-        for (auto& req_meta : q_pull_reqmeta_[i][msg.key]) {
-          SendPullResponse(msg.type, msg.key, req_meta, byteps_server_); 
-          pull_cnt_[i][msg.key] += 1;
-          if (pull_cnt_[i][msg.key] == (size_t) ps::NumWorkers()) {
-            is_push_finished_[i][msg.key] = false;
-            pull_cnt_[i][msg.key] = 0;
-          }
-        }
-        q_pull_reqmeta_[i][msg.key].clear();
+        FinishMerge(msg);
+        break;
+      }
+      case FLIP_MERGED: {
+        FinishMerge(msg);
+        break;
+      }
+      case APPLY_OPTIMIZER: {
+        server_optimizer_->Apply((float*) msg.dst, (float*) msg.src,
+                                 (float*) msg.state[0], (float*) msg.state[1],
+                                 msg.len / sizeof(float), msg.replicas, msg.step);
+        FinishMerge(msg);
+        break;
+      }
+      case DECOMPRESS_RECV:
+      case DECOMPRESS_SUM_RECV: {
+        GetStore(msg.key)->compressor->Decompress(
+            msg.src, msg.dst, msg.ops == DECOMPRESS_SUM_RECV);
+        break;
+      }
+      case COMPRESS_MERGED: {
+        GetStore(msg.key)->compressor->Compress(msg.src, msg.dst);
+        FinishMerge(msg);
+        break;
+      }
+      case SPARSE_SUM_RECV: {
+        auto stored = GetStore(msg.key);
+        byteps::common::AddRows(msg.src, msg.dst, msg.type.dtype,
+                                &stored->row_seen, &stored->rows);
+        break;
+      }
+      case SPARSE_MERGED: {
+        MergeRows(msg.key, *GetStore(msg.key));
+        FinishMerge(msg);
+        break;
+      }
+      case SUM_RECV_PAIR: {
+        CHECK(msg.src2);
+        CHECK_GE(bps_reducer_->sum(msg.dst, msg.src, msg.src2, msg.len,
+                                   bps_reducer_->GetDataType(msg.type.dtype)), 0);
         break;
       }
       case SUM_RECV: {
@@ -141,14 +375,224 @@ void BytePSServerEngineThread(int i) {
       default:
         CHECK(0);
     }
+    if (enable_stats_) {
+      auto& stats = *engine_stats_[i];
+      stats.msgs++;
+      stats.busy_us += StatsNowMicros() - start;
+      if (msg.ops == SUM_RECV || msg.ops == SUM_RECV_PAIR ||
+          msg.ops == DECOMPRESS_SUM_RECV || msg.ops == SPARSE_SUM_RECV) {
+        stats.sum_bytes += msg.len;
+      }
+    }
+    engine_queues_[home]->Done(EngineQueueKey(msg));
+  }
+}
+
+// Copies summed by a merge of |pushes| pushes of a server-optimizer key. A
+// resize leaves the replicas of the new workers unknown, they are assumed to
+// have as many GPUs as the initial workers on average.
+size_t MergedReplicas(const BytePSArray& stored, size_t pushes) {
+  if (pushes == stored.replica_pushes) return stored.replicas;
+  return std::max<size_t>(
+      (pushes * stored.replicas + stored.replica_pushes / 2) /
+          stored.replica_pushes, 1);
+}
+
+// Publish the pushes merged so far for |key| to the store, as the engine
+// finishes summing them. Called with the handle_mu_ of the key's shard held.
+void CloseRound(uint64_t key, DataHandleType type, UpdateBuf& updates,
+                BytePSArray& stored, size_t tid, bool double_buffer) {
+  auto& update = updates.merged;
+  auto len = update.len;
+  auto step = updates.merges++;
+  if (enable_stats_) {
+    auto ks = GetKeyStats(key);
+    ks->merges++;
+    ks->push_span_us += std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - updates.round_start).count();
+  }
+  if (stored.compressor) {
+    // recompress the sum into the store, which the pulls are answered with
+    if (is_engine_blocking_) {
+      stored.compressor->Compress(stored.decompressed, stored.tensor);
+    } else {
+      BytePSEngineMessage msg = {timestamp_++, type, key, stored.tensor, stored.decompressed, stored.len, COMPRESS_MERGED};
+      msg.pushes = updates.request.size();
+      // not chunked, compressed data cannot be split by bytes
+      engine_queues_[tid]->Push(msg);
+      ClearEngineCounter(tid, key, 0);
+    }
+    updates.request.clear();
+    return;
+  }
+  if (stored.row_len) {
+    if (is_engine_blocking_) {
+      MergeRows(key, stored);
+    } else {
+      BytePSEngineMessage msg = {timestamp_++, type, key, stored.tensor, stored.decompressed, stored.dense_len, SPARSE_MERGED};
+      msg.pushes = updates.request.size();
+      // not chunked, the rows are scattered over the sum
+      engine_queues_[tid]->Push(msg);
+      ClearEngineCounter(tid, key, 0);
+    }
+    updates.request.clear();
+    return;
+  }
+  if (is_engine_blocking_) {
+    if (stored.optimized) {
+      server_optimizer_->Apply((float*) stored.tensor, (float*) update.tensor,
+                               stored.opt_state[0], stored.opt_state[1],
+                               len / sizeof(float),
+                               MergedReplicas(stored, updates.request.size()),
+                               step);
+    } else {
+      bps_reducer_->copy(stored.tensor, updates.merged.tensor, len);
+    }
+  } else {
+    if (debug_mode_ && (debug_key_ == key)) {
+      std::lock_guard<std::mutex> lock(debug_mu_);
+      LOG(INFO) << "stage: COPY_MERGED_TO_STORE \t" 
+                << "stored: " << DEBUG_PRINT_TENSOR_VALUE(stored.tensor) << "\t"
+                << "merged: " << DEBUG_PRINT_TENSOR_VALUE(updates.merged.tensor) << "\t"
+                << "pushes: " << updates.request.size();
+    }
+    auto ops = double_buffer ? FLIP_MERGED : COPY_MERGED;
+    if (stored.optimized) ops = APPLY_OPTIMIZER;
+    // the message holds the first push, which |merged| may alias, as the
+    // next push can start a new merge before the engine gets to this one
+    BytePSEngineMessage msg = {timestamp_++, type, key, stored.tensor, update.tensor, len, ops, update.tmp_sarray};
+    msg.pushes = updates.request.size();
+    if (stored.optimized) msg.replicas = MergedReplicas(stored, msg.pushes);
+    msg.state[0] = stored.opt_state[0];
+    msg.state[1] = stored.opt_state[1];
+    msg.step = step;
+    PushEngineMessage(tid, msg);
+    ClearEngineCounter(tid, key, len);
+  }
+  updates.request.clear();
+}
+
+// The resize requests of the workers that stay, answered together once all
+// of them came in, which also lines them up at the same iteration boundary
+std::mutex resize_mu_;
+std::vector<ps::KVMeta> resize_requests_;
+size_t resize_workers_ = 0;
+
+void HandleResize(const ps::KVMeta& req_meta,
+                  const ps::KVPairs<char>& req_data, ps::KVServer<char>* server) {
+  CHECK(req_meta.push) << "resize requests are pushes";
+  CHECK_EQ(req_data.vals.size(), sizeof(int32_t));
+  auto workers = *reinterpret_cast<const int32_t*>(req_data.vals.data());
+  CHECK_GT(workers, 0);
+  // ps-lite keeps the nodes it started with, only their share can change
+  CHECK_LE(workers, ps::NumWorkers()) << "cannot grow past DMLC_NUM_WORKER";
+  std::lock_guard<std::mutex> lock(resize_mu_);
+  if (resize_requests_.empty()) resize_workers_ = workers;
+  CHECK_EQ((size_t) workers, resize_workers_) << "workers disagree on the new size";
+  resize_requests_.push_back(req_meta);
+  if (resize_requests_.size() < resize_workers_) return;
+  // between iterations, no merge is open and no pull is waiting
+  for (size_t s = 0; s < handle_shard_num_; ++s) {
+    std::lock_guard<std::mutex> shard_lock(handle_mu_[s]);
+    for (auto& it : update_buf_[s]) {
+      CHECK(it.second.request.empty()) << "key=" << it.first
+          << " has pushes of an unfinished iteration, resize between iterations";
+    }
+  }
+  LOG(INFO) << "BytePS server merges the pushes of " << resize_workers_
+            << " workers, instead of " << ActiveWorkers();
+  num_workers_ = resize_workers_;
+  ps::KVPairs<char> response;
+  response.keys = req_data.keys;
+  for (const auto& req : resize_requests_) server->Response(req, response);
+  resize_requests_.clear();
+}
+
+// Publish the merges whose first push is older than round_timeout_ms_, so a
+// straggler cannot hold back the pulls of the others
+void BytePSServerRoundTimer() {
+  auto timeout = std::chrono::milliseconds(round_timeout_ms_);
+  auto interval = std::max(timeout / 4, std::chrono::milliseconds(1));
+  while (!round_timer_stop_) {
+    std::this_thread::sleep_for(interval);
+    auto now = std::chrono::steady_clock::now();
+    for (size_t shard = 0; shard < handle_shard_num_; ++shard) {
+      std::lock_guard<std::mutex> lock(handle_mu_[shard]);
+      for (auto& it : update_buf_[shard]) {
+        auto key = it.first;
+        auto& updates = it.second;
+        if (updates.request.empty() || now - updates.round_start < timeout) {
+          continue;
+        }
+        auto& stored = *GetStore(key);
+        if (!stored.tensor) continue;  // still collecting the init pushes
+        DataHandleType type = {RequestType::kDefaultPushPull,
+                               updates.merged.dtype};
+        CloseRound(key, type, updates, stored, GetThreadID(key, 0), false);
+      }
+    }
+  }
+}
+
+// Write the counters of stats.h to stats_file_ every stats_interval_ms_, as
+// one line per engine thread and per key. Rates are over the last interval.
+void BytePSServerStatsDumper() {
+  std::vector<uint64_t> last_bytes(engine_thread_num_, 0);
+  std::vector<uint64_t> last_busy(engine_thread_num_, 0);
+  auto last = StatsNowMicros();
+  while (!stats_stop_) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(stats_interval_ms_));
+    auto now = StatsNowMicros();
+    double elapsed = std::max<double>(now - last, 1);
+    last = now;
+
+    auto tmp = stats_file_ + ".tmp";
+    std::ofstream out(tmp, std::ios::trunc);
+    if (!out) {
+      LOG(WARNING) << "cannot write server stats to " << stats_file_;
+      continue;
+    }
+    for (size_t i = 0; i < engine_thread_num_; ++i) {
+      auto& stats = *engine_stats_[i];
+      uint64_t bytes = stats.sum_bytes, busy = stats.busy_us;
+      out << "engine " << i
+          << " queue=" << engine_queues_[i]->Size()
+          << " msgs=" << stats.msgs
+          << " sum_bytes=" << bytes
+          << " sum_MBps=" << (bytes - last_bytes[i]) / elapsed
+          << " busy=" << (busy - last_busy[i]) / elapsed << "\n";
+      last_bytes[i] = bytes;
+      last_busy[i] = busy;
+    }
+    for (size_t shard = 0; shard < handle_shard_num_; ++shard) {
+      std::lock_guard<std::mutex> lock(store_mu_[shard]);
+      for (auto& it : key_stats_[shard]) {
+        auto& ks = it.second;
+        uint64_t merges = ks.merges, waits = ks.pull_waits;
+        out << "key " << it.first
+            << " pushes=" << ks.pushes
+            << " push_bytes=" << ks.push_bytes
+            << " merges=" << merges
+            << " push_span_us=" << (merges ? ks.push_span_us / merges : 0)
+            << " pulls=" << ks.pulls
+            << " pull_waits=" << waits
+            << " pull_wait_us=" << (waits ? ks.pull_wait_us / waits : 0)
+            << "\n";
+      }
+    }
+    out.close();
+    std::rename(tmp.c_str(), stats_file_.c_str());
   }
 }
 
 void BytePSHandler(const ps::KVMeta& req_meta,
                    const ps::KVPairs<char> &req_data, ps::KVServer<char>* server) {
-  std::lock_guard<std::mutex> lock(handle_mu_); // push & pull may have racing
   DataHandleType type = DepairDataHandleType(req_meta.cmd);
-  CHECK_EQ(type.requestType, RequestType::kDefaultPushPull); 
+  CHECK(type.requestType == RequestType::kDefaultPushPull ||
+        type.requestType == RequestType::kRowSparsePushPull ||
+        type.requestType == RequestType::kCompressedPushPull ||
+        type.requestType == RequestType::kServerOptimizerPushPull ||
+        type.requestType == RequestType::kColocatedPushPull);
   // do some check
   CHECK_EQ(req_data.keys.size(), (size_t)1);
   if (log_key_info_) {
@@ -166,41 +610,160 @@ void BytePSHandler(const ps::KVMeta& req_meta,
     }
   }
   uint64_t key = DecodeKey(req_data.keys[0]);
+  if (key == byteps::common::kResizeKey) {
+    HandleResize(req_meta, req_data, server);
+    return;
+  }
+  auto shard = GetShardID(key);
+  // push & pull of the same key may have racing
+  std::lock_guard<std::mutex> lock(handle_mu_[shard]);
+  auto& update_buf = update_buf_[shard];
   if (req_meta.push) { // push request
     CHECK_EQ(req_data.lens.size(), (size_t)1);
     CHECK_EQ(req_data.vals.size(), (size_t)req_data.lens[0]);
-    auto& stored = store_[key];
+    auto& stored = *GetStore(key);
     auto len = (size_t) req_data.lens[0];
     auto recved = reinterpret_cast<char*>(req_data.vals.data());
+    if (type.requestType == RequestType::kColocatedPushPull) {
+      // a dense push read from the shared memory of the worker, which it
+      // leaves alone until its pull is answered
+      CHECK(enable_colocated_) << "co-located push of key=" << key;
+      CHECK_EQ(len, sizeof(byteps::common::ColocatedBuffer)) << "key=" << key;
+      auto& buf = *reinterpret_cast<const byteps::common::ColocatedBuffer*>(recved);
+      recved = MapColocated(buf);
+      len = buf.len;
+      type.requestType = RequestType::kDefaultPushPull;
+      std::lock_guard<std::mutex> lock(store_mu_[shard]);
+      stored.colocated[req_meta.sender] = recved;
+    }
+    if (enable_stats_) {
+      auto ks = GetKeyStats(key);
+      ks->pushes++;
+      ks->push_bytes += len;
+    }
     if (!stored.tensor) {
-      if (sync_mode_ && (update_buf_.find(key) == update_buf_.end())) {
-        update_buf_[key].merged.len = len;
-        update_buf_[key].merged.dtype = type.dtype;
+      const byteps::common::ServerOptimizerHeader* opt_header = nullptr;
+      if (type.requestType == RequestType::kServerOptimizerPushPull) {
+        // no values, only the size and the replicas of the worker
+        CHECK_EQ(len, sizeof(*opt_header)) << "key=" << key;
+        opt_header = reinterpret_cast<const byteps::common::ServerOptimizerHeader*>(recved);
+        CHECK_GT(opt_header->replicas, 0u) << "key=" << key;
+        len = opt_header->len;
+      }
+      if (sync_mode_ && (update_buf.find(key) == update_buf.end())) {
+        update_buf[key].merged.len = len;
+        update_buf[key].merged.dtype = type.dtype;
       }
       // buffer the request meta
-      auto &updates = update_buf_[key];
+      auto &updates = update_buf[key];
       updates.request.push_back(req_meta);
+      if (opt_header) updates.replicas += opt_header->replicas;
       // should send response after collecting all init push
-      if (updates.request.size() < (size_t) ps::NumWorkers()) return;
+      if (updates.request.size() < ActiveWorkers()) return;
       if (log_key_info_) {
         LOG(INFO) << "Collected all " << updates.request.size()
                   << " requests for key=" << key
                   << ", init the store buffer size=" << (size_t) req_data.lens[0];
       }
       // initialization
-      stored.tensor = (char*) malloc(len); 
+      auto store_len = len;
+      if (type.requestType == RequestType::kRowSparsePushPull) {
+        // room for the rows of any merge, the init push has none
+        auto header = reinterpret_cast<const byteps::common::RowSparseHeader*>(recved);
+        CHECK_GE(len, sizeof(*header)) << "key=" << key << " is not row-sparse";
+        store_len = byteps::common::RowSparseCapacity(header->len, header->row_len);
+      }
+      stored.tensor = buffer_pool_->Alloc(store_len); 
       stored.len = len;
       stored.dtype = type.dtype;
       CHECK(stored.tensor);
-      bps_reducer_->copy(stored.tensor, recved, len); // we may not need this copy
+      if (type.requestType == RequestType::kServerOptimizerPushPull) {
+        CHECK(sync_mode_) << "the server optimizer needs synchronous training";
+        CHECK_EQ(bps_reducer_->GetDataType(type.dtype), byteps::common::BYTEPS_FLOAT32)
+            << "the server optimizer only supports float32, key=" << key;
+        stored.optimized = true;
+        stored.replicas = updates.replicas;
+        stored.replica_pushes = updates.request.size();
+        for (int s = 0; s < server_optimizer_->NumStates(); ++s) {
+          stored.opt_state[s] = (float*) buffer_pool_->Alloc(len);
+          memset(stored.opt_state[s], 0, len);
+        }
+      } else if (type.requestType == RequestType::kCompressedPushPull) {
+        CHECK(sync_mode_) << "compression needs synchronous training";
+        // the init push tells the format of the compressed pushes
+        stored.compressor = byteps::common::Compressor::Create(recved, compressor_error_feedback_);
+        CHECK(stored.compressor) << "key=" << key << " is not compressed";
+        CHECK_EQ(stored.compressor->compressed_len(), len) << "key=" << key;
+        stored.decompressed = buffer_pool_->Alloc(stored.compressor->len());
+      } else if (type.requestType == RequestType::kRowSparsePushPull) {
+        CHECK(sync_mode_) << "row-sparse push_pull needs synchronous training";
+        auto header = reinterpret_cast<const byteps::common::RowSparseHeader*>(recved);
+        CHECK_GT(header->row_len, 0) << "key=" << key;
+        CHECK_EQ(header->len % header->row_len, 0) << "key=" << key;
+        stored.row_len = header->row_len;
+        stored.dense_len = header->len;
+        stored.decompressed = buffer_pool_->Alloc(stored.dense_len);
+        memset(stored.decompressed, 0, stored.dense_len);
+        stored.row_seen.assign(stored.dense_len / stored.row_len, false);
+      } else if (enable_double_buffer_) {
+        stored.next = buffer_pool_->Alloc(len);
+        CHECK(stored.next);
+      }
+      if (stored.optimized) {
+        // the weights come with the first merge
+        memset(stored.tensor, 0, len);
+      } else {
+        bps_reducer_->copy(stored.tensor, recved, len); // we may not need this copy
+      }
       for (const auto& req : updates.request) {
         SendPushResponse(key, req, server);
       }
       updates.request.clear();
+    } else if (stored.row_len) {
+      // sum the rows of the pushes in order, on the engine of the key
+      auto header = reinterpret_cast<const byteps::common::RowSparseHeader*>(recved);
+      CHECK_EQ(header->len, stored.dense_len) << "key=" << key;
+      auto &updates = update_buf[key];
+      auto tid = GetThreadID(key, stored.dense_len);
+      if (updates.request.empty()) updates.round_start = std::chrono::steady_clock::now();
+      if (is_engine_blocking_) {
+        byteps::common::AddRows(recved, stored.decompressed, type.dtype,
+                                &stored.row_seen, &stored.rows);
+      } else {
+        BytePSEngineMessage msg = {timestamp_++, type, key, stored.decompressed, recved, len, SPARSE_SUM_RECV, req_data, req_meta};
+        engine_queues_[tid]->Push(msg);
+      }
+      updates.request.push_back(req_meta);
+      SendPushResponse(key, req_meta, server);
+      if (updates.request.size() == RoundSize()) {
+        CloseRound(key, type, updates, stored, tid, false);
+      }
+    } else if (stored.compressor) {
+      // decompress and sum the pushes in order, on the engine of the key
+      auto &updates = update_buf[key];
+      auto tid = GetThreadID(key, len);
+      bool first = updates.request.empty();
+      if (first) updates.round_start = std::chrono::steady_clock::now();
+      if (is_engine_blocking_) {
+        stored.compressor->Decompress(recved, stored.decompressed, !first);
+      } else {
+        BytePSEngineMessage msg = {timestamp_++, type, key, stored.decompressed, recved, len, first ? DECOMPRESS_RECV : DECOMPRESS_SUM_RECV, req_data, req_meta};
+        engine_queues_[tid]->Push(msg);
+      }
+      updates.request.push_back(req_meta);
+      SendPushResponse(key, req_meta, server);
+      if (updates.request.size() == RoundSize()) {
+        CloseRound(key, type, updates, stored, tid, false);
+      }
     } else {
-      auto &updates = update_buf_[key];
+      auto &updates = update_buf[key];
       auto tid = GetThreadID(key, len);
+      // reduce into the other store slot and flip, instead of copying
+      bool double_buffer = enable_double_buffer_ && sync_mode_ &&
+          !is_engine_blocking_ && ActiveWorkers() > 1 &&
+          !IsPartialAggregation() && !stored.optimized;
       if (updates.request.empty()) { // from the first incoming worker
+        updates.round_start = std::chrono::steady_clock::now();
         if (sync_mode_) {
           if (is_engine_blocking_) {
             bps_reducer_->copy(updates.merged.tensor, recved, len);
@@ -225,7 +788,7 @@ void BytePSHandler(const ps::KVMeta& req_meta,
                                       bps_reducer_->GetDataType(stored.dtype)), 0);
           } else {
             BytePSEngineMessage msg = {timestamp_++, type, key, stored.tensor, recved, len, SUM_RECV, req_data};
-            engine_queues_[tid]->Push(msg);
+            PushEngineMessage(tid, msg);
           }
         }
       } else { // from other workers
@@ -246,39 +809,30 @@ void BytePSHandler(const ps::KVMeta& req_meta,
                       << "len: " << len << "\t"
                       << "addr: " << DEBUG_PRINT_TENSOR_ADDRESS(recved);
           }
-          BytePSEngineMessage msg = {timestamp_++, type, key, updates.merged.tensor, recved, len, SUM_RECV, req_data, req_meta};
-          engine_queues_[tid]->Push(msg);
+          if (double_buffer && updates.request.size() == 1) {
+            // the first worker's buffer plus this one, into the store slot
+            BytePSEngineMessage msg = {timestamp_++, type, key, stored.next, updates.merged.tensor, len, SUM_RECV_PAIR, req_data, req_meta, recved};
+            PushEngineMessage(tid, msg);
+            updates.merged.tensor = stored.next;
+          } else {
+            BytePSEngineMessage msg = {timestamp_++, type, key, updates.merged.tensor, recved, len, SUM_RECV, req_data, req_meta};
+            PushEngineMessage(tid, msg);
+          }
         }
       }
       // add a worker information (request.size() is the # workers received)
       updates.request.push_back(req_meta);
       SendPushResponse(key, req_meta, server);
-      if (sync_mode_ && updates.request.size() == (size_t) ps::NumWorkers()) {
-        auto& stored = store_[key];
-        auto& update = updates.merged;
-        if (is_engine_blocking_) {
-          bps_reducer_->copy(stored.tensor, updates.merged.tensor, len);
-        } else {
-          if (debug_mode_ && (debug_key_ == key)) {
-            std::lock_guard<std::mutex> lock(debug_mu_);
-            LOG(INFO) << "stage: COPY_MERGED_TO_STORE \t" 
-                      << "stored: " << DEBUG_PRINT_TENSOR_VALUE(stored.tensor) << "\t"
-                      << "merged: " << DEBUG_PRINT_TENSOR_VALUE(updates.merged.tensor) << "\t"
-                      << "recved: " << DEBUG_PRINT_TENSOR_VALUE(recved);
-          }
-          BytePSEngineMessage msg = {timestamp_++, type, key, stored.tensor, update.tensor, len, COPY_MERGED};
-          engine_queues_[tid]->Push(msg);
-          engine_queues_[tid]->ClearCounter(key);
-        }
-        updates.request.clear();
+      if (sync_mode_ && updates.request.size() == RoundSize()) {
+        CloseRound(key, type, updates, stored, tid, double_buffer);
       } else if (!sync_mode_) { 
         // async: clean the request buffer 
         updates.request.clear();
-        engine_queues_[tid]->ClearCounter(key);
+        ClearEngineCounter(tid, key, len);
       }
     }
   } else { // pull request
-    auto& stored = store_[key];
+    auto& stored = *GetStore(key);
     CHECK(stored.tensor) << "Processing pull request when the NDArray of key " 
                << key << " has not been inited yet, which is not expected.";
     if (is_engine_blocking_) {
@@ -289,19 +843,23 @@ void BytePSHandler(const ps::KVMeta& req_meta,
       if (is_push_finished_[tid].find(key) == is_push_finished_[tid].end()) {
         is_push_finished_[tid][key] = false;
         pull_cnt_[tid][key] = 0;
+        pull_quota_[tid][key] = 0;
       }
       if (is_push_finished_[tid][key]) { // push already finished
         SendPullResponse(type, key, req_meta, server); 
+        if (enable_stats_) GetKeyStats(key)->pulls++;
         pull_cnt_[tid][key] += 1;
-        if (pull_cnt_[tid][key] == (size_t) ps::NumWorkers()) {
+        if (pull_cnt_[tid][key] == pull_quota_[tid][key]) {
           is_push_finished_[tid][key] = false;
           pull_cnt_[tid][key] = 0;
+          pull_quota_[tid][key] = 0;
           // check: remain should be 0
           auto remain = q_pull_reqmeta_[tid][key].size();
           CHECK_EQ(remain, 0) << remain;
         }
       } else { // push not finished, put into the queue, and wait for the engine 
         q_pull_reqmeta_[tid][key].push_back(req_meta);
+        if (enable_stats_) q_pull_time_[tid][key].push_back(StatsNowMicros());
       }
     }
   }
@@ -331,9 +889,57 @@ void init_global_env() {
             << ", consider increasing BYTEPS_SERVER_ENGINE_THREAD for higher performance";
   CHECK_GE(engine_thread_num_, 1);
 
+  // idle engine threads take work from busy ones
+  enable_engine_steal_ = GetEnv("BYTEPS_SERVER_ENGINE_STEAL", true);
+  engine_steal_interval_us_ = GetEnv("BYTEPS_SERVER_ENGINE_STEAL_INTERVAL_US", 100);
+  if (enable_engine_steal_) LOG(INFO) << "Enable work stealing between server engine threads";
+
+  // large messages are reduced in chunks by several engine threads, 0 disables
+  engine_chunk_size_ = GetEnv("BYTEPS_SERVER_ENGINE_CHUNK_SIZE", 512 * 1024);
+  engine_chunk_size_ = engine_chunk_size_ / 64 * 64; // keep the chunks aligned
+
+  // sum into a second store buffer and flip it, instead of COPY_MERGED
+  enable_double_buffer_ = GetEnv("BYTEPS_SERVER_DOUBLE_BUFFER", false);
+  if (enable_double_buffer_) LOG(INFO) << "Enable double-buffered store for BytePS server";
+
+  // bounded staleness, only with the non-blocking engine in sync mode
+  quorum_ = GetEnv("BYTEPS_SERVER_QUORUM", 0);
+  round_timeout_ms_ = GetEnv("BYTEPS_SERVER_ROUND_TIMEOUT_MS", 0);
+  if (!sync_mode_ || is_engine_blocking_) {
+    quorum_ = 0;
+    round_timeout_ms_ = 0;
+  }
+  if (quorum_) LOG(INFO) << "BytePS server publishes a merge after " << quorum_ << " pushes";
+  if (round_timeout_ms_) LOG(INFO) << "BytePS server publishes a merge after " << round_timeout_ms_ << " ms";
+
+  // the workers on the host push through shared memory, and must not touch
+  // it until their pull is answered, which only holds for full rounds
+  enable_colocated_ = GetEnv("BYTEPS_SERVER_COLOCATED", false);
+  if (enable_colocated_ && (!sync_mode_ || IsPartialAggregation())) {
+    LOG(WARNING) << "BYTEPS_SERVER_COLOCATED needs synchronous training without "
+                 << "BYTEPS_SERVER_QUORUM or BYTEPS_SERVER_ROUND_TIMEOUT_MS";
+    enable_colocated_ = false;
+  }
+
+  // telemetry
+  if (getenv("BYTEPS_SERVER_STATS_FILE")) {
+    enable_stats_ = true;
+    stats_file_ = getenv("BYTEPS_SERVER_STATS_FILE");
+    stats_interval_ms_ = GetEnv("BYTEPS_SERVER_STATS_INTERVAL_MS", 1000);
+    CHECK_GT(stats_interval_ms_, 0);
+    LOG(INFO) << "BytePS server dumps its stats to " << stats_file_;
+  }
+
+  // error feedback when recompressing the sums of compressed keys
+  compressor_error_feedback_ = GetEnv("BYTEPS_COMPRESSOR_ERROR_FEEDBACK", true);
+
   // enable scheduling for server engine
   enable_schedule_ = GetEnv("BYTEPS_SERVER_ENABLE_SCHEDULE", false);
   if (enable_schedule_) LOG(INFO) << "Enable engine scheduling for BytePS server";
+
+  // number of lock shards of the per-key state
+  handle_shard_num_ = GetEnv("BYTEPS_SERVER_HANDLE_SHARDS", 32);
+  CHECK_GE(handle_shard_num_, 1);
 }
 
 extern "C" void byteps_server() {
@@ -342,23 +948,61 @@ extern "C" void byteps_server() {
   // cpu reducer
   bps_reducer_ = new byteps::common::CpuReducer(nullptr);
 
+  // store buffers
+  buffer_pool_ = new BufferPool(
+      GetEnv("BYTEPS_SERVER_ARENA_REGION_SIZE", 256 << 20),
+      getenv("BYTEPS_SERVER_MEMORY_LIMIT")
+          ? strtoull(getenv("BYTEPS_SERVER_MEMORY_LIMIT"), nullptr, 10) : 0,
+      GetEnv("BYTEPS_SERVER_NUMA_NODE", -1));
+  if (engine_chunk_size_ && !is_engine_blocking_) {
+    // the engine threads split the work already, no nested OpenMP team
+    bps_reducer_->setNumThreads(1);
+  }
+
+  // pin the engine threads, by default near the store buffers
+  if (getenv("BYTEPS_SERVER_THREAD_AFFINITY")) {
+    engine_affinity_ = new byteps::common::CpuAffinity(
+        getenv("BYTEPS_SERVER_THREAD_AFFINITY"),
+        GetEnv("BYTEPS_SERVER_NUMA_NODE", -1), 0, 1);
+    if (engine_affinity_->Enabled()) {
+      LOG(INFO) << "BytePS server engine threads pinned to CPUs "
+                << engine_affinity_->ToString();
+    }
+  }
+
   // flag mu and its protected map
   std::vector<std::mutex> tmp_flagmu(engine_thread_num_);
   std::vector<std::unordered_map<uint64_t, bool> > tmp_ispushfinished(engine_thread_num_);
   std::vector<std::unordered_map<uint64_t, std::vector<ps::KVMeta> > > tmp_qpullreqmeta(engine_thread_num_);
   std::vector<std::unordered_map<uint64_t, size_t> > tmp_pullcnt(engine_thread_num_);
+  std::vector<std::unordered_map<uint64_t, size_t> > tmp_pullquota(engine_thread_num_);
+  std::vector<std::unordered_map<uint64_t, std::vector<uint64_t> > > tmp_pulltime(engine_thread_num_);
   flag_mu_.swap(tmp_flagmu);
   is_push_finished_.swap(tmp_ispushfinished);
   q_pull_reqmeta_.swap(tmp_qpullreqmeta);
   pull_cnt_.swap(tmp_pullcnt);
+  pull_quota_.swap(tmp_pullquota);
+  q_pull_time_.swap(tmp_pulltime);
   CHECK_EQ(flag_mu_.size(), engine_thread_num_);
   CHECK_EQ(is_push_finished_.size(), engine_thread_num_);
   CHECK_EQ(q_pull_reqmeta_.size(), engine_thread_num_);
   CHECK_EQ(pull_cnt_.size(), engine_thread_num_);
 
+  // striped per-key state
+  std::vector<std::mutex> tmp_handlemu(handle_shard_num_);
+  std::vector<std::mutex> tmp_storemu(handle_shard_num_);
+  handle_mu_.swap(tmp_handlemu);
+  store_mu_.swap(tmp_storemu);
+  store_.resize(handle_shard_num_);
+  update_buf_.resize(handle_shard_num_);
+  push_response_map_.resize(handle_shard_num_);
+  pull_response_map_.resize(handle_shard_num_);
+  key_stats_.resize(handle_shard_num_);
+
   // init the engine
   for (size_t i = 0; i < engine_thread_num_; ++i) {
     acc_load_.push_back(0);
+    engine_stats_.emplace_back(new EngineStats());
   }
   for (size_t i = 0; i < engine_thread_num_; ++i) {
     auto q = new PriorityQueue(enable_schedule_);
@@ -369,10 +1013,25 @@ extern "C" void byteps_server() {
     engine_threads_.push_back(t);
   }
 
+  std::thread* stats_dumper = nullptr;
+  if (enable_stats_) stats_dumper = new std::thread(&BytePSServerStatsDumper);
+  std::thread* round_timer = nullptr;
+  if (round_timeout_ms_) round_timer = new std::thread(&BytePSServerRoundTimer);
+
+  server_optimizer_ = new ServerOptimizer();
+
   // init server instance
   byteps_server_ = new KVServer<SERVER_DATA_TYPE>(0);
   byteps_server_->set_request_handle(BytePSHandler);
   StartAsync(0, "byteps_server\0");
+  // before the barrier, after which the workers look for it
+  int rank = ps::MyRank();
+  num_workers_ = ps::NumWorkers();
+  if (enable_colocated_) {
+    byteps::common::AdvertiseColocatedServer(rank);
+    LOG(INFO) << "BytePS server " << rank
+              << " takes the pushes of the workers on its host through shared memory";
+  }
   if (!Postoffice::Get()->is_recovery()) {
     Postoffice::Get()->Barrier(0,
       ps::kWorkerGroup + ps::kServerGroup + ps::kScheduler);
@@ -380,6 +1039,7 @@ extern "C" void byteps_server() {
 
   // clean the server resource
   Finalize(0, true);
+  if (enable_colocated_) byteps::common::WithdrawColocatedServer(rank);
   if (byteps_server_) {
     delete byteps_server_;
     byteps_server_ = nullptr;
@@ -388,12 +1048,31 @@ extern "C" void byteps_server() {
     delete bps_reducer_;
     bps_reducer_ = nullptr;
   }
+  if (round_timer) {
+    round_timer_stop_ = true;
+    round_timer->join();
+    delete round_timer;
+  }
+  if (stats_dumper) {
+    stats_stop_ = true;
+    stats_dumper->join();
+    delete stats_dumper;
+  }
   BytePSEngineMessage msg;
   msg.ops = TERMINATE;
   for (auto q : engine_queues_) q->Push(msg);
   for (auto t : engine_threads_) t->join();
-  for (auto& it : store_) free(it.second.tensor);
-  for (auto& it : update_buf_) free(it.second.merged.tensor);
+  // the store buffers come from the pool, the merge buffers alias them or
+  // the received data
+  LOG(INFO) << "BytePS server store used " << buffer_pool_->mapped() << " bytes";
+  delete buffer_pool_;
+  buffer_pool_ = nullptr;
+  delete server_optimizer_;
+  server_optimizer_ = nullptr;
+  delete engine_affinity_;
+  engine_affinity_ = nullptr;
+  for (auto& it : colocated_segments_) munmap(it.second.first, it.second.second);
+  colocated_segments_.clear();
   LOG(INFO) << "byteps has been shutdown";
 
   return;
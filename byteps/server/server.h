@@ -16,11 +16,18 @@
 #ifndef BYTEPS_SERVER_H
 #define BYTEPS_SERVER_H
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <cmath>
 #include <cstdlib>
+#include <memory>
 #include "ps/ps.h"
+#include "../common/colocated.h"
+#include "../common/compressor.h"
 #include "../common/cpu_reducer.h"
+#include "../common/row_sparse.h"
+#include "stats.h"
 
 namespace byteps {
 namespace server {
@@ -33,11 +40,14 @@ namespace server {
 using namespace ps;
 
 enum class RequestType {
-  kDefaultPushPull, kRowSparsePushPull, kCompressedPushPull
+  kDefaultPushPull, kRowSparsePushPull, kCompressedPushPull,
+  kServerOptimizerPushPull, kColocatedPushPull
 };
 
 enum BytePSEngineOperation {
-  SUM_RECV, COPY_MERGED, TERMINATE
+  SUM_RECV, SUM_RECV_PAIR, COPY_MERGED, FLIP_MERGED, APPLY_OPTIMIZER,
+  DECOMPRESS_RECV, DECOMPRESS_SUM_RECV, COMPRESS_MERGED, SPARSE_SUM_RECV,
+  SPARSE_MERGED, TERMINATE
 };
 
 struct PSKV {
@@ -55,11 +65,41 @@ struct BytePSArray {
   size_t len;
   int dtype;
   ps::KVPairs<char> tmp_sarray;
+  // with double buffering, the store slot the next merge is summed into
+  char* next;
+  // number of merges published to the store
+  uint64_t version;
+  // with the server optimizer, the weights are in |tensor| and its state here
+  bool optimized;
+  float* opt_state[2];
+  // the local copies summed by the |replica_pushes| init pushes
+  size_t replicas;
+  size_t replica_pushes;
+  // kCompressedPushPull: |tensor| holds the compressed sum, the pushes are
+  // decompressed and summed into |decompressed|
+  std::shared_ptr<byteps::common::Compressor> compressor;
+  char* decompressed;
+  // kRowSparsePushPull: |tensor| holds the encoded rows of the last merge,
+  // |len| bytes. The pushes are summed into the dense |decompressed|, and
+  // |rows| lists the rows they touched, which are marked in |row_seen|.
+  size_t row_len;
+  size_t dense_len;
+  std::vector<bool> row_seen;
+  std::vector<uint32_t> rows;
+  // by sender, the shared memory the pulls of a co-located worker are copied
+  // to, where its kColocatedPushPull pushes are read from
+  std::unordered_map<int, char*> colocated;
 };
 
 struct UpdateBuf {
   std::vector<ps::KVMeta> request;
   BytePSArray merged;
+  // arrival of the first push merged into |merged|
+  std::chrono::steady_clock::time_point round_start;
+  // number of merges closed
+  uint64_t merges;
+  // server optimizer: local copies summed by the init pushes collected
+  size_t replicas;
 };
 
 struct BytePSEngineMessage {
@@ -72,8 +112,24 @@ struct BytePSEngineMessage {
   BytePSEngineOperation ops;
   ps::KVPairs<char> sarray; // to temporarily hold it and auto release 
   ps::KVMeta req_meta;
+  void* src2; // SUM_RECV_PAIR: dst = src + src2
+  size_t pushes; // COPY_MERGED, FLIP_MERGED: number of pushes merged
+  // APPLY_OPTIMIZER: number of copies the pushes sum, one per worker GPU
+  size_t replicas;
+  // APPLY_OPTIMIZER: optimizer state of the weights in dst, and the step
+  void* state[2];
+  uint64_t step;
+  // set when the message is one chunk of a larger one
+  int chunk;
+  std::shared_ptr<std::atomic<int> > pending_chunks;
 };
 
+// The engine queues serialize messages by this key: chunks of a message are
+// independent of each other, but not of the same chunk of another message.
+inline uint64_t EngineQueueKey(const BytePSEngineMessage& msg) {
+  return msg.key ^ ((uint64_t) msg.chunk << 48);
+}
+
 static DataHandleType DepairDataHandleType(int cmd) {
   int w = std::floor((std::sqrt(8 * cmd + 1) - 1)/2);
   int t = ((w * w) + w) / 2;
@@ -91,20 +147,30 @@ static DataHandleType DepairDataHandleType(int cmd) {
 KVServer<SERVER_DATA_TYPE>* byteps_server_;
 byteps::common::CpuReducer* bps_reducer_;
 std::unordered_map<SERVER_KEY_TYPE, KVPairs<SERVER_DATA_TYPE> > mem_map_;
-std::mutex pullresp_mu_;
-std::unordered_map<uint64_t, ps::KVPairs<char> > push_response_map_;
-std::unordered_map<uint64_t, ps::KVPairs<char> > pull_response_map_;
+
+// The per-key state below is striped into handle_shard_num_ shards by key, so
+// that requests of different keys do not serialize on one mutex. A key always
+// maps to the same shard, which keeps the order of its pushes and pulls.
+// Lock order: handle_mu_, then flag_mu_, then store_mu_.
+size_t handle_shard_num_ = 32;
+std::vector<std::mutex> store_mu_; // guards insertion into store_, key_stats_, pull response
+std::vector<std::unordered_map<uint64_t, ps::KVPairs<char> > > push_response_map_;
+std::vector<std::unordered_map<uint64_t, ps::KVPairs<char> > > pull_response_map_;
 
 // push & pull flag 
 std::vector<std::mutex> flag_mu_; 
 std::vector<std::unordered_map<uint64_t, bool> > is_push_finished_;
 std::vector<std::unordered_map<uint64_t, std::vector<ps::KVMeta> > > q_pull_reqmeta_;
 std::vector<std::unordered_map<uint64_t, size_t> > pull_cnt_;
+// arrival of the pulls in q_pull_reqmeta_, only kept with enable_stats_
+std::vector<std::unordered_map<uint64_t, std::vector<uint64_t> > > q_pull_time_;
+// pulls the published merges can answer, one per merged push
+std::vector<std::unordered_map<uint64_t, size_t> > pull_quota_;
 
 // address map 
-std::mutex handle_mu_;
-std::unordered_map<uint64_t, BytePSArray> store_; 
-std::unordered_map<uint64_t, UpdateBuf> update_buf_;
+std::vector<std::mutex> handle_mu_;
+std::vector<std::unordered_map<uint64_t, BytePSArray> > store_; 
+std::vector<std::unordered_map<uint64_t, UpdateBuf> > update_buf_;
 
 // hash function
 std::mutex hash_mu_;
@@ -112,13 +178,35 @@ std::unordered_map<uint64_t, size_t> hash_cache_;
 std::vector<uint64_t> acc_load_; // accumulated tensor size for an engine thread 
 
 // global knob
-uint64_t timestamp_ = 0;
+std::atomic<uint64_t> timestamp_{0};
 size_t engine_thread_num_ = 4;
 volatile bool is_engine_blocking_ = false;
 volatile bool log_key_info_ = false;
 volatile bool sync_mode_ = true;
 volatile bool debug_mode_ = false;
 volatile bool enable_schedule_ = false;
+volatile bool enable_double_buffer_ = false;
+// bounded staleness: publish a merge after quorum_ pushes, or once its first
+// push is round_timeout_ms_ old, instead of waiting for all workers
+size_t quorum_ = 0;
+int round_timeout_ms_ = 0;
+// workers whose pushes make a merge, ps::NumWorkers() until a resize
+std::atomic<size_t> num_workers_{0};
+volatile bool round_timer_stop_ = false;
+volatile bool enable_engine_steal_ = true;
+size_t engine_chunk_size_ = 512 * 1024;
+int engine_steal_interval_us_ = 100;
+bool compressor_error_feedback_ = true;
+// advertised to the workers on the host, which push through shared memory
+bool enable_colocated_ = false;
+
+// telemetry, dumped to stats_file_ every stats_interval_ms_
+volatile bool enable_stats_ = false;
+std::string stats_file_;
+int stats_interval_ms_ = 1000;
+volatile bool stats_stop_ = false;
+std::vector<std::unique_ptr<EngineStats> > engine_stats_;
+std::vector<std::unordered_map<uint64_t, KeyStats> > key_stats_; // by shard
 
 // debug
 uint64_t debug_key_;
@@ -135,6 +223,38 @@ uint64_t EncodeKey(ps::Key key) {
   return key + kr.begin();
 }
 
+bool IsPartialAggregation() {
+  return quorum_ || round_timeout_ms_;
+}
+
+size_t ActiveWorkers() {
+  return num_workers_;
+}
+
+// Number of pushes that complete a merge
+size_t RoundSize() {
+  return std::min(quorum_ ? quorum_ : (size_t) -1, ActiveWorkers());
+}
+
+size_t GetShardID(uint64_t key) {
+  // keys are (declared key << 16) + partition, mix the bits before the modulo
+  return ((key * 0x9E3779B97F4A7C15ULL) >> 32) % handle_shard_num_;
+}
+
+// The stored tensor of |key|, created empty if new. Entries are never erased,
+// so the pointer stays valid.
+BytePSArray* GetStore(uint64_t key) {
+  auto shard = GetShardID(key);
+  std::lock_guard<std::mutex> lock(store_mu_[shard]);
+  return &store_[shard][key];
+}
+
+KeyStats* GetKeyStats(uint64_t key) {
+  auto shard = GetShardID(key);
+  std::lock_guard<std::mutex> lock(store_mu_[shard]);
+  return &key_stats_[shard][key];
+}
+
 size_t GetThreadID(uint64_t key, size_t len) {
   std::lock_guard<std::mutex> lock(hash_mu_);
   if (len == 0) { // pull
@@ -0,0 +1,58 @@
+// Copyright 2019 Bytedance Inc. or its affiliates. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// =============================================================================
+
+#ifndef BYTEPS_SERVER_STATS_H
+#define BYTEPS_SERVER_STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace byteps {
+namespace server {
+
+/**
+ * \brief counters of the server, only updated when BYTEPS_SERVER_STATS_FILE
+ * is set, and dumped to that file periodically. They are monotonic, rates are
+ * derived by the dumper.
+ */
+struct EngineStats {
+  std::atomic<uint64_t> msgs{0};
+  std::atomic<uint64_t> sum_bytes{0};  // bytes reduced by SUM_RECV(_PAIR)
+  std::atomic<uint64_t> busy_us{0};    // time spent processing messages
+};
+
+struct KeyStats {
+  std::atomic<uint64_t> pushes{0};
+  std::atomic<uint64_t> push_bytes{0};
+  std::atomic<uint64_t> merges{0};
+  // first to last push of each merge
+  std::atomic<uint64_t> push_span_us{0};
+  std::atomic<uint64_t> pulls{0};
+  // pulls that waited in q_pull_reqmeta_ for their merge, and for how long
+  std::atomic<uint64_t> pull_waits{0};
+  std::atomic<uint64_t> pull_wait_us{0};
+};
+
+inline uint64_t StatsNowMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+}  // namespace server
+}  // namespace byteps
+
+#endif  // BYTEPS_SERVER_STATS_H
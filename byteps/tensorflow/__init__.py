@@ -24,6 +24,9 @@ from byteps.tensorflow.compression import Compression
 from byteps.tensorflow.ops import broadcast, _push_pull
 from byteps.tensorflow.ops import init, shutdown
 from byteps.tensorflow.ops import size, local_size, rank, local_rank
+from byteps.tensorflow.ops import dump_traces
+from byteps.tensorflow.ops import resize
+from byteps.tensorflow.ops import get_metrics
 from byteps.tensorflow.util import _executing_eagerly
 
 import tensorflow as tf
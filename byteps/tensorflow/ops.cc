@@ -14,6 +14,7 @@
 // limitations under the License.
 // =============================================================================
 
+#include <atomic>
 #include <memory>
 #include <queue>
 #include <thread>
@@ -71,6 +72,8 @@ const common::DataType ConvertDType(int dtype) {
       return common::BYTEPS_INT64;
     case ::tensorflow::DT_HALF:
       return common::BYTEPS_FLOAT16;
+    case ::tensorflow::DT_BFLOAT16:
+      return common::BYTEPS_BFLOAT16;
     case ::tensorflow::DT_FLOAT:
       return common::BYTEPS_FLOAT32;
     case ::tensorflow::DT_DOUBLE:
@@ -135,27 +138,24 @@ extern "C" void byteps_tensorflow_declare_tensor(char* name) {
 
 void StartTask(::tensorflow::OpKernelContext* context,
                ::tensorflow::AsyncOpKernel::DoneCallback done,
-               std::string node_name, std::shared_ptr<TFTensor> byteps_input,
+               common::BPSContext* byteps_context,
+               std::shared_ptr<TFTensor> byteps_input,
                std::shared_ptr<TFTensor> byteps_output,
                std::shared_ptr<common::ReadyEvent> ready_event) {
-  auto& byteps_context = common::GetContextFromName(node_name);
   auto device = GetDeviceID(context);
   auto size = byteps_input->size();
   auto dtype = byteps_input->dtype();
   void* cpubuff = (device == CPU_DEVICE_ID)
                       ? const_cast<void*>(byteps_input->data())
                       : nullptr;
-  common::InitTensor(byteps_context, size, dtype, cpubuff);
+  common::InitTensor(*byteps_context, size, dtype, cpubuff);
 
-  auto queue_list = common::GetPushQueueList(device);
-  auto queue_list_pull = common::GetPullQueueList(device);
-  queue_list->insert(queue_list->end(), queue_list_pull->begin(),
-                     queue_list_pull->end());
+  auto queue_list = common::GetPushPullQueueList(device);
 
   // TODO: assign priority based on topological sort
   auto enqueue_result =
-      EnqueueTensor(byteps_context, byteps_input, byteps_output, ready_event,
-                    device, -byteps_context.declared_key, 0,
+      EnqueueTensor(*byteps_context, byteps_input, byteps_output, ready_event,
+                    device, -byteps_context->declared_key, 0,
                     [context, done](const common::Status& status) {
                       context->SetStatus(ConvertStatus(status));
                       done();
@@ -167,7 +167,7 @@ void StartTask(::tensorflow::OpKernelContext* context,
 class BytePSPushPullOp : public ::tensorflow::AsyncOpKernel {
  public:
   explicit BytePSPushPullOp(::tensorflow::OpKernelConstruction* context)
-      : AsyncOpKernel(context) {}
+      : AsyncOpKernel(context), bps_context_(nullptr) {}
 
   void ComputeAsync(::tensorflow::OpKernelContext* context,
                     DoneCallback done) override {
@@ -181,18 +181,42 @@ class BytePSPushPullOp : public ::tensorflow::AsyncOpKernel {
     // ReadyEvent makes sure input tensor is ready, and output is allocated.
     auto ready_event =
         std::shared_ptr<common::ReadyEvent>(RecordReadyEvent(context));
-    auto bps_input = std::make_shared<TFTensor>(tensor);
-    auto bps_output = std::make_shared<TFTensor>(*output);
-    auto node_name = name();
-    auto& bps_context = common::GetContextFromName(node_name);
-    if (bps_context.initialized) {
-      StartTask(context, done, node_name, bps_input, bps_output, ready_event);
+    // The wrappers hold the buffers of this step until its callback, so
+    // they are allocated together, and aliased by the two pointers
+    auto tensors = std::make_shared<StepTensors>(tensor, *output);
+    std::shared_ptr<TFTensor> bps_input(tensors, &tensors->input);
+    std::shared_ptr<TFTensor> bps_output(tensors, &tensors->output);
+    auto bps_context = GetBPSContext();
+    if (bps_context->initialized) {
+      StartTask(context, done, bps_context, bps_input, bps_output,
+                ready_event);
     } else {
-      std::thread t(StartTask, context, done, node_name, bps_input, bps_output,
-                    ready_event);
+      std::thread t(StartTask, context, done, bps_context, bps_input,
+                    bps_output, ready_event);
       t.detach();
     }
   }
+
+ private:
+  struct StepTensors {
+    StepTensors(::tensorflow::Tensor& in, ::tensorflow::Tensor& out)
+        : input(in), output(out) {}
+    TFTensor input;
+    TFTensor output;
+  };
+
+  // The contexts are never erased and the map does not move them, so the
+  // lookup by node name, under the global context mutex, is done once
+  common::BPSContext* GetBPSContext() {
+    auto bps_context = bps_context_.load(std::memory_order_acquire);
+    if (!bps_context) {
+      bps_context = &common::GetContextFromName(name());
+      bps_context_.store(bps_context, std::memory_order_release);
+    }
+    return bps_context;
+  }
+
+  std::atomic<common::BPSContext*> bps_context_;
 };
 
 REGISTER_KERNEL_BUILDER(Name("BytepsPushPull").Device(::tensorflow::DEVICE_CPU),
@@ -201,7 +225,7 @@ REGISTER_KERNEL_BUILDER(Name("BytepsPushPull").Device(::tensorflow::DEVICE_GPU),
                         BytePSPushPullOp);
 
 REGISTER_OP("BytepsPushPull")
-    .Attr("T: {int32, int64, float16, float32, float64}")
+    .Attr("T: {int32, int64, float16, bfloat16, float32, float64}")
     .Input("tensor: T")
     .Output("sum: T")
     .SetShapeFn([](::tensorflow::shape_inference::InferenceContext* c) {
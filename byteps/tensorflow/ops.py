@@ -57,6 +57,9 @@ size = _basics.size
 local_size = _basics.local_size
 rank = _basics.rank
 local_rank = _basics.local_rank
+dump_traces = _basics.dump_traces
+resize = _basics.resize
+get_metrics = _basics.get_metrics
 
 dll_path = os.path.join(os.path.dirname(__file__),
                         'c_lib' + get_ext_suffix())
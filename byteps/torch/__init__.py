@@ -21,9 +21,13 @@ from __future__ import print_function
 from byteps.torch.compression import Compression
 from byteps.torch.ops import push_pull_async_inplace as byteps_push_pull
 from byteps.torch.ops import push_pull
-from byteps.torch.ops import poll, synchronize, declare
+from byteps.torch.ops import poll, synchronize, wait_all, declare
+from byteps.torch.ops import set_backward_passes, init_tensors
 from byteps.torch.ops import init, shutdown
 from byteps.torch.ops import size, local_size, rank, local_rank
+from byteps.torch.ops import dump_traces
+from byteps.torch.ops import resize
+from byteps.torch.ops import get_metrics
 
 import os
 import torch
@@ -79,6 +83,7 @@ class _DistributedOptimizer(torch.optim.Optimizer):
                                      for param_group in self.param_groups
                                      for i, v in enumerate(param_group['params'])}
         self.backward_passes_per_step = backward_passes_per_step
+        set_backward_passes(backward_passes_per_step)
         self._push_pull_delay = {v: self.backward_passes_per_step
                                  for _, v in sorted(named_parameters)}
         self._handles = {}
@@ -106,6 +111,7 @@ class _DistributedOptimizer(torch.optim.Optimizer):
 
     def set_backward_passes_per_step(self, passes):
         self.backward_passes_per_step = passes
+        set_backward_passes(passes)
         for p in self._push_pull_delay:
             self._push_pull_delay[p] = self.backward_passes_per_step
 
@@ -163,8 +169,10 @@ class _DistributedOptimizer(torch.optim.Optimizer):
             if handle is None:
                 handle, ctx = self._push_pull_grad_async(p)
                 self._handles[p] = (handle, ctx)
-        for p, (handle, _) in self._handles.items():
-            output = synchronize(handle)
+        params = list(self._handles.keys())
+        outputs = wait_all([self._handles[p][0] for p in params])
+        for p, output in zip(params, outputs):
+            _, ctx = self._handles[p]
             self._push_pull_delay[p] = self.backward_passes_per_step
             if not self._enable_async:
                 p.grad.set_(self._compression.decompress(output, ctx))
@@ -231,7 +239,9 @@ def DistributedOptimizer(optimizer, named_parameters=None,
                                   before calling step()/synchronize(). This
                                   allows accumulating gradients over multiple
                                   mini-batches before executing averaging and
-                                  applying them.
+                                  applying them. The gradients are summed
+                                  locally by autograd in `p.grad`, and only the
+                                  last backward pass pushes them.
     """
     # We dynamically create a new class that inherits from the optimizer that was passed in.
     # The goal is to override the `step()` method with an push_pull implementation.
@@ -4,7 +4,7 @@ from __future__ import print_function
 
 from byteps.torch.compression import Compression
 from byteps.torch.ops import push_pull_async_inplace as byteps_push_pull
-from byteps.torch.ops import poll, synchronize
+from byteps.torch.ops import synchronize, watch, wait_watched, stop_watching
 from byteps.torch.ops import init, shutdown
 from byteps.torch.ops import size, local_size, rank, local_rank
 
@@ -14,7 +14,6 @@ try:
     import queue
 except ImportError:
     import Queue as queue
-import time
 import math
 import torch
 import byteps.torch as bps
@@ -59,12 +58,19 @@ class _CrossBarrier(_DistributedOptimizer):
             for p in param_group['params']:
                 self._locks[p] = threading.Lock()
 
+        # Push and pull the parameters in the order of the forward pass, so
+        # that the first layers are updated first
+        self._forward_order = {}
+        for i, p in enumerate(self._model.parameters()):
+            self._forward_order.setdefault(p, i)
+
         if size() > 1:
             self._register_forward_hooks()
             self._register_hooks()
 
-            # Poll whether the tensor push-pull is finished.
-            self._event_queue = queue.Queue()
+            # The core hands over the push-pulls as they finish.
+            self._pending = {}
+            self._pending_lock = threading.Lock()
             self._poller = threading.Thread(target=self._poll, args=())
             self._poller.start()
 
@@ -81,9 +87,7 @@ class _CrossBarrier(_DistributedOptimizer):
             # if it is the final training step, wait for the completion of all tensors
             if self._step == self._final_step:
                 self._logger.debug("final step {}, waiting for push-pull completion.".format(self._final_step))
-                while not self._event_queue.empty():
-                    time.sleep(0.001)
-                self._event_queue.put((None, None, None))
+                stop_watching()
                 self._poller.join()
                 self._logger.info("training finished!")
             loss = None
@@ -150,40 +154,48 @@ class _CrossBarrier(_DistributedOptimizer):
         tensor_compressed, ctx = self._compression.compress(tensor)
 
         self._locks[p].acquire()
-        handle = byteps_push_pull(tensor_compressed, average=True, name="Gradient."+name)
+        priority = -self._forward_order.get(p, 0)
+        handle = byteps_push_pull(tensor_compressed, average=True, name="Gradient."+name,
+                                  priority=priority)
         self._logger.debug("{} calls byteps_push_pull for {}".format(self._desc, self._get_parameter_name(p)))
-        # Add to queue to poll completion
-        self._event_queue.put((p, handle, ctx))
+        # The poller gets the handle when the push-pull finishes
+        with self._pending_lock:
+            self._pending[handle] = (p, ctx)
+        watch(handle)
         return handle, ctx
 
     def _poll(self):
-        """Poll the completion of the tensor's backward or push-pull from a FIFO event_queue"""
+        """Update each parameter as soon as the core reports that its push-pull finished"""
+        stopping = False
         while True:
-            p, handle, ctx = self._event_queue.get()
-            if p is None:
-                self._logger.debug("poller exits.")
-                break
-            # Check whether the push-pull is finished. If so, start updating parameters.
-            if handle is not None and poll(handle):
-                output = synchronize(handle)
-                p.grad.set_(self._compression.decompress(output, ctx))
-                self._logger.debug("{} {} finished push-pull".format(self._desc, self._get_parameter_name(p)))
-                self._push_pull_delay[p] = self.backward_passes_per_step
-                # So only support SGD, Adam and RMSprop optimizers in torch
-                if isinstance(self._opt, torch.optim.SGD):
-                    self._sgd(p)
-                elif isinstance(self._opt, torch.optim.Adam):
-                    self._adam(p)
-                elif isinstance(self._opt, torch.optim.RMSprop):
-                    self._rmsprop(p)
-                else:
-                    raise ValueError("Invalid optimizer! Only support SGD, Adam and RMSprop.")
-                self._zero_one_grad(p)
-                # notify update completion and parameter is ready for forward propagation
-                if p in self._locks:
-                    self._locks[p].release()
+            with self._pending_lock:
+                if stopping and not self._pending:
+                    break
+            handle = wait_watched()
+            if handle == 0:
+                # the final step waits for the push-pulls in flight
+                stopping = True
+                continue
+            with self._pending_lock:
+                p, ctx = self._pending.pop(handle)
+            output = synchronize(handle)
+            p.grad.set_(self._compression.decompress(output, ctx))
+            self._logger.debug("{} {} finished push-pull".format(self._desc, self._get_parameter_name(p)))
+            self._push_pull_delay[p] = self.backward_passes_per_step
+            # So only support SGD, Adam and RMSprop optimizers in torch
+            if isinstance(self._opt, torch.optim.SGD):
+                self._sgd(p)
+            elif isinstance(self._opt, torch.optim.Adam):
+                self._adam(p)
+            elif isinstance(self._opt, torch.optim.RMSprop):
+                self._rmsprop(p)
             else:
-                self._event_queue.put((p, handle, ctx))
+                raise ValueError("Invalid optimizer! Only support SGD, Adam and RMSprop.")
+            self._zero_one_grad(p)
+            # notify update completion and parameter is ready for forward propagation
+            if p in self._locks:
+                self._locks[p].release()
+        self._logger.debug("poller exits.")
 
     def _register_forward_hooks(self):
         """Add hook before forward propagation of each layer to block forward computation until the push-pull and
@@ -16,40 +16,103 @@
 
 #include "handle_manager.h"
 
+#include <stdexcept>
+#include <string>
+
 namespace byteps {
 namespace torch {
 
+HandleManager::HandleManager()
+    : slots_(new Slot[kNumSlots]), last_handle_(0), waiters_(0) {}
+
 int HandleManager::AllocateHandle() {
-  int handle = last_handle_.fetch_add(1) + 1;
-  std::lock_guard<std::mutex> guard(mutex_);
-  results_[handle] = nullptr;
-  return handle;
+  // A slot still held by an unreleased handle is skipped
+  while (true) {
+    int handle = (last_handle_.fetch_add(1) + 1) & 0x7fffffff;
+    if (handle == 0) continue;
+    auto& slot = slots_[handle % kNumSlots];
+    int expected = kFree;
+    if (slot.state.compare_exchange_strong(expected, kPending)) {
+      slot.handle.store(handle);
+      return handle;
+    }
+  }
+}
+
+HandleManager::Slot& HandleManager::GetSlot(int handle) {
+  if (handle > 0) {
+    auto& slot = slots_[handle % kNumSlots];
+    if (slot.handle.load() == handle && slot.state.load() != kFree) {
+      return slot;
+    }
+  }
+  throw std::invalid_argument("Handle " + std::to_string(handle) +
+                              " was not created or has been cleared.");
 }
 
 void HandleManager::MarkDone(int handle, const Status& status) {
-  std::lock_guard<std::mutex> guard(mutex_);
-  results_[handle] = std::make_shared<Status>(status);
+  auto& slot = slots_[handle % kNumSlots];
+  slot.status = status;
+  slot.state.store(kDone);
+  if (slot.watched.exchange(false)) {
+    PushWatched(handle);
+    return;
+  }
+  // A waiter registers itself under the mutex before checking the state, so
+  // either it sees kDone or this sees it and must wake it up
+  if (waiters_.load() > 0) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    cv_.notify_all();
+  }
 }
 
 bool HandleManager::PollHandle(int handle) {
-  std::lock_guard<std::mutex> guard(mutex_);
-  if (results_.find(handle) == results_.end()) {
-    throw std::invalid_argument("Handle " + std::to_string(handle) +
-                                " was not created or has been cleared.");
-  }
-  return results_[handle] != nullptr;
+  return GetSlot(handle).state.load() == kDone;
+}
+
+void HandleManager::WaitHandle(int handle) {
+  auto& slot = GetSlot(handle);
+  if (slot.state.load() == kDone) return;
+  std::unique_lock<std::mutex> lock(mutex_);
+  waiters_.fetch_add(1);
+  cv_.wait(lock, [&slot] { return slot.state.load() == kDone; });
+  waiters_.fetch_sub(1);
 }
 
 std::shared_ptr<Status> HandleManager::ReleaseHandle(int handle) {
-  std::lock_guard<std::mutex> guard(mutex_);
-  if (results_.find(handle) == results_.end()) {
-    throw std::invalid_argument("Handle " + std::to_string(handle) +
-                                " was not created or has been cleared.");
-  }
-  auto status = results_[handle];
-  results_.erase(handle);
+  auto& slot = GetSlot(handle);
+  if (slot.state.load() != kDone) return nullptr;
+  auto status = std::make_shared<Status>(slot.status);
+  slot.watched.store(false);
+  slot.handle.store(0);
+  slot.state.store(kFree);
   return status;
 }
 
+void HandleManager::WatchHandle(int handle) {
+  auto& slot = GetSlot(handle);
+  slot.watched.store(true);
+  // MarkDone may run concurrently, the exchange makes sure only one pushes
+  if (slot.state.load() == kDone && slot.watched.exchange(false)) {
+    PushWatched(handle);
+  }
+}
+
+void HandleManager::PushWatched(int handle) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  watched_.push_back(handle);
+  cv_.notify_all();
+}
+
+int HandleManager::WaitWatched() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this] { return !watched_.empty(); });
+  int handle = watched_.front();
+  watched_.pop_front();
+  return handle;
+}
+
+void HandleManager::StopWatching() { PushWatched(0); }
+
 }  // namespace torch
 }  // namespace byteps
@@ -18,9 +18,11 @@
 #define BYTEPS_TORCH_HANDLE_MANAGER_H
 
 #include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <memory>
 #include <mutex>
-#include <unordered_map>
+#include <vector>
 
 #include "../common/common.h"
 
@@ -29,17 +31,46 @@ namespace torch {
 
 using namespace byteps::common;
 
+// The handles live in a fixed array of slots, indexed by the handle modulo
+// its size. Allocating, completing and polling a handle only touch the
+// atomics of its slot; the mutex is only taken to sleep in a wait.
 class HandleManager {
  public:
+  HandleManager();
   int AllocateHandle();
   void MarkDone(int handle, const Status& status);
   bool PollHandle(int handle);
+  // Blocks until the handle is done, without polling
+  void WaitHandle(int handle);
+  // Releases a done handle and returns its status
   std::shared_ptr<Status> ReleaseHandle(int handle);
+  // Hands the handle to WaitWatched() once it is done
+  void WatchHandle(int handle);
+  // Blocks until a watched handle is done and returns it, in the order they
+  // complete. Returns 0 for every StopWatching() call.
+  int WaitWatched();
+  void StopWatching();
 
  private:
+  enum SlotState { kFree, kPending, kDone };
+  struct Slot {
+    std::atomic_int handle{0};
+    std::atomic_int state{kFree};
+    std::atomic_bool watched{false};
+    Status status;
+  };
+  // Throws if the handle was not created or has been released
+  Slot& GetSlot(int handle);
+  void PushWatched(int handle);
+
+  static const int kNumSlots = 1 << 16;
+  std::unique_ptr<Slot[]> slots_;
   std::atomic_int last_handle_;
-  std::unordered_map<int, std::shared_ptr<Status>> results_;
+  std::atomic_int waiters_;
   std::mutex mutex_;
+  std::condition_variable cv_;
+  // done watched handles, guarded by mutex_
+  std::deque<int> watched_;
 };
 
 }  // namespace torch
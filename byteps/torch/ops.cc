@@ -16,9 +16,8 @@
 
 #include <torch/extension.h>
 #include <torch/torch.h>
-#include <chrono>
 #include <memory>
-#include <thread>
+#include <vector>
 
 #include "../common/operations.h"
 #include "adapter.h"
@@ -66,22 +65,25 @@ void StartTask(::torch::Tensor tensor, ::torch::Tensor output, int average,
                       ? const_cast<void*>(byteps_input->data())
                       : nullptr);
 
-  auto queue_list = common::GetPushQueueList(device);
-  auto queue_list_pull = common::GetPullQueueList(device);
-  queue_list->insert(queue_list->end(), queue_list_pull->begin(),
-                     queue_list_pull->end());
+  auto queue_list = common::GetPushPullQueueList(device);
+  // the server already averages what it applies, the output is the weights
+  if (context.server_optimizer) average = 0;
+  // averaged by the NCCL reduce if possible, instead of dividing the output
+  bool fused_average =
+      average && common::CanFuseAverage(context, device, dtype);
 
   auto enqueue_result = common::EnqueueTensor(
       context, byteps_input, byteps_output, ready_event, device, priority,
       version,
-      [handle, average, tensor, output](const Status& status) mutable {
+      [handle, average, fused_average, tensor,
+       output](const Status& status) mutable {
         // Will execute in the `device` context.
-        if (average) {
+        if (average && !fused_average) {
           output.div_(byteps_size());
         }
         handle_manager.MarkDone(handle, status);
       },
-      queue_list);
+      queue_list, fused_average);
 
   ThrowIfError(enqueue_result);
   return;
@@ -98,12 +100,33 @@ int DoPushPull(::torch::Tensor tensor, ::torch::Tensor output, int average,
   if (context.initialized) {
     StartTask(tensor, output, average, tensor_name, version, priority, handle);
   } else {
-    std::thread t(StartTask, tensor, output, average, tensor_name, version, priority, handle);
-    t.detach();
+    common::RunInitTask([=] {
+      StartTask(tensor, output, average, tensor_name, version, priority,
+                handle);
+    });
   }
   return handle;
 }
 
+void InitTensors(const std::vector<std::string>& names,
+                 const std::vector<::torch::Tensor>& tensors) {
+  ThrowIfError(common::CheckInitialized());
+  std::vector<common::BPSContext*> contexts;
+  std::vector<size_t> sizes;
+  std::vector<int> dtypes;
+  for (size_t i = 0; i < names.size(); ++i) {
+    // CPU tensors are registered with their own buffer at the first push_pull
+    if (GetDeviceID(tensors[i]) == CPU_DEVICE_ID) continue;
+    std::string tensor_name = GetOpName("byteps", names[i].c_str(), 0);
+    common::IsTensorDeclared(tensor_name);
+    TorchTensor tensor(tensors[i]);
+    contexts.push_back(&common::GetContextFromName(tensor_name));
+    sizes.push_back(tensor.size());
+    dtypes.push_back(tensor.dtype());
+  }
+  common::InitTensors(contexts, sizes, dtypes);
+}
+
 int PollHandle(int handle) { return handle_manager.PollHandle(handle) ? 1 : 0; }
 
 void DeclareTensor(const std::string& name) {
@@ -111,14 +134,50 @@ void DeclareTensor(const std::string& name) {
   common::IsTensorDeclared(tensor_name);
 }
 
+void DeclareProphetTensor(const std::string& name, int enabled) {
+  std::string tensor_name = GetOpName("byteps", name.c_str(), 0);
+  common::DeclareProphetTensor(tensor_name, enabled != 0);
+}
+
+void DeclareRowSparseTensor(const std::string& name, int row_elems) {
+  std::string tensor_name = GetOpName("byteps", name.c_str(), 0);
+  common::DeclareRowSparseTensor(tensor_name, row_elems);
+}
+
+void SetBackwardPasses(int passes) {
+  common::SetBackwardPassesPerStep(passes);
+}
+
+void DeclareServerOptimizerTensor(const std::string& name) {
+  std::string tensor_name = GetOpName("byteps", name.c_str(), 0);
+  common::DeclareServerOptimizerTensor(tensor_name);
+}
+
 void WaitAndClear(int handle) {
-  while (!handle_manager.PollHandle(handle)) {
-    std::this_thread::sleep_for(std::chrono::milliseconds(1));
-  }
+  handle_manager.WaitHandle(handle);
   auto status = handle_manager.ReleaseHandle(handle);
   ThrowIfError(*status);
 }
 
+// Waits for all the handles and releases them, then throws the first error
+void WaitAllAndClear(const std::vector<int>& handles) {
+  for (auto handle : handles) {
+    handle_manager.WaitHandle(handle);
+  }
+  Status result = Status::OK();
+  for (auto handle : handles) {
+    auto status = handle_manager.ReleaseHandle(handle);
+    if (result.ok() && !status->ok()) result = *status;
+  }
+  ThrowIfError(result);
+}
+
+void WatchHandle(int handle) { handle_manager.WatchHandle(handle); }
+
+int WaitWatched() { return handle_manager.WaitWatched(); }
+
+void StopWatching() { handle_manager.StopWatching(); }
+
 PYBIND11_MODULE(c_lib, m) {
   // push_pull
   m.def("byteps_torch_push_pull_async_torch_IntTensor", &DoPushPull);
@@ -137,8 +196,23 @@ PYBIND11_MODULE(c_lib, m) {
 
   // basics
   m.def("byteps_torch_poll", &PollHandle);
-  m.def("byteps_torch_wait_and_clear", &WaitAndClear);
+  // the waits release the GIL, so that other Python threads keep running
+  m.def("byteps_torch_wait_and_clear", &WaitAndClear,
+        pybind11::call_guard<pybind11::gil_scoped_release>());
+  m.def("byteps_torch_wait_all_and_clear", &WaitAllAndClear,
+        pybind11::call_guard<pybind11::gil_scoped_release>());
+  m.def("byteps_torch_watch", &WatchHandle);
+  m.def("byteps_torch_wait_watched", &WaitWatched,
+        pybind11::call_guard<pybind11::gil_scoped_release>());
+  m.def("byteps_torch_stop_watching", &StopWatching);
   m.def("byteps_torch_declare_tensor", &DeclareTensor);
+  m.def("byteps_torch_init_tensors", &InitTensors,
+        pybind11::call_guard<pybind11::gil_scoped_release>());
+  m.def("byteps_torch_declare_prophet_tensor", &DeclareProphetTensor);
+  m.def("byteps_torch_declare_server_optimizer_tensor",
+        &DeclareServerOptimizerTensor);
+  m.def("byteps_torch_declare_row_sparse_tensor", &DeclareRowSparseTensor);
+  m.def("byteps_torch_set_backward_passes", &SetBackwardPasses);
 }
 
 }  // namespace torch
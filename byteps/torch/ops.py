@@ -41,6 +41,9 @@ size = _basics.size
 local_size = _basics.local_size
 rank = _basics.rank
 local_rank = _basics.local_rank
+dump_traces = _basics.dump_traces
+resize = _basics.resize
+get_metrics = _basics.get_metrics
 
 
 # Schema: handle -> input, output
@@ -196,11 +199,56 @@ def poll(handle):
     return c_lib.byteps_torch_poll(handle) != 0
 
 
-def declare(name):
+def declare(name, prophet=None, server_optimizer=False, row_sparse=0):
+    """
+    Declares a tensor. If `prophet` is True or False, it forces Prophet
+    scheduling on or off for this tensor instead of matching its name.
+    If `server_optimizer` is True, the servers apply BYTEPS_SERVER_OPTIMIZER
+    to this tensor: its first push_pull sets the weights, and every later one
+    pushes gradients and returns the updated weights, which are not divided
+    by size() whatever `average` is.
+    If `row_sparse` is the number of elements of a row, e.g. the embedding
+    dimension of an embedding gradient, only the rows that are not all zero
+    are pushed and pulled.
+    """
     c_lib.byteps_torch_declare_tensor(name.encode())
+    if prophet is not None:
+        c_lib.byteps_torch_declare_prophet_tensor(name.encode(), int(prophet))
+    if server_optimizer:
+        c_lib.byteps_torch_declare_server_optimizer_tensor(name.encode())
+    if row_sparse:
+        c_lib.byteps_torch_declare_row_sparse_tensor(name.encode(),
+                                                     int(row_sparse))
     return 0
 
 
+def init_tensors(named_tensors):
+    """
+    Initializes the push_pull of several GPU tensors at once, instead of at
+    their first push_pull, so that the first step does not wait for them one
+    by one. The init pushes of all their partitions go out together.
+    Arguments:
+        named_tensors: (name, tensor) pairs, with the name given to push_pull,
+                       e.g. [("Gradient." + n, p) for n, p in
+                       model.named_parameters()]. Only the size and type of
+                       the tensors matter; CPU tensors are skipped.
+    With BYTEPS_FUSION_THRESHOLD, the small tensors of the list are fused;
+    list the same tensors on every worker.
+    """
+    named_tensors = list(named_tensors)
+    c_lib.byteps_torch_init_tensors([name for name, _ in named_tensors],
+                                    [tensor for _, tensor in named_tensors])
+
+
+def set_backward_passes(passes):
+    """
+    Tells the scheduler that gradients are accumulated locally over `passes`
+    backward passes between two push_pulls, so that Prophet profiles and
+    caches its plan per synchronization.
+    """
+    c_lib.byteps_torch_set_backward_passes(int(passes))
+
+
 def synchronize(handle):
     """
     Synchronizes an asynchronous push_pull operation until
@@ -216,3 +264,46 @@ def synchronize(handle):
     c_lib.byteps_torch_wait_and_clear(handle)
     _, output = _handle_map.pop(handle)
     return output
+
+
+def wait_all(handles):
+    """
+    Synchronizes a batch of asynchronous push_pull operations. It returns
+    as soon as the last one completes, which is faster than calling
+    `synchronize()` on each handle.
+    Arguments:
+        handles: A list of handles returned by push_pull asynchronous
+                 operations.
+    Returns:
+        A list with the output tensor of each operation.
+    """
+    known = [h for h in handles if h in _handle_map]
+    try:
+        c_lib.byteps_torch_wait_all_and_clear(known)
+    finally:
+        outputs = {h: _handle_map.pop(h)[1] for h in known}
+    return [outputs.get(h) for h in handles]
+
+
+def watch(handle):
+    """
+    Hands a push_pull handle to `wait_watched()` once its operation completes.
+    """
+    c_lib.byteps_torch_watch(handle)
+
+
+def wait_watched():
+    """
+    Blocks, without holding the GIL, until a watched push_pull completes.
+    Returns:
+        The handle of the operation, in the order they complete, or 0 after
+        `stop_watching()`. The handle still has to be synchronized.
+    """
+    return c_lib.byteps_torch_wait_watched()
+
+
+def stop_watching():
+    """
+    Makes `wait_watched()` return 0 once, e.g. to stop its thread.
+    """
+    c_lib.byteps_torch_stop_watching()
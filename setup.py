@@ -241,8 +241,18 @@ def get_common_options(build_ext):
                'byteps/common/logging.cc',
                'byteps/common/communicator.cc',
                'byteps/common/scheduled_queue.cc',
+               'byteps/common/scheduling_policy.cc',
+               'byteps/common/credit_controller.cc',
+               'byteps/common/prophet_plan.cc',
+               'byteps/common/fusion.cc',
+               'byteps/common/compressor.cc',
+               'byteps/common/row_sparse.cc',
+               'byteps/common/cpu_affinity.cc',
+               'byteps/common/colocated.cc',
                'byteps/common/ready_table.cc',
                'byteps/common/shared_memory.cc',
+               'byteps/common/tracer.cc',
+               'byteps/common/metrics.cc',
                'byteps/common/nccl_manager.cc',
                'byteps/common/cpu_reducer.cc']
     if "BYTEPS_USE_MPI" in os.environ and os.environ["BYTEPS_USE_MPI"] == "1":
@@ -286,6 +296,10 @@ def build_server(build_ext, options):
     server_lib.include_dirs = options['INCLUDES']
     server_lib.sources = ['byteps/server/server.cc', 
                           'byteps/common/cpu_reducer.cc',
+                          'byteps/common/compressor.cc',
+                          'byteps/common/row_sparse.cc',
+                          'byteps/common/cpu_affinity.cc',
+                          'byteps/common/colocated.cc',
                           'byteps/common/logging.cc']
     server_lib.extra_compile_args = options['COMPILE_FLAGS'] + \
         ['-DBYTEPS_BUILDING_SERVER']
@@ -293,13 +307,38 @@ def build_server(build_ext, options):
     server_lib.extra_objects = options['EXTRA_OBJECTS']
     server_lib.library_dirs = options['LIBRARY_DIRS']
     if int(os.environ.get('BYTEPS_USE_RDMA', 0)):
-        server_lib.libraries = ['rdmacm', 'ibverbs']
+        server_lib.libraries = ['rdmacm', 'ibverbs', 'numa']
     else:
-        server_lib.libraries = []
+        server_lib.libraries = ['numa']
 
     build_ext.build_extension(server_lib)
 
 
+def build_benchmark(build_ext, options):
+    """Builds build/byteps_microbench and build/byteps_simulator from the
+    common sources, see docs/microbenchmarks.md and docs/simulator.md."""
+    cuda_include_dirs, cuda_lib_dirs = get_cuda_dirs(
+        build_ext, options['COMPILE_FLAGS'])
+    compile_args = dict(
+        output_dir=os.path.join(build_ext.build_temp, 'benchmark'),
+        macros=options['MACROS'] + [('HAVE_CUDA', '1')],
+        include_dirs=options['INCLUDES'] + cuda_include_dirs,
+        extra_postargs=options['COMPILE_FLAGS'])
+    objects = build_ext.compiler.compile(
+        options['SOURCES'] + ['byteps/benchmark/models.cc',
+                              'byteps/benchmark/trace_reader.cc'],
+        **compile_args)
+    for name, main in [('byteps_microbench', 'byteps/benchmark/microbench.cc'),
+                       ('byteps_simulator', 'byteps/benchmark/simulator.cc')]:
+        main_objects = build_ext.compiler.compile([main], **compile_args)
+        build_ext.compiler.link_executable(
+            objects + main_objects + options['EXTRA_OBJECTS'], name,
+            output_dir='build',
+            libraries=options['LIBRARIES'] + ['cudart', 'pthread', 'rt'],
+            library_dirs=options['LIBRARY_DIRS'] + cuda_lib_dirs,
+            extra_postargs=['-fopenmp'])
+
+
 def check_tf_version():
     try:
         import tensorflow as tf
@@ -801,6 +840,14 @@ class custom_build_ext(build_ext):
             raise DistutilsSetupError('An ERROR occured while building the server module.\n\n'
                                       '%s' % traceback.format_exc())
 
+        if int(os.environ.get('BYTEPS_BUILD_BENCHMARK', 0)):
+            try:
+                build_benchmark(self, options)
+                print('INFO: build/byteps_microbench and build/byteps_simulator are built successfully.')
+            except:
+                raise DistutilsSetupError('An ERROR occured while building the microbenchmarks.\n\n'
+                                          '%s' % traceback.format_exc())
+
         # If PyTorch is installed, it must be imported before others, otherwise
         # we may get an error: dlopen: cannot load any more object with static TLS
         if not int(os.environ.get('BYTEPS_WITHOUT_PYTORCH', 0)):
@@ -113,6 +113,27 @@ class MXTest:
                                                  incorrect results for self'
 
 
+    def test_byteps_server_optimizer_init(self):
+        """Test that the first push_pull of a server-optimizer tensor returns
+        the initial weights, also with more than one GPU per worker."""
+        bps.init()
+        ctx = self._current_context()
+        shapes = [(17), (17, 17), (17, 17, 17)]
+        for dim, shape in enumerate(shapes):
+            mx.random.seed(1234, ctx=ctx)
+            weights = mx.nd.random.uniform(-100, 100, shape=shape, ctx=ctx)
+            initial = weights.copy()
+            name = "server_optimizer_" + str(dim)
+            bps.byteps_declare_tensor(name, server_optimizer=True)
+            bps.byteps_push_pull(weights, name=name, is_average=False)
+            weights.wait_to_read()
+            max_difference = mx.nd.max(mx.nd.abs(weights - initial))
+            if max_difference > 1e-4:
+                print("weights", bps.rank(), bps.local_size(), weights)
+                print("initial", bps.rank(), bps.local_size(), initial)
+            assert max_difference <= 1e-4, 'the server optimizer does not \
+                                            return the initial weights'
+
     def test_byteps_broadcast(self):
         """Test that the broadcast correctly broadcasts 1D, 2D, 3D tensors."""
         bps.init()
@@ -161,3 +182,4 @@ class MXTest:
 if __name__ == '__main__':
     mxtest = MXTest()
     mxtest.test_byteps_push_pull()
+    mxtest.test_byteps_server_optimizer_init()